@@ -40,12 +40,17 @@ extern "C" {
 
 #define ALLOC_FLAG_NO_GROW          0x1     /** Tag given allocator as non-growable */
 #define ALLOC_FLAG_HUGE_PAGE        0x2     /** Allocator steals from huge page pool */
+#define ALLOC_FLAG_THREAD_SAFE      0x4     /** Allocator can be shared by threads, with per-thread caches */
 
 struct allocator;
 
 /** \brief Create a new allocator
  * Create and initialize a new allocator, setup to contain at least item_count
  * items of size item_size.
+ * If tagged ALLOC_FLAG_THREAD_SAFE, any thread can allocate from the allocator, and
+ * free items allocated by any other thread. Each thread then keeps a small cache of
+ * free items, and only takes a lock to swap a full or empty cache with a shared one,
+ * so items stay off the slabs until the allocator is deleted or the thread exits.
  */
 aresult_t allocator_new(struct allocator **alloc,
                         size_t item_size,
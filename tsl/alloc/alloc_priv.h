@@ -38,10 +38,48 @@ extern "C" {
 #include <tsl/list.h>
 #include <tsl/alloc.h>
 
+#include <ck_spinlock.h>
+
+#include <pthread.h>
+
 /** \file allocator_priv.h
  * Private state for the slab allocator used by the Trading Standard Library
  */
 
+/**
+ * Number of items held by a magazine
+ */
+#define ALLOC_MAGAZINE_SIZE         32
+
+/** \brief A magazine of free items
+ * A bounded stack of free items, cached in front of the slabs of a thread-safe
+ * allocator. Magazines are swapped whole between the threads and the depot.
+ */
+struct allocator_magazine {
+    /** Next magazine in the depot */
+    struct allocator_magazine *next;
+    /** Number of items in the magazine */
+    unsigned int nr_items;
+    /** The items */
+    void *items[ALLOC_MAGAZINE_SIZE];
+};
+
+/** \brief Per-thread cache of a thread-safe allocator
+ * Each thread has a loaded magazine it allocates from and frees to, and the
+ * previous one, so a thread going back and forth around a magazine boundary does
+ * not keep going to the depot.
+ */
+struct allocator_thread_cache {
+    /** Entry in the list of caches of the allocator */
+    struct list_entry cnode;
+    /** The allocator this is a cache for */
+    struct allocator *alloc;
+    /** The magazine allocated from and freed to */
+    struct allocator_magazine *loaded;
+    /** The previously loaded magazine, either full or empty */
+    struct allocator_magazine *previous;
+};
+
 /** \brief Allocator state structure
  * Structure representing the internal state of an allocator.
  */
@@ -60,6 +98,18 @@ struct allocator {
     unsigned int flags;
     /** Number of times we had to go back to the free slab pool */
     unsigned int slabs_taken;
+    /** Lock protecting the slabs and the depot, for a thread-safe allocator */
+    ck_spinlock_t lock;
+    /** Key of the per-thread caches, for a thread-safe allocator */
+    pthread_key_t cache_key;
+    /** Every per-thread cache, so they can be drained when the allocator is deleted */
+    struct list_entry caches;
+    /** The depot: magazines full of free items */
+    struct allocator_magazine *full_mags;
+    /** The depot: empty magazines */
+    struct allocator_magazine *empty_mags;
+    /** Number of times a thread had to go to the depot */
+    unsigned long depot_swaps;
 };
 
 #define SLAB_FLAG_SQUEEZE 0x1   /**< Mark a slab to be squeezed */
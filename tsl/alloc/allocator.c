@@ -310,6 +310,13 @@ struct allocator *__helper_allocator_new_init(void)
         new_alloc->item_size = 0;
         new_alloc->max_items = 0;
         new_alloc->free_mask = 0;
+        new_alloc->flags = 0;
+        new_alloc->slabs_taken = 0;
+        ck_spinlock_init(&new_alloc->lock);
+        list_init(&new_alloc->caches);
+        new_alloc->full_mags = NULL;
+        new_alloc->empty_mags = NULL;
+        new_alloc->depot_swaps = 0;
     }
 
     return new_alloc;
@@ -323,6 +330,9 @@ void __helper_add_slab(struct allocator *alloc,
     alloc->max_items += slab->free_item_count;
 }
 
+static
+void __helper_thread_cache_destroy(void *arg);
+
 /* Public interface functions */
 
 aresult_t allocator_new(struct allocator **alloc, size_t item_size, size_t item_count, uint32_t flags)
@@ -365,6 +375,16 @@ aresult_t allocator_new(struct allocator **alloc, size_t item_size, size_t item_
     new_alloc->item_size = real_size;
     new_alloc->free_mask = ~(page_size - 1);
     new_alloc->alloc_state = cls;
+    new_alloc->flags = flags;
+
+    if (ALLOC_FLAG_THREAD_SAFE & flags) {
+        if (0 != pthread_key_create(&new_alloc->cache_key, __helper_thread_cache_destroy)) {
+            DIAG("Out of thread-specific keys for the per-thread caches.");
+            free(new_alloc);
+            result = A_E_NOMEM;
+            goto done;
+        }
+    }
 
     DIAG("New Allocator: requested item_size = %zd, real_size = %zd, free_mask = 0x%016zx",
             item_size, new_alloc->item_size, new_alloc->free_mask);
@@ -450,13 +470,12 @@ done:
     return result;
 }
 
-aresult_t allocator_alloc(struct allocator *alloc, void **item_ptr)
+/* Take an item from the slabs */
+static
+aresult_t __helper_slab_alloc(struct allocator *alloc, void **item_ptr)
 {
     aresult_t result = A_OK;
 
-    TSL_ASSERT_ARG(alloc != NULL);
-    TSL_ASSERT_ARG(item_ptr);
-
     int growable = !(alloc->flags & ALLOC_FLAG_NO_GROW);
 
     *item_ptr = NULL;
@@ -518,17 +537,12 @@ done:
     return result;
 }
 
-aresult_t allocator_free(struct allocator *alloc,
-                         void **item_ptr)
+/* Return an item to its slab */
+static
+aresult_t __helper_slab_free(struct allocator *alloc, void *item)
 {
     aresult_t result = A_OK;
 
-    TSL_ASSERT_ARG(alloc != NULL);
-    TSL_ASSERT_ARG(item_ptr != NULL);
-    TSL_ASSERT_ARG(*item_ptr != NULL);
-
-    void *item = *item_ptr;
-
     /* Find our slab (yay for page alignment rules) */
     struct slab *slab = (struct slab *)((size_t)item & alloc->free_mask);
 
@@ -552,12 +566,341 @@ aresult_t allocator_free(struct allocator *alloc,
         list_prepend(&alloc->slabs, &slab->snode);
     }
 
+    return result;
+}
+
+static
+struct allocator_magazine *__helper_magazine_new(void)
+{
+    struct allocator_magazine *mag = NULL;
+
+    mag = (struct allocator_magazine *)malloc(sizeof(struct allocator_magazine));
+
+    if (mag) {
+        mag->next = NULL;
+        mag->nr_items = 0;
+    }
+
+    return mag;
+}
+
+/* Return the items in a magazine to the slabs. Called with the allocator lock held. */
+static
+void __helper_magazine_drain(struct allocator *alloc,
+                             struct allocator_magazine *mag)
+{
+    while (0 != mag->nr_items) {
+        __helper_slab_free(alloc, mag->items[--mag->nr_items]);
+    }
+}
+
+/* Take an empty magazine from the depot. Called with the allocator lock held. */
+static
+struct allocator_magazine *__helper_depot_get_empty(struct allocator *alloc)
+{
+    struct allocator_magazine *mag = alloc->empty_mags;
+
+    if (NULL != mag) {
+        alloc->empty_mags = mag->next;
+    }
+
+    return mag;
+}
+
+static
+void __helper_depot_put(struct allocator_magazine **depot,
+                        struct allocator_magazine *mag)
+{
+    mag->next = *depot;
+    *depot = mag;
+}
+
+/* Destructor of the per-thread cache, when a thread exits */
+static
+void __helper_thread_cache_destroy(void *arg)
+{
+    struct allocator_thread_cache *cache = (struct allocator_thread_cache *)arg;
+    struct allocator *alloc = cache->alloc;
+
+    ck_spinlock_lock(&alloc->lock);
+
+    /* Whatever the thread had cached goes back to the slabs */
+    __helper_magazine_drain(alloc, cache->loaded);
+    __helper_magazine_drain(alloc, cache->previous);
+    __helper_depot_put(&alloc->empty_mags, cache->loaded);
+    __helper_depot_put(&alloc->empty_mags, cache->previous);
+
+    list_del(&cache->cnode);
+
+    ck_spinlock_unlock(&alloc->lock);
+
+    free(cache);
+}
+
+/* Create the cache of the calling thread, with two empty magazines */
+static
+struct allocator_thread_cache *__helper_thread_cache_new(struct allocator *alloc)
+{
+    struct allocator_thread_cache *cache = NULL;
+    struct allocator_magazine *mags[2] = { NULL, NULL };
+
+    cache = (struct allocator_thread_cache *)malloc(sizeof(struct allocator_thread_cache));
+
+    if (NULL == cache) {
+        goto fail;
+    }
+
+    ck_spinlock_lock(&alloc->lock);
+    mags[0] = __helper_depot_get_empty(alloc);
+    mags[1] = __helper_depot_get_empty(alloc);
+    ck_spinlock_unlock(&alloc->lock);
+
+    for (size_t i = 0; i < 2; i++) {
+        if (NULL == mags[i] && NULL == (mags[i] = __helper_magazine_new())) {
+            goto fail;
+        }
+    }
+
+    cache->alloc = alloc;
+    cache->loaded = mags[0];
+    cache->previous = mags[1];
+
+    if (0 != pthread_setspecific(alloc->cache_key, cache)) {
+        goto fail;
+    }
+
+    ck_spinlock_lock(&alloc->lock);
+    list_append(&alloc->caches, &cache->cnode);
+    ck_spinlock_unlock(&alloc->lock);
+
+    return cache;
+
+fail:
+    DIAG("Failed to set up a cache for this thread, going straight to the slabs.");
+    free(mags[0]);
+    free(mags[1]);
+    free(cache);
+    return NULL;
+}
+
+static inline
+struct allocator_thread_cache *__helper_thread_cache(struct allocator *alloc)
+{
+    struct allocator_thread_cache *cache = pthread_getspecific(alloc->cache_key);
+
+    if (CAL_UNLIKELY(NULL == cache)) {
+        cache = __helper_thread_cache_new(alloc);
+    }
+
+    return cache;
+}
+
+/*
+ * Allocate from the cache of the calling thread. The previous magazine is always
+ * either full or empty, so only going to the depot when both magazines are empty
+ * means a thread gets at least a magazine worth of allocations between two visits.
+ */
+static
+aresult_t __helper_cached_alloc(struct allocator *alloc, void **item_ptr)
+{
+    aresult_t result = A_OK;
+    struct allocator_thread_cache *cache = __helper_thread_cache(alloc);
+    struct allocator_magazine *mag = NULL;
+
+    if (CAL_UNLIKELY(NULL == cache)) {
+        ck_spinlock_lock(&alloc->lock);
+        result = __helper_slab_alloc(alloc, item_ptr);
+        ck_spinlock_unlock(&alloc->lock);
+        goto done;
+    }
+
+    mag = cache->loaded;
+
+    if (CAL_LIKELY(0 != mag->nr_items)) {
+        goto pop;
+    }
+
+    if (0 != cache->previous->nr_items) {
+        cache->loaded = cache->previous;
+        cache->previous = mag;
+        mag = cache->loaded;
+        goto pop;
+    }
+
+    /* Swap the empty magazine for a full one, or fill it halfway from the slabs */
+    ck_spinlock_lock(&alloc->lock);
+
+    alloc->depot_swaps++;
+
+    if (NULL != alloc->full_mags) {
+        struct allocator_magazine *full = alloc->full_mags;
+        alloc->full_mags = full->next;
+        __helper_depot_put(&alloc->empty_mags, mag);
+        cache->loaded = mag = full;
+    } else {
+        while (mag->nr_items < ALLOC_MAGAZINE_SIZE / 2 &&
+                !AFAILED(result = __helper_slab_alloc(alloc, &mag->items[mag->nr_items])))
+        {
+            mag->nr_items++;
+        }
+    }
+
+    ck_spinlock_unlock(&alloc->lock);
+
+    if (CAL_UNLIKELY(0 == mag->nr_items)) {
+        *item_ptr = NULL;
+        goto done;
+    }
+
+    result = A_OK;
+
+pop:
+    *item_ptr = mag->items[--mag->nr_items];
+
+done:
+    return result;
+}
+
+/* Free to the cache of the calling thread, the mirror image of __helper_cached_alloc */
+static
+aresult_t __helper_cached_free(struct allocator *alloc, void *item)
+{
+    aresult_t result = A_OK;
+    struct allocator_thread_cache *cache = __helper_thread_cache(alloc);
+    struct allocator_magazine *mag = NULL;
+    struct allocator_magazine *empty = NULL;
+
+    if (CAL_UNLIKELY(NULL == cache)) {
+        ck_spinlock_lock(&alloc->lock);
+        result = __helper_slab_free(alloc, item);
+        ck_spinlock_unlock(&alloc->lock);
+        goto done;
+    }
+
+    mag = cache->loaded;
+
+    if (CAL_LIKELY(ALLOC_MAGAZINE_SIZE != mag->nr_items)) {
+        goto push;
+    }
+
+    if (ALLOC_MAGAZINE_SIZE != cache->previous->nr_items) {
+        cache->loaded = cache->previous;
+        cache->previous = mag;
+        mag = cache->loaded;
+        goto push;
+    }
+
+    /* Swap the full magazine for an empty one */
+    ck_spinlock_lock(&alloc->lock);
+
+    alloc->depot_swaps++;
+
+    if (NULL == (empty = __helper_depot_get_empty(alloc))) {
+        ck_spinlock_unlock(&alloc->lock);
+        empty = __helper_magazine_new();
+        ck_spinlock_lock(&alloc->lock);
+
+        if (CAL_UNLIKELY(NULL == empty)) {
+            result = __helper_slab_free(alloc, item);
+            ck_spinlock_unlock(&alloc->lock);
+            goto done;
+        }
+    }
+
+    __helper_depot_put(&alloc->full_mags, mag);
+
+    ck_spinlock_unlock(&alloc->lock);
+
+    cache->loaded = mag = empty;
+
+push:
+    mag->items[mag->nr_items++] = item;
+
+done:
+    return result;
+}
+
+aresult_t allocator_alloc(struct allocator *alloc, void **item_ptr)
+{
+    TSL_ASSERT_ARG(alloc != NULL);
+    TSL_ASSERT_ARG(item_ptr);
+
+    if (alloc->flags & ALLOC_FLAG_THREAD_SAFE) {
+        return __helper_cached_alloc(alloc, item_ptr);
+    }
+
+    return __helper_slab_alloc(alloc, item_ptr);
+}
+
+aresult_t allocator_free(struct allocator *alloc,
+                         void **item_ptr)
+{
+    aresult_t result = A_OK;
+
+    TSL_ASSERT_ARG(alloc != NULL);
+    TSL_ASSERT_ARG(item_ptr != NULL);
+    TSL_ASSERT_ARG(*item_ptr != NULL);
+
+    if (alloc->flags & ALLOC_FLAG_THREAD_SAFE) {
+        result = __helper_cached_free(alloc, *item_ptr);
+    } else {
+        result = __helper_slab_free(alloc, *item_ptr);
+    }
 
     *item_ptr = NULL;
 
     return result;
 }
 
+/*
+ * Return every cached item of a thread-safe allocator to the slabs. The caches and
+ * magazines stay in place, so the allocator is still usable if it turns out to be
+ * busy.
+ */
+static
+void __helper_allocator_drain_caches(struct allocator *alloc)
+{
+    struct allocator_thread_cache *cache = NULL;
+    struct allocator_magazine *mag = NULL;
+
+    ck_spinlock_lock(&alloc->lock);
+
+    list_for_each_type(cache, &alloc->caches, cnode) {
+        __helper_magazine_drain(alloc, cache->loaded);
+        __helper_magazine_drain(alloc, cache->previous);
+    }
+
+    while (NULL != (mag = alloc->full_mags)) {
+        alloc->full_mags = mag->next;
+        __helper_magazine_drain(alloc, mag);
+        __helper_depot_put(&alloc->empty_mags, mag);
+    }
+
+    ck_spinlock_unlock(&alloc->lock);
+}
+
+/* Release the caches and magazines of a thread-safe allocator that is going away */
+static
+void __helper_allocator_release_caches(struct allocator *alloc)
+{
+    struct allocator_thread_cache *cache = NULL, *tmp = NULL;
+    struct allocator_magazine *mag = NULL;
+
+    /* No destructor runs for the key once deleted, this thread or any other */
+    pthread_key_delete(alloc->cache_key);
+
+    list_for_each_type_safe(cache, tmp, &alloc->caches, cnode) {
+        list_del(&cache->cnode);
+        free(cache->loaded);
+        free(cache->previous);
+        free(cache);
+    }
+
+    while (NULL != (mag = __helper_depot_get_empty(alloc))) {
+        free(mag);
+    }
+}
+
 /**
  * \note This might be encumbered by an IBM patent
  */
@@ -580,6 +923,10 @@ aresult_t allocator_delete(struct allocator **alloc)
 
     TSL_ASSERT_ARG(cls != NULL);
 
+    if (dalloc->flags & ALLOC_FLAG_THREAD_SAFE) {
+        __helper_allocator_drain_caches(dalloc);
+    }
+
     if (!list_empty(&dalloc->slabs)) {
         struct slab *slab = NULL, *tmp = NULL;
         list_for_each_type_safe(slab, tmp, &dalloc->slabs, snode) {
@@ -602,6 +949,11 @@ aresult_t allocator_delete(struct allocator **alloc)
         goto done;
     }
 
+    if (dalloc->flags & ALLOC_FLAG_THREAD_SAFE) {
+        DIAG("Allocator at %p went to its depot %lu times during lifetime.", dalloc, dalloc->depot_swaps);
+        __helper_allocator_release_caches(dalloc);
+    }
+
     DIAG("Allocator at %p destroyed. Allocator used %u auxiliary slabs during lifetime.", dalloc, dalloc->slabs_taken);
 
     memset(dalloc, 0, sizeof(struct allocator));
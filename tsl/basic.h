@@ -36,6 +36,11 @@
  */
 #define BL_ROUND_POW2(val, n) (( ((val) + (n) - 1) >> (n) ) << (n))
 
+/** \brief Check if the given value is a non-zero power of two
+ * \param val Value to check
+ */
+#define BL_IS_POW2(val) ((0 != (val)) && (0 == ((val) & ((val) - 1))))
+
 /** \brief Get containing structure pointer
  * Extract a pointer to the structure that contains the given pointer.
  * Usually used when an embedded structure is used to reference the entire
@@ -66,5 +71,10 @@
  */
 #define BL_MIN3(x, y, z) ( ((x) < (y)) ? BL_MIN2((x), (z)) : BL_MIN2((y), (z)) )
 
+/** \brief Find the maximum of a pair of arguments
+ *
+ */
+#define BL_MAX2(x, y) ( (x) > (y) ? (x) : (y) )
+
 #endif /* __INCLUDED_TSL_BASIC_H__ */
 
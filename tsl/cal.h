@@ -63,6 +63,13 @@
 #define CAL_UNLIKELY(x) \
     __builtin_expect(!!(x), 0)
 
+/**
+ * \brief Hint that the cache line holding addr is about to be read
+ * \param addr Address to prefetch. Never faults, even if addr is not mapped.
+ */
+#define CAL_PREFETCH(addr) \
+    __builtin_prefetch((addr), 0, 3)
+
 /**
  * \brief Tag a function as never returning
  */
@@ -54,6 +54,8 @@
 #define A_E_UNKNOWN     ARESULT_ERROR(FACIL_SYSTEM, 13)
 /** Process is finished */
 #define A_E_DONE        ARESULT_ERROR(FACIL_SYSTEM, 14)
+/** Reader was overrun by the writer */
+#define A_E_OVERRUN     ARESULT_ERROR(FACIL_SYSTEM, 15)
 /*@}*/
 #endif /* __TSL_ERRORS_H__ */
 
@@ -239,6 +239,30 @@ done:
     return ret;
 }
 
+/**
+ * Restore the heap property after the key of the item at the head of the heap was
+ * changed in place. Replacing the head with the next item from the same source (as
+ * in a k-way merge) this way costs a single sift down, rather than a pop and a push.
+ */
+static inline
+aresult_t fixed_heap_update_head(struct fixed_heap *heap)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG_DEBUG(heap != NULL);
+    TSL_ASSERT_ARG_DEBUG(heap->heap != NULL);
+
+    if (CAL_UNLIKELY(heap->entries == 0)) {
+        ret = A_E_EMPTY;
+        goto done;
+    }
+
+    __fixed_heap_heapify(heap, 0);
+
+done:
+    return ret;
+}
+
 /**
  * Remove the specified item (found by searching) from the heap.
  */
@@ -0,0 +1,186 @@
+#include <tsl/lvcache/lvcache.h>
+
+#include <tsl/diag.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static
+size_t __lvcache_slot_size(size_t value_size)
+{
+    size_t size = sizeof(struct lvcache_slot) + value_size;
+
+    return (size + SYS_CACHE_LINE_LENGTH - 1) & ~((size_t)SYS_CACHE_LINE_LENGTH - 1);
+}
+
+static
+size_t __lvcache_map_size(size_t slot_size, uint64_t nr_keys)
+{
+    return sizeof(struct lvcache_header) + slot_size * nr_keys;
+}
+
+/**
+ * Check that the object holds a cache we understand, of the expected shape.
+ */
+static
+aresult_t __lvcache_check(int fd, size_t value_size, uint64_t nr_keys, struct lvcache_header *hdr)
+{
+    struct stat st;
+
+    if (0 > fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+        DIAG("Last-value cache is too small to be valid.");
+        return A_E_INVAL;
+    }
+
+    if (sizeof(*hdr) != pread(fd, hdr, sizeof(*hdr), 0)) {
+        PDIAG("Failed to read the last-value cache header");
+        return A_E_INVAL;
+    }
+
+    if (LVCACHE_MAGIC != hdr->magic || LVCACHE_VERSION != hdr->version ||
+            sizeof(*hdr) != hdr->header_size || __lvcache_slot_size(hdr->value_size) != hdr->slot_size ||
+            (size_t)st.st_size < __lvcache_map_size(hdr->slot_size, hdr->nr_keys))
+    {
+        DIAG("Last-value cache is not valid, or was built by an incompatible version.");
+        return A_E_INVAL;
+    }
+
+    if ((0 != value_size && value_size != hdr->value_size) || (0 != nr_keys && nr_keys != hdr->nr_keys)) {
+        DIAG("Last-value cache holds %" PRIu64 " keys of %" PRIu64 " bytes, expected %" PRIu64 " of %zu.",
+             hdr->nr_keys, hdr->value_size, nr_keys, value_size);
+        return A_E_BADARGS;
+    }
+
+    return A_OK;
+}
+
+aresult_t lvcache_open(struct lvcache *cache, int mode, const char *name, size_t value_size, uint64_t nr_keys)
+{
+    aresult_t ret = A_OK;
+    struct lvcache_header hdr;
+    int prot = PROT_READ;
+    void *mapping = MAP_FAILED;
+
+    TSL_ASSERT_ARG(NULL != cache);
+    TSL_ASSERT_ARG(NULL != name);
+    TSL_ASSERT_ARG(0 != strlen(name));
+    TSL_ASSERT_ARG(!(mode & O_CREAT) || (0 != value_size && 0 != nr_keys));
+
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -1;
+
+    if (0 > asprintf(&cache->name, "/%s%s", LVCACHE_NAME_PREFIX, name)) {
+        PDIAG("Unable to generate last-value cache name.");
+        cache->name = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    DIAG("Opening last-value cache '%s'", cache->name);
+
+    if (0 > (cache->fd = shm_open(cache->name, mode & (O_ACCMODE | O_CREAT), 0666))) {
+        if (ENOENT == errno) {
+            ret = A_E_NOTFOUND;
+            goto done;
+        }
+
+        PDIAG("Failed to open last-value cache with mode 0x%08x", (unsigned int)mode);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (mode & O_CREAT) {
+        hdr.value_size = value_size;
+        hdr.slot_size = __lvcache_slot_size(value_size);
+        hdr.nr_keys = nr_keys;
+
+        /* Truncating first zeroes every slot, so all keys start out never written */
+        if (0 > ftruncate(cache->fd, 0) ||
+                0 > ftruncate(cache->fd, __lvcache_map_size(hdr.slot_size, hdr.nr_keys)))
+        {
+            PDIAG("Failed to size the last-value cache.");
+            ret = A_E_INVAL;
+            goto done;
+        }
+    } else if (AFAILED(ret = __lvcache_check(cache->fd, value_size, nr_keys, &hdr))) {
+        goto done;
+    }
+
+    if ((O_RDWR & mode) || (O_WRONLY & mode)) {
+        prot |= PROT_WRITE;
+    }
+
+    cache->map_size = __lvcache_map_size(hdr.slot_size, hdr.nr_keys);
+
+    if (MAP_FAILED == (mapping = mmap(NULL, cache->map_size, prot, MAP_SHARED | MAP_POPULATE, cache->fd, 0))) {
+        PDIAG("Failed to mmap(2) the last-value cache.");
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    cache->hdr = mapping;
+    cache->slots = (uint8_t *)(cache->hdr + 1);
+    cache->value_size = hdr.value_size;
+    cache->slot_size = hdr.slot_size;
+    cache->nr_keys = hdr.nr_keys;
+
+    if (mode & O_CREAT) {
+        cache->hdr->value_size = hdr.value_size;
+        cache->hdr->slot_size = hdr.slot_size;
+        cache->hdr->nr_keys = hdr.nr_keys;
+        cache->hdr->version = LVCACHE_VERSION;
+        cache->hdr->header_size = sizeof(struct lvcache_header);
+        ck_pr_fence_store();
+        ck_pr_store_64(&cache->hdr->magic, LVCACHE_MAGIC);
+    }
+
+done:
+    if (AFAILED(ret)) {
+        if (0 <= cache->fd) {
+            close(cache->fd);
+        }
+
+        if (NULL != cache->name) {
+            free(cache->name);
+        }
+
+        memset(cache, 0, sizeof(*cache));
+        cache->fd = -1;
+    }
+
+    return ret;
+}
+
+aresult_t lvcache_close(struct lvcache *cache, int unlink)
+{
+    TSL_ASSERT_ARG(NULL != cache);
+
+    if (NULL != cache->hdr) {
+        munmap(cache->hdr, cache->map_size);
+        cache->hdr = NULL;
+        cache->slots = NULL;
+    }
+
+    if (0 <= cache->fd) {
+        close(cache->fd);
+        cache->fd = -1;
+    }
+
+    if (NULL != cache->name) {
+        if (unlink) {
+            shm_unlink(cache->name);
+        }
+
+        free(cache->name);
+        cache->name = NULL;
+    }
+
+    return A_OK;
+}
@@ -0,0 +1,243 @@
+#ifndef __INCLUDED_LVCACHE_LVCACHE_H__
+#define __INCLUDED_LVCACHE_LVCACHE_H__
+
+#include <tsl/result.h>
+#include <tsl/errors.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+#include <tsl/cal.h>
+
+#include <ck_pr.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LVCACHE_NAME_PREFIX         "lvcache_"
+
+/**
+ * Magic number at the start of every last-value cache ("LVCACHE", little-endian)
+ */
+#define LVCACHE_MAGIC               0x004548434143564cull
+
+/**
+ * Version of the layout of the last-value cache
+ */
+#define LVCACHE_VERSION             1
+
+/**
+ * Contents of the start of the shared cache. The slots follow, one per key.
+ */
+struct lvcache_header {
+    /** Always LVCACHE_MAGIC */
+    uint64_t magic CAL_CACHE_ALIGNED;
+    /** Version of the layout (LVCACHE_VERSION) */
+    uint32_t version;
+    /** Size of this structure */
+    uint32_t header_size;
+    /** Largest value a slot holds, in bytes */
+    uint64_t value_size;
+    /** Distance between two slots, a whole number of cache lines */
+    uint64_t slot_size;
+    /** Number of keys, and of slots */
+    uint64_t nr_keys;
+} CAL_CACHE_ALIGNED;
+
+/**
+ * A slot, holding the last value written for one key. Slots never share a cache
+ * line, so readers of one key do not slow down the writer of another.
+ */
+struct lvcache_slot {
+    /**
+     * Sequence lock: odd while the writer is updating the value. Half of it is the
+     * number of times the value was written, 0 if it never was.
+     */
+    uint64_t seq;
+    /** Length of the value */
+    uint64_t length;
+    /** The value itself */
+    uint8_t value[];
+};
+
+/**
+ * A last-value cache: a table of slots in shared memory, holding the latest value
+ * of each key (say, the top of book of each instrument). Unlike a Megaqueue, a
+ * reader never has to replay a stream to find out the current state: whoever joins
+ * late, or falls behind, reads the latest value of a key in O(1).
+ *
+ * Keys are dense, from 0 to nr_keys - 1. There is a single writer. Each slot is
+ * guarded by a sequence lock: readers never take a lock or write to the cache, and
+ * retry if the writer updated the slot while they were copying it. Any number of
+ * processes can read.
+ */
+struct lvcache {
+    /** The shared header */
+    struct lvcache_header *hdr;
+    /** The first slot, following the header */
+    uint8_t *slots;
+    /** Size of the mapping */
+    size_t map_size;
+    /** Largest value a slot holds, in bytes */
+    size_t value_size;
+    /** Distance between two slots */
+    size_t slot_size;
+    /** Number of keys */
+    uint64_t nr_keys;
+    /** Name of the shm object */
+    char *name;
+    /** File descriptor of the shm object */
+    int fd;
+};
+
+/**
+ * Open (and optionally create) a last-value cache.
+ *
+ * \param cache The cache handle to initialize
+ * \param mode O_RDONLY for a reader, O_RDWR for the writer, plus O_CREAT to create
+ *        the cache. Creating an existing cache empties it.
+ * \param name The name of the cache
+ * \param value_size Largest value a slot holds, in bytes. When opening an existing
+ *        cache, 0 accepts whatever the cache holds.
+ * \param nr_keys Number of keys. When opening an existing cache, 0 accepts whatever
+ *        the cache holds.
+ *
+ * \return A_OK on success, A_E_NOTFOUND if the cache does not exist, A_E_BADARGS if
+ *         it does not have the expected shape, an error code otherwise.
+ */
+aresult_t lvcache_open(struct lvcache *cache, int mode, const char *name, size_t value_size, uint64_t nr_keys);
+
+/**
+ * Close the cache. If unlink is set, the cache is removed as well.
+ */
+aresult_t lvcache_close(struct lvcache *cache, int unlink);
+
+static inline
+struct lvcache_slot *__lvcache_slot(struct lvcache *cache, uint64_t key)
+{
+    return (struct lvcache_slot *)(cache->slots + key * cache->slot_size);
+}
+
+/**
+ * Start updating the value of a key in place. Readers of the key spin until
+ * lvcache_write_end is called, so keep it short.
+ *
+ * \param cache The cache, opened by the writer
+ * \param key The key, below nr_keys
+ *
+ * \return The value to update, with room for value_size bytes. It still holds the
+ *         previous value.
+ */
+static inline
+void *lvcache_write_begin(struct lvcache *cache, uint64_t key)
+{
+    struct lvcache_slot *slot = __lvcache_slot(cache, key);
+
+    ck_pr_store_64(&slot->seq, slot->seq + 1);
+    /* Readers must see the slot as busy before any byte of the value changes */
+    ck_pr_fence_store();
+
+    return slot->value;
+}
+
+/**
+ * Finish updating the value of a key, started with lvcache_write_begin.
+ *
+ * \param cache The cache
+ * \param key The key
+ * \param length The length of the new value
+ */
+static inline
+void lvcache_write_end(struct lvcache *cache, uint64_t key, size_t length)
+{
+    struct lvcache_slot *slot = __lvcache_slot(cache, key);
+
+    ck_pr_store_64(&slot->length, length);
+    ck_pr_fence_store();
+    ck_pr_store_64(&slot->seq, slot->seq + 1);
+}
+
+/**
+ * Replace the value of a key.
+ *
+ * \return A_OK on success. In debug builds, A_E_BADARGS if the key or the length
+ *         are out of range.
+ */
+static inline
+aresult_t lvcache_write(struct lvcache *cache, uint64_t key, const void *value, size_t length)
+{
+    TSL_ASSERT_ARG_DEBUG(NULL != cache);
+    TSL_ASSERT_ARG_DEBUG(key < cache->nr_keys);
+    TSL_ASSERT_ARG_DEBUG(length <= cache->value_size);
+
+    memcpy(lvcache_write_begin(cache, key), value, length);
+    lvcache_write_end(cache, key, length);
+
+    return A_OK;
+}
+
+/**
+ * Get the version of the value of a key: the number of times it was written. A
+ * reader can poll this to find out if a key changed, without copying the value.
+ */
+static inline
+uint64_t lvcache_version(struct lvcache *cache, uint64_t key)
+{
+    return ck_pr_load_64(&__lvcache_slot(cache, key)->seq) / 2;
+}
+
+/**
+ * Copy a consistent snapshot of the value of a key. Never blocks the writer; if the
+ * writer updates the key while it is being copied, the copy is retried.
+ *
+ * \param cache The cache
+ * \param key The key, below nr_keys
+ * \param value Receives the value, must have room for value_size bytes
+ * \param length Receives the length of the value
+ * \param version Receives the version of the value, see lvcache_version. Optional.
+ *
+ * \return A_OK on success, A_E_NOENT if the key was never written.
+ */
+static inline
+aresult_t lvcache_read(struct lvcache *cache, uint64_t key, void *value, size_t *length, uint64_t *version)
+{
+    struct lvcache_slot *slot = NULL;
+    uint64_t seq = 0;
+    size_t len = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != cache);
+    TSL_ASSERT_ARG_DEBUG(NULL != value);
+    TSL_ASSERT_ARG_DEBUG(NULL != length);
+    TSL_ASSERT_ARG_DEBUG(key < cache->nr_keys);
+
+    slot = __lvcache_slot(cache, key);
+
+    do {
+        while (CAL_UNLIKELY((seq = ck_pr_load_64(&slot->seq)) & 1)) {
+            ck_pr_stall();
+        }
+
+        if (CAL_UNLIKELY(0 == seq)) {
+            return A_E_NOENT;
+        }
+
+        ck_pr_fence_load();
+
+        /* A torn length is caught by the sequence check, just keep it in bounds */
+        len = BL_MIN2((size_t)ck_pr_load_64(&slot->length), cache->value_size);
+        memcpy(value, slot->value, len);
+
+        ck_pr_fence_load();
+    } while (CAL_UNLIKELY(seq != ck_pr_load_64(&slot->seq)));
+
+    *length = len;
+
+    if (NULL != version) {
+        *version = seq / 2;
+    }
+
+    return A_OK;
+}
+
+#endif /* __INCLUDED_LVCACHE_LVCACHE_H__ */
+
@@ -3,9 +3,14 @@
 #include <tsl/errors.h>
 #include <tsl/diag.h>
 #include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <linux/falloc.h>
+#include <linux/futex.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -15,16 +20,51 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 
 #define MB(x) KB((x) * 1024)
 #define KB(x) ((x) * 1024)
 
+/**
+ * Longest a consumer sleeps in megaqueue_wait before checking the queue again. This
+ * bounds the delay if the producer misses the consumer going to sleep.
+ */
+#define MEGAQUEUE_WAIT_SLICE_NS     1000000ull
+
+#define NS_PER_SEC                  1000000000ull
+
+static
+uint64_t __megaqueue_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
 aresult_t megaqueue_close(struct megaqueue *queue, int unlink)
 {
     aresult_t ret = A_OK;
 
     TSL_ASSERT_ARG(NULL != queue);
 
+    if (NULL != queue->consumer) {
+        megaqueue_consumer_detach(queue);
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        __megaqueue_journal_close(queue, unlink);
+        unlink = 0;
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_HUGE_PAGE) {
+        __megaqueue_huge_close(queue, unlink);
+    }
+
     if (NULL != queue->region && 0 < queue->region_size) {
         if (munmap(queue->region, queue->region_size) < 0) {
             PDIAG("An error occurred while munmap()ing the megaqueue region.");
@@ -38,8 +78,16 @@ aresult_t megaqueue_close(struct megaqueue *queue, int unlink)
         queue->fd = -1;
     }
 
-    if (unlink) {
+    if (unlink && NULL != queue->rgn_name) {
+        char *index_name = NULL;
+
         shm_unlink(queue->rgn_name);
+
+        /* Along with its timestamp index, if it has one */
+        if (0 < asprintf(&index_name, "%s%s", queue->rgn_name, MEGAQUEUE_INDEX_SUFFIX)) {
+            shm_unlink(index_name);
+            free(index_name);
+        }
     }
 
     if (NULL != queue->rgn_name) {
@@ -52,23 +100,55 @@ aresult_t megaqueue_close(struct megaqueue *queue, int unlink)
     return ret;
 }
 
-static
-aresult_t megaqueue_prepare_superblock(void *base, size_t obj_size, size_t obj_count)
+aresult_t __megaqueue_prepare_superblock(void *base, size_t obj_size, size_t obj_count,
+                                       const struct megaqueue_params *params)
 {
     aresult_t ret = A_OK;
 
     struct megaqueue_header *hdr = base;
 
     TSL_ASSERT_ARG(NULL != base);
+    TSL_ASSERT_ARG(NULL != params);
+
+    memset(hdr, 0, sizeof(*hdr));
 
+    hdr->magic = MEGAQUEUE_MAGIC;
+    hdr->version = MEGAQUEUE_VERSION;
+    hdr->header_size = sizeof(*hdr);
     hdr->head = 0;
+    hdr->heartbeat = __megaqueue_now_ns();
     hdr->producer_pid = getpid();
     hdr->object_size = obj_size;
     hdr->object_count = obj_count;
+    hdr->flags = params->flags & ~MEGAQUEUE_HANDLE_FLAGS;
+    hdr->lap_distance = params->lap_distance == 0 ? 1 : params->lap_distance;
+    hdr->journal_retain = params->journal_retain;
 
     return ret;
 }
 
+/**
+ * Size of the header region at the start of the Megaqueue, rounded up to a full page.
+ */
+size_t __megaqueue_header_size(size_t page_size)
+{
+    return (sizeof(struct megaqueue_header) + page_size - 1) & ~(page_size - 1);
+}
+
+/**
+ * Size of the commit array of a multi-producer Megaqueue, rounded up to a full page.
+ * The commit array sits between the header and the objects.
+ */
+static
+size_t __megaqueue_commit_size(uint64_t flags, size_t obj_count, size_t page_size)
+{
+    if (!(flags & MEGAQUEUE_FLAG_MULTI_PRODUCER)) {
+        return 0;
+    }
+
+    return (obj_count * sizeof(uint64_t) + page_size - 1) & ~(page_size - 1);
+}
+
 /**
  * Destructively pre-fault an entire region of memory. Writes a value to the region,
  * at the beginning of each page. Do not run on initialized pages.
@@ -103,6 +183,184 @@ aresult_t __megaqueue_prefault_range(void *base, size_t bytes, size_t page_size)
     return ret;
 }
 
+/**
+ * Sanity check the header of an existing Megaqueue.
+ *
+ * \param hdr The header to check
+ * \param obj_size The object size the application expects
+ *
+ * \return A_OK if the header is sane, A_E_INVAL otherwise
+ */
+aresult_t __megaqueue_check_header(struct megaqueue_header *hdr, size_t obj_size)
+{
+    if (MEGAQUEUE_MAGIC != hdr->magic) {
+        DIAG("Megaqueue header has bad magic (0x%016" PRIx64 "), not a megaqueue.", hdr->magic);
+        return A_E_INVAL;
+    }
+
+    if (MEGAQUEUE_VERSION != hdr->version || sizeof(*hdr) != hdr->header_size) {
+        DIAG("Megaqueue has version %u with a %u byte header, expected version %u with a %zu byte header.",
+             hdr->version, hdr->header_size, MEGAQUEUE_VERSION, sizeof(*hdr));
+        return A_E_INVAL;
+    }
+
+    if (hdr->object_size < obj_size) {
+        DIAG("Object size in queue does not match application expectation (got %zu, expected %zu).", (size_t)hdr->object_size, obj_size);
+        return A_E_INVAL;
+    }
+
+    if (0 == hdr->object_count) {
+        DIAG("Megaqueue mapping is invalid.");
+        return A_E_INVAL;
+    }
+
+    return A_OK;
+}
+
+/**
+ * Set up the state of a handle from the header it just mapped.
+ *
+ * \param queue The handle, with the header already mapped
+ * \param mode The mode the handle was opened with
+ * \param params The parameters the handle was opened with
+ *
+ * \return A_OK on success, an error code otherwise
+ */
+aresult_t __megaqueue_setup_handle(struct megaqueue *queue, int mode, const struct megaqueue_params *params)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+
+    /* The object size and count in the header are authoritative */
+    queue->object_size = hdr->object_size;
+    queue->object_count = hdr->object_count;
+    queue->flags = hdr->flags | (params->flags & MEGAQUEUE_HANDLE_FLAGS);
+    queue->consumer = NULL;
+    queue->group = NULL;
+    queue->group_claimed = 0;
+    queue->missed = 0;
+
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        if (!BL_IS_POW2(queue->object_count) || !BL_IS_POW2(queue->object_size)) {
+            DIAG("Fast mode needs a power of two object size and count (got %u, %u)", queue->object_size, queue->object_count);
+            return A_E_BADARGS;
+        }
+
+        queue->object_mask = queue->object_count - 1;
+    }
+
+    if (BL_IS_POW2(queue->object_size)) {
+        queue->object_shift = __builtin_ctz(queue->object_size);
+    }
+
+    queue->mp_claimed = 0;
+    queue->reclaim_offset = 0;
+    queue->prefetch_distance = params->prefetch_distance;
+    queue->prod_head = ck_pr_load_64(&hdr->head);
+    queue->prod_delete_cache = ck_pr_load_64(&hdr->_delete);
+    queue->cons_head_cache = queue->prod_head;
+
+    /* A read-only handle can't move anything in the header */
+    if (O_RDONLY == (mode & O_ACCMODE)) {
+        queue->flags |= MEGAQUEUE_FLAG_SNOOP;
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_SNOOP) {
+        /* Start from the oldest object there is, megaqueue_seek moves on from there */
+        queue->snoop_cursor = megaqueue_oldest_sequence(queue);
+        queue->cursor = &queue->snoop_cursor;
+    } else {
+        /* Broadcast consumers must attach to a named cursor before reading */
+        queue->cursor = (queue->flags & MEGAQUEUE_FLAG_BROADCAST) ? NULL : &hdr->tail;
+    }
+
+    return A_OK;
+}
+
+/**
+ * Check whether an existing queue can be resumed with the given parameters.
+ *
+ * \param qfd The file descriptor of the queue, opened with O_CREAT
+ * \param obj_size The object size the application expects
+ * \param obj_count The object count the application expects
+ * \param params The parameters the queue is being opened with
+ * \param resume Set to true if there is a queue to resume, false if it must be created
+ *
+ * \return A_OK on success, A_E_INVAL if there is a queue that does not match
+ */
+static
+aresult_t __megaqueue_resume_check(int qfd, size_t obj_size, size_t obj_count,
+                                   const struct megaqueue_params *params, bool *resume)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header read_header;
+    struct stat st;
+
+    *resume = false;
+
+    if (0 > fstat(qfd, &st)) {
+        PDIAG("Failed to stat megaqueue.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 == st.st_size) {
+        /* Nothing to resume, the queue was just created */
+        goto done;
+    }
+
+    if (sizeof(read_header) != pread(qfd, (void *)&read_header, sizeof(read_header), 0)) {
+        PDIAG("Failed to read %zu bytes from the megaqueue header", sizeof(read_header));
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_check_header(&read_header, obj_size))) {
+        goto done;
+    }
+
+    if (read_header.object_size != obj_size || read_header.object_count != obj_count ||
+            read_header.flags != (params->flags & ~MEGAQUEUE_HANDLE_FLAGS))
+    {
+        DIAG("Can't resume megaqueue of %" PRIu64 " objects of %" PRIu64 " bytes (flags 0x%" PRIx64 ") "
+             "as %zu objects of %zu bytes (flags 0x%x)", read_header.object_count, read_header.object_size,
+             read_header.flags, obj_count, obj_size, params->flags & ~MEGAQUEUE_HANDLE_FLAGS);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    *resume = true;
+
+done:
+    return ret;
+}
+
+/**
+ * Take over as the producer of an existing queue, after the previous producer went
+ * away. The head is left alone, so consumers carry on where they are.
+ */
+void __megaqueue_resume(struct megaqueue *queue)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+    uint64_t head = ck_pr_load_64(&hdr->head);
+    uint64_t reserve = ck_pr_load_64(&hdr->reserve);
+
+    DIAG("Resuming megaqueue '%s' at sequence %" PRIu64, queue->rgn_name, head);
+
+    /* Claims the old producers never published would block the head forever */
+    if ((queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) && reserve != head) {
+        DIAG("Rolling back %" PRIu64 " unpublished claims", reserve - head);
+
+        for (uint64_t pos = head; pos < reserve; pos++) {
+            ck_pr_store_64(&queue->commit[pos % queue->object_count], 0);
+        }
+
+        ck_pr_store_64(&hdr->reserve, head);
+    }
+
+    ck_pr_store_64(&hdr->producer_pid, getpid());
+    megaqueue_heartbeat(queue);
+}
+
 /**
  * Open the specified megaqueue with the given O_ constant flags.
  * \param queue The queue information target
@@ -114,13 +372,37 @@ aresult_t __megaqueue_prefault_range(void *base, size_t bytes, size_t page_size)
  *
  * \note Due to limitations in how hugetlbfs works, MADV_REMOVE is not
  *       supported on huge-page mappings. As such, we use standard shm for
- *       megaqueues, because we can punch holes in the VMA quite readily.
+ *       megaqueues by default. MEGAQUEUE_FLAG_HUGE_PAGE puts the objects in a
+ *       hugetlbfs file instead, and pages are reclaimed by punching holes in the
+ *       file with fallocate(2). See megaqueue_reclaim.
  *
  * \see struct megaqueue
  * \see megaqueue_consumer_open
  * \see megaqueue_producer_open
  */
 aresult_t megaqueue_open(struct megaqueue *queue, int mode, const char *queue_name, size_t obj_size, size_t obj_count)
+{
+    return megaqueue_open_ex(queue, mode, queue_name, obj_size, obj_count, NULL);
+}
+
+/**
+ * Open the specified megaqueue, with optional creation parameters.
+ * \param queue The queue information target
+ * \param mode The mode (see the O_ constants passed to open(2))
+ * \param queue_name The human-readable name of the queue in question.
+ * \param obj_size Size of an object living in the queue. For a variable-length queue,
+ *        this is the record alignment (8 or 64 bytes).
+ * \param obj_count Count of objects in the queue. For a variable-length queue, this is
+ *        the size of the ring in units of the record alignment.
+ * \param params Creation parameters, or NULL for a plain single-consumer queue. The
+ *        creation flags are only used when the queue is created; consumers take them
+ *        from the header. Handle flags (MEGAQUEUE_FLAG_FAST) apply to this handle only.
+ * \return A_OK on success, an error code otherwise.
+ *
+ * \see megaqueue_open
+ */
+aresult_t megaqueue_open_ex(struct megaqueue *queue, int mode, const char *queue_name, size_t obj_size, size_t obj_count,
+                            const struct megaqueue_params *params)
 {
     aresult_t ret = A_OK;
     char *queue_name_alloc = NULL;
@@ -128,12 +410,80 @@ aresult_t megaqueue_open(struct megaqueue *queue, int mode, const char *queue_na
     void *mapping = MAP_FAILED;
     int prot = PROT_READ;
     size_t page_size = getpagesize();
-    size_t queue_size = obj_size * obj_count + page_size;
+    size_t header_size = __megaqueue_header_size(page_size);
+    size_t commit_size = 0;
+    size_t data_size = 0;
+    size_t queue_size = 0;
+    struct megaqueue_params default_params = { .flags = 0 };
+    bool resume = false;
+    bool created = false;
+    bool huge_opened = false;
+    int numa_node = -1;
 
     TSL_ASSERT_ARG(NULL != queue);
     TSL_ASSERT_ARG(NULL != queue_name);
     TSL_ASSERT_ARG(0 != strlen(queue_name));
 
+    if (NULL == params) {
+        params = &default_params;
+    }
+
+    if ((params->flags & MEGAQUEUE_FLAG_LAP) && !(params->flags & MEGAQUEUE_FLAG_BROADCAST)) {
+        DIAG("Lapping is only supported for broadcast megaqueues.");
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if ((params->flags & MEGAQUEUE_FLAG_VARLEN) && (params->flags & MEGAQUEUE_FLAG_LAP)) {
+        DIAG("Lapping is not supported for variable-length megaqueues.");
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if ((params->flags & MEGAQUEUE_FLAG_VARLEN) && (mode & O_CREAT) && 8 != obj_size && 64 != obj_size) {
+        DIAG("Variable-length megaqueues align records to 8 or 64 bytes (got %zu)", obj_size);
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if ((params->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) &&
+            (params->flags & (MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_VARLEN | MEGAQUEUE_FLAG_JOURNAL)))
+    {
+        DIAG("Multi-producer megaqueues do not support lapping, variable-length records or journals.");
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if (params->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        if (params->flags & MEGAQUEUE_FLAG_LAP) {
+            DIAG("Lapping is not supported for journal megaqueues.");
+            ret = A_E_BADARGS;
+            goto done;
+        }
+
+        if (MEGAQUEUE_NUMA_DEFAULT != params->numa_policy) {
+            DIAG("NUMA placement is not supported for journal megaqueues.");
+            ret = A_E_BADARGS;
+            goto done;
+        }
+
+        ret = __megaqueue_journal_open(queue, mode, queue_name, obj_size, obj_count, params);
+        goto done;
+    }
+
+    /* Before anything is created, so a bad request doesn't leave a queue behind */
+    if ((params->flags & MEGAQUEUE_FLAG_FAST) && (mode & O_CREAT) &&
+            (!BL_IS_POW2(obj_count) || !BL_IS_POW2(obj_size)))
+    {
+        DIAG("Fast mode needs a power of two object size and count (got %zu, %zu)", obj_size, obj_count);
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_numa_node(params, &numa_node))) {
+        goto done;
+    }
+
     /* Generate the filename for the queue */
     asprintf(&queue_name_alloc, "/%s%s", MEGAQUEUE_NAME_PREFIX, queue_name);
 
@@ -152,7 +502,20 @@ aresult_t megaqueue_open(struct megaqueue *queue, int mode, const char *queue_na
         goto done;
     }
 
-    if (mode & O_CREAT) {
+    if ((mode & O_CREAT) && (params->flags & MEGAQUEUE_FLAG_RESUME) &&
+            AFAILED(ret = __megaqueue_resume_check(qfd, obj_size, obj_count, params, &resume)))
+    {
+        goto done;
+    }
+
+    if ((mode & O_CREAT) && false == resume) {
+        commit_size = __megaqueue_commit_size(params->flags, obj_count, page_size);
+        data_size = (params->flags & MEGAQUEUE_FLAG_HUGE_PAGE) ? 0 : obj_size * obj_count;
+        queue_size = header_size + commit_size + data_size;
+
+        /* From here on, the queue in shm is ours to remove if the open fails */
+        created = true;
+
         /* ftruncate(2) the region of memory */
         if ((ftruncate(qfd, queue_size)) < 0) {
             PDIAG("Failed to ftruncate(2) the shm fd.");
@@ -161,13 +524,21 @@ aresult_t megaqueue_open(struct megaqueue *queue, int mode, const char *queue_na
         }
     } else {
         struct megaqueue_header read_header;
-        if (0 > read(qfd, (void *)&read_header, sizeof(read_header))) {
+        if (sizeof(read_header) != pread(qfd, (void *)&read_header, sizeof(read_header), 0)) {
             PDIAG("Failed to read %zu bytes from the megaqueue header", sizeof(read_header));
             ret = A_E_INVAL;
             goto done;
         }
 
-        queue_size = read_header.object_count * read_header.object_size + page_size;
+        /* Don't size the mapping from a header we can't make sense of */
+        if (AFAILED(ret = __megaqueue_check_header(&read_header, obj_size))) {
+            goto done;
+        }
+
+        commit_size = __megaqueue_commit_size(read_header.flags, read_header.object_count, page_size);
+        data_size = (read_header.flags & MEGAQUEUE_FLAG_HUGE_PAGE) ? 0 :
+                        read_header.object_count * read_header.object_size;
+        queue_size = header_size + commit_size + data_size;
         obj_count = read_header.object_count;
     }
 
@@ -176,14 +547,22 @@ aresult_t megaqueue_open(struct megaqueue *queue, int mode, const char *queue_na
         prot |= PROT_WRITE;
     }
 
-    if ((mapping = mmap(NULL, queue_size, prot, MAP_SHARED, qfd, 0)) == MAP_FAILED) {
+    if ((mapping = mmap(NULL, queue_size, prot,
+                    MAP_SHARED | ((params->flags & MEGAQUEUE_FLAG_POPULATE) ? MAP_POPULATE : 0),
+                    qfd, 0)) == MAP_FAILED)
+    {
         PDIAG("Failed to mmap(2) shared memory region.");
         ret = A_E_INVAL;
         goto done;
     }
 
+    /* Before anything is faulted in, so the prefault allocates on the right node */
+    if (AFAILED(ret = __megaqueue_numa_bind(mapping, queue_size, numa_node))) {
+        goto done;
+    }
+
     /* If this was a queue that was created explicitly, invalidate up to the first 512 MB (or the entire queue) */
-    if (O_CREAT & mode) {
+    if ((O_CREAT & mode) && false == resume) {
         size_t prefetch = queue_size > MB(512) ? MB(512) : ((queue_size + page_size - 1));
         prefetch = (prefetch + page_size - 1) & ~(page_size - 1);
         DIAG("Prefetching %zu bytes of megaqueue", prefetch);
@@ -197,38 +576,59 @@ aresult_t megaqueue_open(struct megaqueue *queue, int mode, const char *queue_na
             PDIAG("Warning: failed to prefault megaqueue directly.");
         }
 
-        megaqueue_prepare_superblock(mapping, obj_size, obj_count);
+        __megaqueue_prepare_superblock(mapping, obj_size, obj_count, params);
     } else {
-        /* Check the header */
-        struct megaqueue_header *hdr = mapping;
-        if (hdr->object_size < obj_size) {
-            DIAG("Object size in queue does not match application expectation (got %zu, expected %zu).", hdr->object_size, obj_size);
-            ret = A_E_INVAL;
-            goto done;
-        }
-
-        if (0 == hdr->object_count) {
-            DIAG("Megaqueue mapping is invalid.");
-            ret = A_E_INVAL;
+        if (AFAILED(ret = __megaqueue_check_header(mapping, obj_size))) {
             goto done;
         }
-
-        /* Set the object size based on what is in the queue descriptor */
-        obj_count = hdr->object_count;
     }
 
     queue->region = mapping;
-    queue->object_size = obj_size;
-    queue->object_count = obj_count;
     queue->fd = qfd;
     queue->region_size = queue_size;
     queue->hdr = (struct megaqueue_header *)mapping;
-    queue->writable_start = mapping + page_size;
+    queue->commit = (0 != commit_size) ? mapping + header_size : NULL;
+    queue->writable_start = mapping + header_size + commit_size;
+    queue->read_start = queue->writable_start;
     queue->rgn_name = queue_name_alloc;
 
+    if (AFAILED(ret = __megaqueue_setup_handle(queue, mode, params))) {
+        goto done;
+    }
+
+    queue->data_region = NULL;
+    queue->data_name = NULL;
+    queue->data_fd = qfd;
+    queue->data_offset = header_size + commit_size;
+    queue->page_size = page_size;
+
+    /* The header stays in shm, the objects move to hugetlbfs */
+    if ((queue->flags & MEGAQUEUE_FLAG_HUGE_PAGE) &&
+            AFAILED(ret = __megaqueue_huge_open(queue, mode, queue_name, params)))
+    {
+        goto done;
+    }
+
+    huge_opened = !!(queue->flags & MEGAQUEUE_FLAG_HUGE_PAGE);
+
+    /* Huge pages are allocated by mmap(2) already, this moves them */
+    if ((queue->flags & MEGAQUEUE_FLAG_HUGE_PAGE) &&
+            AFAILED(ret = __megaqueue_numa_bind(queue->data_region, queue->data_size, numa_node)))
+    {
+        goto done;
+    }
+
+    if (true == resume) {
+        __megaqueue_resume(queue);
+    }
+
 done:
     if (AFAILED(ret)) {
-        if (NULL != mapping) {
+        if (true == huge_opened) {
+            __megaqueue_huge_close(queue, created);
+        }
+
+        if (MAP_FAILED != mapping) {
             munmap(mapping, queue_size);
             mapping = NULL;
         }
@@ -238,13 +638,737 @@ done:
             qfd = -1;
         }
 
+        if (true == created) {
+            shm_unlink(queue_name_alloc);
+        }
+
         if (NULL != queue_name_alloc) {
             free(queue_name_alloc);
             queue_name_alloc = NULL;
         }
 
+        /* Don't hand back pointers to what was just released */
+        *queue = (struct megaqueue)MEGAQUEUE_SAFE_INIT_EMPTY;
     }
 
     return ret;
 }
 
+
+/**
+ * Find the slowest live consumer, and move the deletion pointer up to it. If the queue
+ * is still full and allows lapping, drop the oldest objects from under the slowest
+ * consumer. Only ever called by producers; on a multi-producer queue, several of them
+ * can be in here at once, so the deletion pointer is only moved with a CAS.
+ */
+aresult_t __megaqueue_make_room(struct megaqueue *queue)
+{
+    struct megaqueue_header *hdr = NULL;
+    uint64_t head = 0;
+    uint64_t old_delete = 0;
+    uint64_t new_delete = 0;
+    uint64_t moved_delete = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        /* Journal producers never wait for consumers, they move on to the next segment */
+        return __megaqueue_journal_roll(queue);
+    }
+
+    hdr = queue->hdr;
+    head = ck_pr_load_64(&hdr->head);
+    old_delete = ck_pr_load_64(&hdr->_delete);
+    new_delete = head;
+
+    for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        struct megaqueue_consumer *cons = &hdr->consumers[i];
+        if (MEGAQUEUE_CONSUMER_LIVE == ck_pr_load_32(&cons->state)) {
+            uint64_t cursor = ck_pr_load_64(&cons->cursor);
+            new_delete = BL_MIN2(new_delete, cursor);
+        }
+    }
+
+    /* Consumers behind the old deletion pointer have already been lapped */
+    new_delete = BL_MAX2(new_delete, old_delete);
+
+    /* Slots up to the reservation counter might already be claimed by other producers */
+    if (queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) {
+        head = ck_pr_load_64(&hdr->reserve);
+    }
+
+    if (head - new_delete >= queue->object_count && (queue->flags & MEGAQUEUE_FLAG_LAP)) {
+        new_delete = head - queue->object_count + hdr->lap_distance;
+        new_delete = BL_MIN2(new_delete, head);
+        ck_pr_store_64(&hdr->laps, ck_pr_load_64(&hdr->laps) + 1);
+    }
+
+    if (new_delete == old_delete) {
+        return A_E_NOSPC;
+    }
+
+    /*
+     * Never move the deletion pointer back to an older snapshot. If another producer
+     * moved it first, the caller looks at the queue again.
+     */
+    if (!ck_pr_cas_64(&hdr->_delete, old_delete, new_delete)) {
+        return A_OK;
+    }
+
+    moved_delete = new_delete;
+
+    if (!(queue->flags & MEGAQUEUE_FLAG_LAP)) {
+        /*
+         * A consumer might have gone live while we were scanning. Check again, and
+         * pull the deletion pointer back if so; nothing past the old deletion pointer
+         * has been overwritten yet. The consumer does the mirror image of this check
+         * when attaching.
+         */
+        ck_pr_fence_memory();
+
+        for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+            struct megaqueue_consumer *cons = &hdr->consumers[i];
+            if (MEGAQUEUE_CONSUMER_LIVE == ck_pr_load_32(&cons->state)) {
+                uint64_t cursor = ck_pr_load_64(&cons->cursor);
+                new_delete = BL_MIN2(new_delete, BL_MAX2(cursor, old_delete));
+            }
+        }
+
+        /* Unless another producer has moved it on since, from its own scan */
+        if (new_delete != moved_delete && !ck_pr_cas_64(&hdr->_delete, moved_delete, new_delete)) {
+            return A_OK;
+        }
+    }
+
+    return (head - new_delete >= queue->object_count) ? A_E_NOSPC : A_OK;
+}
+
+/**
+ * Claim the given consumer table entry, and position its cursor. A new plain
+ * consumer or group starts at the head, a new member holds nothing.
+ */
+static
+aresult_t __megaqueue_consumer_claim(struct megaqueue *queue, struct megaqueue_consumer *cons,
+                                     const char *name, uint32_t kind, bool resume)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+    uint64_t cursor = 0;
+    uint64_t delete_offset = 0;
+
+    if (false == ck_pr_cas_32(&cons->state, MEGAQUEUE_CONSUMER_FREE, MEGAQUEUE_CONSUMER_ATTACHING)) {
+        /* Lost a race with another consumer */
+        return A_E_BUSY;
+    }
+
+    if (false == resume) {
+        memset(cons->name, 0, sizeof(cons->name));
+        strncpy(cons->name, name, MEGAQUEUE_CONSUMER_NAME_LEN - 1);
+        cons->kind = kind;
+        ck_pr_store_64(&cons->cursor, MEGAQUEUE_CONSUMER_MEMBER == kind ?
+                MEGAQUEUE_MEMBER_IDLE : ck_pr_load_64(&hdr->head));
+    }
+
+    cons->pid = getpid();
+
+    ck_pr_fence_store();
+    ck_pr_store_32(&cons->state, MEGAQUEUE_CONSUMER_LIVE);
+
+    /* Make sure the producer did not reclaim our position out from under us */
+    ck_pr_fence_memory();
+
+    cursor = ck_pr_load_64(&cons->cursor);
+    delete_offset = ck_pr_load_64(&hdr->_delete);
+
+    if (cursor < delete_offset) {
+        DIAG("Consumer '%s' was lapped while detached, skipping %zu objects", name, (size_t)(delete_offset - cursor));
+        queue->missed += delete_offset - cursor;
+        ck_pr_store_64(&cons->cursor, delete_offset);
+    }
+
+    return A_OK;
+}
+
+/**
+ * Claim a consumer table entry for a new consumer, group or member. Never-used
+ * entries are preferred, then detached consumers are recycled.
+ */
+static
+aresult_t __megaqueue_consumer_new(struct megaqueue *queue, const char *name, uint32_t kind,
+                                   struct megaqueue_consumer **pcons)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+            struct megaqueue_consumer *cons = &hdr->consumers[i];
+
+            if (MEGAQUEUE_CONSUMER_FREE != ck_pr_load_32(&cons->state)) {
+                continue;
+            }
+
+            if (0 == pass && '\0' != cons->name[0]) {
+                continue;
+            }
+
+            if (!AFAILED(__megaqueue_consumer_claim(queue, cons, name, kind, false))) {
+                *pcons = cons;
+                return A_OK;
+            }
+        }
+    }
+
+    DIAG("No free consumer entries left for consumer '%s'", name);
+
+    return A_E_NOSPC;
+}
+
+/**
+ * Check that consumers can attach to this handle of the queue, in a given role.
+ */
+static
+aresult_t __megaqueue_consumer_check(struct megaqueue *queue, const char *name, uint32_t kind)
+{
+    if (!(queue->flags & MEGAQUEUE_FLAG_BROADCAST)) {
+        DIAG("Megaqueue is not a broadcast megaqueue, can't attach consumer '%s'", name);
+        return A_E_INVAL;
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_SNOOP) {
+        DIAG("Snooping handles read with a private cursor, can't attach consumer '%s'", name);
+        return A_E_INVAL;
+    }
+
+    if (MEGAQUEUE_CONSUMER_PLAIN != kind && (queue->flags & (MEGAQUEUE_FLAG_VARLEN | MEGAQUEUE_FLAG_JOURNAL))) {
+        DIAG("Consumer groups are not supported for variable-length or journal megaqueues ('%s')", name);
+        return A_E_INVAL;
+    }
+
+    return A_OK;
+}
+
+/**
+ * Find the live group with the given name
+ */
+static
+struct megaqueue_consumer *__megaqueue_group_find(struct megaqueue *queue, const char *group)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+
+    for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        struct megaqueue_consumer *cons = &hdr->consumers[i];
+
+        if (MEGAQUEUE_CONSUMER_GROUP == cons->kind &&
+                MEGAQUEUE_CONSUMER_LIVE == ck_pr_load_32(&cons->state) &&
+                0 == strncmp(cons->name, group, MEGAQUEUE_CONSUMER_NAME_LEN))
+        {
+            return cons;
+        }
+    }
+
+    return NULL;
+}
+
+aresult_t megaqueue_consumer_attach(struct megaqueue *queue, const char *name)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    struct megaqueue_consumer *found = NULL;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != name);
+    TSL_ASSERT_ARG(0 != strlen(name));
+    TSL_ASSERT_ARG(MEGAQUEUE_CONSUMER_NAME_LEN > strlen(name));
+    TSL_ASSERT_ARG(NULL == queue->consumer);
+
+    hdr = queue->hdr;
+
+    if (AFAILED(ret = __megaqueue_consumer_check(queue, name, MEGAQUEUE_CONSUMER_PLAIN))) {
+        goto done;
+    }
+
+    /* First, try to resume a consumer with the same name */
+    for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        struct megaqueue_consumer *cons = &hdr->consumers[i];
+
+        if (0 != strncmp(cons->name, name, MEGAQUEUE_CONSUMER_NAME_LEN)) {
+            continue;
+        }
+
+        if (MEGAQUEUE_CONSUMER_PLAIN != cons->kind) {
+            /* Groups and their members share the namespace, but can't be resumed */
+            if (MEGAQUEUE_CONSUMER_FREE == ck_pr_load_32(&cons->state)) {
+                continue;
+            }
+
+            DIAG("'%s' is a consumer group.", name);
+            ret = A_E_EXIST;
+            goto done;
+        }
+
+        if (MEGAQUEUE_CONSUMER_FREE != ck_pr_load_32(&cons->state)) {
+            DIAG("Consumer '%s' is already attached.", name);
+            ret = A_E_BUSY;
+            goto done;
+        }
+
+        if (!AFAILED(ret = __megaqueue_consumer_claim(queue, cons, name, MEGAQUEUE_CONSUMER_PLAIN, true))) {
+            found = cons;
+            goto done;
+        }
+    }
+
+    ret = __megaqueue_consumer_new(queue, name, MEGAQUEUE_CONSUMER_PLAIN, &found);
+
+done:
+    if (!AFAILED(ret)) {
+        queue->consumer = found;
+        queue->cursor = &found->cursor;
+    }
+
+    return ret;
+}
+
+aresult_t megaqueue_consumer_detach(struct megaqueue *queue)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != queue);
+
+    if (NULL == queue->consumer) {
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    ck_pr_store_32(&queue->consumer->state, MEGAQUEUE_CONSUMER_FREE);
+
+    queue->consumer = NULL;
+    queue->cursor = NULL;
+    queue->group = NULL;
+    queue->group_claimed = 0;
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_group_create(struct megaqueue *queue, const char *group)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    struct megaqueue_consumer *cons = NULL;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != group);
+    TSL_ASSERT_ARG(0 != strlen(group));
+    TSL_ASSERT_ARG(MEGAQUEUE_CONSUMER_NAME_LEN > strlen(group));
+
+    hdr = queue->hdr;
+
+    if (AFAILED(ret = __megaqueue_consumer_check(queue, group, MEGAQUEUE_CONSUMER_GROUP))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        cons = &hdr->consumers[i];
+
+        if (0 != strncmp(cons->name, group, MEGAQUEUE_CONSUMER_NAME_LEN)) {
+            continue;
+        }
+
+        if (MEGAQUEUE_CONSUMER_GROUP == cons->kind && MEGAQUEUE_CONSUMER_LIVE == ck_pr_load_32(&cons->state)) {
+            goto done;
+        }
+
+        /* Stale groups and members are recycled, named consumers keep their name */
+        if (MEGAQUEUE_CONSUMER_PLAIN == cons->kind) {
+            DIAG("A consumer named '%s' already exists.", group);
+            ret = A_E_EXIST;
+            goto done;
+        }
+    }
+
+    if (AFAILED(ret = __megaqueue_consumer_new(queue, group, MEGAQUEUE_CONSUMER_GROUP, &cons))) {
+        goto done;
+    }
+
+    DIAG("Created consumer group '%s' at %" PRIu64, group, ck_pr_load_64(&cons->cursor));
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_group_destroy(struct megaqueue *queue, const char *group)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_consumer *cons = NULL;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != group);
+
+    if (NULL == (cons = __megaqueue_group_find(queue, group))) {
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    ck_pr_store_32(&cons->state, MEGAQUEUE_CONSUMER_FREE);
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_group_join(struct megaqueue *queue, const char *group)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_consumer *found = NULL;
+    struct megaqueue_consumer *member = NULL;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != group);
+    TSL_ASSERT_ARG(0 != strlen(group));
+    TSL_ASSERT_ARG(MEGAQUEUE_CONSUMER_NAME_LEN > strlen(group));
+    TSL_ASSERT_ARG(NULL == queue->consumer);
+
+    if (AFAILED(ret = __megaqueue_consumer_check(queue, group, MEGAQUEUE_CONSUMER_MEMBER))) {
+        goto done;
+    }
+
+    if (NULL == (found = __megaqueue_group_find(queue, group))) {
+        DIAG("No consumer group named '%s'", group);
+        ret = A_E_NOTFOUND;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_consumer_new(queue, group, MEGAQUEUE_CONSUMER_MEMBER, &member))) {
+        goto done;
+    }
+
+    queue->consumer = member;
+    queue->group = found;
+    queue->group_claimed = 0;
+    /* So megaqueue_wait can tell when there is something left to claim */
+    queue->cursor = &found->cursor;
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_group_leave(struct megaqueue *queue)
+{
+    TSL_ASSERT_ARG(NULL != queue);
+
+    if (NULL == queue->group) {
+        return A_E_NOTFOUND;
+    }
+
+    if (0 != queue->group_claimed) {
+        DIAG("Leaving consumer group '%s' with %" PRIu64 " objects unacknowledged", queue->group->name,
+             queue->group_claimed);
+    }
+
+    return megaqueue_consumer_detach(queue);
+}
+
+aresult_t megaqueue_seek(struct megaqueue *queue, uint64_t seq)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    uint64_t oldest = 0;
+    uint64_t tail_offset = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->cursor);
+    /* Would move the whole group, behind the back of its members */
+    TSL_ASSERT_ARG(NULL == queue->group);
+
+    hdr = queue->hdr;
+
+    if (seq > ck_pr_load_64(&hdr->head)) {
+        DIAG("Sequence %" PRIu64 " has not been produced yet.", seq);
+        ret = A_E_NOENT;
+        goto done;
+    }
+
+    oldest = megaqueue_oldest_sequence(queue);
+
+    if (seq < oldest) {
+        DIAG("Sequence %" PRIu64 " is no longer in the queue, seeking to %" PRIu64 " instead.", seq, oldest);
+        queue->missed += oldest - seq;
+        seq = oldest;
+        ret = A_E_OVERRUN;
+    }
+
+    tail_offset = ck_pr_load_64(queue->cursor);
+    ck_pr_store_64(queue->cursor, seq);
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        /* Retired segments are caught when the consumer maps them */
+        goto done;
+    }
+
+    if (queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_SNOOP)) {
+        /*
+         * The producer might have reclaimed the objects we moved back to before it
+         * saw our cursor. Check again, like when attaching.
+         */
+        ck_pr_fence_memory();
+
+        if (AFAILED(__megaqueue_check_lapped(queue))) {
+            ret = A_E_OVERRUN;
+        }
+    } else if (ck_pr_load_64(&hdr->_delete) == tail_offset) {
+        /* Keep the deletion pointer in lockstep for megaqueue_read_advance users */
+        ck_pr_store_64(&hdr->_delete, seq);
+    }
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_reset_sequence(struct megaqueue *queue, uint64_t seq)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    uint64_t head_offset = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+
+    hdr = queue->hdr;
+
+    if (queue->flags & (MEGAQUEUE_FLAG_JOURNAL | MEGAQUEUE_FLAG_SNOOP)) {
+        DIAG("Can't move the sequence of a journal, or through a read-only handle.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    head_offset = ck_pr_load_64(&hdr->head);
+
+    if (seq < head_offset) {
+        DIAG("Can't move the sequence back from %" PRIu64 " to %" PRIu64, head_offset, seq);
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if (seq == head_offset) {
+        goto done;
+    }
+
+    /* Everything produced must have been consumed, and nobody may be reading */
+    if (ck_pr_load_64(&hdr->reserve) != head_offset ||
+            (!(queue->flags & MEGAQUEUE_FLAG_BROADCAST) && ck_pr_load_64(&hdr->tail) != head_offset))
+    {
+        DIAG("Megaqueue is not empty, can't move its sequence to %" PRIu64, seq);
+        ret = A_E_BUSY;
+        goto done;
+    }
+
+    for (size_t i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        if (MEGAQUEUE_CONSUMER_FREE != ck_pr_load_32(&hdr->consumers[i].state)) {
+            DIAG("Consumer '%s' is attached, can't move the sequence to %" PRIu64, hdr->consumers[i].name, seq);
+            ret = A_E_BUSY;
+            goto done;
+        }
+    }
+
+    DIAG("Moving megaqueue '%s' from sequence %" PRIu64 " to %" PRIu64, queue->rgn_name, head_offset, seq);
+
+    /* Detached consumers find they were lapped when they attach again */
+    ck_pr_store_64(&hdr->_delete, seq);
+    ck_pr_store_64(&hdr->tail, seq);
+    ck_pr_store_64(&hdr->reserve, seq);
+    ck_pr_fence_store();
+
+    queue->prod_delete_cache = seq;
+    queue->cons_head_cache = seq;
+    __megaqueue_set_head(queue, seq);
+
+done:
+    return ret;
+}
+
+/**
+ * The futex is the low 32 bits of the head (we only run on little-endian machines).
+ * Megaqueues are shared between processes, so this can't be a private futex.
+ */
+static inline
+uint32_t *__megaqueue_futex(struct megaqueue *queue)
+{
+    return (uint32_t *)&queue->hdr->head;
+}
+
+void __megaqueue_wake(struct megaqueue *queue)
+{
+    syscall(SYS_futex, __megaqueue_futex(queue), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void megaqueue_heartbeat(struct megaqueue *queue)
+{
+    ck_pr_store_64(&queue->hdr->heartbeat, __megaqueue_now_ns());
+}
+
+aresult_t megaqueue_producer_state(struct megaqueue *queue, uint64_t max_age_ns, unsigned int *state)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    pid_t pid = 0;
+    uint64_t heartbeat = 0;
+    uint64_t now = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->hdr);
+    TSL_ASSERT_ARG(NULL != state);
+
+    hdr = queue->hdr;
+    pid = (pid_t)ck_pr_load_64(&hdr->producer_pid);
+
+    /* EPERM means the process exists, it just isn't ours */
+    if (0 > kill(pid, 0) && ESRCH == errno) {
+        *state = MEGAQUEUE_PRODUCER_DEAD;
+        goto done;
+    }
+
+    heartbeat = ck_pr_load_64(&hdr->heartbeat);
+    now = __megaqueue_now_ns();
+
+    *state = (now > heartbeat && now - heartbeat > max_age_ns) ? MEGAQUEUE_PRODUCER_STALLED : MEGAQUEUE_PRODUCER_ALIVE;
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_wait(struct megaqueue *queue, uint32_t spins, uint64_t timeout_ns)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    uint64_t deadline = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->cursor);
+
+    hdr = queue->hdr;
+
+    for (uint32_t i = 0; i < spins; i++) {
+        if (!__megaqueue_is_empty(queue)) {
+            goto done;
+        }
+        ck_pr_stall();
+    }
+
+    if (0 == timeout_ns) {
+        ret = __megaqueue_is_empty(queue) ? A_E_EMPTY : A_OK;
+        goto done;
+    }
+
+    if (MEGAQUEUE_WAIT_FOREVER != timeout_ns) {
+        deadline = __megaqueue_now_ns() + timeout_ns;
+    }
+
+    ck_pr_inc_32(&hdr->waiters);
+
+    while (true) {
+        uint64_t slice = MEGAQUEUE_WAIT_SLICE_NS;
+        uint32_t head_low = 0;
+        struct timespec ts;
+
+        /* Make sure the producer can see we are waiting before checking the head */
+        ck_pr_fence_memory();
+
+        head_low = ck_pr_load_32(__megaqueue_futex(queue));
+
+        if (!__megaqueue_is_empty(queue)) {
+            break;
+        }
+
+        if (0 != deadline) {
+            uint64_t now = __megaqueue_now_ns();
+
+            if (now >= deadline) {
+                ret = A_E_EMPTY;
+                break;
+            }
+
+            slice = BL_MIN2(slice, deadline - now);
+        }
+
+        ts.tv_sec = slice / NS_PER_SEC;
+        ts.tv_nsec = slice % NS_PER_SEC;
+
+        /* Spurious wakeups, timeouts and signals are all handled by checking again */
+        syscall(SYS_futex, __megaqueue_futex(queue), FUTEX_WAIT, head_low, &ts, NULL, 0);
+    }
+
+    ck_pr_dec_32(&hdr->waiters);
+
+done:
+    return ret;
+}
+
+/**
+ * Punch a run of pages out of the file backing the objects.
+ */
+static
+aresult_t __megaqueue_punch(struct megaqueue *queue, size_t offset, size_t length)
+{
+    if (0 > fallocate(queue->data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      queue->data_offset + offset, length))
+    {
+        PDIAG("Failed to punch %zu bytes at offset %zu out of the megaqueue", length, offset);
+        return A_E_INVAL;
+    }
+
+    return A_OK;
+}
+
+aresult_t megaqueue_reclaim(struct megaqueue *queue, uint64_t guard)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    size_t ring_pages = 0;
+    uint64_t top = 0;
+    uint64_t start = 0;
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+
+    hdr = queue->hdr;
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        DIAG("Journal segments are reclaimed by the retention policy.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 != ((size_t)queue->object_size * queue->object_count) % queue->page_size) {
+        DIAG("Megaqueue ring is not a whole number of %zu byte pages, can't reclaim.", queue->page_size);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    ring_pages = (size_t)queue->object_size * queue->object_count / queue->page_size;
+
+    /* Slots up to the reservation counter might already be in use */
+    top = (queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) ? ck_pr_load_64(&hdr->reserve) : ck_pr_load_64(&hdr->head);
+    top += guard;
+
+    /* Slots of objects before start are written again within guard objects of the head */
+    start = top > queue->object_count ? top - queue->object_count : 0;
+    start = BL_MAX2(start * queue->object_size, queue->reclaim_offset);
+
+    /* Only whole pages of objects that every consumer is done with */
+    first = (start + queue->page_size - 1) / queue->page_size;
+    last = (ck_pr_load_64(&hdr->_delete) * queue->object_size) / queue->page_size;
+
+    while (first < last) {
+        uint64_t ring_page = first % ring_pages;
+        uint64_t run = BL_MIN2(last - first, ring_pages - ring_page);
+
+        if (AFAILED(ret = __megaqueue_punch(queue, ring_page * queue->page_size, run * queue->page_size))) {
+            goto done;
+        }
+
+        first += run;
+        queue->reclaim_offset = first * queue->page_size;
+    }
+
+done:
+    return ret;
+}
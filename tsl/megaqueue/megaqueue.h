@@ -4,6 +4,7 @@
 #include <tsl/cal.h>
 #include <tsl/result.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 /**
  * A megaqueue filename is of the form "megaqueue_[qdesc]"
@@ -11,45 +12,350 @@
 #define MEGAQUEUE_NAME_PREFIX       "megaqueue_"
 
 /**
- * Contents of the header page of the Megaqueue
+ * Default mount point of the hugetlbfs used for MEGAQUEUE_FLAG_HUGE_PAGE Megaqueues.
+ * Can be overridden by the TSL_MEGAQUEUE_HUGETLBFS environment variable, or in the
+ * parameters passed to megaqueue_open_ex.
+ */
+#define MEGAQUEUE_HUGETLBFS_DEFAULT "/dev/hugepages"
+
+/**
+ * A journal Megaqueue is a directory holding the header in a file of this name, and
+ * segment files named after the segment number, in hex (i.e. "000000000000002a.seg").
+ * The optional timestamp index (see megaqueue_index.h) lives alongside them.
+ */
+#define MEGAQUEUE_JOURNAL_HEADER    "header"
+#define MEGAQUEUE_JOURNAL_INDEX     "index"
+
+/**
+ * The shm object holding the timestamp index of any other Megaqueue is named after
+ * the queue, with this suffix
+ */
+#define MEGAQUEUE_INDEX_SUFFIX      "_index"
+#define MEGAQUEUE_JOURNAL_SEG_FMT   "%016" PRIx64 ".seg"
+
+/**
+ * Magic number at the start of every Megaqueue header ("MEGAQUEU", little-endian)
+ */
+#define MEGAQUEUE_MAGIC             0x554555514147454dull
+
+/**
+ * Version of the layout of the shared header and objects. Bumped whenever a change
+ * would confuse a process built against an older version.
+ */
+#define MEGAQUEUE_VERSION           1
+
+/**
+ * Maximum number of named consumers that can attach to a broadcast Megaqueue
+ */
+#define MEGAQUEUE_MAX_CONSUMERS     32
+
+/**
+ * Maximum length of a consumer name, including the terminating NUL
+ */
+#define MEGAQUEUE_CONSUMER_NAME_LEN 40
+
+/**
+ * \group megaqueue_flags Megaqueue creation flags
+ * Flags that are stored in the header of the Megaqueue when it is created. Consumers
+ * pick these up from the header when they open the queue.
+ * @{
+ */
+#define MEGAQUEUE_FLAG_BROADCAST    0x1     /** Queue is read by several named consumers */
+#define MEGAQUEUE_FLAG_LAP          0x2     /** Producer laps the slowest consumer instead of stopping */
+#define MEGAQUEUE_FLAG_VARLEN       0x4     /** Queue holds variable-length records, see megaqueue_reserve */
+#define MEGAQUEUE_FLAG_JOURNAL      0x8     /** Queue is a chain of segment files in a directory */
+#define MEGAQUEUE_FLAG_MULTI_PRODUCER 0x10  /** Several producers, possibly in different processes */
+#define MEGAQUEUE_FLAG_HUGE_PAGE    0x20    /** Objects live in a file on hugetlbfs */
+/*@}*/
+
+/**
+ * \group megaqueue_handle_flags Megaqueue handle flags
+ * Flags that only affect the handle they are passed to, and are never stored in the
+ * header. Each side of the queue can pick these independently.
+ * @{
+ */
+#define MEGAQUEUE_FLAG_FAST         0x100   /** Cache the remote index and mask by power-of-two count and size */
+#define MEGAQUEUE_FLAG_RESUME       0x200   /** With O_CREAT, pick up an existing queue instead of resetting it */
+#define MEGAQUEUE_FLAG_SNOOP        0x400   /** Read with a private cursor, invisible to the producer (implied by O_RDONLY) */
+#define MEGAQUEUE_FLAG_POPULATE     0x800   /** Map every page up front (MAP_POPULATE), so reads never take a page fault */
+#define MEGAQUEUE_HANDLE_FLAGS      (MEGAQUEUE_FLAG_FAST | MEGAQUEUE_FLAG_RESUME | MEGAQUEUE_FLAG_SNOOP | \
+                                     MEGAQUEUE_FLAG_POPULATE)
+/*@}*/
+
+/**
+ * \group megaqueue_numa Megaqueue NUMA placement policies
+ * Where the pages of a Megaqueue are allocated, see megaqueue_params.
+ * @{
+ */
+#define MEGAQUEUE_NUMA_DEFAULT      0       /** Pages land on the node of whoever touches them first */
+#define MEGAQUEUE_NUMA_LOCAL        1       /** Bind to the node of the CPU opening the queue */
+#define MEGAQUEUE_NUMA_NODE         2       /** Bind to the node given as the target */
+#define MEGAQUEUE_NUMA_CPU          3       /** Bind to the node of the CPU given as the target */
+/*@}*/
+
+/**
+ * Highest NUMA node number a Megaqueue can be bound to, plus one
+ */
+#define MEGAQUEUE_NUMA_MAX_NODES    1024
+
+/**
+ * States of an entry in the broadcast consumer table
+ */
+#define MEGAQUEUE_CONSUMER_FREE         0
+#define MEGAQUEUE_CONSUMER_ATTACHING    1
+#define MEGAQUEUE_CONSUMER_LIVE         2
+
+/**
+ * \group megaqueue_consumer_kinds Kinds of entries in the broadcast consumer table
+ * @{
+ */
+#define MEGAQUEUE_CONSUMER_PLAIN        0   /** A named consumer, reading every object */
+#define MEGAQUEUE_CONSUMER_GROUP        1   /** A consumer group, the cursor is the next position to hand out */
+#define MEGAQUEUE_CONSUMER_MEMBER       2   /** A member of a group, the cursor is the start of the batch it holds */
+/*@}*/
+
+/**
+ * Cursor of a group member that holds no batch, so it does not hold the producer back
+ */
+#define MEGAQUEUE_MEMBER_IDLE           UINT64_MAX
+
+/**
+ * States of the producer, as seen by megaqueue_producer_state
+ */
+#define MEGAQUEUE_PRODUCER_ALIVE        0   /** Producer process exists and its heartbeat is recent */
+#define MEGAQUEUE_PRODUCER_STALLED      1   /** Producer process exists, but stopped beating */
+#define MEGAQUEUE_PRODUCER_DEAD         2   /** Producer process is gone */
+
+/**
+ * A named consumer cursor, living in the header page of a broadcast Megaqueue
+ */
+struct megaqueue_consumer {
+    /** Position of the next object this consumer will read */
+    uint64_t cursor;
+    /** PID of the process that attached to this cursor */
+    uint64_t pid;
+    /** State of this entry (one of MEGAQUEUE_CONSUMER_*) */
+    uint32_t state;
+    /** Name of the consumer, NUL terminated. Members carry the name of their group. */
+    char name[MEGAQUEUE_CONSUMER_NAME_LEN];
+    /** Kind of entry (one of MEGAQUEUE_CONSUMER_PLAIN, _GROUP or _MEMBER) */
+    uint32_t kind;
+} CAL_CACHE_ALIGNED;
+
+/**
+ * Contents of the header page of the Megaqueue.
+ *
+ * All positions in the header are monotonically increasing object counts. The
+ * slot an object lives in is found by taking the position modulo the object count.
+ * A position doubles as the sequence number of the object, which never wraps and
+ * survives a journal being reopened.
  */
 struct megaqueue_header {
+    /** Always MEGAQUEUE_MAGIC */
+    uint64_t magic CAL_CACHE_ALIGNED;
+    /** Version of the layout (MEGAQUEUE_VERSION) */
+    uint32_t version;
+    /** Size of this structure, catches builds with different limits */
+    uint32_t header_size;
     /** Head of the Megaqueue, current position */
     uint64_t head CAL_CACHE_ALIGNED;
+    /** Number of consumers sleeping in megaqueue_wait, on the same line as the head */
+    uint32_t waiters;
+    /** Reservation counter, for multi-producer Megaqueues. Slots below it are claimed. */
+    uint64_t reserve CAL_CACHE_ALIGNED;
     /** Tail of the Megaqueue for the sensitive listener */
     uint64_t tail CAL_CACHE_ALIGNED;
     /** Deletion pointer for the Megaqueue */
     uint64_t _delete CAL_CACHE_ALIGNED;
+    /** Last time the producer signalled it is alive, CLOCK_MONOTONIC nanoseconds */
+    uint64_t heartbeat CAL_CACHE_ALIGNED;
     /* PID of the process that is the producer */
     uint64_t producer_pid CAL_CACHE_ALIGNED;
     /* Size of an object in the Megaqueue */
     uint64_t object_size;
     /* Maximum count of objects in the Megaqueue */
     uint64_t object_count;
+    /* Flags the Megaqueue was created with (MEGAQUEUE_FLAG_*) */
+    uint64_t flags;
+    /* Number of objects dropped from under the slowest consumer when lapping */
+    uint64_t lap_distance;
+    /* Number of times the producer has lapped a consumer */
+    uint64_t laps;
+    /* Oldest segment of a journal that has not been retired */
+    uint64_t journal_first;
+    /* Number of journal segments to retain, 0 to keep them all */
+    uint64_t journal_retain;
+    /** Table of named consumer cursors, for broadcast Megaqueues */
+    struct megaqueue_consumer consumers[MEGAQUEUE_MAX_CONSUMERS];
 } CAL_CACHE_ALIGNED;
 
+/**
+ * \group megaqueue_record_flags Flags in the header of a variable-length record
+ * @{
+ */
+#define MEGAQUEUE_RECORD_PAD        0x1     /** Record fills the end of the ring and carries no data */
+/*@}*/
+
+/**
+ * Header of a record in a variable-length (MEGAQUEUE_FLAG_VARLEN) Megaqueue.
+ *
+ * In a variable-length Megaqueue, the object size is the record alignment (8 or 64
+ * bytes) and all positions count alignment units. Each record starts with this
+ * header, followed by the payload, padded up to the alignment. A record never wraps
+ * around the end of the ring; instead, a padding record fills the space up to the
+ * end of the ring, and the record starts at the beginning.
+ */
+struct megaqueue_record {
+    /** Length of the payload following the header, in bytes */
+    uint32_t length;
+    /** Record flags (MEGAQUEUE_RECORD_*) */
+    uint32_t flags;
+};
+
+/**
+ * Optional parameters used when creating a Megaqueue.
+ */
+struct megaqueue_params {
+    /** Creation and handle flags (MEGAQUEUE_FLAG_*) */
+    uint32_t flags;
+    /**
+     * Number of objects the producer reclaims from under the slowest consumer when
+     * it laps. Only used with MEGAQUEUE_FLAG_LAP. 0 is treated as 1.
+     */
+    uint32_t lap_distance;
+    /**
+     * Number of segments a journal keeps around, including the one being written.
+     * Older segments are deleted as the producer moves on. 0 keeps all segments.
+     * Only used with MEGAQUEUE_FLAG_JOURNAL.
+     */
+    uint32_t journal_retain;
+    /**
+     * Mount point of the hugetlbfs to put the objects in, or NULL for the default.
+     * The page size of the filesystem (2 MB or 1 GB) is used for the mapping. Only
+     * used with MEGAQUEUE_FLAG_HUGE_PAGE.
+     */
+    const char *hugetlbfs_path;
+    /**
+     * Where the pages of the queue go (one of MEGAQUEUE_NUMA_*). Usually the
+     * producer creates the queue bound to its own node (MEGAQUEUE_NUMA_LOCAL), so
+     * its writes never cross the interconnect, or to the node of the core the
+     * consumer is pinned to (MEGAQUEUE_NUMA_CPU). Pages that other processes already
+     * map stay where they are. Not supported for journals.
+     */
+    uint32_t numa_policy;
+    /** Node (MEGAQUEUE_NUMA_NODE) or CPU (MEGAQUEUE_NUMA_CPU) to bind the queue to */
+    uint32_t numa_target;
+    /**
+     * How many slots ahead of its cursor a consumer prefetches, 0 for none. Reading
+     * slot N prefetches slot N + prefetch_distance, so by the time the consumer gets
+     * there it is already in cache. Should cover the memory latency at the rate the
+     * queue is read: a few slots for large objects, more for small ones. For a
+     * variable-length queue, the distance is in alignment units, not records.
+     */
+    uint32_t prefetch_distance;
+};
+
+/**
+ * A run of objects in the Megaqueue, returned by the batch APIs. If the run wraps
+ * around the end of the ring, it is split in two contiguous pieces.
+ */
+struct megaqueue_span {
+    /** First contiguous run of objects */
+    void *first;
+    /** Number of objects in the first run */
+    size_t first_count;
+    /** Run of objects at the start of the ring, NULL if the span did not wrap */
+    void *second;
+    /** Number of objects in the second run */
+    size_t second_count;
+};
+
 struct megaqueue {
     /** Size of an object in the megaqueue, in bytes */
     uint32_t object_size;
     /** Count of objects in the megaqueue */
     uint32_t object_count;
-    /** Start of the writable megaqueue region */
+    /** Flags the megaqueue was created with, plus the handle flags */
+    uint32_t flags;
+    /** Shift converting an object index to a byte offset (MEGAQUEUE_FLAG_FAST only) */
+    unsigned int object_shift;
+    /** Mask converting a position to an object index (MEGAQUEUE_FLAG_FAST only) */
+    uint64_t object_mask;
+    /** Start of the writable megaqueue region (the producer's segment, for a journal) */
     void *writable_start;
+    /** Start of the region consumers read from (the consumer's segment, for a journal) */
+    void *read_start;
     /** The entire shared memory region */
     void *region;
     /** The size of the full mapped region */
     size_t region_size;
     /** Shared memory region name */
     char *rgn_name;
+    /** Separate mapping of the objects, for hugetlbfs-backed Megaqueues */
+    void *data_region;
+    /** Size of the separate mapping of the objects */
+    size_t data_size;
+    /** Path of the hugetlbfs file holding the objects */
+    char *data_name;
+    /** File descriptor of the file holding the objects */
+    int data_fd;
+    /** Offset of the first object in the file holding the objects */
+    size_t data_offset;
+    /** Size of the pages backing the objects */
+    size_t page_size;
+    /**
+     * Commit array of a multi-producer Megaqueue. Each slot holds the position of the
+     * object last committed to it, plus one.
+     */
+    uint64_t *commit;
 
     /* The megaqueue header, used in initialization of a consumer */
     struct megaqueue_header *hdr;
 
+    /** The read cursor for this consumer (the tail, or a broadcast consumer cursor) */
+    uint64_t *cursor;
+    /** The broadcast consumer entry this handle is attached to, if any */
+    struct megaqueue_consumer *consumer;
+    /** The group entry, for a handle that joined a consumer group */
+    struct megaqueue_consumer *group;
+    /** Number of objects in the batch this group member holds, 0 if none */
+    uint64_t group_claimed;
+    /** Number of objects this consumer lost by being lapped */
+    uint64_t missed;
+
     /** The file descriptor used to map the region */
     int fd;
+    /** The journal directory, for a journal Megaqueue */
+    int dir_fd;
+
+    /** Producer's private copy of the head (MEGAQUEUE_FLAG_FAST only) */
+    uint64_t prod_head CAL_CACHE_ALIGNED;
+    /** Producer's cached copy of the deletion pointer, refreshed when the queue looks full */
+    uint64_t prod_delete_cache;
+    /** Units of padding in front of the record reserved by megaqueue_reserve */
+    uint64_t resv_pad;
+    /** Units reserved by megaqueue_reserve for the record itself */
+    uint64_t resv_units;
+    /** End of the journal segment the producer has mapped */
+    uint64_t prod_seg_end;
+    /** First position claimed by this multi-producer handle, but not committed yet */
+    uint64_t mp_pos;
+    /** Number of positions claimed by this multi-producer handle */
+    uint64_t mp_claimed;
+    /** Byte offset (without wrapping) up to which megaqueue_reclaim released pages */
+    uint64_t reclaim_offset;
+
+    /** Consumer's cached copy of the head, refreshed when the queue looks empty */
+    uint64_t cons_head_cache CAL_CACHE_ALIGNED;
+    /** Start of the journal segment the consumer has mapped */
+    uint64_t cons_seg_base;
+    /** Private cursor of a snooping handle (MEGAQUEUE_FLAG_SNOOP) */
+    uint64_t snoop_cursor;
+    /** Number of slots ahead of the cursor to prefetch, 0 for none */
+    uint32_t prefetch_distance;
 };
 
-#define MEGAQUEUE_SAFE_INIT_EMPTY { .writable_start = NULL, .region = NULL, .region_size = NULL, .rgn_name = NULL, .hdr = NULL, .fd = -1 }
+#define MEGAQUEUE_SAFE_INIT_EMPTY { .writable_start = NULL, .region = NULL, .region_size = 0, .rgn_name = NULL, .hdr = NULL, .cursor = NULL, .consumer = NULL, .fd = -1, .dir_fd = -1, .data_fd = -1 }
 
 #define MEGAQUEUE_EMPTY(x) \
     do { \
@@ -58,7 +364,13 @@ struct megaqueue {
         (x)->region_size = 0; \
         (x)->rgn_name = NULL; \
         (x)->hdr = NULL; \
+        (x)->cursor = NULL; \
+        (x)->consumer = NULL; \
         (x)->fd = -1; \
+        (x)->dir_fd = -1; \
+        (x)->data_region = NULL; \
+        (x)->data_name = NULL; \
+        (x)->data_fd = -1; \
     } while (0)
 
 aresult_t megaqueue_open(struct megaqueue *queue,
@@ -67,8 +379,180 @@ aresult_t megaqueue_open(struct megaqueue *queue,
                          size_t obj_size,
                          size_t obj_count);
 
+/**
+ * Open a Megaqueue. With MEGAQUEUE_FLAG_JOURNAL set in params, queue_name is the path
+ * of the journal directory, and every handle must pass the flag.
+ *
+ * With O_CREAT and MEGAQUEUE_FLAG_RESUME, an existing queue with the same version,
+ * object size, count and creation flags is picked up where it was left, and the
+ * calling process becomes the producer. Consumers carry on without noticing. An
+ * existing queue that does not match is an error, rather than being reset. For a
+ * multi-producer queue, all producers must have been restarted, as claims that
+ * were never published are rolled back.
+ *
+ * A handle opened O_RDONLY snoops (MEGAQUEUE_FLAG_SNOOP): it reads from the oldest
+ * object with a cursor of its own, never holds the producer back, and finds out it
+ * was overwritten through A_E_OVERRUN, like a lapped consumer.
+ */
+aresult_t megaqueue_open_ex(struct megaqueue *queue,
+                            int mode,
+                            const char *queue_name,
+                            size_t obj_size,
+                            size_t obj_count,
+                            const struct megaqueue_params *params);
+
 aresult_t megaqueue_close(struct megaqueue *queue, int unlink);
 
+/**
+ * Attach to a named consumer cursor of a broadcast Megaqueue. If a detached
+ * cursor with the same name exists, the consumer resumes where it left off.
+ * Otherwise the consumer starts at the current head of the queue.
+ */
+aresult_t megaqueue_consumer_attach(struct megaqueue *queue, const char *name);
+
+/**
+ * Detach from the broadcast consumer cursor. The cursor no longer holds the
+ * producer back, but is kept around so the consumer can resume by name.
+ */
+aresult_t megaqueue_consumer_detach(struct megaqueue *queue);
+
+/**
+ * Create a consumer group on a broadcast Megaqueue. The members of a group share the
+ * objects between them: each object goes to exactly one member, which claims it in
+ * a batch with megaqueue_group_claim. Only fixed-size, non-journal queues can have
+ * groups.
+ *
+ * A group is durable: it holds the producer back from the moment it is created,
+ * whether members come and go or not, so objects are never lost between workers
+ * restarting. Create it once, e.g. from the producer, before the members join.
+ *
+ * \return A_OK on success (or if the group exists already), A_E_INVAL if the queue
+ *         can't have groups, A_E_EXIST if a consumer by that name exists, A_E_NOSPC
+ *         if the consumer table is full.
+ */
+aresult_t megaqueue_group_create(struct megaqueue *queue, const char *group);
+
+/**
+ * Remove a consumer group, so it no longer holds the producer back. Members still
+ * in the group get A_E_NOTFOUND when they next claim.
+ */
+aresult_t megaqueue_group_destroy(struct megaqueue *queue, const char *group);
+
+/**
+ * Join a consumer group with this handle. Each member takes an entry of the
+ * consumer table, to publish the batch it holds. The handle can only read objects
+ * through megaqueue_group_claim and megaqueue_group_ack: its cursor is the cursor of
+ * the group, shared by every member, so the other consumer calls (reading, peeking,
+ * consuming, seeking) are refused with A_E_BADARGS. Only megaqueue_seek checks in
+ * release builds, the inline calls only in debug builds.
+ *
+ * \return A_OK on success, A_E_NOTFOUND if there is no such group, A_E_NOSPC if the
+ *         consumer table is full.
+ */
+aresult_t megaqueue_group_join(struct megaqueue *queue, const char *group);
+
+/**
+ * Leave the consumer group. A batch that was claimed but not acknowledged is lost.
+ */
+aresult_t megaqueue_group_leave(struct megaqueue *queue);
+
+/**
+ * Give the pages holding objects every consumer is done with back to the system.
+ * Pages are punched out of the backing file (shm or hugetlbfs), and faulted back in
+ * when the producer gets around to them again. Only whole pages whose slots will
+ * not be written until the head moves guard objects further are released.
+ *
+ * Reclaiming races with the producer writing the slots. Call this from the producer
+ * with a guard of 0, or from another thread with a guard larger than the number of
+ * objects the producer can write while the call runs.
+ *
+ * \note The deletion pointer of a broadcast Megaqueue only moves when the producer
+ *       needs room, so there is nothing to reclaim before the first lap.
+ *
+ * \return A_OK on success, A_E_INVAL if the ring is not a whole number of pages or
+ *         the queue is a journal.
+ */
+aresult_t megaqueue_reclaim(struct megaqueue *queue, uint64_t guard);
+
+/**
+ * Signal that the producer is alive. Call this periodically from the producer, e.g.
+ * whenever it is idle, so consumers can tell a quiet producer from a stuck one.
+ */
+void megaqueue_heartbeat(struct megaqueue *queue);
+
+/**
+ * Check whether the producer of a Megaqueue is still around.
+ *
+ * \param queue The queue
+ * \param max_age_ns Age of the last heartbeat past which the producer is stalled
+ * \param state Receives one of MEGAQUEUE_PRODUCER_*
+ *
+ * \note The process check only makes sense on the host the producer runs on.
+ *
+ * \return A_OK on success, an error code otherwise
+ */
+aresult_t megaqueue_producer_state(struct megaqueue *queue, uint64_t max_age_ns, unsigned int *state);
+
+/**
+ * Count the pages holding the objects of a Megaqueue on each NUMA node, to check the
+ * queue ended up where it was meant to.
+ *
+ * \param queue The queue
+ * \param pages Receives the number of pages on each node, indexed by node number
+ * \param nr_nodes Number of entries in pages. Pages on higher nodes are not counted.
+ * \param absent Receives the number of pages that are not in memory
+ *
+ * \return A_OK on success, A_E_INVAL if the queue is a journal or the kernel can't
+ *         tell where the pages are.
+ */
+aresult_t megaqueue_numa_residency(struct megaqueue *queue, uint64_t *pages, size_t nr_nodes, uint64_t *absent);
+
+/**
+ * Pass as the timeout to megaqueue_wait to wait until something is produced
+ */
+#define MEGAQUEUE_WAIT_FOREVER      UINT64_MAX
+
+/**
+ * Wait for an object to become readable by this consumer. Polls the queue up to
+ * spins times, then sleeps on a futex on the head until the producer publishes or
+ * the timeout expires. The producer only makes a system call when a consumer is
+ * asleep, so busy-polling consumers do not slow it down.
+ *
+ * \param queue The queue to wait on. The header must be mapped writable.
+ * \param spins Number of times to poll before going to sleep
+ * \param timeout_ns Maximum time to sleep, in nanoseconds. 0 never sleeps, and
+ *        MEGAQUEUE_WAIT_FOREVER waits until something is produced.
+ *
+ * \return A_OK if there is something to read, A_E_EMPTY if the wait timed out.
+ */
+aresult_t megaqueue_wait(struct megaqueue *queue, uint32_t spins, uint64_t timeout_ns);
+
+/**
+ * Move this consumer to the object with the given sequence number, so it is the
+ * next one read. A consumer can seek back to any object that is still in the queue
+ * (or retained by a journal), or forward up to the head.
+ *
+ * For a variable-length queue, seq must be the start of a record.
+ *
+ * \return A_OK on success, A_E_NOENT if seq was not produced yet, A_E_OVERRUN if
+ *         seq is no longer in the queue. The consumer is then moved to the oldest
+ *         object that is, and the skipped objects are counted in missed.
+ */
+aresult_t megaqueue_seek(struct megaqueue *queue, uint64_t seq);
+
+/**
+ * Move the sequence of an empty queue forward, so the next object produced gets
+ * sequence number seq. Used to keep the sequence numbers of a copy of a queue (such
+ * as a replica) in line with the original, across a gap.
+ *
+ * The queue must be empty, with no consumer attached or reading, and can't be a
+ * journal.
+ *
+ * \return A_OK on success, A_E_BADARGS if seq is behind the head, A_E_BUSY if the
+ *         queue is not empty or has consumers attached, A_E_INVAL for a journal.
+ */
+aresult_t megaqueue_reset_sequence(struct megaqueue *queue, uint64_t seq);
+
 /* Internal functions for managing the megaqueue */
 static inline
 aresult_t megaqueue_advance(struct megaqueue *queue);
@@ -89,6 +573,49 @@ aresult_t megaqueue_read_only_advance(struct megaqueue *queue);
 static inline
 aresult_t megaqueue_delete_advance(struct megaqueue *queue);
 
+/* Batch interfaces, moving many objects per update of the shared header */
+static inline
+aresult_t megaqueue_claim_n(struct megaqueue *queue, size_t max, struct megaqueue_span *span, size_t *count);
+
+static inline
+aresult_t megaqueue_publish_n(struct megaqueue *queue, size_t count);
+
+static inline
+aresult_t megaqueue_peek_n(struct megaqueue *queue, size_t max, struct megaqueue_span *span, size_t *count);
+
+static inline
+aresult_t megaqueue_consume_n(struct megaqueue *queue, size_t count);
+
+/* Variable-length record interfaces, for MEGAQUEUE_FLAG_VARLEN queues */
+static inline
+aresult_t megaqueue_reserve(struct megaqueue *queue, size_t length, void **buf);
+
+static inline
+aresult_t megaqueue_commit(struct megaqueue *queue, size_t length);
+
+static inline
+aresult_t megaqueue_read_record(struct megaqueue *queue, void **buf, size_t *length);
+
+static inline
+aresult_t megaqueue_release_record(struct megaqueue *queue);
+
+/* Sequence numbers */
+static inline
+uint64_t megaqueue_read_sequence(struct megaqueue *queue);
+
+static inline
+uint64_t megaqueue_write_sequence(struct megaqueue *queue);
+
+static inline
+uint64_t megaqueue_oldest_sequence(struct megaqueue *queue);
+
+/* Consumer group interfaces, for handles that joined a group */
+static inline
+aresult_t megaqueue_group_claim(struct megaqueue *queue, size_t max, struct megaqueue_span *span, size_t *count);
+
+static inline
+aresult_t megaqueue_group_ack(struct megaqueue *queue);
+
 #include <tsl/megaqueue/megaqueue_priv.h>
 
 #endif /* __INCLUDED_MEGAQUEUE_MEGAQUEUE_H__ */
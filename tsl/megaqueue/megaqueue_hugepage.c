@@ -0,0 +1,155 @@
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Map the objects of a Megaqueue from a file on hugetlbfs. The header of the queue
+ * stays in shm, so it does not take up a whole huge page.
+ *
+ * \param queue The queue, with the header already set up
+ * \param mode The mode the queue is being opened with
+ * \param queue_name The name of the queue
+ * \param params The parameters the queue is being opened with
+ *
+ * \return A_OK on success, an error code otherwise
+ */
+aresult_t __megaqueue_huge_open(struct megaqueue *queue, int mode, const char *queue_name,
+                                const struct megaqueue_params *params)
+{
+    aresult_t ret = A_OK;
+    const char *mount = NULL;
+    char *path = NULL;
+    int fd = -1;
+    void *mapping = MAP_FAILED;
+    int prot = PROT_READ;
+    size_t huge_page_size = 0;
+    size_t data_size = 0;
+    bool created = false;
+    struct statfs sfs;
+    struct stat st;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue_name);
+    TSL_ASSERT_ARG(NULL != params);
+
+    if (NULL == (mount = params->hugetlbfs_path) && NULL == (mount = getenv("TSL_MEGAQUEUE_HUGETLBFS"))) {
+        mount = MEGAQUEUE_HUGETLBFS_DEFAULT;
+    }
+
+    asprintf(&path, "%s/%s%s", mount, MEGAQUEUE_NAME_PREFIX, queue_name);
+
+    if (NULL == path) {
+        PDIAG("Unable to generate hugetlbfs filename.");
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (0 > (fd = open(path, mode & (O_ACCMODE | O_CREAT), 0666))) {
+        PDIAG("Failed to open hugetlbfs file '%s' with mode 0x%08x", path, (unsigned int)mode);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* An empty file was just created, and is ours to remove if the open fails */
+    if ((mode & O_CREAT) && 0 == fstat(fd, &st) && 0 == st.st_size) {
+        created = true;
+    }
+
+    /* The filesystem block size is the huge page size of the mount */
+    if (0 > fstatfs(fd, &sfs)) {
+        PDIAG("Failed to statfs(2) '%s'", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    huge_page_size = sfs.f_bsize;
+    data_size = (size_t)queue->object_size * queue->object_count;
+    data_size = (data_size + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+    DIAG("Mapping %zu bytes of megaqueue objects from '%s' (%zu byte pages)", data_size, path, huge_page_size);
+
+    if ((mode & O_CREAT) && 0 > ftruncate(fd, data_size)) {
+        PDIAG("Failed to ftruncate(2) the hugetlbfs file.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if ((O_RDWR & mode) || (O_WRONLY & mode)) {
+        prot |= PROT_WRITE;
+    }
+
+    /* Huge pages are reserved at mmap(2) time, so a short pool fails here, not later */
+    if (MAP_FAILED == (mapping = mmap(NULL, data_size, prot, MAP_SHARED | MAP_POPULATE, fd, 0))) {
+        PDIAG("Failed to mmap(2) hugetlbfs file '%s'", path);
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    queue->data_region = mapping;
+    queue->data_size = data_size;
+    queue->data_name = path;
+    queue->data_fd = fd;
+    queue->data_offset = 0;
+    queue->page_size = huge_page_size;
+    queue->writable_start = mapping;
+    queue->read_start = mapping;
+
+done:
+    if (AFAILED(ret)) {
+        if (0 <= fd) {
+            close(fd);
+        }
+
+        if (true == created) {
+            unlink(path);
+        }
+
+        if (NULL != path) {
+            free(path);
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Unmap the objects of a hugetlbfs-backed Megaqueue. If destroy is set, also remove
+ * the file holding them.
+ */
+void __megaqueue_huge_close(struct megaqueue *queue, int destroy)
+{
+    if (NULL != queue->data_region) {
+        munmap(queue->data_region, queue->data_size);
+        queue->data_region = NULL;
+        queue->data_size = 0;
+    }
+
+    if (0 <= queue->data_fd && queue->data_fd != queue->fd) {
+        close(queue->data_fd);
+        queue->data_fd = -1;
+    }
+
+    if (NULL != queue->data_name) {
+        if (destroy && 0 > unlink(queue->data_name)) {
+            PDIAG("WARNING: failed to remove hugetlbfs file '%s'", queue->data_name);
+        }
+
+        free(queue->data_name);
+        queue->data_name = NULL;
+    }
+}
+
@@ -0,0 +1,314 @@
+#include <tsl/megaqueue/megaqueue_index.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static
+size_t __megaqueue_index_map_size(uint64_t capacity)
+{
+    return sizeof(struct megaqueue_index_header) + capacity * sizeof(struct megaqueue_index_entry);
+}
+
+/**
+ * Check that the file holds an index we understand. Fills in the stride and the
+ * capacity from the header.
+ */
+static
+aresult_t __megaqueue_index_check(int fd, uint64_t *stride, uint64_t *capacity)
+{
+    struct megaqueue_index_header hdr;
+    struct stat st;
+
+    if (0 > fstat(fd, &st) || (size_t)st.st_size < sizeof(hdr)) {
+        return A_E_INVAL;
+    }
+
+    if (sizeof(hdr) != pread(fd, &hdr, sizeof(hdr), 0)) {
+        PDIAG("Failed to read the megaqueue index header");
+        return A_E_INVAL;
+    }
+
+    if (MEGAQUEUE_INDEX_MAGIC != hdr.magic || MEGAQUEUE_INDEX_VERSION != hdr.version ||
+            sizeof(hdr) != hdr.header_size || 0 == hdr.stride || 0 == hdr.capacity ||
+            (size_t)st.st_size < __megaqueue_index_map_size(hdr.capacity))
+    {
+        return A_E_INVAL;
+    }
+
+    *stride = hdr.stride;
+    *capacity = hdr.capacity;
+
+    return A_OK;
+}
+
+/**
+ * Pick up an existing index of a queue that was resumed. Entries for records that
+ * were rolled back, or never made it into the queue, are dropped.
+ */
+static
+void __megaqueue_index_resume(struct megaqueue_index *index, struct megaqueue *queue)
+{
+    struct megaqueue_index_header *hdr = index->hdr;
+    uint64_t head = megaqueue_write_sequence(queue);
+    uint64_t oldest = hdr->count > index->capacity ? hdr->count - index->capacity : 0;
+
+    while (hdr->count > oldest && index->entries[(hdr->count - 1) % index->capacity].seq >= head) {
+        hdr->count--;
+    }
+
+    if (hdr->count > oldest) {
+        struct megaqueue_index_entry *last = &index->entries[(hdr->count - 1) % index->capacity];
+        index->next_seq = last->seq + index->stride;
+        index->last_timestamp = last->timestamp;
+    } else {
+        hdr->count = 0;
+    }
+
+    DIAG("Resuming megaqueue index with %" PRIu64 " entries", hdr->count);
+}
+
+aresult_t megaqueue_index_open(struct megaqueue_index *index, struct megaqueue *queue, int mode,
+                               uint64_t stride, uint64_t capacity)
+{
+    aresult_t ret = A_OK;
+    int flags = mode & (O_ACCMODE | O_CREAT);
+    int prot = PROT_READ;
+    bool fresh = true;
+    void *mapping = MAP_FAILED;
+
+    TSL_ASSERT_ARG(NULL != index);
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->hdr);
+
+    memset(index, 0, sizeof(*index));
+    index->fd = -1;
+    index->dir_fd = -1;
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        index->dir_fd = queue->dir_fd;
+        index->fd = openat(index->dir_fd, MEGAQUEUE_JOURNAL_INDEX, flags, 0666);
+    } else {
+        asprintf(&index->name, "%s%s", queue->rgn_name, MEGAQUEUE_INDEX_SUFFIX);
+
+        if (NULL == index->name) {
+            PDIAG("Unable to generate megaqueue index name.");
+            ret = A_E_NOMEM;
+            goto done;
+        }
+
+        index->fd = shm_open(index->name, flags, 0666);
+    }
+
+    if (0 > index->fd) {
+        if (ENOENT == errno) {
+            ret = A_E_NOTFOUND;
+            goto done;
+        }
+
+        PDIAG("Failed to open megaqueue index with mode 0x%08x", (unsigned int)mode);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (mode & O_CREAT) {
+        uint64_t old_stride = 0;
+        uint64_t old_capacity = 0;
+
+        index->stride = 0 != stride ? stride : MEGAQUEUE_INDEX_DEFAULT_STRIDE;
+        index->capacity = 0 != capacity ? capacity : MEGAQUEUE_INDEX_DEFAULT_CAPACITY;
+
+        /* A queue that carried on keeps its index, as long as it has the same shape */
+        fresh = !(queue->flags & (MEGAQUEUE_FLAG_RESUME | MEGAQUEUE_FLAG_JOURNAL)) ||
+                AFAILED(__megaqueue_index_check(index->fd, &old_stride, &old_capacity)) ||
+                old_stride != index->stride || old_capacity != index->capacity;
+
+        if (true == fresh && (0 > ftruncate(index->fd, 0) ||
+                    0 > ftruncate(index->fd, __megaqueue_index_map_size(index->capacity))))
+        {
+            PDIAG("Failed to size the megaqueue index.");
+            ret = A_E_INVAL;
+            goto done;
+        }
+    } else {
+        fresh = false;
+
+        if (AFAILED(ret = __megaqueue_index_check(index->fd, &index->stride, &index->capacity))) {
+            DIAG("Megaqueue index is not valid, or was built by an incompatible version.");
+            goto done;
+        }
+    }
+
+    if ((O_RDWR & mode) || (O_WRONLY & mode)) {
+        prot |= PROT_WRITE;
+    }
+
+    index->map_size = __megaqueue_index_map_size(index->capacity);
+
+    if (MAP_FAILED == (mapping = mmap(NULL, index->map_size, prot, MAP_SHARED, index->fd, 0))) {
+        PDIAG("Failed to mmap(2) the megaqueue index.");
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    index->hdr = mapping;
+    index->entries = (struct megaqueue_index_entry *)(index->hdr + 1);
+
+    if (true == fresh) {
+        index->hdr->stride = index->stride;
+        index->hdr->capacity = index->capacity;
+        index->hdr->count = 0;
+        index->hdr->version = MEGAQUEUE_INDEX_VERSION;
+        index->hdr->header_size = sizeof(struct megaqueue_index_header);
+        ck_pr_fence_store();
+        ck_pr_store_64(&index->hdr->magic, MEGAQUEUE_INDEX_MAGIC);
+    } else if (mode & O_CREAT) {
+        __megaqueue_index_resume(index, queue);
+    }
+
+done:
+    if (AFAILED(ret)) {
+        if (0 <= index->fd) {
+            close(index->fd);
+        }
+
+        if (NULL != index->name) {
+            free(index->name);
+        }
+
+        memset(index, 0, sizeof(*index));
+        index->fd = -1;
+        index->dir_fd = -1;
+    }
+
+    return ret;
+}
+
+aresult_t megaqueue_index_close(struct megaqueue_index *index, int unlink)
+{
+    TSL_ASSERT_ARG(NULL != index);
+
+    if (NULL != index->hdr) {
+        munmap(index->hdr, index->map_size);
+        index->hdr = NULL;
+        index->entries = NULL;
+    }
+
+    if (0 <= index->fd) {
+        close(index->fd);
+        index->fd = -1;
+    }
+
+    if (unlink) {
+        if (NULL != index->name) {
+            shm_unlink(index->name);
+        } else if (0 <= index->dir_fd) {
+            unlinkat(index->dir_fd, MEGAQUEUE_JOURNAL_INDEX, 0);
+        }
+    }
+
+    if (NULL != index->name) {
+        free(index->name);
+        index->name = NULL;
+    }
+
+    index->dir_fd = -1;
+
+    return A_OK;
+}
+
+aresult_t megaqueue_index_find(struct megaqueue_index *index, uint64_t timestamp, uint64_t *seq)
+{
+    uint64_t count = 0;
+    uint64_t oldest = 0;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    uint64_t found = 0;
+    bool before = false;
+
+    TSL_ASSERT_ARG(NULL != index);
+    TSL_ASSERT_ARG(NULL != index->hdr);
+    TSL_ASSERT_ARG(NULL != seq);
+
+    do {
+        count = ck_pr_load_64(&index->hdr->count);
+        ck_pr_fence_load();
+
+        if (0 == count) {
+            return A_E_EMPTY;
+        }
+
+        /* The oldest entry in a full ring is the next one to be overwritten */
+        oldest = count >= index->capacity ? count - index->capacity + 1 : 0;
+        lo = oldest;
+        hi = count - 1;
+
+        before = ck_pr_load_64(&index->entries[lo % index->capacity].timestamp) > timestamp;
+
+        /* Newest entry at or before the timestamp, in [lo, hi] */
+        while (false == before && lo < hi) {
+            uint64_t mid = lo + (hi - lo + 1) / 2;
+
+            if (ck_pr_load_64(&index->entries[mid % index->capacity].timestamp) <= timestamp) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+
+        found = ck_pr_load_64(&index->entries[lo % index->capacity].seq);
+
+        ck_pr_fence_load();
+
+        /* Start over if the producer got around to overwriting the oldest entry we used */
+    } while (ck_pr_load_64(&index->hdr->count) >= oldest + index->capacity);
+
+    if (true == before) {
+        return A_E_NOTFOUND;
+    }
+
+    *seq = found;
+
+    return A_OK;
+}
+
+aresult_t megaqueue_index_seek(struct megaqueue_index *index, struct megaqueue *queue, uint64_t timestamp)
+{
+    aresult_t ret = A_OK;
+    uint64_t seq = 0;
+    uint64_t oldest = 0;
+
+    TSL_ASSERT_ARG(NULL != index);
+    TSL_ASSERT_ARG(NULL != queue);
+
+    ret = megaqueue_index_find(index, timestamp, &seq);
+
+    if (A_E_EMPTY == ret) {
+        goto done;
+    }
+
+    /* Everything still in the queue is past the indexed record, so start from the oldest */
+    oldest = megaqueue_oldest_sequence(queue);
+
+    if (A_E_NOTFOUND == ret || seq < oldest) {
+        seq = oldest;
+    }
+
+    ret = megaqueue_seek(queue, seq);
+
+done:
+    return ret;
+}
+
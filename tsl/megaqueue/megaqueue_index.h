@@ -0,0 +1,171 @@
+#ifndef __INCLUDED_MEGAQUEUE_MEGAQUEUE_INDEX_H__
+#define __INCLUDED_MEGAQUEUE_MEGAQUEUE_INDEX_H__
+
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <ck_pr.h>
+#include <stdint.h>
+
+/**
+ * Magic number at the start of every timestamp index ("MEGAIDX", little-endian)
+ */
+#define MEGAQUEUE_INDEX_MAGIC           0x005844494147454dull
+
+/**
+ * Version of the layout of the timestamp index
+ */
+#define MEGAQUEUE_INDEX_VERSION         1
+
+/**
+ * Defaults used when creating an index with a stride or capacity of 0
+ */
+#define MEGAQUEUE_INDEX_DEFAULT_STRIDE      1024
+#define MEGAQUEUE_INDEX_DEFAULT_CAPACITY    65536
+
+/**
+ * An entry in the timestamp index: the sequence number of a record, and the time the
+ * producer gave it.
+ */
+struct megaqueue_index_entry {
+    uint64_t timestamp;
+    uint64_t seq;
+};
+
+/**
+ * Contents of the start of the shared index. The entries follow, as a ring of
+ * capacity entries. Once the ring is full, the oldest entries are overwritten.
+ */
+struct megaqueue_index_header {
+    /** Always MEGAQUEUE_INDEX_MAGIC */
+    uint64_t magic CAL_CACHE_ALIGNED;
+    /** Version of the layout (MEGAQUEUE_INDEX_VERSION) */
+    uint32_t version;
+    /** Size of this structure */
+    uint32_t header_size;
+    /** Minimum distance between the sequence numbers of two entries */
+    uint64_t stride;
+    /** Number of entries in the ring */
+    uint64_t capacity;
+    /** Number of entries ever added. The newest entry is at (count - 1) % capacity. */
+    uint64_t count CAL_CACHE_ALIGNED;
+} CAL_CACHE_ALIGNED;
+
+/**
+ * A sparse index of a Megaqueue, mapping the timestamp of every stride-th record to
+ * its sequence number, so a consumer can find the records around a given time with
+ * a binary search instead of scanning the whole queue.
+ *
+ * The index is kept by the producer, which adds every record it publishes with
+ * megaqueue_index_add; only the records at least stride positions past the last
+ * entry make it into the index. What the timestamps mean (wall clock, exchange
+ * time, ...) is up to the producer, but they must not go backwards.
+ */
+struct megaqueue_index {
+    /** The shared index header */
+    struct megaqueue_index_header *hdr;
+    /** The ring of entries, following the header */
+    struct megaqueue_index_entry *entries;
+    /** Size of the mapping */
+    size_t map_size;
+    /** Number of entries in the ring */
+    uint64_t capacity;
+    /** Minimum distance between the sequence numbers of two entries */
+    uint64_t stride;
+    /** Producer: first sequence number that goes into the index */
+    uint64_t next_seq;
+    /** Producer: timestamp of the last entry */
+    uint64_t last_timestamp;
+    /** Name of the shm object, or NULL for the index of a journal */
+    char *name;
+    /** Journal directory the index lives in, for a journal (not owned) */
+    int dir_fd;
+    /** File descriptor of the index */
+    int fd;
+};
+
+/**
+ * Open the timestamp index of a Megaqueue.
+ *
+ * \param index The index handle to initialize
+ * \param queue The queue the index belongs to, already open
+ * \param mode O_RDONLY or O_RDWR, plus O_CREAT to create the index. Only the producer
+ *        creates the index. If the queue was resumed (or is a journal), an existing
+ *        index with the same stride and capacity is picked up where it was left.
+ * \param stride When creating, the minimum distance between indexed sequence numbers
+ *        (0 for MEGAQUEUE_INDEX_DEFAULT_STRIDE). Ignored otherwise.
+ * \param capacity When creating, the number of entries kept (0 for
+ *        MEGAQUEUE_INDEX_DEFAULT_CAPACITY). Ignored otherwise.
+ *
+ * \return A_OK on success, A_E_NOTFOUND if the queue has no index, an error code
+ *         otherwise
+ */
+aresult_t megaqueue_index_open(struct megaqueue_index *index, struct megaqueue *queue, int mode,
+                               uint64_t stride, uint64_t capacity);
+
+/**
+ * Close the timestamp index. If unlink is set, the index is removed as well.
+ */
+aresult_t megaqueue_index_close(struct megaqueue_index *index, int unlink);
+
+/**
+ * Find the newest indexed record with a timestamp at or before the given time.
+ * Scanning forward from that record finds the first record at or after the time.
+ *
+ * \param index The index
+ * \param timestamp The time to look for
+ * \param seq Receives the sequence number of the record
+ *
+ * \return A_OK on success, A_E_EMPTY if the index has no entries, A_E_NOTFOUND if
+ *         timestamp is before the oldest entry in the index.
+ */
+aresult_t megaqueue_index_find(struct megaqueue_index *index, uint64_t timestamp, uint64_t *seq);
+
+/**
+ * Move a consumer of the queue to the newest indexed record with a timestamp at or
+ * before the given time, or to the oldest record if the time is before anything in
+ * the index.
+ *
+ * \return A_OK on success, A_E_EMPTY if the index has no entries, or any of the
+ *         errors of megaqueue_seek.
+ */
+aresult_t megaqueue_index_seek(struct megaqueue_index *index, struct megaqueue *queue, uint64_t timestamp);
+
+/**
+ * Add a record to the index, if it is at least stride positions past the last entry.
+ * Called by the producer for every record it publishes, in order. Only one producer
+ * may add to an index.
+ *
+ * \param index The index, opened O_RDWR
+ * \param seq The sequence number of the record (the start of the record, for a
+ *        variable-length queue)
+ * \param timestamp The time of the record. Clamped to the timestamp of the last
+ *        entry if it goes backwards.
+ */
+static inline
+void megaqueue_index_add(struct megaqueue_index *index, uint64_t seq, uint64_t timestamp)
+{
+    struct megaqueue_index_entry *entry = NULL;
+    uint64_t count = 0;
+
+    if (CAL_LIKELY(seq < index->next_seq)) {
+        return;
+    }
+
+    if (CAL_UNLIKELY(timestamp < index->last_timestamp)) {
+        timestamp = index->last_timestamp;
+    }
+
+    count = ck_pr_load_64(&index->hdr->count);
+    entry = &index->entries[count % index->capacity];
+
+    ck_pr_store_64(&entry->timestamp, timestamp);
+    ck_pr_store_64(&entry->seq, seq);
+    ck_pr_fence_store();
+    ck_pr_store_64(&index->hdr->count, count + 1);
+
+    index->next_seq = seq + index->stride;
+    index->last_timestamp = timestamp;
+}
+
+#endif /* __INCLUDED_MEGAQUEUE_MEGAQUEUE_INDEX_H__ */
+
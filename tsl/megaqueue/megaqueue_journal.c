@@ -0,0 +1,397 @@
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <ck_pr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MEGAQUEUE_JOURNAL_SEG_NAME_LEN  32
+
+static
+void __megaqueue_journal_seg_name(char *name, uint64_t segment)
+{
+    snprintf(name, MEGAQUEUE_JOURNAL_SEG_NAME_LEN, MEGAQUEUE_JOURNAL_SEG_FMT, segment);
+}
+
+static
+size_t __megaqueue_journal_seg_size(struct megaqueue *queue)
+{
+    return (size_t)queue->object_size * queue->object_count;
+}
+
+/**
+ * Make sure the given segment file exists and has all its blocks allocated, so the
+ * producer does not have to wait on the filesystem when it rolls onto it.
+ */
+static
+aresult_t __megaqueue_journal_preallocate(struct megaqueue *queue, uint64_t segment)
+{
+    aresult_t ret = A_OK;
+    char name[MEGAQUEUE_JOURNAL_SEG_NAME_LEN];
+    int fd = -1;
+    int err = 0;
+
+    __megaqueue_journal_seg_name(name, segment);
+
+    if (0 > (fd = openat(queue->dir_fd, name, O_RDWR | O_CREAT, 0666))) {
+        PDIAG("Failed to create journal segment '%s'", name);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 != (err = posix_fallocate(fd, 0, __megaqueue_journal_seg_size(queue)))) {
+        DIAG("Failed to allocate journal segment '%s': %s", name, strerror(err));
+        ret = A_E_NOSPC;
+        goto done;
+    }
+
+done:
+    if (0 <= fd) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+/**
+ * Map the given segment. A writable mapping creates and allocates the segment if
+ * it does not exist yet.
+ */
+static
+aresult_t __megaqueue_journal_map(struct megaqueue *queue, uint64_t segment, int prot, int flags, void **pmapping)
+{
+    aresult_t ret = A_OK;
+    char name[MEGAQUEUE_JOURNAL_SEG_NAME_LEN];
+    int fd = -1;
+    void *mapping = MAP_FAILED;
+    size_t seg_size = __megaqueue_journal_seg_size(queue);
+
+    *pmapping = NULL;
+
+    if ((prot & PROT_WRITE) && AFAILED(ret = __megaqueue_journal_preallocate(queue, segment))) {
+        goto done;
+    }
+
+    __megaqueue_journal_seg_name(name, segment);
+
+    if (0 > (fd = openat(queue->dir_fd, name, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY))) {
+        /* The segment can legitimately be retired under a slow consumer */
+        if (ENOENT != errno) {
+            PDIAG("Failed to open journal segment '%s'", name);
+        }
+        ret = A_E_NOENT;
+        goto done;
+    }
+
+    if (MAP_FAILED == (mapping = mmap(NULL, seg_size, prot, MAP_SHARED | flags, fd, 0))) {
+        PDIAG("Failed to mmap(2) journal segment '%s'", name);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    *pmapping = mapping;
+
+done:
+    if (0 <= fd) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+aresult_t __megaqueue_journal_roll(struct megaqueue *queue)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_header *hdr = NULL;
+    uint64_t head = 0;
+    uint64_t segment = 0;
+    uint64_t retain = 0;
+    void *mapping = NULL;
+
+    TSL_ASSERT_ARG(NULL != queue);
+
+    hdr = queue->hdr;
+    head = __megaqueue_head(queue);
+
+    if (head < queue->prod_seg_end) {
+        goto done;
+    }
+
+    segment = head / queue->object_count;
+
+    /* Populate the page tables up front, like the shm queues are prefaulted */
+    if (AFAILED(ret = __megaqueue_journal_map(queue, segment, PROT_READ | PROT_WRITE, MAP_POPULATE, &mapping))) {
+        DIAG("Failed to roll journal onto segment %" PRIu64, segment);
+        goto done;
+    }
+
+    if (NULL != queue->writable_start) {
+        munmap(queue->writable_start, __megaqueue_journal_seg_size(queue));
+    }
+
+    queue->writable_start = mapping;
+    queue->prod_seg_end = (segment + 1) * queue->object_count;
+
+    if (AFAILED(__megaqueue_journal_preallocate(queue, segment + 1))) {
+        /* Not fatal, we will try again when we get there */
+        DIAG("WARNING: failed to pre-allocate journal segment %" PRIu64, segment + 1);
+    }
+
+    retain = hdr->journal_retain;
+    if (0 != retain) {
+        uint64_t first = ck_pr_load_64(&hdr->journal_first);
+
+        while (segment - first >= retain) {
+            char name[MEGAQUEUE_JOURNAL_SEG_NAME_LEN];
+
+            /* Consumers must see the segment is retired before it goes away */
+            ck_pr_store_64(&hdr->journal_first, first + 1);
+
+            __megaqueue_journal_seg_name(name, first);
+            if (0 > unlinkat(queue->dir_fd, name, 0) && ENOENT != errno) {
+                PDIAG("WARNING: failed to retire journal segment '%s'", name);
+            }
+
+            first++;
+        }
+    }
+
+done:
+    return ret;
+}
+
+aresult_t __megaqueue_journal_follow(struct megaqueue *queue, uint64_t tail)
+{
+    aresult_t ret = A_OK;
+    uint64_t segment = 0;
+    uint64_t first = 0;
+    void *mapping = NULL;
+
+    TSL_ASSERT_ARG(NULL != queue);
+
+    segment = tail / queue->object_count;
+    first = ck_pr_load_64(&queue->hdr->journal_first);
+
+    if (segment < first) {
+        uint64_t oldest = first * queue->object_count;
+
+        DIAG("Consumer fell behind the journal retention, skipping %" PRIu64 " objects", oldest - tail);
+        queue->missed += oldest - tail;
+        ck_pr_store_64(queue->cursor, oldest);
+
+        ret = A_E_OVERRUN;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_journal_map(queue, segment, PROT_READ,
+                    (queue->flags & MEGAQUEUE_FLAG_POPULATE) ? MAP_POPULATE : 0, &mapping)))
+    {
+        goto done;
+    }
+
+    if (NULL != queue->read_start) {
+        munmap(queue->read_start, __megaqueue_journal_seg_size(queue));
+    }
+
+    queue->read_start = mapping;
+    queue->cons_seg_base = segment * queue->object_count;
+
+done:
+    return ret;
+}
+
+/**
+ * Open (and optionally create) a journal Megaqueue in the given directory. The header
+ * of an existing journal is never reinitialized, even with O_CREAT, so a producer can
+ * pick up where it left off.
+ */
+aresult_t __megaqueue_journal_open(struct megaqueue *queue, int mode, const char *path, size_t obj_size,
+                                   size_t obj_count, const struct megaqueue_params *params)
+{
+    aresult_t ret = A_OK;
+    int dir_fd = -1;
+    int hfd = -1;
+    void *mapping = MAP_FAILED;
+    int prot = PROT_READ;
+    size_t header_size = __megaqueue_header_size(getpagesize());
+    char *path_alloc = NULL;
+    struct stat st;
+    bool fresh = false;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != path);
+    TSL_ASSERT_ARG(NULL != params);
+
+    DIAG("Opening Megaqueue journal '%s'", path);
+
+    if (NULL == (path_alloc = strdup(path))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if ((mode & O_CREAT) && 0 > mkdir(path, 0777) && EEXIST != errno) {
+        PDIAG("Failed to create journal directory '%s'", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 > (dir_fd = open(path, O_RDONLY | O_DIRECTORY))) {
+        PDIAG("Failed to open journal directory '%s'", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 > (hfd = openat(dir_fd, MEGAQUEUE_JOURNAL_HEADER, mode & (O_ACCMODE | O_CREAT), 0666))) {
+        PDIAG("Failed to open journal header in '%s' with mode 0x%08x", path, (unsigned int)mode);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 > fstat(hfd, &st)) {
+        PDIAG("Failed to stat journal header");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 == st.st_size) {
+        if (!(mode & O_CREAT)) {
+            DIAG("Journal '%s' was never initialized.", path);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (0 > ftruncate(hfd, header_size)) {
+            PDIAG("Failed to ftruncate(2) the journal header.");
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        fresh = true;
+    }
+
+    if ((O_RDWR & mode) || (O_WRONLY & mode)) {
+        prot |= PROT_WRITE;
+    }
+
+    if (MAP_FAILED == (mapping = mmap(NULL, header_size, prot, MAP_SHARED, hfd, 0))) {
+        PDIAG("Failed to mmap(2) journal header.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (true == fresh) {
+        __megaqueue_prepare_superblock(mapping, obj_size, obj_count, params);
+    } else if (AFAILED(ret = __megaqueue_check_header(mapping, obj_size))) {
+        goto done;
+    }
+
+    if (!(((struct megaqueue_header *)mapping)->flags & MEGAQUEUE_FLAG_JOURNAL)) {
+        DIAG("Header in '%s' does not describe a journal.", path);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    queue->region = mapping;
+    queue->region_size = header_size;
+    queue->fd = hfd;
+    queue->dir_fd = dir_fd;
+    queue->data_fd = -1;
+    queue->data_region = NULL;
+    queue->data_name = NULL;
+    queue->hdr = mapping;
+    queue->rgn_name = path_alloc;
+
+    if (AFAILED(ret = __megaqueue_setup_handle(queue, mode, params))) {
+        goto done;
+    }
+
+    /* Segments are mapped on first use, by either side */
+    queue->writable_start = NULL;
+    queue->read_start = NULL;
+    queue->prod_seg_end = queue->prod_head;
+    queue->cons_seg_base = 0;
+
+    /* Whoever opens an existing journal with O_CREAT is picking up as its producer */
+    if (false == fresh && (mode & O_CREAT)) {
+        __megaqueue_resume(queue);
+    }
+
+done:
+    if (AFAILED(ret)) {
+        if (MAP_FAILED != mapping) {
+            munmap(mapping, header_size);
+        }
+
+        if (0 <= hfd) {
+            close(hfd);
+        }
+
+        if (0 <= dir_fd) {
+            close(dir_fd);
+        }
+
+        if (NULL != path_alloc) {
+            free(path_alloc);
+        }
+
+        MEGAQUEUE_EMPTY(queue);
+    }
+
+    return ret;
+}
+
+/**
+ * Unmap the segments of a journal handle. If destroy is set, deletes all the segments
+ * and the header, and removes the journal directory.
+ */
+void __megaqueue_journal_close(struct megaqueue *queue, int destroy)
+{
+    size_t seg_size = __megaqueue_journal_seg_size(queue);
+
+    if (NULL != queue->writable_start) {
+        munmap(queue->writable_start, seg_size);
+        queue->writable_start = NULL;
+    }
+
+    if (NULL != queue->read_start) {
+        munmap(queue->read_start, seg_size);
+        queue->read_start = NULL;
+    }
+
+    if (destroy && NULL != queue->hdr) {
+        struct megaqueue_header *hdr = queue->hdr;
+        /* Include the segment pre-allocated past the head */
+        uint64_t last = ck_pr_load_64(&hdr->head) / queue->object_count + 1;
+
+        for (uint64_t seg = ck_pr_load_64(&hdr->journal_first); seg <= last; seg++) {
+            char name[MEGAQUEUE_JOURNAL_SEG_NAME_LEN];
+            __megaqueue_journal_seg_name(name, seg);
+            unlinkat(queue->dir_fd, name, 0);
+        }
+
+        unlinkat(queue->dir_fd, MEGAQUEUE_JOURNAL_HEADER, 0);
+        unlinkat(queue->dir_fd, MEGAQUEUE_JOURNAL_INDEX, 0);
+
+        if (0 > rmdir(queue->rgn_name)) {
+            PDIAG("WARNING: failed to remove journal directory '%s'", queue->rgn_name);
+        }
+    }
+
+    if (0 <= queue->dir_fd) {
+        close(queue->dir_fd);
+        queue->dir_fd = -1;
+    }
+}
+
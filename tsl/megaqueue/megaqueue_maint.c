@@ -0,0 +1,265 @@
+#include <tsl/megaqueue/megaqueue_maint.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <ck_pr.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE         23
+#endif
+
+static
+struct work_endpoint_ops __megaqueue_maint_ops;
+
+typedef aresult_t (*__megaqueue_maint_op_t)(struct megaqueue_maint *maint, void *base, size_t length);
+
+/**
+ * Apply an operation to the pages between two byte offsets (without wrapping) of
+ * the ring of objects, splitting the range where it wraps around.
+ */
+static
+aresult_t __megaqueue_maint_range(struct megaqueue_maint *maint, uint64_t from, uint64_t to, __megaqueue_maint_op_t op)
+{
+    aresult_t ret = A_OK;
+    void *base = maint->queue->writable_start;
+
+    while (from < to) {
+        size_t ring_offset = from % maint->ring_size;
+        size_t run = BL_MIN2(to - from, maint->ring_size - ring_offset);
+
+        if (AFAILED(ret = op(maint, base + ring_offset, run))) {
+            goto done;
+        }
+
+        from += run;
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Fault in a run of pages without changing their contents, since the slowest
+ * consumer might still be reading the objects on them.
+ */
+static
+aresult_t __megaqueue_maint_fault(struct megaqueue_maint *maint, void *base, size_t length)
+{
+    size_t page_size = maint->queue->page_size;
+
+    if (CAL_LIKELY(true == maint->populate)) {
+        if (0 == madvise(base, length, MADV_POPULATE_WRITE)) {
+            return A_OK;
+        }
+
+        if (EINVAL != errno) {
+            PDIAG("Failed to populate %zu bytes of the megaqueue", length);
+            return A_E_INVAL;
+        }
+
+        /* Older kernel, touch the pages ourselves from now on */
+        DIAG("MADV_POPULATE_WRITE is not supported, falling back to touching pages.");
+        maint->populate = false;
+    }
+
+    for (size_t offs = 0; offs < length; offs += page_size) {
+        /* An atomic add of 0 takes a write fault, without racing the producer */
+        ck_pr_faa_32((uint32_t *)(base + offs), 0);
+    }
+
+    return A_OK;
+}
+
+static
+aresult_t __megaqueue_maint_lock(struct megaqueue_maint *maint, void *base, size_t length)
+{
+    if (0 > mlock(base, length)) {
+        /* Usually RLIMIT_MEMLOCK. Keep going, with the pages faulted in but not locked */
+        PDIAG("WARNING: failed to mlock(2) %zu bytes of the megaqueue, no longer locking.", length);
+        maint->flags &= ~MEGAQUEUE_MAINT_LOCK;
+    }
+
+    return A_OK;
+}
+
+static
+aresult_t __megaqueue_maint_unlock(struct megaqueue_maint *maint, void *base, size_t length)
+{
+    if (0 > munlock(base, length)) {
+        PDIAG("WARNING: failed to munlock(2) %zu bytes of the megaqueue", length);
+    }
+
+    return A_OK;
+}
+
+aresult_t megaqueue_maint_init(struct megaqueue_maint *maint, struct megaqueue *queue, uint64_t ahead,
+                               uint64_t guard, unsigned int flags)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != maint);
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->hdr);
+
+    memset(maint, 0, sizeof(*maint));
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        DIAG("Journal segments are populated when the producer rolls onto them.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    maint->ring_size = (size_t)queue->object_size * queue->object_count;
+
+    if (0 != maint->ring_size % queue->page_size) {
+        DIAG("Megaqueue ring is not a whole number of %zu byte pages, can't maintain it.", queue->page_size);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    maint->queue = queue;
+    maint->ahead = BL_MIN2(ahead, (uint64_t)queue->object_count);
+    maint->guard = BL_MAX2(guard, maint->ahead);
+    maint->flags = flags;
+    maint->interval = MEGAQUEUE_MAINT_INTERVAL;
+    maint->populate = true;
+
+    /* Everything before the head is the producer's problem already */
+    maint->fault_offset = (ck_pr_load_64(&queue->hdr->head) * queue->object_size) & ~(queue->page_size - 1);
+    maint->lock_offset = maint->fault_offset;
+
+    if (AFAILED(ret = work_endpoint_init(&maint->ep, &__megaqueue_maint_ops, maint))) {
+        DIAG("Failed to initialize work endpoint for megaqueue maintenance.");
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_maint_step(struct megaqueue_maint *maint)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue *queue = NULL;
+    struct megaqueue_header *hdr = NULL;
+    size_t page_mask = 0;
+    uint64_t top = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint64_t behind = 0;
+    uint64_t unlock_from = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != maint);
+    TSL_ASSERT_ARG_DEBUG(NULL != maint->queue);
+
+    queue = maint->queue;
+    hdr = queue->hdr;
+    page_mask = ~(queue->page_size - 1);
+
+    /* Slots up to the reservation counter might already be in use */
+    top = (queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) ? ck_pr_load_64(&hdr->reserve) : ck_pr_load_64(&hdr->head);
+
+    /* Unlock the pages behind the deletion pointer, unless they are ahead again */
+    behind = (ck_pr_load_64(&hdr->_delete) * queue->object_size) & page_mask;
+    unlock_from = maint->fault_offset > maint->ring_size ? maint->fault_offset - maint->ring_size : 0;
+    unlock_from = BL_MAX2(unlock_from, maint->lock_offset);
+
+    if (behind > unlock_from) {
+        __megaqueue_maint_range(maint, unlock_from, behind, __megaqueue_maint_unlock);
+    }
+
+    maint->lock_offset = BL_MAX2(maint->lock_offset, behind);
+
+    /* Punch out the pages behind the deletion pointer */
+    if (AFAILED(ret = megaqueue_reclaim(queue, maint->guard))) {
+        goto done;
+    }
+
+    /* Fault in (and lock) the window ahead of the head */
+    start = (top * queue->object_size) & page_mask;
+    end = ((top + maint->ahead) * queue->object_size + queue->page_size - 1) & page_mask;
+
+    if (maint->fault_offset < start) {
+        /* The producer got ahead of us, don't bother with the pages behind it */
+        maint->fault_offset = start;
+    }
+
+    if (end <= maint->fault_offset) {
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_maint_range(maint, maint->fault_offset, end, __megaqueue_maint_fault))) {
+        goto done;
+    }
+
+    if (maint->flags & MEGAQUEUE_MAINT_LOCK) {
+        __megaqueue_maint_range(maint, maint->fault_offset, end, __megaqueue_maint_lock);
+    }
+
+    maint->fault_offset = end;
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_maint_cleanup(struct megaqueue_maint *maint)
+{
+    aresult_t ret = A_OK;
+    uint64_t from = 0;
+
+    TSL_ASSERT_ARG(NULL != maint);
+
+    if (NULL == maint->queue) {
+        goto done;
+    }
+
+    /* Unlocking pages that were never locked is harmless */
+    from = BL_MAX2(maint->lock_offset, maint->fault_offset > maint->ring_size ? maint->fault_offset - maint->ring_size : 0);
+    __megaqueue_maint_range(maint, from, maint->fault_offset, __megaqueue_maint_unlock);
+
+    maint->queue = NULL;
+
+done:
+    return ret;
+}
+
+/**
+ * poll operation for the maintenance endpoint
+ */
+static
+aresult_t __megaqueue_maint_poll(struct work_endpoint *ep, unsigned int *wait)
+{
+    struct megaqueue_maint *maint = (struct megaqueue_maint *)ep->priv;
+
+    *wait = maint->interval;
+
+    return megaqueue_maint_step(maint);
+}
+
+static
+aresult_t __megaqueue_maint_startup(struct work_endpoint *ep)
+{
+    return A_OK;
+}
+
+static
+aresult_t __megaqueue_maint_shutdown(struct work_endpoint *ep)
+{
+    return megaqueue_maint_cleanup((struct megaqueue_maint *)ep->priv);
+}
+
+static
+struct work_endpoint_ops __megaqueue_maint_ops = {
+    .poll = __megaqueue_maint_poll,
+    .startup = __megaqueue_maint_startup,
+    .shutdown = __megaqueue_maint_shutdown
+};
+
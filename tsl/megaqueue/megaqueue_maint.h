@@ -0,0 +1,96 @@
+#ifndef __INCLUDED_MEGAQUEUE_MEGAQUEUE_MAINT_H__
+#define __INCLUDED_MEGAQUEUE_MEGAQUEUE_MAINT_H__
+
+#include <tsl/megaqueue/megaqueue.h>
+#include <tsl/offload/endpoint.h>
+
+#include <stdbool.h>
+
+/**
+ * \group megaqueue_maint_flags Megaqueue maintenance flags
+ * @{
+ */
+#define MEGAQUEUE_MAINT_LOCK        0x1     /** Keep the window ahead of the head locked in memory */
+/*@}*/
+
+/**
+ * Default number of milliseconds between two maintenance steps, when run as a
+ * work endpoint.
+ */
+#define MEGAQUEUE_MAINT_INTERVAL    1
+
+/**
+ * State of the background maintenance of a Megaqueue. Maintenance keeps a window of
+ * objects ahead of the head faulted in (and optionally locked), so the producer
+ * does not take page faults while writing, and gives the pages behind the deletion
+ * pointer back to the system, so the resident size of the queue stays bounded.
+ *
+ * Maintenance can be driven by calling megaqueue_maint_step periodically, or by
+ * adding the work endpoint (megaqueue_maint_endpoint) to a work thread or pool.
+ */
+struct megaqueue_maint {
+    /** The queue being maintained, a handle opened for writing */
+    struct megaqueue *queue;
+    /** Number of objects ahead of the head to keep faulted in */
+    uint64_t ahead;
+    /** Number of objects ahead of the head that are never reclaimed (at least ahead) */
+    uint64_t guard;
+    /** Size of the ring of objects, in bytes */
+    size_t ring_size;
+    /** Byte offset (without wrapping) up to which pages were faulted in */
+    uint64_t fault_offset;
+    /** Byte offset (without wrapping) where the locked pages start */
+    uint64_t lock_offset;
+    /** MEGAQUEUE_MAINT_* flags */
+    unsigned int flags;
+    /** Milliseconds between maintenance steps, when run as a work endpoint */
+    unsigned int interval;
+    /** Whether madvise(2) can populate the page tables for us */
+    bool populate;
+    /** Work endpoint, for running maintenance in a work thread */
+    struct work_endpoint ep;
+};
+
+/**
+ * Prepare maintenance of a Megaqueue.
+ *
+ * \param maint The maintenance state to initialize
+ * \param queue The queue to maintain. Must be opened for writing. Reclaim state is
+ *        kept in the handle, so use a handle of its own if maintenance runs in a
+ *        different thread than the producer.
+ * \param ahead Number of objects ahead of the head to keep faulted in. Clamped to
+ *        the size of the queue.
+ * \param guard Number of objects ahead of the head whose pages are never reclaimed.
+ *        Raised to ahead if smaller. See megaqueue_reclaim.
+ * \param flags MEGAQUEUE_MAINT_* flags
+ *
+ * \return A_OK on success, A_E_INVAL if the queue is a journal (journal segments
+ *         are populated when the producer rolls onto them).
+ */
+aresult_t megaqueue_maint_init(struct megaqueue_maint *maint, struct megaqueue *queue, uint64_t ahead,
+                               uint64_t guard, unsigned int flags);
+
+/**
+ * Run a single maintenance step: release the pages behind the deletion pointer and
+ * fault in the pages up to ahead objects past the head.
+ */
+aresult_t megaqueue_maint_step(struct megaqueue_maint *maint);
+
+/**
+ * Release the resources held by the maintenance state. Unlocks any pages still
+ * locked by it.
+ */
+aresult_t megaqueue_maint_cleanup(struct megaqueue_maint *maint);
+
+/**
+ * Get the work endpoint that runs the maintenance steps every maint->interval
+ * milliseconds.
+ */
+static inline
+struct work_endpoint *megaqueue_maint_endpoint(struct megaqueue_maint *maint)
+{
+    return &maint->ep;
+}
+
+#endif /* __INCLUDED_MEGAQUEUE_MEGAQUEUE_MAINT_H__ */
+
@@ -0,0 +1,247 @@
+#include <tsl/megaqueue/megaqueue_merge.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SEC                  1000000000ull
+
+static
+uint64_t __megaqueue_merge_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Order sources by the timestamp of the record at their head, oldest first. Ties go
+ * to the source that was passed first, so the merge is deterministic.
+ */
+static
+int __megaqueue_merge_compare(void *lhs, void *rhs)
+{
+    struct megaqueue_merge_source *l = lhs;
+    struct megaqueue_merge_source *r = rhs;
+
+    if (l->timestamp != r->timestamp) {
+        return l->timestamp < r->timestamp ? 1 : -1;
+    }
+
+    return l->index < r->index ? 1 : (l->index > r->index ? -1 : 0);
+}
+
+/**
+ * Look at the record at the head of a source, without consuming it
+ */
+static
+aresult_t __megaqueue_merge_peek(struct megaqueue_merge *merge, struct megaqueue_merge_source *src)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue *queue = src->queue;
+
+    do {
+        if (queue->flags & MEGAQUEUE_FLAG_VARLEN) {
+            ret = megaqueue_read_record(queue, &src->buf, &src->length);
+        } else {
+            ret = megaqueue_read_next_slot(queue, &src->buf);
+            src->length = queue->object_size;
+        }
+    } while (A_E_OVERRUN == ret);
+
+    if (A_OK == ret) {
+        src->timestamp = merge->timestamp(src->buf, src->length);
+    }
+
+    return ret;
+}
+
+static
+aresult_t __megaqueue_merge_consume(struct megaqueue_merge_source *src)
+{
+    if (src->queue->flags & MEGAQUEUE_FLAG_VARLEN) {
+        return megaqueue_release_record(src->queue);
+    }
+
+    return megaqueue_read_advance(src->queue);
+}
+
+aresult_t megaqueue_merge_init(struct megaqueue_merge *merge, struct megaqueue **queues, size_t nr_queues,
+                               megaqueue_merge_timestamp_func_t timestamp, uint64_t max_delay_ns)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != merge);
+    TSL_ASSERT_ARG(NULL != queues);
+    TSL_ASSERT_ARG(0 != nr_queues);
+    TSL_ASSERT_ARG(NULL != timestamp);
+
+    memset(merge, 0, sizeof(*merge));
+
+    if (NULL == (merge->sources = calloc(nr_queues, sizeof(struct megaqueue_merge_source)))) {
+        DIAG("Failed to allocate %zu merge sources", nr_queues);
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (AFAILED(ret = fixed_heap_new(&merge->heap, nr_queues, __megaqueue_merge_compare))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < nr_queues; i++) {
+        TSL_ASSERT_ARG(NULL != queues[i]);
+        merge->sources[i].queue = queues[i];
+        merge->sources[i].index = i;
+    }
+
+    merge->nr_sources = nr_queues;
+    merge->timestamp = timestamp;
+    merge->max_delay_ns = max_delay_ns;
+
+done:
+    if (AFAILED(ret)) {
+        if (NULL != merge->sources) {
+            free(merge->sources);
+            merge->sources = NULL;
+        }
+    }
+
+    return ret;
+}
+
+aresult_t megaqueue_merge_cleanup(struct megaqueue_merge *merge)
+{
+    TSL_ASSERT_ARG(NULL != merge);
+
+    if (NULL != merge->heap.heap) {
+        fixed_heap_delete(&merge->heap);
+    }
+
+    if (NULL != merge->sources) {
+        free(merge->sources);
+        merge->sources = NULL;
+    }
+
+    merge->nr_sources = 0;
+    merge->current = NULL;
+
+    return A_OK;
+}
+
+aresult_t megaqueue_merge_next(struct megaqueue_merge *merge, void **buf, size_t *length, unsigned int *source)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_merge_source *next = NULL;
+    uint64_t now = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != merge);
+    TSL_ASSERT_ARG_DEBUG(NULL != buf);
+    TSL_ASSERT_ARG_DEBUG(NULL != length);
+
+    if (CAL_UNLIKELY(NULL != merge->current)) {
+        ret = A_E_BUSY;
+        goto done;
+    }
+
+    /* Line up a record from every source that does not have one in the heap */
+    for (size_t i = 0; i < merge->nr_sources; i++) {
+        struct megaqueue_merge_source *src = &merge->sources[i];
+
+        if (true == src->queued) {
+            continue;
+        }
+
+        if (A_OK == __megaqueue_merge_peek(merge, src)) {
+            src->queued = true;
+            src->empty_since = 0;
+            fixed_heap_push(&merge->heap, src);
+        } else if (0 == src->empty_since) {
+            src->empty_since = now = (0 != now ? now : __megaqueue_merge_now_ns());
+        }
+    }
+
+    if (AFAILED(fixed_heap_peek_head(&merge->heap, (void **)&next))) {
+        ret = A_E_EMPTY;
+        goto done;
+    }
+
+    /* An empty source could still produce something older, unless it is stalled */
+    for (size_t i = 0; i < merge->nr_sources; i++) {
+        struct megaqueue_merge_source *src = &merge->sources[i];
+
+        if (true == src->queued || next->timestamp <= src->last_timestamp) {
+            continue;
+        }
+
+        if (MEGAQUEUE_MERGE_WAIT_FOREVER == merge->max_delay_ns) {
+            ret = A_E_EMPTY;
+            goto done;
+        }
+
+        if (0 == now) {
+            now = __megaqueue_merge_now_ns();
+        }
+
+        if (now - src->empty_since < merge->max_delay_ns) {
+            ret = A_E_EMPTY;
+            goto done;
+        }
+    }
+
+    if (CAL_UNLIKELY(next->timestamp < merge->watermark)) {
+        merge->late++;
+    }
+
+    merge->watermark = BL_MAX2(merge->watermark, next->timestamp);
+    next->last_timestamp = next->timestamp;
+    merge->current = next;
+
+    *buf = next->buf;
+    *length = next->length;
+
+    if (NULL != source) {
+        *source = next->index;
+    }
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_merge_release(struct megaqueue_merge *merge)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_merge_source *src = NULL;
+    void *head = NULL;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != merge);
+
+    if (CAL_UNLIKELY(NULL == (src = merge->current))) {
+        ret = A_E_EMPTY;
+        goto done;
+    }
+
+    merge->current = NULL;
+
+    /*
+     * The source is at the head of the heap: sift its next record down, or drop it.
+     * If it was lapped, its cursor already moved on, so drop it as well, to look at
+     * wherever it is now on the next call.
+     */
+    if (A_OK == (ret = __megaqueue_merge_consume(src)) && A_OK == __megaqueue_merge_peek(merge, src)) {
+        fixed_heap_update_head(&merge->heap);
+    } else {
+        fixed_heap_pop(&merge->heap, &head);
+        src->queued = false;
+    }
+
+done:
+    return ret;
+}
+
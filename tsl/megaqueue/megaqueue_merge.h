@@ -0,0 +1,121 @@
+#ifndef __INCLUDED_MEGAQUEUE_MEGAQUEUE_MERGE_H__
+#define __INCLUDED_MEGAQUEUE_MEGAQUEUE_MERGE_H__
+
+#include <tsl/megaqueue/megaqueue.h>
+#include <tsl/fixed_heap.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Pass as the maximum delay to megaqueue_merge_init to always wait for every source
+ */
+#define MEGAQUEUE_MERGE_WAIT_FOREVER    UINT64_MAX
+
+/**
+ * Get the timestamp of a record. Records of each source must come in timestamp
+ * order.
+ */
+typedef uint64_t (*megaqueue_merge_timestamp_func_t)(const void *buf, size_t length);
+
+/**
+ * A source of a merge: a queue, and the record at its head
+ */
+struct megaqueue_merge_source {
+    /** The queue, a consumer handle owned by the caller */
+    struct megaqueue *queue;
+    /** The record at the head of the queue, if the source is in the heap */
+    void *buf;
+    /** Length of the record at the head of the queue */
+    size_t length;
+    /** Timestamp of the record at the head of the queue */
+    uint64_t timestamp;
+    /** Timestamp of the last record taken from this source */
+    uint64_t last_timestamp;
+    /** When the source was found empty (CLOCK_MONOTONIC ns), 0 if it is not */
+    uint64_t empty_since;
+    /** Index of the source, as passed to megaqueue_merge_init */
+    unsigned int index;
+    /** Whether the record at the head is in the heap */
+    bool queued;
+};
+
+/**
+ * A consumer that merges the records of several Megaqueues in timestamp order.
+ *
+ * A record is only handed out once every source has a record lined up, so nothing
+ * older can show up later. The exception is a source that has nothing to read: it
+ * does not hold back records that are no newer than the last one it gave us, and
+ * once it has been empty for longer than the maximum delay, it is skipped, so a
+ * stalled feed only holds the others up for a bounded time. Records such a source
+ * produces later, older than what was already handed out, are passed on as soon as
+ * they are seen, and counted as late.
+ */
+struct megaqueue_merge {
+    /** Min-heap of the sources with a record lined up, keyed on its timestamp */
+    struct fixed_heap heap;
+    /** The sources */
+    struct megaqueue_merge_source *sources;
+    /** Number of sources */
+    size_t nr_sources;
+    /** Function getting the timestamp of a record */
+    megaqueue_merge_timestamp_func_t timestamp;
+    /** How long an empty source can hold the others back, in nanoseconds */
+    uint64_t max_delay_ns;
+    /** The timestamp of the newest record handed out so far */
+    uint64_t watermark;
+    /** Number of records that were handed out after a newer record */
+    uint64_t late;
+    /** The source of the record handed out, until it is released */
+    struct megaqueue_merge_source *current;
+};
+
+/**
+ * Set up a merge of several queues.
+ *
+ * \param merge The merge to initialize
+ * \param queues The queues to merge, open for reading. The handles must stay around
+ *        until megaqueue_merge_cleanup, and must not be read from by anyone else.
+ * \param nr_queues Number of queues
+ * \param timestamp Function getting the timestamp of a record
+ * \param max_delay_ns How long a source that has nothing to read can hold back the
+ *        records of the others. 0 never waits for an empty source, and
+ *        MEGAQUEUE_MERGE_WAIT_FOREVER always does.
+ *
+ * \return A_OK on success, an error code otherwise
+ */
+aresult_t megaqueue_merge_init(struct megaqueue_merge *merge, struct megaqueue **queues, size_t nr_queues,
+                               megaqueue_merge_timestamp_func_t timestamp, uint64_t max_delay_ns);
+
+/**
+ * Release the resources held by the merge. Does not close the queues.
+ */
+aresult_t megaqueue_merge_cleanup(struct megaqueue_merge *merge);
+
+/**
+ * Get the next record in timestamp order. The record stays valid until it is
+ * released with megaqueue_merge_release.
+ *
+ * \param merge The merge
+ * \param buf Receives a pointer to the record
+ * \param length Receives the length of the record
+ * \param source Receives the index of the queue the record came from. Can be NULL.
+ *
+ * \return A_OK on success, A_E_EMPTY if there is nothing to read, or if the next
+ *         record is held back by an empty source. A_E_BUSY if the previous record
+ *         was not released.
+ */
+aresult_t megaqueue_merge_next(struct megaqueue_merge *merge, void **buf, size_t *length, unsigned int *source);
+
+/**
+ * Release the record returned by megaqueue_merge_next, giving it back to its queue.
+ *
+ * \return A_OK on success, A_E_EMPTY if there is no record to release. A_E_OVERRUN
+ *         if a lapping queue overwrote the record while it was held: the merge
+ *         carries on from the oldest record the queue still has.
+ */
+aresult_t megaqueue_merge_release(struct megaqueue_merge *merge);
+
+#endif /* __INCLUDED_MEGAQUEUE_MEGAQUEUE_MERGE_H__ */
+
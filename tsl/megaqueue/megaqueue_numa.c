@@ -0,0 +1,247 @@
+#include <tsl/megaqueue/megaqueue.h>
+#include <tsl/megaqueue/megaqueue_priv.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <linux/mempolicy.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Number of pages looked up per call to move_pages(2)
+ */
+#define MEGAQUEUE_NUMA_QUERY_PAGES  1024
+
+#define MEGAQUEUE_NUMA_MASK_LONGS   (MEGAQUEUE_NUMA_MAX_NODES / (sizeof(unsigned long) * CHAR_BIT))
+
+/**
+ * Find the node a CPU belongs to, from the nodeN link in its sysfs directory.
+ */
+static
+int __megaqueue_numa_cpu_node(unsigned int cpu)
+{
+    char path[64];
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+
+    if (NULL == (dir = opendir(path))) {
+        PDIAG("Failed to open '%s', is CPU %u online?", path, cpu);
+        return -1;
+    }
+
+    while (NULL != (ent = readdir(dir))) {
+        if (1 == sscanf(ent->d_name, "node%d", &node)) {
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return node;
+}
+
+/**
+ * Work out the node a queue is to be bound to. Done before anything is created, so a
+ * bad policy does not leave a half-made queue behind.
+ *
+ * \return A_OK on success, with node set to -1 if the pages are left where they
+ *         land. A_E_BADARGS if the policy or the node make no sense.
+ */
+aresult_t __megaqueue_numa_node(const struct megaqueue_params *params, int *node)
+{
+    aresult_t ret = A_OK;
+    unsigned int cpu = 0;
+    unsigned int local = 0;
+
+    *node = -1;
+
+    switch (params->numa_policy) {
+    case MEGAQUEUE_NUMA_DEFAULT:
+        break;
+    case MEGAQUEUE_NUMA_LOCAL:
+        if (0 > syscall(SYS_getcpu, &cpu, &local, NULL)) {
+            PDIAG("Failed to find out which node we are running on");
+            ret = A_E_INVAL;
+            goto done;
+        }
+        *node = local;
+        break;
+    case MEGAQUEUE_NUMA_NODE:
+        *node = params->numa_target;
+        break;
+    case MEGAQUEUE_NUMA_CPU:
+        *node = __megaqueue_numa_cpu_node(params->numa_target);
+        break;
+    default:
+        DIAG("Unknown NUMA policy %u", params->numa_policy);
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if (MEGAQUEUE_NUMA_DEFAULT != params->numa_policy && (0 > *node || MEGAQUEUE_NUMA_MAX_NODES <= *node)) {
+        DIAG("No usable NUMA node for policy %u (target %u)", params->numa_policy, params->numa_target);
+        ret = A_E_BADARGS;
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Bind a mapping of the queue to the node found by __megaqueue_numa_node, if
+ * any. Called before the pages are prefaulted, so they are allocated on that
+ * node. For shm, the policy sticks to the object, so pages faulted in later by any
+ * process (i.e. after being reclaimed) go to the same node. Pages that are already
+ * there are moved, if no other process maps them.
+ *
+ * \return A_OK on success, or if the kernel has no NUMA support. An error code if
+ *         binding failed.
+ */
+aresult_t __megaqueue_numa_bind(void *base, size_t length, int node)
+{
+    aresult_t ret = A_OK;
+    unsigned long mask[MEGAQUEUE_NUMA_MASK_LONGS];
+    size_t bits = sizeof(unsigned long) * CHAR_BIT;
+
+    if (0 > node) {
+        goto done;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] = 1ul << (node % bits);
+
+    DIAG("Binding %zu bytes of megaqueue to NUMA node %d", length, node);
+
+    /* The kernel drops the top bit of maxnode, hence the + 1 */
+    if (0 > syscall(SYS_mbind, base, length, MPOL_BIND, mask, sizeof(mask) * CHAR_BIT + 1, MPOL_MF_MOVE)) {
+        if (ENOSYS == errno) {
+            DIAG("WARNING: kernel has no NUMA support, not binding the megaqueue.");
+            goto done;
+        }
+
+        PDIAG("Failed to mbind(2) megaqueue to NUMA node %d", node);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Find out which of count pages from chunk are resident. mincore(2) reports one byte
+ * per base page, so for huge pages only the first base page of each is asked about.
+ */
+static
+aresult_t __megaqueue_numa_mincore(void *chunk, size_t count, size_t page_size, unsigned char *resident)
+{
+    size_t base_page_size = (size_t)getpagesize();
+
+    if (page_size == base_page_size) {
+        if (0 > mincore(chunk, count * page_size, resident)) {
+            goto fail;
+        }
+
+        return A_OK;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (0 > mincore(chunk + i * page_size, base_page_size, &resident[i])) {
+            goto fail;
+        }
+    }
+
+    return A_OK;
+
+fail:
+    PDIAG("Failed to mincore(2) the megaqueue");
+    return A_E_INVAL;
+}
+
+aresult_t megaqueue_numa_residency(struct megaqueue *queue, uint64_t *pages, size_t nr_nodes, uint64_t *absent)
+{
+    aresult_t ret = A_OK;
+    void *addrs[MEGAQUEUE_NUMA_QUERY_PAGES];
+    int status[MEGAQUEUE_NUMA_QUERY_PAGES];
+    unsigned char resident[MEGAQUEUE_NUMA_QUERY_PAGES];
+    void *base = NULL;
+    size_t page_size = 0;
+    size_t nr_pages = 0;
+
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->hdr);
+    TSL_ASSERT_ARG(NULL != pages);
+    TSL_ASSERT_ARG(NULL != absent);
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        DIAG("Journal segments come and go, can't report where they reside.");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    memset(pages, 0, nr_nodes * sizeof(*pages));
+    *absent = 0;
+
+    base = queue->read_start;
+    page_size = queue->page_size;
+    nr_pages = ((size_t)queue->object_size * queue->object_count + page_size - 1) / page_size;
+
+    for (size_t first = 0; first < nr_pages; first += MEGAQUEUE_NUMA_QUERY_PAGES) {
+        size_t count = BL_MIN2(nr_pages - first, (size_t)MEGAQUEUE_NUMA_QUERY_PAGES);
+        void *chunk = base + first * page_size;
+        size_t asked = 0;
+
+        /* Only ask about pages that exist, and map them so move_pages(2) sees them */
+        if (AFAILED(ret = __megaqueue_numa_mincore(chunk, count, page_size, resident))) {
+            goto done;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (0 == (resident[i] & 1)) {
+                (*absent)++;
+                continue;
+            }
+
+            addrs[asked] = chunk + i * page_size;
+            (void)*(volatile uint8_t *)addrs[asked];
+            asked++;
+        }
+
+        if (0 == asked) {
+            continue;
+        }
+
+        if (0 > syscall(SYS_move_pages, 0, asked, addrs, NULL, status, 0)) {
+            PDIAG("Failed to query the NUMA node of the megaqueue pages");
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        for (size_t i = 0; i < asked; i++) {
+            if (0 > status[i]) {
+                (*absent)++;
+            } else if ((size_t)status[i] < nr_nodes) {
+                pages[status[i]]++;
+            }
+        }
+    }
+
+done:
+    return ret;
+}
+
@@ -2,41 +2,374 @@
 #define __INCLUDED_MEGAQUEUE_MEGAQUEUE_PRIV_H__
 
 #include <tsl/assert.h>
+#include <tsl/basic.h>
 #include <tsl/errors.h>
 
 #include <ck_pr.h>
 
+/**
+ * Slow path for a broadcast producer that found the queue full. Moves the deletion
+ * pointer up to the slowest live consumer, and laps it if the queue allows that.
+ * A journal producer moves on to the next segment instead.
+ */
+aresult_t __megaqueue_make_room(struct megaqueue *queue);
+
+/**
+ * Map the journal segment following the one the producer filled, pre-allocate the
+ * segment after it, and retire segments the retention policy no longer covers.
+ */
+aresult_t __megaqueue_journal_roll(struct megaqueue *queue);
+
+/**
+ * Map the journal segment holding the given consumer position. If the segment was
+ * already retired, skips the cursor forward to the oldest retained segment and
+ * returns A_E_OVERRUN.
+ */
+aresult_t __megaqueue_journal_follow(struct megaqueue *queue, uint64_t tail);
+
+/**
+ * Wake up all consumers sleeping in megaqueue_wait.
+ */
+void __megaqueue_wake(struct megaqueue *queue);
+
+/* Internal to the megaqueue implementation */
+size_t __megaqueue_header_size(size_t page_size);
+aresult_t __megaqueue_prepare_superblock(void *base, size_t obj_size, size_t obj_count,
+                                         const struct megaqueue_params *params);
+aresult_t __megaqueue_check_header(struct megaqueue_header *hdr, size_t obj_size);
+aresult_t __megaqueue_setup_handle(struct megaqueue *queue, int mode, const struct megaqueue_params *params);
+void __megaqueue_resume(struct megaqueue *queue);
+aresult_t __megaqueue_journal_open(struct megaqueue *queue, int mode, const char *path, size_t obj_size,
+                                   size_t obj_count, const struct megaqueue_params *params);
+void __megaqueue_journal_close(struct megaqueue *queue, int unlink);
+aresult_t __megaqueue_huge_open(struct megaqueue *queue, int mode, const char *queue_name,
+                                const struct megaqueue_params *params);
+void __megaqueue_huge_close(struct megaqueue *queue, int destroy);
+aresult_t __megaqueue_numa_node(const struct megaqueue_params *params, int *node);
+aresult_t __megaqueue_numa_bind(void *base, size_t length, int node);
+
+/**
+ * Get the address of the slot the given position maps to.
+ */
+static inline
+void *__megaqueue_slot(struct megaqueue *queue, uint64_t pos)
+{
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        return queue->writable_start + ((pos & queue->object_mask) << queue->object_shift);
+    }
+
+    return queue->writable_start + (queue->object_size * (pos % queue->object_count));
+}
+
+/**
+ * Get the address of the slot the given position maps to, on the consumer side. This
+ * only differs from __megaqueue_slot for a journal, where the producer and the
+ * consumer can be in different segments.
+ */
+static inline
+void *__megaqueue_read_slot(struct megaqueue *queue, uint64_t pos)
+{
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        return queue->read_start + ((pos & queue->object_mask) << queue->object_shift);
+    }
+
+    return queue->read_start + (queue->object_size * (pos % queue->object_count));
+}
+
+/**
+ * Prefetch the slot prefetch_distance slots past pos, for a consumer about to read
+ * pos. Prefetching past the head is harmless, the line is just fetched again later.
+ */
+static inline
+void __megaqueue_prefetch(struct megaqueue *queue, uint64_t pos)
+{
+    uint8_t *slot = NULL;
+
+    if (CAL_LIKELY(0 == queue->prefetch_distance)) {
+        return;
+    }
+
+    slot = __megaqueue_read_slot(queue, pos + queue->prefetch_distance);
+
+    for (size_t offs = 0; offs < queue->object_size; offs += SYS_CACHE_LINE_LENGTH) {
+        CAL_PREFETCH(slot + offs);
+    }
+}
+
+/**
+ * Get the offset of the slot the given position maps to, as an object index.
+ */
+static inline
+uint64_t __megaqueue_index(struct megaqueue *queue, uint64_t pos)
+{
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        return pos & queue->object_mask;
+    }
+
+    return pos % queue->object_count;
+}
+
+/**
+ * Get the producer's view of the head. In fast mode, this is kept privately.
+ */
+static inline
+uint64_t __megaqueue_head(struct megaqueue *queue)
+{
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        return queue->prod_head;
+    }
+
+    return ck_pr_load_64(&queue->hdr->head);
+}
+
+/**
+ * Publish a new head. Also updates the producer's private copy, for fast mode, and
+ * wakes up any sleeping consumers.
+ */
+static inline
+void __megaqueue_set_head(struct megaqueue *queue, uint64_t head)
+{
+    queue->prod_head = head;
+    ck_pr_store_64(&queue->hdr->head, head);
+
+    /*
+     * No fence here: a consumer that goes to sleep just as we publish is caught by
+     * the futex value check, or at worst by its sleep slice expiring.
+     */
+    if (CAL_UNLIKELY(0 != ck_pr_load_32(&queue->hdr->waiters))) {
+        __megaqueue_wake(queue);
+    }
+}
+
+/**
+ * Get the number of free slots the producer can fill. In fast mode, the deletion
+ * pointer is only read from the shared header when the cached copy says the queue
+ * is full.
+ */
+static inline
+uint64_t __megaqueue_free_slots(struct megaqueue *queue, uint64_t head)
+{
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_JOURNAL)) {
+        /* A journal is only full when the producer reaches the end of the segment */
+        return queue->prod_seg_end - head;
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        if (CAL_LIKELY(head - queue->prod_delete_cache < queue->object_count)) {
+            return queue->object_count - (head - queue->prod_delete_cache);
+        }
+
+        queue->prod_delete_cache = ck_pr_load_64(&queue->hdr->_delete);
+        return queue->object_count - (head - queue->prod_delete_cache);
+    }
+
+    return queue->object_count - (head - ck_pr_load_64(&queue->hdr->_delete));
+}
+
+/**
+ * Get the number of objects this consumer can read, starting at tail. In fast mode,
+ * the head is only read from the shared header when the cached copy says the
+ * queue is empty.
+ */
+static inline
+uint64_t __megaqueue_readable(struct megaqueue *queue, uint64_t tail)
+{
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_JOURNAL)) {
+        uint64_t head_offset = ck_pr_load_64(&queue->hdr->head);
+
+        if (head_offset == tail) {
+            return 0;
+        }
+
+        if (CAL_UNLIKELY(NULL == queue->read_start || tail - queue->cons_seg_base >= queue->object_count)) {
+            if (AFAILED(__megaqueue_journal_follow(queue, tail))) {
+                return 0;
+            }
+        }
+
+        return BL_MIN2(head_offset, queue->cons_seg_base + queue->object_count) - tail;
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_FAST) {
+        if (CAL_LIKELY(queue->cons_head_cache > tail)) {
+            return queue->cons_head_cache - tail;
+        }
+
+        queue->cons_head_cache = ck_pr_load_64(&queue->hdr->head);
+        return queue->cons_head_cache > tail ? queue->cons_head_cache - tail : 0;
+    }
+
+    return ck_pr_load_64(&queue->hdr->head) - tail;
+}
+
 static inline
 bool __megaqueue_is_full(struct megaqueue *queue)
+{
+    return 0 == __megaqueue_free_slots(queue, __megaqueue_head(queue));
+}
+
+static inline
+bool __megaqueue_is_empty(struct megaqueue *queue)
+{
+    return 0 == __megaqueue_readable(queue, ck_pr_load_64(queue->cursor));
+}
+
+static inline
+bool __megaqueue_can_delete(struct megaqueue *queue)
 {
     struct megaqueue_header *hdr = queue->hdr;
 
-    size_t head_offset = ck_pr_load_64(&hdr->head);
-    size_t delete_offset = ck_pr_load_64(&hdr->_delete);
+    uint64_t tail_offset = ck_pr_load_64(&hdr->tail);
+    uint64_t delete_offset = ck_pr_load_64(&hdr->_delete);
 
-    return delete_offset == ((head_offset + 1) % queue->object_count);
+    return tail_offset == delete_offset;
 }
 
+/**
+ * Check if the producer can write another object, making room on a broadcast queue
+ * if need be.
+ */
 static inline
-bool __megaqueue_is_empty(struct megaqueue *queue)
+bool __megaqueue_has_room(struct megaqueue *queue)
+{
+    if (CAL_LIKELY(!__megaqueue_is_full(queue))) {
+        return true;
+    }
+
+    if (queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_JOURNAL)) {
+        return !AFAILED(__megaqueue_make_room(queue));
+    }
+
+    return false;
+}
+
+/**
+ * Check if the producer lapped this consumer. If so, skip the cursor forward to the
+ * oldest object still in the queue and account for the objects that were lost. For a
+ * journal, this maps the segment the consumer reads next, which tells if retention
+ * retired it.
+ */
+static inline
+aresult_t __megaqueue_check_lapped(struct megaqueue *queue)
+{
+    uint64_t tail_offset = ck_pr_load_64(queue->cursor);
+    uint64_t delete_offset = ck_pr_load_64(&queue->hdr->_delete);
+
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_JOURNAL)) {
+        /* The segment at the head might not exist yet */
+        if (ck_pr_load_64(&queue->hdr->head) == tail_offset) {
+            return A_OK;
+        }
+
+        if (CAL_UNLIKELY(NULL == queue->read_start || tail_offset - queue->cons_seg_base >= queue->object_count) &&
+                A_E_OVERRUN == __megaqueue_journal_follow(queue, tail_offset))
+        {
+            return A_E_OVERRUN;
+        }
+
+        return A_OK;
+    }
+
+    if (CAL_LIKELY(tail_offset >= delete_offset)) {
+        return A_OK;
+    }
+
+    queue->missed += delete_offset - tail_offset;
+    ck_pr_store_64(queue->cursor, delete_offset);
+
+    return A_E_OVERRUN;
+}
+
+/**
+ * Claim up to max slots for this multi-producer handle, by moving the shared
+ * reservation counter forward.
+ */
+static inline
+aresult_t __megaqueue_mp_claim(struct megaqueue *queue, size_t max)
 {
     struct megaqueue_header *hdr = queue->hdr;
+    uint64_t reserved = 0;
+    uint64_t free_slots = 0;
+    uint64_t count = 0;
+
+    do {
+        reserved = ck_pr_load_64(&hdr->reserve);
+        free_slots = queue->object_count - (reserved - ck_pr_load_64(&hdr->_delete));
 
-    size_t head_offset = ck_pr_load_64(&hdr->head);
-    size_t tail_offset = ck_pr_load_64(&hdr->tail);
+        if (CAL_UNLIKELY(0 == free_slots || free_slots > queue->object_count)) {
+            /*
+             * Either full, or the pointers moved between the two loads. A broadcast
+             * producer makes room from where they are now, rather than spinning on
+             * them: a consumer that attached while room was made can leave the
+             * deletion pointer behind the reservation until it catches up.
+             */
+            if (queue->flags & MEGAQUEUE_FLAG_BROADCAST) {
+                if (AFAILED(__megaqueue_make_room(queue))) {
+                    return A_E_NOSPC;
+                }
+            } else if (0 == free_slots) {
+                return A_E_NOSPC;
+            }
+            continue;
+        }
 
-    return tail_offset == head_offset;
+        count = BL_MIN2(max, free_slots);
+    } while (!ck_pr_cas_64(&hdr->reserve, reserved, reserved + count));
+
+    queue->mp_pos = reserved;
+    queue->mp_claimed = count;
+
+    return A_OK;
 }
 
+/**
+ * Mark the slots claimed by this multi-producer handle as committed, then move the
+ * head over every committed slot in order. Whichever producer commits the slot the
+ * head is waiting on moves it forward, on behalf of the others too.
+ */
 static inline
-bool __megaqueue_can_delete(struct megaqueue *queue)
+void __megaqueue_mp_commit(struct megaqueue *queue)
 {
     struct megaqueue_header *hdr = queue->hdr;
+    uint64_t head_offset = 0;
+    uint64_t end = 0;
 
-    size_t tail_offset = ck_pr_load_64(&hdr->tail);
-    size_t delete_offset = ck_pr_load_64(&hdr->_delete);
+    /* The objects must be visible before they are marked committed */
+    ck_pr_fence_store();
 
-    return tail_offset == delete_offset;
+    for (uint64_t pos = queue->mp_pos; pos < queue->mp_pos + queue->mp_claimed; pos++) {
+        ck_pr_store_64(&queue->commit[__megaqueue_index(queue, pos)], pos + 1);
+    }
+
+    queue->mp_claimed = 0;
+
+    /*
+     * The marks must be visible before the head is read. Otherwise two producers can
+     * each read a stale head and miss the other's marks, and neither moves the head
+     * over the slots of the other.
+     */
+    ck_pr_fence_memory();
+
+    head_offset = ck_pr_load_64(&hdr->head);
+
+    do {
+        /* Stale entries from the previous lap never match */
+        for (end = head_offset; ck_pr_load_64(&queue->commit[__megaqueue_index(queue, end)]) == end + 1; end++);
+
+        if (end == head_offset) {
+            break;
+        }
+
+        if (ck_pr_cas_64(&hdr->head, head_offset, end)) {
+            head_offset = end;
+        } else {
+            head_offset = ck_pr_load_64(&hdr->head);
+        }
+    } while (1);
+
+    if (CAL_UNLIKELY(0 != ck_pr_load_32(&hdr->waiters))) {
+        __megaqueue_wake(queue);
+    }
 }
 
 /**
@@ -46,25 +379,29 @@ static inline
 aresult_t megaqueue_next_slot(struct megaqueue *queue, void **slot)
 {
     aresult_t ret = A_OK;
-    size_t head_offset = 0;
-    struct megaqueue_header *hdr = NULL;
-    void *cur_pos = NULL;
+    uint64_t head_offset = 0;
 
     TSL_ASSERT_ARG_DEBUG(NULL != queue);
     TSL_ASSERT_ARG_DEBUG(NULL != slot);
 
-    hdr = queue->hdr;
-    head_offset = ck_pr_load_64(&hdr->head);
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER)) {
+        /* Hold on to the slot until it is committed by megaqueue_advance */
+        if (0 == queue->mp_claimed && AFAILED(ret = __megaqueue_mp_claim(queue, 1))) {
+            goto done;
+        }
 
-    /* Always leave one free entry */
-    if ( __megaqueue_is_full(queue) ) {
-        ret = A_E_NOSPC;
+        *slot = __megaqueue_slot(queue, queue->mp_pos);
         goto done;
     }
 
-    cur_pos = queue->writable_start + (queue->object_size * head_offset);
+    head_offset = __megaqueue_head(queue);
 
-    *slot = cur_pos;
+    if ( !__megaqueue_has_room(queue) ) {
+        ret = A_E_NOSPC;
+        goto done;
+    }
+
+    *slot = __megaqueue_slot(queue, head_offset);
 
 done:
     return ret;
@@ -77,50 +414,88 @@ static inline
 aresult_t megaqueue_advance(struct megaqueue *queue)
 {
     aresult_t ret = A_OK;
-    struct megaqueue_header *hdr = NULL;
-    size_t offset = 0;
 
     TSL_ASSERT_ARG_DEBUG(NULL != queue);
 
-    hdr = queue->hdr;
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER)) {
+        if (0 == queue->mp_claimed && AFAILED(ret = __megaqueue_mp_claim(queue, 1))) {
+            goto done;
+        }
 
-    if (!__megaqueue_is_full(queue)) {
-        offset = ck_pr_load_64(&hdr->head);
-        offset = (offset + 1) % queue->object_count;
+        __megaqueue_mp_commit(queue);
+        goto done;
+    }
 
-        ck_pr_store_64(&hdr->head, offset);
+    if (__megaqueue_has_room(queue)) {
+        __megaqueue_set_head(queue, __megaqueue_head(queue) + 1);
     } else {
         ret = A_E_NOSPC;
     }
 
+done:
     return ret;
 }
 
+/**
+ * Get the next object to be read by this consumer. If the producer lapped a
+ * broadcast consumer, or retention retired the journal segment a consumer was
+ * reading, returns A_E_OVERRUN and skips ahead; just call again.
+ */
 static inline
 aresult_t megaqueue_read_next_slot(struct megaqueue *queue, void **slot)
 {
     aresult_t ret = A_OK;
-    struct megaqueue_header *hdr = NULL;
-    void *cur_pos = NULL;
-    size_t tail_offset = 0;
+    uint64_t tail_offset = 0;
 
     TSL_ASSERT_ARG_DEBUG(NULL != queue);
     TSL_ASSERT_ARG_DEBUG(NULL != slot);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
 
-    hdr = queue->hdr;
-    tail_offset = ck_pr_load_64(&hdr->tail);
+    if (CAL_UNLIKELY(queue->flags & (MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_SNOOP | MEGAQUEUE_FLAG_JOURNAL))) {
+        if (AFAILED(ret = __megaqueue_check_lapped(queue))) {
+            *slot = NULL;
+            goto done;
+        }
+    }
 
-    if (!__megaqueue_is_empty(queue)) {
-        cur_pos = queue->writable_start + (queue->object_size * tail_offset);
-        *slot = cur_pos;
+    tail_offset = ck_pr_load_64(queue->cursor);
+
+    if (0 != __megaqueue_readable(queue, tail_offset)) {
+        *slot = __megaqueue_read_slot(queue, tail_offset);
+        __megaqueue_prefetch(queue, tail_offset);
     } else {
         *slot = NULL;
         ret = A_E_EMPTY;
     }
 
+done:
     return ret;
 }
 
+/**
+ * Move a consumer's cursor count objects forward. If the producer lapped a broadcast
+ * consumer while it was reading, the objects might have been overwritten:
+ * A_E_OVERRUN is returned and the objects should be discarded.
+ */
+static inline
+aresult_t __megaqueue_consumer_advance(struct megaqueue *queue, uint64_t count)
+{
+    uint64_t offset = ck_pr_load_64(queue->cursor);
+
+    if (CAL_UNLIKELY(queue->flags & (MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_SNOOP))) {
+        /* Make sure the object was read before checking if it was reclaimed */
+        ck_pr_fence_load();
+        if (AFAILED(__megaqueue_check_lapped(queue))) {
+            return A_E_OVERRUN;
+        }
+    }
+
+    ck_pr_store_64(queue->cursor, offset + count);
+
+    return A_OK;
+}
+
 /**
  * Legacy -- advance both the read and delete pointers in lockstep
  */
@@ -129,15 +504,22 @@ aresult_t megaqueue_read_advance(struct megaqueue *queue)
 {
     aresult_t ret = A_OK;
     struct megaqueue_header *hdr = NULL;
-    size_t offset = 0;
+    uint64_t offset = 0;
 
     TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
 
     hdr = queue->hdr;
 
     if (!__megaqueue_is_empty(queue)) {
-        offset = ck_pr_load_64(&hdr->tail);
-        offset = (offset + 1) % queue->object_count;
+        if (queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_SNOOP)) {
+            /* The producer collects the deletion pointer from the consumer table */
+            ret = __megaqueue_consumer_advance(queue, 1);
+            goto done;
+        }
+
+        offset = ck_pr_load_64(&hdr->tail) + 1;
 
         ck_pr_store_64(&hdr->tail, offset);
         ck_pr_store_64(&hdr->_delete, offset);
@@ -145,6 +527,7 @@ aresult_t megaqueue_read_advance(struct megaqueue *queue)
         ret = A_E_EMPTY;
     }
 
+done:
     return ret;
 }
 
@@ -155,18 +538,13 @@ static inline
 aresult_t megaqueue_read_only_advance(struct megaqueue *queue)
 {
     aresult_t ret = A_OK;
-    struct megaqueue_header *hdr = NULL;
-    size_t offset = 0;
 
     TSL_ASSERT_ARG_DEBUG(NULL != queue);
-
-    hdr = queue->hdr;
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
 
     if (!__megaqueue_is_empty(queue)) {
-        offset = ck_pr_load_64(&hdr->tail);
-        offset = (offset + 1) % queue->object_count;
-
-        ck_pr_store_64(&hdr->tail, offset);
+        ret = __megaqueue_consumer_advance(queue, 1);
     } else {
         ret = A_E_EMPTY;
     }
@@ -182,21 +560,604 @@ aresult_t megaqueue_delete_advance(struct megaqueue *queue)
 {
     aresult_t ret = A_OK;
     struct megaqueue_header *hdr = NULL;
-    size_t offset = 0;
+    uint64_t offset = 0;
 
     TSL_ASSERT_ARG_DEBUG(NULL != queue);
 
     hdr = queue->hdr;
 
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_BROADCAST)) {
+        /* The deletion pointer of a broadcast queue is owned by the producer */
+        ret = A_E_INVAL;
+        goto done;
+    }
+
     if (!__megaqueue_can_delete(queue)) {
         offset = ck_pr_load_64(&hdr->_delete);
-        offset = (offset + 1) % queue->object_count;
+        ck_pr_store_64(&hdr->_delete, offset + 1);
+    } else {
+        ret = A_E_EMPTY;
+    }
 
-        ck_pr_store_64(&hdr->_delete, offset);
+done:
+    return ret;
+}
+
+/**
+ * Describe the run of count objects starting at the given position.
+ */
+static inline
+void __megaqueue_span_fill(struct megaqueue *queue, void *base, uint64_t pos, size_t count, struct megaqueue_span *span)
+{
+    size_t to_end = queue->object_count - __megaqueue_index(queue, pos);
+
+    span->first = base + __megaqueue_index(queue, pos) * queue->object_size;
+
+    if (CAL_LIKELY(count <= to_end)) {
+        span->first_count = count;
+        span->second = NULL;
+        span->second_count = 0;
     } else {
+        span->first_count = to_end;
+        span->second = base;
+        span->second_count = count - to_end;
+    }
+}
+
+/**
+ * Claim up to max free slots for the producer to fill in. The claim is not visible
+ * to consumers until megaqueue_publish_n is called.
+ *
+ * \param queue The queue to claim slots in
+ * \param max The maximum number of slots the caller wants
+ * \param span The claimed slots, returned by reference
+ * \param count The number of slots claimed (up to max), returned by reference
+ *
+ * \return A_OK on success, A_E_NOSPC if no slots are free.
+ */
+static inline
+aresult_t megaqueue_claim_n(struct megaqueue *queue, size_t max, struct megaqueue_span *span, size_t *count)
+{
+    aresult_t ret = A_OK;
+    uint64_t head_offset = 0;
+    uint64_t free_slots = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != span);
+    TSL_ASSERT_ARG_DEBUG(NULL != count);
+    TSL_ASSERT_ARG_DEBUG(0 != max);
+
+    *count = 0;
+
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER)) {
+        TSL_ASSERT_ARG_DEBUG(0 == queue->mp_claimed);
+
+        if (AFAILED(ret = __megaqueue_mp_claim(queue, max))) {
+            goto done;
+        }
+
+        *count = queue->mp_claimed;
+        __megaqueue_span_fill(queue, queue->writable_start, queue->mp_pos, *count, span);
+        goto done;
+    }
+
+    head_offset = __megaqueue_head(queue);
+    free_slots = __megaqueue_free_slots(queue, head_offset);
+
+    if (CAL_UNLIKELY(0 == free_slots)) {
+        if (!(queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_JOURNAL)) ||
+                AFAILED(__megaqueue_make_room(queue)))
+        {
+            ret = A_E_NOSPC;
+            goto done;
+        }
+
+        free_slots = __megaqueue_free_slots(queue, head_offset);
+    }
+
+    *count = BL_MIN2(max, free_slots);
+    __megaqueue_span_fill(queue, queue->writable_start, head_offset, *count, span);
+
+done:
+    return ret;
+}
+
+/**
+ * Publish count objects, previously claimed with megaqueue_claim_n, in a single
+ * update of the head.
+ *
+ * \note count must not exceed the number of slots returned by the claim. For a
+ *       multi-producer queue, count must be exactly the number of slots claimed,
+ *       since other producers might have claimed the slots after them.
+ */
+static inline
+aresult_t megaqueue_publish_n(struct megaqueue *queue, size_t count)
+{
+    uint64_t offset = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+
+    if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER)) {
+        TSL_ASSERT_ARG_DEBUG(count == queue->mp_claimed);
+        __megaqueue_mp_commit(queue);
+        return A_OK;
+    }
+
+    offset = __megaqueue_head(queue);
+
+    TSL_ASSERT_ARG_DEBUG(offset + count - ck_pr_load_64(&queue->hdr->_delete) <= queue->object_count);
+
+    __megaqueue_set_head(queue, offset + count);
+
+    return A_OK;
+}
+
+/**
+ * Get up to max objects that are ready to be read by this consumer, without
+ * consuming them.
+ *
+ * \param queue The queue to read from
+ * \param max The maximum number of objects the caller wants
+ * \param span The readable objects, returned by reference
+ * \param count The number of objects available (up to max), returned by reference
+ *
+ * \return A_OK on success, A_E_EMPTY if there is nothing to read, A_E_OVERRUN if
+ *         this broadcast consumer was lapped, or fell behind the retention of a
+ *         journal (just call again).
+ */
+static inline
+aresult_t megaqueue_peek_n(struct megaqueue *queue, size_t max, struct megaqueue_span *span, size_t *count)
+{
+    aresult_t ret = A_OK;
+    uint64_t tail_offset = 0;
+    uint64_t readable = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != span);
+    TSL_ASSERT_ARG_DEBUG(NULL != count);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
+    TSL_ASSERT_ARG_DEBUG(0 != max);
+
+    *count = 0;
+
+    if (CAL_UNLIKELY(queue->flags & (MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_SNOOP | MEGAQUEUE_FLAG_JOURNAL))) {
+        if (AFAILED(ret = __megaqueue_check_lapped(queue))) {
+            goto done;
+        }
+    }
+
+    tail_offset = ck_pr_load_64(queue->cursor);
+    readable = __megaqueue_readable(queue, tail_offset);
+
+    if (0 == readable) {
         ret = A_E_EMPTY;
+        goto done;
+    }
+
+    *count = BL_MIN2(max, readable);
+    __megaqueue_span_fill(queue, queue->read_start, tail_offset, *count, span);
+    __megaqueue_prefetch(queue, tail_offset + *count - 1);
+
+done:
+    return ret;
+}
+
+/**
+ * Consume count objects, previously returned by megaqueue_peek_n, in a single update
+ * of the cursor. Like megaqueue_read_advance, this also moves the deletion pointer
+ * for single-consumer queues.
+ *
+ * \return A_OK on success, A_E_OVERRUN if this broadcast consumer was lapped while
+ *         reading, in which case the objects might have been overwritten.
+ */
+static inline
+aresult_t megaqueue_consume_n(struct megaqueue *queue, size_t count)
+{
+    uint64_t offset = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
+
+    offset = ck_pr_load_64(queue->cursor);
+
+    TSL_ASSERT_ARG_DEBUG(offset + count <= ck_pr_load_64(&queue->hdr->head));
+
+    if (queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_SNOOP)) {
+        return __megaqueue_consumer_advance(queue, count);
+    }
+
+    ck_pr_store_64(&queue->hdr->tail, offset + count);
+    ck_pr_store_64(&queue->hdr->_delete, offset + count);
+
+    return A_OK;
+}
+
+/**
+ * Get the number of alignment units taken by a record with the given payload length.
+ */
+static inline
+uint64_t __megaqueue_record_units(struct megaqueue *queue, size_t length)
+{
+    return (length + sizeof(struct megaqueue_record) + queue->object_size - 1) >> queue->object_shift;
+}
+
+/**
+ * Write a padding record of the given number of units at the given position.
+ */
+static inline
+void __megaqueue_write_pad(struct megaqueue *queue, uint64_t pos, uint64_t units)
+{
+    struct megaqueue_record *rec = __megaqueue_slot(queue, pos);
+
+    rec->length = (units << queue->object_shift) - sizeof(struct megaqueue_record);
+    rec->flags = MEGAQUEUE_RECORD_PAD;
+}
+
+/**
+ * Reserve space for a record of up to length bytes in a variable-length Megaqueue.
+ * The record is filled in place, and made visible to consumers with
+ * megaqueue_commit.
+ *
+ * \param queue The queue to reserve space in
+ * \param length The maximum length of the record payload, in bytes
+ * \param buf The payload buffer, returned by reference
+ *
+ * \return A_OK on success, A_E_NOSPC if the queue is too full, A_E_BADARGS if the
+ *         record takes more than half of the ring.
+ */
+static inline
+aresult_t megaqueue_reserve(struct megaqueue *queue, size_t length, void **buf)
+{
+    aresult_t ret = A_OK;
+    uint64_t head_offset = 0;
+    uint64_t units = 0;
+    uint64_t to_end = 0;
+    uint64_t pad = 0;
+    struct megaqueue_record *rec = NULL;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != buf);
+    TSL_ASSERT_ARG_DEBUG(queue->flags & MEGAQUEUE_FLAG_VARLEN);
+
+    *buf = NULL;
+
+    head_offset = __megaqueue_head(queue);
+    units = __megaqueue_record_units(queue, length);
+
+    /* A record of at most half the ring always fits once the queue drains */
+    if (CAL_UNLIKELY(units > queue->object_count / 2)) {
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    /* Make sure the journal producer has a segment mapped before looking at it */
+    if (CAL_UNLIKELY((queue->flags & MEGAQUEUE_FLAG_JOURNAL) && 0 == __megaqueue_free_slots(queue, head_offset))) {
+        if (AFAILED(ret = __megaqueue_make_room(queue))) {
+            goto done;
+        }
+    }
+
+    /* Records do not wrap, so pad out the end of the ring if need be */
+    to_end = queue->object_count - __megaqueue_index(queue, head_offset);
+    if (CAL_UNLIKELY(units > to_end)) {
+        pad = to_end;
+
+        if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+            /* Journal segments are not contiguous, so close this one out right away */
+            __megaqueue_write_pad(queue, head_offset, pad);
+            ck_pr_fence_store();
+            head_offset += pad;
+            __megaqueue_set_head(queue, head_offset);
+            pad = 0;
+        }
+    }
+
+    if (CAL_UNLIKELY(__megaqueue_free_slots(queue, head_offset) < pad + units)) {
+        if (!(queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_JOURNAL))) {
+            ret = A_E_NOSPC;
+            goto done;
+        }
+
+        __megaqueue_make_room(queue);
+
+        if (__megaqueue_free_slots(queue, head_offset) < pad + units) {
+            ret = A_E_NOSPC;
+            goto done;
+        }
+    }
+
+    if (0 != pad) {
+        __megaqueue_write_pad(queue, head_offset, pad);
+    }
+
+    rec = __megaqueue_slot(queue, head_offset + pad);
+    *buf = rec + 1;
+
+    queue->resv_pad = pad;
+    queue->resv_units = units;
+
+done:
+    return ret;
+}
+
+/**
+ * Commit the record reserved with megaqueue_reserve, making it visible to consumers.
+ *
+ * \param queue The queue the record was reserved in
+ * \param length The actual length of the payload, at most the reserved length
+ */
+static inline
+aresult_t megaqueue_commit(struct megaqueue *queue, size_t length)
+{
+    uint64_t offset = 0;
+    uint64_t units = 0;
+    struct megaqueue_record *rec = NULL;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(0 != queue->resv_units);
+
+    units = __megaqueue_record_units(queue, length);
+
+    TSL_ASSERT_ARG_DEBUG(units <= queue->resv_units);
+
+    offset = __megaqueue_head(queue) + queue->resv_pad;
+
+    rec = __megaqueue_slot(queue, offset);
+    rec->length = length;
+    rec->flags = 0;
+
+    /* The record must be visible before the head moves past it */
+    ck_pr_fence_store();
+
+    __megaqueue_set_head(queue, offset + units);
+
+    queue->resv_pad = 0;
+    queue->resv_units = 0;
+
+    return A_OK;
+}
+
+/**
+ * Get the next record to be read by this consumer from a variable-length Megaqueue.
+ * Padding records are skipped.
+ *
+ * \param queue The queue to read from
+ * \param buf The record payload, returned by reference
+ * \param length The length of the record payload, returned by reference
+ *
+ * \return A_OK on success, A_E_EMPTY if there is nothing to read, A_E_OVERRUN if
+ *         this consumer fell behind the retention of a journal (just call again).
+ */
+static inline
+aresult_t megaqueue_read_record(struct megaqueue *queue, void **buf, size_t *length)
+{
+    aresult_t ret = A_OK;
+    uint64_t tail_offset = 0;
+    struct megaqueue_record *rec = NULL;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != buf);
+    TSL_ASSERT_ARG_DEBUG(NULL != length);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
+    TSL_ASSERT_ARG_DEBUG(queue->flags & MEGAQUEUE_FLAG_VARLEN);
+
+    *buf = NULL;
+    *length = 0;
+
+    do {
+        if (CAL_UNLIKELY(queue->flags & MEGAQUEUE_FLAG_JOURNAL) && AFAILED(ret = __megaqueue_check_lapped(queue))) {
+            goto done;
+        }
+
+        tail_offset = ck_pr_load_64(queue->cursor);
+
+        if (0 == __megaqueue_readable(queue, tail_offset)) {
+            ret = A_E_EMPTY;
+            goto done;
+        }
+
+        /* Do not read the record before seeing the head move past it */
+        ck_pr_fence_load();
+
+        rec = __megaqueue_read_slot(queue, tail_offset);
+
+        if (CAL_LIKELY(!(rec->flags & MEGAQUEUE_RECORD_PAD))) {
+            break;
+        }
+
+        megaqueue_consume_n(queue, __megaqueue_record_units(queue, rec->length));
+    } while (1);
+
+    *buf = rec + 1;
+    *length = rec->length;
+
+    __megaqueue_prefetch(queue, tail_offset);
+
+done:
+    return ret;
+}
+
+/**
+ * Release the record returned by megaqueue_read_record, moving this consumer on to
+ * the next record.
+ */
+static inline
+aresult_t megaqueue_release_record(struct megaqueue *queue)
+{
+    struct megaqueue_record *rec = NULL;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->cursor);
+    TSL_ASSERT_ARG_DEBUG(NULL == queue->group);
+
+    rec = __megaqueue_read_slot(queue, ck_pr_load_64(queue->cursor));
+
+    return megaqueue_consume_n(queue, __megaqueue_record_units(queue, rec->length));
+}
+
+/**
+ * Get the sequence number of the next object this consumer will read. A consumer
+ * can detect gaps by comparing this to the sequence it expects, and can resume at
+ * it later with megaqueue_seek.
+ */
+static inline
+uint64_t megaqueue_read_sequence(struct megaqueue *queue)
+{
+    return ck_pr_load_64(queue->cursor);
+}
+
+/**
+ * Get the sequence number the next object the producer writes will get.
+ */
+static inline
+uint64_t megaqueue_write_sequence(struct megaqueue *queue)
+{
+    return ck_pr_load_64(&queue->hdr->head);
+}
+
+/**
+ * Get the sequence number of the oldest object that can still be read.
+ */
+static inline
+uint64_t megaqueue_oldest_sequence(struct megaqueue *queue)
+{
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        return ck_pr_load_64(&queue->hdr->journal_first) * queue->object_count;
     }
 
+    return ck_pr_load_64(&queue->hdr->_delete);
+}
+
+/**
+ * Claim a batch of up to max objects for this member of a consumer group. No other
+ * member gets these objects. The batch holds the producer back until it is released
+ * with megaqueue_group_ack, so it can be read in place.
+ *
+ * The member publishes where its batch starts before moving the group cursor past
+ * it, so the producer always sees the batch held by one of the two.
+ *
+ * \param queue The queue, joined to a group with megaqueue_group_join
+ * \param max The maximum number of objects the caller wants
+ * \param span The claimed objects, returned by reference
+ * \param count The number of objects claimed (up to max), returned by reference
+ *
+ * \return A_OK on success, A_E_EMPTY if there is nothing left to claim, A_E_BUSY if
+ *         the previous batch was not acknowledged, A_E_OVERRUN if the group was
+ *         lapped (just call again), A_E_NOTFOUND if the group was destroyed.
+ */
+static inline
+aresult_t megaqueue_group_claim(struct megaqueue *queue, size_t max, struct megaqueue_span *span, size_t *count)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_consumer *group = NULL;
+    uint64_t start = 0;
+    uint64_t delete_offset = 0;
+    uint64_t nr = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != span);
+    TSL_ASSERT_ARG_DEBUG(NULL != count);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->group);
+    TSL_ASSERT_ARG_DEBUG(0 != max);
+
+    *count = 0;
+    group = queue->group;
+
+    if (CAL_UNLIKELY(0 != queue->group_claimed)) {
+        ret = A_E_BUSY;
+        goto done;
+    }
+
+    for (;;) {
+        if (CAL_UNLIKELY(MEGAQUEUE_CONSUMER_LIVE != ck_pr_load_32(&group->state))) {
+            ret = A_E_NOTFOUND;
+            goto fail;
+        }
+
+        start = ck_pr_load_64(&group->cursor);
+
+        if (queue->flags & MEGAQUEUE_FLAG_LAP) {
+            delete_offset = ck_pr_load_64(&queue->hdr->_delete);
+
+            if (CAL_UNLIKELY(start < delete_offset)) {
+                /* Only the member that moves the group forward accounts for the loss */
+                if (ck_pr_cas_64(&group->cursor, start, delete_offset)) {
+                    queue->missed += delete_offset - start;
+                    ret = A_E_OVERRUN;
+                    goto fail;
+                }
+                continue;
+            }
+        }
+
+        if (0 == (nr = __megaqueue_readable(queue, start))) {
+            ret = A_E_EMPTY;
+            goto fail;
+        }
+
+        nr = BL_MIN2(max, nr);
+
+        ck_pr_store_64(&queue->consumer->cursor, start);
+        ck_pr_fence_memory();
+
+        if (ck_pr_cas_64(&group->cursor, start, start + nr)) {
+            break;
+        }
+    }
+
+    queue->group_claimed = nr;
+    *count = nr;
+    __megaqueue_span_fill(queue, queue->read_start, start, nr, span);
+    __megaqueue_prefetch(queue, start + nr - 1);
+
+done:
+    return ret;
+
+fail:
+    ck_pr_store_64(&queue->consumer->cursor, MEGAQUEUE_MEMBER_IDLE);
+    return ret;
+}
+
+/**
+ * Release the batch claimed with megaqueue_group_claim, once it has been processed.
+ *
+ * \return A_OK on success, A_E_EMPTY if no batch is held, A_E_OVERRUN if the
+ *         producer lapped the batch while it was read, in which case the objects
+ *         might have been overwritten.
+ */
+static inline
+aresult_t megaqueue_group_ack(struct megaqueue *queue)
+{
+    aresult_t ret = A_OK;
+    uint64_t start = 0;
+    uint64_t delete_offset = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != queue);
+    TSL_ASSERT_ARG_DEBUG(NULL != queue->group);
+
+    if (CAL_UNLIKELY(0 == queue->group_claimed)) {
+        return A_E_EMPTY;
+    }
+
+    start = ck_pr_load_64(&queue->consumer->cursor);
+
+    if (queue->flags & MEGAQUEUE_FLAG_LAP) {
+        delete_offset = ck_pr_load_64(&queue->hdr->_delete);
+
+        if (CAL_UNLIKELY(delete_offset > start)) {
+            queue->missed += BL_MIN2(delete_offset - start, queue->group_claimed);
+            ret = A_E_OVERRUN;
+        }
+    }
+
+    /* All reads of the batch must be done before the producer may reuse it */
+    ck_pr_fence_memory();
+    ck_pr_store_64(&queue->consumer->cursor, MEGAQUEUE_MEMBER_IDLE);
+    queue->group_claimed = 0;
+
     return ret;
 }
 
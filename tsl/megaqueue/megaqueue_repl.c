@@ -0,0 +1,401 @@
+#include <tsl/megaqueue/megaqueue_repl.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+/**
+ * Send or receive the whole of an I/O vector, however many system calls it takes.
+ * The vector is updated as it goes.
+ */
+static
+aresult_t __megaqueue_repl_io(int fd, struct iovec *iov, int nr_iov, bool out)
+{
+    while (0 < nr_iov) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = nr_iov };
+        ssize_t len = 0;
+
+        /* Don't die of SIGPIPE when the other end goes away */
+        len = true == out ? sendmsg(fd, &msg, MSG_NOSIGNAL) : recvmsg(fd, &msg, MSG_WAITALL);
+
+        if (0 > len) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            if (EPIPE == errno || ECONNRESET == errno) {
+                return A_E_DONE;
+            }
+
+            PDIAG("Failed to %s replication stream", true == out ? "write to" : "read from");
+            return A_E_NO_SOCKET;
+        }
+
+        if (0 == len && false == out) {
+            return A_E_DONE;
+        }
+
+        while (0 < nr_iov && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            nr_iov--;
+        }
+
+        if (0 < nr_iov) {
+            iov->iov_base += len;
+            iov->iov_len -= len;
+        }
+    }
+
+    return A_OK;
+}
+
+/**
+ * Check if the other end closed the connection, even if some of what it sent is
+ * still waiting to be read.
+ */
+static
+bool __megaqueue_repl_hung_up(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+
+    return 0 < poll(&pfd, 1, 0) && 0 != (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+static
+aresult_t __megaqueue_repl_hello_send(int fd, struct megaqueue *queue, uint64_t seq)
+{
+    struct megaqueue_repl_hello hello = {
+        .magic = MEGAQUEUE_REPL_MAGIC,
+        .version = MEGAQUEUE_REPL_VERSION,
+        .flags = queue->flags & ~MEGAQUEUE_HANDLE_FLAGS,
+        .object_size = queue->object_size,
+        .object_count = queue->object_count,
+        .seq = seq,
+    };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+
+    return __megaqueue_repl_io(fd, &iov, 1, true);
+}
+
+static
+aresult_t __megaqueue_repl_hello_check(const struct megaqueue_repl_hello *hello, struct megaqueue *queue)
+{
+    if (hello->object_size != queue->object_size || hello->object_count != queue->object_count ||
+            (hello->flags & MEGAQUEUE_FLAG_VARLEN) != (queue->flags & MEGAQUEUE_FLAG_VARLEN))
+    {
+        DIAG("Replica holds %" PRIu64 " objects of %" PRIu64 " bytes (flags 0x%x), queue holds %u of %u (flags 0x%x)",
+             hello->object_count, hello->object_size, hello->flags, queue->object_count, queue->object_size,
+             queue->flags);
+        return A_E_BADARGS;
+    }
+
+    return A_OK;
+}
+
+/**
+ * Get the number of objects making up whole records, from the start of the span and
+ * up to max if possible. A record bigger than max is sent on its own.
+ */
+static
+size_t __megaqueue_repl_whole_records(struct megaqueue *queue, uint64_t start, size_t count, size_t max)
+{
+    uint64_t pos = start;
+
+    while (pos - start < count) {
+        struct megaqueue_record *rec = __megaqueue_read_slot(queue, pos);
+        uint64_t units = __megaqueue_record_units(queue, rec->length);
+
+        if (pos + units - start > max && pos != start) {
+            break;
+        }
+
+        pos += units;
+    }
+
+    return pos - start;
+}
+
+aresult_t megaqueue_repl_sender_init(struct megaqueue_repl *repl, struct megaqueue *queue, int fd,
+                                     uint64_t start, size_t max_batch)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_repl_hello hello;
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    uint64_t from = 0;
+    uint64_t head_offset = 0;
+
+    TSL_ASSERT_ARG(NULL != repl);
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->cursor);
+    TSL_ASSERT_ARG(0 <= fd);
+
+    memset(repl, 0, sizeof(*repl));
+    repl->queue = queue;
+    repl->fd = fd;
+    repl->max_batch = BL_MIN2(0 == max_batch ? MEGAQUEUE_REPL_DEFAULT_BATCH : max_batch,
+                              (size_t)queue->object_count);
+
+    /* Objects could be overwritten while they are sent, and the receiver can't tell */
+    if (queue->flags & MEGAQUEUE_FLAG_LAP) {
+        DIAG("Can't replicate a megaqueue whose producer laps its consumers");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_repl_hello_send(fd, queue, megaqueue_oldest_sequence(queue)))) {
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_repl_io(fd, &iov, 1, false))) {
+        goto done;
+    }
+
+    if (MEGAQUEUE_REPL_MAGIC != hello.magic || MEGAQUEUE_REPL_VERSION != hello.version) {
+        DIAG("Receiver does not speak version %u of the replication protocol", MEGAQUEUE_REPL_VERSION);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_repl_hello_check(&hello, queue))) {
+        goto done;
+    }
+
+    /* Never send the receiver what it already has */
+    from = hello.seq;
+    if (MEGAQUEUE_REPL_RESUME != start) {
+        from = BL_MAX2(start, from);
+    }
+
+    head_offset = megaqueue_write_sequence(queue);
+
+    if (from > head_offset) {
+        DIAG("Replica is at %" PRIu64 ", ahead of the queue at %" PRIu64, from, head_offset);
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* If the queue no longer has it, start from the oldest object, the receiver skips the gap */
+    if (A_E_OVERRUN == (ret = megaqueue_seek(queue, from))) {
+        ret = A_OK;
+    }
+
+    DIAG("Replicating from sequence %" PRIu64 ", replica needs %" PRIu64, megaqueue_read_sequence(queue), hello.seq);
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_repl_send(struct megaqueue_repl *repl)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue *queue = NULL;
+    struct megaqueue_span span;
+    struct megaqueue_repl_batch batch;
+    struct iovec iov[3];
+    size_t count = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != repl);
+
+    queue = repl->queue;
+
+    do {
+        /* Look at everything in a variable-length queue, so a batch can end on a record boundary */
+        ret = megaqueue_peek_n(queue, (queue->flags & MEGAQUEUE_FLAG_VARLEN) ? queue->object_count : repl->max_batch,
+                               &span, &count);
+    } while (A_E_OVERRUN == ret);
+
+    if (AFAILED(ret)) {
+        goto done;
+    }
+
+    batch.seq = megaqueue_read_sequence(queue);
+
+    if (queue->flags & MEGAQUEUE_FLAG_VARLEN) {
+        /* Records never wrap, so trimming the span never splits one */
+        count = __megaqueue_repl_whole_records(queue, batch.seq, count, repl->max_batch);
+
+        if (count <= span.first_count) {
+            span.first_count = count;
+            span.second_count = 0;
+        } else {
+            span.second_count = count - span.first_count;
+        }
+    }
+
+    batch.count = count;
+
+    iov[0].iov_base = &batch;
+    iov[0].iov_len = sizeof(batch);
+    iov[1].iov_base = span.first;
+    iov[1].iov_len = span.first_count * queue->object_size;
+    iov[2].iov_base = span.second;
+    iov[2].iov_len = span.second_count * queue->object_size;
+
+    if (AFAILED(ret = __megaqueue_repl_io(repl->fd, iov, 0 != span.second_count ? 3 : 2, true))) {
+        goto done;
+    }
+
+    repl->batches++;
+    repl->objects += count;
+
+    ret = megaqueue_consume_n(queue, count);
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_repl_receiver_hello(int fd, struct megaqueue_repl_hello *hello)
+{
+    aresult_t ret = A_OK;
+    struct iovec iov = { .iov_base = hello, .iov_len = sizeof(*hello) };
+
+    TSL_ASSERT_ARG(0 <= fd);
+    TSL_ASSERT_ARG(NULL != hello);
+
+    if (AFAILED(ret = __megaqueue_repl_io(fd, &iov, 1, false))) {
+        goto done;
+    }
+
+    if (MEGAQUEUE_REPL_MAGIC != hello->magic || MEGAQUEUE_REPL_VERSION != hello->version) {
+        DIAG("Sender does not speak version %u of the replication protocol", MEGAQUEUE_REPL_VERSION);
+        ret = A_E_INVAL;
+    }
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_repl_receiver_init(struct megaqueue_repl *repl, struct megaqueue *queue, int fd,
+                                       const struct megaqueue_repl_hello *hello)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != repl);
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != hello);
+    TSL_ASSERT_ARG(0 <= fd);
+
+    memset(repl, 0, sizeof(*repl));
+    repl->queue = queue;
+    repl->fd = fd;
+    repl->max_batch = queue->object_count;
+
+    if (queue->flags & (MEGAQUEUE_FLAG_MULTI_PRODUCER | MEGAQUEUE_FLAG_SNOOP)) {
+        DIAG("The receiver must be the only producer of the replica");
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    if (AFAILED(ret = __megaqueue_repl_hello_check(hello, queue))) {
+        goto done;
+    }
+
+    /* Batches from a ring could straddle the segments of a journal */
+    if ((queue->flags & MEGAQUEUE_FLAG_JOURNAL) && !(hello->flags & MEGAQUEUE_FLAG_JOURNAL)) {
+        DIAG("Only a journal can be replicated to a journal");
+        ret = A_E_BADARGS;
+        goto done;
+    }
+
+    ret = __megaqueue_repl_hello_send(fd, queue, megaqueue_write_sequence(queue));
+
+done:
+    return ret;
+}
+
+aresult_t megaqueue_repl_receive(struct megaqueue_repl *repl)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue *queue = NULL;
+    struct megaqueue_span span;
+    struct megaqueue_repl_batch batch;
+    struct iovec iov[2];
+    uint64_t next = 0;
+    size_t count = 0;
+    unsigned int tries = 0;
+
+    TSL_ASSERT_ARG_DEBUG(NULL != repl);
+
+    queue = repl->queue;
+
+    /* A batch that found no room last time is still waiting in the socket */
+    if (0 != repl->pending.count) {
+        batch = repl->pending;
+    } else {
+        iov[0].iov_base = &batch;
+        iov[0].iov_len = sizeof(batch);
+
+        if (AFAILED(ret = __megaqueue_repl_io(repl->fd, iov, 1, false))) {
+            goto done;
+        }
+
+        next = megaqueue_write_sequence(queue);
+
+        if (batch.seq < next || 0 == batch.count || batch.count > repl->max_batch) {
+            DIAG("Bad batch of %" PRIu64 " objects at %" PRIu64 ", replica is at %" PRIu64, batch.count, batch.seq, next);
+            ret = A_E_INVAL;
+            goto done;
+        }
+
+        if (batch.seq > next) {
+            if (AFAILED(ret = megaqueue_reset_sequence(queue, batch.seq))) {
+                DIAG("Can't skip the gap of %" PRIu64 " objects in the replica", batch.seq - next);
+                goto done;
+            }
+
+            repl->missed += batch.seq - next;
+        }
+    }
+
+    /* A batch is published whole, so readers never see part of a record */
+    while (A_OK != megaqueue_claim_n(queue, batch.count, &span, &count) || count != batch.count) {
+        if (MEGAQUEUE_REPL_ROOM_TRIES == ++tries) {
+            if (__megaqueue_repl_hung_up(repl->fd)) {
+                repl->pending.count = 0;
+                ret = A_E_DONE;
+                goto done;
+            }
+
+            /* Let the caller decide how long to wait for the replica to be drained */
+            repl->pending = batch;
+            ret = A_E_NOSPC;
+            goto done;
+        }
+
+        /* Claims only make room once the ring is completely full */
+        if (queue->flags & MEGAQUEUE_FLAG_BROADCAST) {
+            __megaqueue_make_room(queue);
+        }
+
+        ck_pr_stall();
+    }
+
+    repl->pending.count = 0;
+
+    iov[0].iov_base = span.first;
+    iov[0].iov_len = span.first_count * queue->object_size;
+    iov[1].iov_base = span.second;
+    iov[1].iov_len = span.second_count * queue->object_size;
+
+    if (AFAILED(ret = __megaqueue_repl_io(repl->fd, iov, 0 != span.second_count ? 2 : 1, false))) {
+        goto done;
+    }
+
+    megaqueue_publish_n(queue, count);
+
+    repl->batches++;
+    repl->objects += count;
+
+done:
+    return ret;
+}
+
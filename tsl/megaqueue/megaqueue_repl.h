@@ -0,0 +1,178 @@
+#ifndef __INCLUDED_MEGAQUEUE_MEGAQUEUE_REPL_H__
+#define __INCLUDED_MEGAQUEUE_MEGAQUEUE_REPL_H__
+
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Magic number at the start of every replication hello ("MQREPL", little-endian)
+ */
+#define MEGAQUEUE_REPL_MAGIC            0x00004c504552514dull
+
+/**
+ * Version of the replication protocol
+ */
+#define MEGAQUEUE_REPL_VERSION          1
+
+/**
+ * Pass as the start of megaqueue_repl_sender_init to carry on from wherever the
+ * replica is
+ */
+#define MEGAQUEUE_REPL_RESUME           UINT64_MAX
+
+/**
+ * Largest batch sent by default, in objects
+ */
+#define MEGAQUEUE_REPL_DEFAULT_BATCH    1024
+
+/**
+ * Number of tries to find room in the replica for a batch, before
+ * megaqueue_repl_receive gives up with A_E_NOSPC
+ */
+#define MEGAQUEUE_REPL_ROOM_TRIES       (1u << 16)
+
+/**
+ * The first message each side sends: the shape of its queue, and a sequence number.
+ * The sender says which is the oldest object it can send, the receiver which is the
+ * next object it needs.
+ */
+struct megaqueue_repl_hello {
+    /** Always MEGAQUEUE_REPL_MAGIC */
+    uint64_t magic;
+    /** Version of the protocol (MEGAQUEUE_REPL_VERSION) */
+    uint32_t version;
+    /** Creation flags of the queue */
+    uint32_t flags;
+    /** Size of an object (of an alignment unit, for a variable-length queue) */
+    uint64_t object_size;
+    /** Number of objects in the ring */
+    uint64_t object_count;
+    /** Oldest sequence the sender has, or next sequence the receiver needs */
+    uint64_t seq;
+};
+
+/**
+ * Header of a batch of objects sent to the receiver, followed by count objects
+ * exactly as they are laid out in the ring.
+ */
+struct megaqueue_repl_batch {
+    /** Sequence number of the first object */
+    uint64_t seq;
+    /** Number of objects (alignment units, for a variable-length queue) */
+    uint64_t count;
+};
+
+/**
+ * One end of the replication of a Megaqueue over a stream socket (typically TCP),
+ * to keep a copy of the queue on another host, with the same sequence numbers.
+ *
+ * The sender reads the queue with a consumer handle, and sends whatever is readable
+ * in batches, each with a single writev straight out of the ring. The receiver is
+ * the only producer of an identically shaped queue, and reads each batch straight
+ * into the ring with a single readv before publishing it. Objects keep their
+ * position in the ring, so a variable-length queue is copied record headers,
+ * padding and all, and batches only ever end on a record boundary.
+ *
+ * When the sender no longer has the objects the receiver needs next, the receiver
+ * moves its sequence forward with megaqueue_reset_sequence, which needs the replica
+ * to be drained, and counts the gap in missed.
+ *
+ * The replica must be drained too: a plain queue needs a consumer, and the
+ * consumers of a broadcast queue must keep up. Otherwise the receiver runs out of
+ * room, stops reading the socket, and the sender, which holds the producer of the
+ * queue back, ends up holding it back too.
+ *
+ * Objects are sent straight out of the ring, so they must not be overwritten while
+ * they are sent: the receiver publishes whatever it got as valid objects, and a torn
+ * record header corrupts a variable-length replica. Queues whose producer laps its
+ * consumers are refused. A read-only sender does not hold the producer back either,
+ * so it can ship corrupt objects if it falls a whole ring behind. Attach the sender
+ * as a named consumer of a broadcast queue to make sure that never happens.
+ */
+struct megaqueue_repl {
+    /** The queue: a consumer handle for the sender, the producer for the receiver */
+    struct megaqueue *queue;
+    /** The connected socket, owned by the caller */
+    int fd;
+    /** Largest batch to send, in objects */
+    size_t max_batch;
+    /** Number of batches sent or received */
+    uint64_t batches;
+    /** Number of objects sent or received */
+    uint64_t objects;
+    /** Number of objects skipped over, because the sender no longer had them */
+    uint64_t missed;
+    /** Receiver: header of a batch that is waiting for room in the replica */
+    struct megaqueue_repl_batch pending;
+};
+
+/**
+ * Set up the sending end of a replication, and exchange hellos with the receiver.
+ * Blocks until the receiver answered.
+ *
+ * \param repl The replication to initialize
+ * \param queue The queue to replicate, a consumer handle owned by the caller
+ * \param fd The connected socket
+ * \param start Sequence to send from, if the receiver does not already have it, or
+ *        MEGAQUEUE_REPL_RESUME to start wherever the receiver is
+ * \param max_batch Largest batch to send, in objects. 0 for the default.
+ *
+ * \return A_OK on success, A_E_BADARGS if the replica is not shaped like the queue,
+ *         A_E_INVAL if the queue laps its consumers, if the receiver is ahead of the
+ *         queue or does not speak the protocol, A_E_DONE if it hung up, A_E_NO_SOCKET
+ *         on a socket error.
+ */
+aresult_t megaqueue_repl_sender_init(struct megaqueue_repl *repl, struct megaqueue *queue, int fd,
+                                     uint64_t start, size_t max_batch);
+
+/**
+ * Send one batch of whatever is readable, and consume it.
+ *
+ * \return A_OK on success, A_E_EMPTY if there is nothing to send, A_E_OVERRUN if
+ *         a read-only sender was overrun while sending: some of the objects sent
+ *         might have been overwritten, and the replica can't be trusted. A_E_DONE
+ *         if the receiver hung up, A_E_NO_SOCKET on a socket error.
+ */
+aresult_t megaqueue_repl_send(struct megaqueue_repl *repl);
+
+/**
+ * Read the hello of the sender, so the receiver can create a replica shaped like
+ * the queue if need be.
+ *
+ * \return A_OK on success, A_E_INVAL if the sender does not speak the protocol,
+ *         A_E_DONE if it hung up, A_E_NO_SOCKET on a socket error.
+ */
+aresult_t megaqueue_repl_receiver_hello(int fd, struct megaqueue_repl_hello *hello);
+
+/**
+ * Set up the receiving end of a replication, and answer the hello of the sender
+ * with the next sequence the replica needs.
+ *
+ * \param repl The replication to initialize
+ * \param queue The replica, opened for writing. Must not have multiple producers.
+ * \param fd The connected socket
+ * \param hello The hello of the sender, from megaqueue_repl_receiver_hello
+ *
+ * \return A_OK on success, A_E_BADARGS if the replica is not shaped like the queue,
+ *         A_E_NO_SOCKET on a socket error.
+ */
+aresult_t megaqueue_repl_receiver_init(struct megaqueue_repl *repl, struct megaqueue *queue, int fd,
+                                       const struct megaqueue_repl_hello *hello);
+
+/**
+ * Receive one batch, and publish it to the replica. Waits a little for room in the
+ * replica; if there still isn't any, the batch is left in the socket and picked up
+ * by the next call.
+ *
+ * \return A_OK on success, A_E_NOSPC if the replica has no room for the batch (call
+ *         again once it was drained), A_E_DONE if the sender hung up, A_E_INVAL if
+ *         the batch goes back in time or does not fit, A_E_NO_SOCKET on a socket
+ *         error, or the error of megaqueue_reset_sequence if there is a gap it can't
+ *         skip.
+ */
+aresult_t megaqueue_repl_receive(struct megaqueue_repl *repl);
+
+#endif /* __INCLUDED_MEGAQUEUE_MEGAQUEUE_REPL_H__ */
+
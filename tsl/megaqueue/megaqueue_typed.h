@@ -0,0 +1,262 @@
+#ifndef __INCLUDED_MEGAQUEUE_MEGAQUEUE_TYPED_H__
+#define __INCLUDED_MEGAQUEUE_MEGAQUEUE_TYPED_H__
+
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <tsl/errors.h>
+#include <tsl/diag.h>
+#include <tsl/assert.h>
+#include <tsl/basic.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Define a typed front end for a fixed-size Megaqueue of objects of the given type.
+ *
+ * The generic interfaces work out the address of a slot from the object size and
+ * count stored in the handle, and hand back void pointers. Here both are compile
+ * time constants: the slot of a position is just an index into an array of type,
+ * so the compiler turns it into shifts and masks (when count is a power of two),
+ * and copies of whole objects into moves of a known size.
+ *
+ * For MEGAQUEUE_DEFINE(md_tick, struct tick, 1 << 20) the following are defined,
+ * all operating on a struct megaqueue handle:
+ *  - struct md_tick_span, a megaqueue_span of struct tick
+ *  - md_tick_open, opening the queue, checking its layout matches the type
+ *  - md_tick_next_slot/md_tick_advance, to produce one object in place
+ *  - md_tick_read_next_slot/md_tick_read_advance, to consume one object in place
+ *  - md_tick_claim_n/md_tick_publish_n and md_tick_peek_n/md_tick_consume_n, to
+ *    produce and consume in batches
+ *  - md_tick_push/md_tick_pop, to copy an object in or out of the queue
+ *
+ * Only single-producer, fixed-size queues can be typed. Everything else about the
+ * queue (broadcast, lapping, journals, huge pages) works as with the generic
+ * interfaces, which can still be used on the same handle.
+ *
+ * \param name Prefix of the generated types and functions
+ * \param type Type of the objects in the queue
+ * \param count Number of objects in the queue (in a journal segment, for a journal)
+ */
+#define MEGAQUEUE_DEFINE(name, type, count) \
+    typedef char name##_count_must_not_be_zero[0 != (count) ? 1 : -1]; \
+    \
+    struct name##_span { \
+        type *first; \
+        size_t first_count; \
+        type *second; \
+        size_t second_count; \
+    }; \
+    \
+    /** Open the queue, and make sure its objects are laid out as an array of type */ \
+    static inline \
+    aresult_t name##_open(struct megaqueue *queue, int mode, const char *queue_name, \
+                          const struct megaqueue_params *params) \
+    { \
+        aresult_t ret = A_OK; \
+        \
+        if (NULL != params && (params->flags & (MEGAQUEUE_FLAG_VARLEN | MEGAQUEUE_FLAG_MULTI_PRODUCER))) { \
+            DIAG("Typed megaqueues can't be variable-length or have multiple producers."); \
+            return A_E_BADARGS; \
+        } \
+        \
+        if (AFAILED(ret = megaqueue_open_ex(queue, mode, queue_name, sizeof(type), (count), params))) { \
+            return ret; \
+        } \
+        \
+        if (queue->object_size != sizeof(type) || queue->object_count != (count) || \
+                (queue->flags & (MEGAQUEUE_FLAG_VARLEN | MEGAQUEUE_FLAG_MULTI_PRODUCER))) \
+        { \
+            DIAG("Megaqueue '%s' does not hold %zu objects of " #type " (holds %zu of %zu bytes).", \
+                 queue_name, (size_t)(count), (size_t)queue->object_count, (size_t)queue->object_size); \
+            megaqueue_close(queue, 0); \
+            return A_E_BADARGS; \
+        } \
+        \
+        return A_OK; \
+    } \
+    \
+    static inline \
+    type *name##_slot(type *base, uint64_t pos) \
+    { \
+        return base + (pos % (count)); \
+    } \
+    \
+    static inline \
+    void name##_span_fill(type *base, uint64_t pos, size_t nr, struct name##_span *span) \
+    { \
+        size_t to_end = (count) - (pos % (count)); \
+        \
+        span->first = name##_slot(base, pos); \
+        \
+        if (CAL_LIKELY(nr <= to_end)) { \
+            span->first_count = nr; \
+            span->second = NULL; \
+            span->second_count = 0; \
+        } else { \
+            span->first_count = to_end; \
+            span->second = base; \
+            span->second_count = nr - to_end; \
+        } \
+    } \
+    \
+    /** Get the next slot to produce into */ \
+    static inline \
+    aresult_t name##_next_slot(struct megaqueue *queue, type **slot) \
+    { \
+        uint64_t head_offset = __megaqueue_head(queue); \
+        \
+        if (CAL_UNLIKELY(!__megaqueue_has_room(queue))) { \
+            return A_E_NOSPC; \
+        } \
+        \
+        *slot = name##_slot(queue->writable_start, head_offset); \
+        \
+        return A_OK; \
+    } \
+    \
+    /** Publish the slot returned by name##_next_slot */ \
+    static inline \
+    aresult_t name##_advance(struct megaqueue *queue) \
+    { \
+        return megaqueue_advance(queue); \
+    } \
+    \
+    /** Get the next object to read. A_E_OVERRUN if the consumer was lapped or fell behind a journal. */ \
+    static inline \
+    aresult_t name##_read_next_slot(struct megaqueue *queue, type **slot) \
+    { \
+        aresult_t ret = A_OK; \
+        uint64_t tail_offset = 0; \
+        \
+        if (CAL_UNLIKELY(queue->flags & (MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_SNOOP | MEGAQUEUE_FLAG_JOURNAL))) { \
+            if (AFAILED(ret = __megaqueue_check_lapped(queue))) { \
+                return ret; \
+            } \
+        } \
+        \
+        tail_offset = ck_pr_load_64(queue->cursor); \
+        \
+        if (0 == __megaqueue_readable(queue, tail_offset)) { \
+            return A_E_EMPTY; \
+        } \
+        \
+        *slot = name##_slot(queue->read_start, tail_offset); \
+        __megaqueue_prefetch(queue, tail_offset); \
+        \
+        return A_OK; \
+    } \
+    \
+    /** Consume the object returned by name##_read_next_slot */ \
+    static inline \
+    aresult_t name##_read_advance(struct megaqueue *queue) \
+    { \
+        return megaqueue_read_advance(queue); \
+    } \
+    \
+    /** Claim up to max slots to produce into, see megaqueue_claim_n */ \
+    static inline \
+    aresult_t name##_claim_n(struct megaqueue *queue, size_t max, struct name##_span *span, size_t *nr) \
+    { \
+        uint64_t head_offset = __megaqueue_head(queue); \
+        uint64_t free_slots = __megaqueue_free_slots(queue, head_offset); \
+        \
+        *nr = 0; \
+        \
+        if (CAL_UNLIKELY(0 == free_slots)) { \
+            if (!(queue->flags & (MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_JOURNAL)) || \
+                    AFAILED(__megaqueue_make_room(queue))) \
+            { \
+                return A_E_NOSPC; \
+            } \
+            \
+            free_slots = __megaqueue_free_slots(queue, head_offset); \
+        } \
+        \
+        *nr = BL_MIN2(max, free_slots); \
+        name##_span_fill(queue->writable_start, head_offset, *nr, span); \
+        \
+        return A_OK; \
+    } \
+    \
+    /** Publish slots claimed by name##_claim_n */ \
+    static inline \
+    aresult_t name##_publish_n(struct megaqueue *queue, size_t nr) \
+    { \
+        return megaqueue_publish_n(queue, nr); \
+    } \
+    \
+    /** Look at up to max objects to read, see megaqueue_peek_n */ \
+    static inline \
+    aresult_t name##_peek_n(struct megaqueue *queue, size_t max, struct name##_span *span, size_t *nr) \
+    { \
+        aresult_t ret = A_OK; \
+        uint64_t tail_offset = 0; \
+        uint64_t readable = 0; \
+        \
+        *nr = 0; \
+        \
+        if (CAL_UNLIKELY(queue->flags & (MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_SNOOP | MEGAQUEUE_FLAG_JOURNAL))) { \
+            if (AFAILED(ret = __megaqueue_check_lapped(queue))) { \
+                return ret; \
+            } \
+        } \
+        \
+        tail_offset = ck_pr_load_64(queue->cursor); \
+        \
+        if (0 == (readable = __megaqueue_readable(queue, tail_offset))) { \
+            return A_E_EMPTY; \
+        } \
+        \
+        *nr = BL_MIN2(max, readable); \
+        name##_span_fill(queue->read_start, tail_offset, *nr, span); \
+        __megaqueue_prefetch(queue, tail_offset + *nr - 1); \
+        \
+        return A_OK; \
+    } \
+    \
+    /** Consume objects returned by name##_peek_n */ \
+    static inline \
+    aresult_t name##_consume_n(struct megaqueue *queue, size_t nr) \
+    { \
+        return megaqueue_consume_n(queue, nr); \
+    } \
+    \
+    /** Copy an object into the queue */ \
+    static inline \
+    aresult_t name##_push(struct megaqueue *queue, const type *obj) \
+    { \
+        aresult_t ret = A_OK; \
+        type *slot = NULL; \
+        \
+        if (AFAILED(ret = name##_next_slot(queue, &slot))) { \
+            return ret; \
+        } \
+        \
+        *slot = *obj; \
+        \
+        return megaqueue_advance(queue); \
+    } \
+    \
+    /** Copy the next object out of the queue. A_E_OVERRUN if it was overwritten meanwhile. */ \
+    static inline \
+    aresult_t name##_pop(struct megaqueue *queue, type *obj) \
+    { \
+        aresult_t ret = A_OK; \
+        type *slot = NULL; \
+        \
+        do { \
+            ret = name##_read_next_slot(queue, &slot); \
+        } while (A_E_OVERRUN == ret); \
+        \
+        if (AFAILED(ret)) { \
+            return ret; \
+        } \
+        \
+        *obj = *slot; \
+        \
+        return megaqueue_read_advance(queue); \
+    }
+
+#endif /* __INCLUDED_MEGAQUEUE_MEGAQUEUE_TYPED_H__ */
+
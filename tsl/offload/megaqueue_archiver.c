@@ -0,0 +1,558 @@
+#include <tsl/offload/megaqueue_archiver.h>
+
+#include <tsl/errors.h>
+#include <tsl/assert.h>
+#include <tsl/diag.h>
+#include <tsl/basic.h>
+
+#include <linux/io_uring.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <ck_pr.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Size of the pipe runs are spliced through, when io_uring is not available
+ */
+#define MEGAQUEUE_ARCHIVER_PIPE_SIZE        (1ul << 20)
+
+static
+struct work_endpoint_ops __megaqueue_archiver_ops;
+
+static
+aresult_t __megaqueue_archiver_error(int err)
+{
+    return ENOSPC == err ? A_E_NOSPC : A_E_INVAL;
+}
+
+/**
+ * Set up an io_uring with depth entries, mapping its rings by hand
+ */
+static
+aresult_t __megaqueue_archiver_uring_setup(struct megaqueue_archiver_uring *uring, unsigned int depth)
+{
+    aresult_t ret = A_OK;
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+
+    if (0 > (uring->fd = syscall(__NR_io_uring_setup, depth, &params))) {
+        PDIAG("io_uring is not available");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings at once */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->sq_ring_size = uring->cq_ring_size = BL_MAX2(uring->sq_ring_size, uring->cq_ring_size);
+    }
+
+    if (MAP_FAILED == (uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING)))
+    {
+        PDIAG("Failed to map the io_uring submission ring");
+        uring->sq_ring = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else if (MAP_FAILED == (uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING)))
+    {
+        PDIAG("Failed to map the io_uring completion ring");
+        uring->cq_ring = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (MAP_FAILED == (uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES)))
+    {
+        PDIAG("Failed to map the io_uring submission entries");
+        uring->sqes = NULL;
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    uring->sq_head = uring->sq_ring + params.sq_off.head;
+    uring->sq_tail = uring->sq_ring + params.sq_off.tail;
+    uring->sq_array = uring->sq_ring + params.sq_off.array;
+    uring->sq_mask = *(uint32_t *)(uring->sq_ring + params.sq_off.ring_mask);
+    uring->cq_head = uring->cq_ring + params.cq_off.head;
+    uring->cq_tail = uring->cq_ring + params.cq_off.tail;
+    uring->cq_mask = *(uint32_t *)(uring->cq_ring + params.cq_off.ring_mask);
+    uring->cqes = uring->cq_ring + params.cq_off.cqes;
+    uring->to_submit = 0;
+
+done:
+    return ret;
+}
+
+static
+void __megaqueue_archiver_uring_teardown(struct megaqueue_archiver_uring *uring)
+{
+    if (NULL != uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
+        uring->sqes = NULL;
+    }
+
+    if (NULL != uring->cq_ring && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    uring->cq_ring = NULL;
+
+    if (NULL != uring->sq_ring) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+        uring->sq_ring = NULL;
+    }
+
+    if (0 <= uring->fd) {
+        close(uring->fd);
+        uring->fd = -1;
+    }
+}
+
+/**
+ * Queue a write of what is left of the given write. It is only submitted to the
+ * kernel by __megaqueue_archiver_uring_enter.
+ */
+static
+void __megaqueue_archiver_uring_queue(struct megaqueue_archiver *arch, unsigned int idx)
+{
+    struct megaqueue_archiver_uring *uring = &arch->uring;
+    struct megaqueue_archiver_write *wr = &arch->writes[idx];
+    uint32_t tail = *uring->sq_tail;
+    uint32_t slot = tail & uring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)uring->sqes + slot;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = arch->fd;
+    sqe->addr = (uintptr_t)wr->iov.iov_base;
+    sqe->len = wr->iov.iov_len;
+    sqe->off = wr->offset;
+    sqe->user_data = idx;
+
+    uring->sq_array[slot] = slot;
+
+    /* The entry must be filled in before the kernel sees the tail move */
+    ck_pr_fence_store();
+    ck_pr_store_32(uring->sq_tail, tail + 1);
+
+    uring->to_submit++;
+}
+
+/**
+ * Submit everything queued, and wait for at least min_complete completions.
+ */
+static
+aresult_t __megaqueue_archiver_uring_enter(struct megaqueue_archiver_uring *uring, unsigned int min_complete)
+{
+    int submitted = 0;
+
+    if (0 == uring->to_submit && 0 == min_complete) {
+        return A_OK;
+    }
+
+    do {
+        submitted = syscall(__NR_io_uring_enter, uring->fd, uring->to_submit, min_complete,
+                            0 != min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (0 > submitted && EINTR == errno);
+
+    if (0 > submitted) {
+        PDIAG("Failed to submit %u archive writes", uring->to_submit);
+        return A_E_INVAL;
+    }
+
+    uring->to_submit -= submitted;
+
+    return A_OK;
+}
+
+/**
+ * Collect the completed writes, without a system call. Short writes are queued
+ * again for what is left.
+ */
+static
+aresult_t __megaqueue_archiver_uring_reap(struct megaqueue_archiver *arch)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_archiver_uring *uring = &arch->uring;
+    uint32_t head = *uring->cq_head;
+
+    while (head != ck_pr_load_32(uring->cq_tail)) {
+        struct io_uring_cqe *cqe = NULL;
+        struct megaqueue_archiver_write *wr = NULL;
+
+        /* Don't read the completion before seeing the tail move past it */
+        ck_pr_fence_load();
+
+        cqe = (struct io_uring_cqe *)uring->cqes + (head & uring->cq_mask);
+        wr = &arch->writes[cqe->user_data];
+
+        if (0 > cqe->res) {
+            errno = -cqe->res;
+            PDIAG("Failed to write %zu bytes of archive at offset %" PRIu64, wr->iov.iov_len, wr->offset);
+            ret = __megaqueue_archiver_error(-cqe->res);
+            wr->failed = true;
+            arch->nr_in_flight--;
+
+            if (A_OK == arch->error) {
+                arch->error = ret;
+            }
+        } else if ((size_t)cqe->res < wr->iov.iov_len) {
+            wr->iov.iov_base += cqe->res;
+            wr->iov.iov_len -= cqe->res;
+            wr->offset += cqe->res;
+            __megaqueue_archiver_uring_queue(arch, cqe->user_data);
+        } else {
+            wr->done = true;
+            arch->nr_in_flight--;
+            arch->nr_completed++;
+        }
+
+        head++;
+    }
+
+    /* Hand the entries back to the kernel once we are done with them */
+    ck_pr_fence_memory();
+    ck_pr_store_32(uring->cq_head, head);
+
+    return ret;
+}
+
+/**
+ * Write a run of objects synchronously, by splicing it through the pipe: the pages
+ * of the ring are referenced by the pipe, not copied, and copied straight into the
+ * page cache of the file.
+ */
+static
+aresult_t __megaqueue_archiver_splice_write(struct megaqueue_archiver *arch, struct megaqueue_archiver_write *wr)
+{
+    while (0 != wr->iov.iov_len) {
+        struct iovec iov = { .iov_base = wr->iov.iov_base,
+                             .iov_len = BL_MIN2(wr->iov.iov_len, MEGAQUEUE_ARCHIVER_PIPE_SIZE) };
+        ssize_t in_pipe = 0;
+
+        if (0 > (in_pipe = vmsplice(arch->pipe[1], &iov, 1, 0))) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            PDIAG("Failed to splice %zu bytes of the ring", iov.iov_len);
+            return A_E_INVAL;
+        }
+
+        while (0 < in_pipe) {
+            loff_t offset = wr->offset;
+            ssize_t written = splice(arch->pipe[0], NULL, arch->fd, &offset, in_pipe, SPLICE_F_MOVE);
+
+            if (0 > written) {
+                if (EINTR == errno) {
+                    continue;
+                }
+
+                PDIAG("Failed to write %zd bytes of archive at offset %" PRIu64, in_pipe, wr->offset);
+                return __megaqueue_archiver_error(errno);
+            }
+
+            in_pipe -= written;
+            wr->iov.iov_base += written;
+            wr->iov.iov_len -= written;
+            wr->offset += written;
+        }
+    }
+
+    wr->done = true;
+    arch->nr_completed++;
+
+    return A_OK;
+}
+
+static
+aresult_t __megaqueue_archiver_splice(struct megaqueue_archiver *arch, struct megaqueue_archiver_write *wr)
+{
+    aresult_t ret = A_OK;
+
+    if (AFAILED(ret = __megaqueue_archiver_splice_write(arch, wr))) {
+        wr->failed = true;
+        arch->error = ret;
+    }
+
+    return ret;
+}
+
+/**
+ * Release the objects of the oldest writes, as long as they completed. A failed
+ * write is never released, so neither is anything after it.
+ */
+static
+aresult_t __megaqueue_archiver_retire(struct megaqueue_archiver *arch)
+{
+    aresult_t ret = A_OK;
+
+    while (0 != arch->nr_writes && true == arch->writes[arch->first].done) {
+        struct megaqueue_archiver_write *wr = &arch->writes[arch->first];
+
+        if (AFAILED(ret = megaqueue_consume_n(arch->queue, wr->count))) {
+            goto done;
+        }
+
+        arch->archived += wr->count;
+        arch->first = (arch->first + 1) % arch->depth;
+        arch->nr_writes--;
+    }
+
+    ret = arch->error;
+
+done:
+    return ret;
+}
+
+/**
+ * Start writing runs of objects, from the last object submitted up to the head, as
+ * long as there is room for more writes in flight. Returns the number of writes
+ * started.
+ */
+static
+aresult_t __megaqueue_archiver_submit(struct megaqueue_archiver *arch, unsigned int *started)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue *queue = arch->queue;
+
+    *started = 0;
+
+    if (CAL_UNLIKELY(A_OK != arch->error)) {
+        return arch->error;
+    }
+
+    while (arch->nr_writes < arch->depth) {
+        unsigned int idx = (arch->first + arch->nr_writes) % arch->depth;
+        struct megaqueue_archiver_write *wr = &arch->writes[idx];
+        uint64_t readable = __megaqueue_readable(queue, arch->submit_pos);
+        uint64_t to_end = queue->object_count - (arch->submit_pos % queue->object_count);
+
+        if (0 == readable) {
+            break;
+        }
+
+        /* Do not write the objects out before seeing the head move past them */
+        ck_pr_fence_load();
+
+        wr->pos = arch->submit_pos;
+        wr->count = BL_MIN2(BL_MIN2(readable, to_end), arch->chunk);
+        wr->offset = arch->offset;
+        wr->iov.iov_base = __megaqueue_read_slot(queue, wr->pos);
+        wr->iov.iov_len = wr->count * queue->object_size;
+        wr->done = false;
+
+        arch->submit_pos += wr->count;
+        arch->offset += wr->iov.iov_len;
+        arch->nr_writes++;
+        (*started)++;
+
+        if (true == megaqueue_archiver_uses_uring(arch)) {
+            __megaqueue_archiver_uring_queue(arch, idx);
+            arch->nr_in_flight++;
+        } else if (AFAILED(ret = __megaqueue_archiver_splice(arch, wr)) ||
+                   AFAILED(ret = __megaqueue_archiver_retire(arch)))
+        {
+            break;
+        }
+    }
+
+    if (true == megaqueue_archiver_uses_uring(arch) && !AFAILED(ret)) {
+        ret = __megaqueue_archiver_uring_enter(&arch->uring, 0);
+    }
+
+    return ret;
+}
+
+aresult_t megaqueue_archiver_init(struct megaqueue_archiver *arch, struct megaqueue *queue, int fd,
+                                  unsigned int depth, size_t chunk, unsigned int flags)
+{
+    aresult_t ret = A_OK;
+    off_t offset = 0;
+
+    TSL_ASSERT_ARG(NULL != arch);
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->cursor);
+    TSL_ASSERT_ARG(0 <= fd);
+
+    memset(arch, 0, sizeof(*arch));
+    arch->uring.fd = -1;
+    arch->pipe[0] = arch->pipe[1] = -1;
+
+    /* Objects must stay put until they are written */
+    if (queue->flags & (MEGAQUEUE_FLAG_SNOOP | MEGAQUEUE_FLAG_LAP | MEGAQUEUE_FLAG_JOURNAL)) {
+        DIAG("Can't archive a megaqueue through a read-only or lapping handle, or a journal");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (0 > (offset = lseek(fd, 0, SEEK_END))) {
+        PDIAG("Can't find the end of the archive");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    if (AFAILED(ret = work_endpoint_init(&arch->ep, &__megaqueue_archiver_ops, arch))) {
+        goto done;
+    }
+
+    arch->queue = queue;
+    arch->fd = fd;
+    arch->offset = offset;
+    arch->submit_pos = megaqueue_read_sequence(queue);
+    arch->depth = 0 != depth ? depth : MEGAQUEUE_ARCHIVER_DEFAULT_DEPTH;
+    arch->chunk = BL_MAX2((0 != chunk ? chunk : MEGAQUEUE_ARCHIVER_DEFAULT_CHUNK) / queue->object_size, 1);
+
+    if (NULL == (arch->writes = calloc(arch->depth, sizeof(struct megaqueue_archiver_write)))) {
+        ret = A_E_NOMEM;
+        goto done;
+    }
+
+    if (!(flags & MEGAQUEUE_ARCHIVER_FLAG_NO_URING) &&
+            !AFAILED(__megaqueue_archiver_uring_setup(&arch->uring, arch->depth)))
+    {
+        goto done;
+    }
+
+    __megaqueue_archiver_uring_teardown(&arch->uring);
+
+    DIAG("Archiving megaqueue by splicing through a pipe");
+
+    if (0 > pipe(arch->pipe)) {
+        PDIAG("Failed to create the archive pipe");
+        ret = A_E_INVAL;
+        goto done;
+    }
+
+    /* Best effort, a smaller pipe just takes more splices */
+    fcntl(arch->pipe[1], F_SETPIPE_SZ, MEGAQUEUE_ARCHIVER_PIPE_SIZE);
+
+done:
+    if (AFAILED(ret) && NULL != arch->writes) {
+        free(arch->writes);
+        arch->writes = NULL;
+    }
+
+    return ret;
+}
+
+aresult_t megaqueue_archiver_flush(struct megaqueue_archiver *arch)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != arch);
+
+    /* Runs are written before the poll returns without io_uring */
+    if (false == megaqueue_archiver_uses_uring(arch)) {
+        return __megaqueue_archiver_retire(arch);
+    }
+
+    /* A failed write is no longer in flight, its error is kept in arch->error */
+    do {
+        __megaqueue_archiver_uring_reap(arch);
+    } while (0 != arch->nr_in_flight && !AFAILED(ret = __megaqueue_archiver_uring_enter(&arch->uring, 1)));
+
+    if (!AFAILED(ret)) {
+        ret = __megaqueue_archiver_retire(arch);
+    }
+
+    return ret;
+}
+
+aresult_t megaqueue_archiver_cleanup(struct megaqueue_archiver *arch)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != arch);
+
+    if (NULL != arch->writes) {
+        ret = megaqueue_archiver_flush(arch);
+    }
+
+    __megaqueue_archiver_uring_teardown(&arch->uring);
+
+    for (int i = 0; i < 2; i++) {
+        if (0 <= arch->pipe[i]) {
+            close(arch->pipe[i]);
+            arch->pipe[i] = -1;
+        }
+    }
+
+    if (NULL != arch->writes) {
+        free(arch->writes);
+        arch->writes = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * poll operation for the Megaqueue archiver
+ */
+static
+aresult_t __megaqueue_archiver_poll(struct work_endpoint *ep, unsigned int *wait)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_archiver *arch = BL_CONTAINER_OF(ep, struct megaqueue_archiver, ep);
+    uint64_t archived = arch->archived;
+    unsigned int started = 0;
+
+    if (true == megaqueue_archiver_uses_uring(arch)) {
+        if (AFAILED(ret = __megaqueue_archiver_uring_reap(arch)) || AFAILED(ret = __megaqueue_archiver_retire(arch))) {
+            goto done;
+        }
+    }
+
+    if (AFAILED(ret = __megaqueue_archiver_submit(arch, &started))) {
+        goto done;
+    }
+
+done:
+    if (!AFAILED(ret) && (0 != started || 0 != arch->nr_writes || archived != arch->archived)) {
+        /* Come straight back while there is a backlog, or writes to collect */
+        arch->idle_wait = 0;
+    } else {
+        /* Back off while the queue is idle */
+        arch->idle_wait = 0 == arch->idle_wait ? 1 : BL_MIN2(arch->idle_wait * 2, MEGAQUEUE_ARCHIVER_MAX_WAIT);
+    }
+
+    *wait = arch->idle_wait;
+
+    return ret;
+}
+
+/**
+ * shutdown operation for the Megaqueue archiver: finish the writes in flight
+ */
+static
+aresult_t __megaqueue_archiver_shutdown(struct work_endpoint *ep)
+{
+    struct megaqueue_archiver *arch = BL_CONTAINER_OF(ep, struct megaqueue_archiver, ep);
+
+    return megaqueue_archiver_flush(arch);
+}
+
+static
+struct work_endpoint_ops __megaqueue_archiver_ops = {
+    .poll = __megaqueue_archiver_poll,
+    .startup = NULL,
+    .shutdown = __megaqueue_archiver_shutdown
+};
+
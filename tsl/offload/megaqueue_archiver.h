@@ -0,0 +1,188 @@
+#ifndef __INCLUDED_FOUNDATION_OFFLOAD_MEGAQUEUE_ARCHIVER_H__
+#define __INCLUDED_FOUNDATION_OFFLOAD_MEGAQUEUE_ARCHIVER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+#include <tsl/offload/endpoint.h>
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default number of writes in flight at once
+ */
+#define MEGAQUEUE_ARCHIVER_DEFAULT_DEPTH    8
+
+/**
+ * Default largest write, in bytes
+ */
+#define MEGAQUEUE_ARCHIVER_DEFAULT_CHUNK    (1ul << 20)
+
+/**
+ * Longest wait between two polls of an idle queue, in milliseconds
+ */
+#define MEGAQUEUE_ARCHIVER_MAX_WAIT         8
+
+/**
+ * \group megaqueue_archiver_flags Megaqueue archiver flags
+ * @{
+ */
+#define MEGAQUEUE_ARCHIVER_FLAG_NO_URING    0x1     /** Don't use io_uring, even if the kernel has it */
+/*@}*/
+
+/**
+ * A write of a contiguous run of objects, straight from the ring to the file
+ */
+struct megaqueue_archiver_write {
+    /** Sequence of the first object */
+    uint64_t pos;
+    /** Number of objects */
+    uint64_t count;
+    /** Offset in the file of what is left to write */
+    uint64_t offset;
+    /** What is left to write */
+    struct iovec iov;
+    /** Whether the write completed */
+    bool done;
+    /** Whether the write failed */
+    bool failed;
+};
+
+/**
+ * An io_uring instance, set up with raw system calls
+ */
+struct megaqueue_archiver_uring {
+    /** The io_uring file descriptor, -1 if io_uring is not used */
+    int fd;
+    /** The submission queue ring */
+    void *sq_ring;
+    size_t sq_ring_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    /** The submission queue entries */
+    void *sqes;
+    size_t sqes_size;
+    /** The completion queue ring, might be the same mapping as the submission ring */
+    void *cq_ring;
+    size_t cq_ring_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    void *cqes;
+    /** Number of entries queued, but not submitted yet */
+    uint32_t to_submit;
+};
+
+/**
+ * A work endpoint that archives everything produced to a Megaqueue to a file.
+ *
+ * Contiguous runs of objects are written straight from the mapped ring to the file:
+ * there is no copy to a user buffer on the way. Several writes are kept in flight
+ * with io_uring, which takes a single system call per poll to submit them all, and
+ * none to find out which completed. The consumer cursor only moves past objects once
+ * they were written, so the producer never overwrites an object still being
+ * archived.
+ *
+ * Without io_uring, each run is spliced to the file through a pipe, and the poll
+ * waits for it to be written.
+ *
+ * The file holds the objects exactly as they are laid out in the ring, including
+ * record headers and padding for a variable-length queue.
+ *
+ * Once a write fails, the archiver stops: the objects from that write on stay in the
+ * queue, holding the producer back, and every poll and flush returns the error.
+ * Clean the archiver up, and start over with another file.
+ */
+struct megaqueue_archiver {
+    /** The work endpoint */
+    struct work_endpoint ep;
+    /** The queue, a consumer handle owned by the caller */
+    struct megaqueue *queue;
+    /** The file to write to, owned by the caller */
+    int fd;
+    /** Offset in the file of the next object to submit */
+    uint64_t offset;
+    /** Sequence of the next object to submit */
+    uint64_t submit_pos;
+    /** Largest write, in objects */
+    size_t chunk;
+    /** Maximum number of writes in flight */
+    unsigned int depth;
+    /** The writes in flight, in the order of the queue */
+    struct megaqueue_archiver_write *writes;
+    /** Index of the oldest write in flight */
+    unsigned int first;
+    /** Number of writes in flight, or completed but not released yet */
+    unsigned int nr_writes;
+    /** Number of writes the kernel still has to complete */
+    unsigned int nr_in_flight;
+    /** The first write error. Nothing more is written once it is set. */
+    aresult_t error;
+    /** The io_uring instance */
+    struct megaqueue_archiver_uring uring;
+    /** The pipe runs are spliced through, without io_uring */
+    int pipe[2];
+    /** Wait hint given on the last empty poll, 0 while objects keep coming */
+    unsigned int idle_wait;
+    /** Number of objects archived */
+    uint64_t archived;
+    /** Number of writes completed */
+    uint64_t nr_completed;
+};
+
+/** \brief Initialize a Megaqueue archiver
+ * \param arch The archiver to initialize
+ * \param queue The queue to archive, a consumer handle that holds the producer back
+ *        (not read-only, and not lapping). Must stay open until the archiver is
+ *        cleaned up. Journals are already on disk, and can't be archived.
+ * \param fd The file to append to, opened for writing
+ * \param depth Maximum number of writes in flight, 0 for MEGAQUEUE_ARCHIVER_DEFAULT_DEPTH
+ * \param chunk Largest write in bytes, 0 for MEGAQUEUE_ARCHIVER_DEFAULT_CHUNK
+ * \param flags Archiver flags, see megaqueue_archiver_flags
+ * \return A_OK on success, A_E_INVAL if the queue can't be archived, an error code
+ *         otherwise
+ */
+aresult_t megaqueue_archiver_init(struct megaqueue_archiver *arch, struct megaqueue *queue, int fd,
+                                  unsigned int depth, size_t chunk, unsigned int flags);
+
+/** \brief Wait for every write in flight to complete, and release the objects
+ * \return A_OK on success, A_E_NOSPC if the file system is full, A_E_INVAL if a
+ *         write failed otherwise.
+ */
+aresult_t megaqueue_archiver_flush(struct megaqueue_archiver *arch);
+
+/** \brief Flush the archiver, and release its resources. Closes neither the queue,
+ *         nor the file.
+ */
+aresult_t megaqueue_archiver_cleanup(struct megaqueue_archiver *arch);
+
+/** \brief Check if the archiver writes with io_uring
+ */
+static inline
+bool megaqueue_archiver_uses_uring(struct megaqueue_archiver *arch)
+{
+    return 0 <= arch->uring.fd;
+}
+
+/** \brief Get the work endpoint, to add to a work thread or pool
+ */
+static inline
+struct work_endpoint *megaqueue_archiver_get(struct megaqueue_archiver *arch)
+{
+    return &arch->ep;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* defined(__cplusplus) */
+
+#endif /* __INCLUDED_FOUNDATION_OFFLOAD_MEGAQUEUE_ARCHIVER_H__ */
+
@@ -0,0 +1,168 @@
+#include <tsl/offload/megaqueue_endpoint.h>
+
+#include <tsl/errors.h>
+#include <tsl/assert.h>
+#include <tsl/diag.h>
+#include <tsl/basic.h>
+
+static
+struct work_endpoint_ops __megaqueue_endpoint_ops;
+
+/**
+ * Hand a run of contiguous objects to the handler. Returns the number handled.
+ */
+static
+size_t __megaqueue_endpoint_dispatch_run(struct megaqueue_endpoint *mep, void *run, size_t count, aresult_t *ret)
+{
+    size_t object_size = mep->queue->object_size;
+
+    for (size_t i = 0; i < count; i++) {
+        if (CAL_UNLIKELY(AFAILED(*ret = mep->handler(mep->priv, run + i * object_size, object_size)))) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Handle a batch of fixed-size objects, consuming all of them at once
+ */
+static
+aresult_t __megaqueue_endpoint_poll_objects(struct megaqueue_endpoint *mep, size_t *handled)
+{
+    aresult_t ret = A_OK;
+    aresult_t consume_ret = A_OK;
+    struct megaqueue_span span;
+    size_t count = 0;
+    size_t done = 0;
+
+    do {
+        ret = megaqueue_peek_n(mep->queue, mep->batch, &span, &count);
+    } while (A_E_OVERRUN == ret);
+
+    if (A_E_EMPTY == ret) {
+        ret = A_OK;
+        goto done;
+    }
+
+    if (AFAILED(ret)) {
+        goto done;
+    }
+
+    done = __megaqueue_endpoint_dispatch_run(mep, span.first, span.first_count, &ret);
+
+    if (A_OK == ret && NULL != span.second) {
+        done += __megaqueue_endpoint_dispatch_run(mep, span.second, span.second_count, &ret);
+    }
+
+    if (0 != done && AFAILED(consume_ret = megaqueue_consume_n(mep->queue, done))) {
+        DIAG("Megaqueue consumer was lapped while handling a batch of %zu objects.", done);
+    }
+
+done:
+    *handled = done;
+    return ret;
+}
+
+/**
+ * Handle a batch of variable-length records, one at a time
+ */
+static
+aresult_t __megaqueue_endpoint_poll_records(struct megaqueue_endpoint *mep, size_t *handled)
+{
+    aresult_t ret = A_OK;
+    size_t done = 0;
+
+    while (done < mep->batch) {
+        void *buf = NULL;
+        size_t length = 0;
+
+        ret = megaqueue_read_record(mep->queue, &buf, &length);
+
+        if (A_E_OVERRUN == ret) {
+            continue;
+        }
+
+        if (A_E_EMPTY == ret) {
+            ret = A_OK;
+            break;
+        }
+
+        if (AFAILED(ret) || AFAILED(ret = mep->handler(mep->priv, buf, length))) {
+            break;
+        }
+
+        megaqueue_release_record(mep->queue);
+        done++;
+    }
+
+    *handled = done;
+    return ret;
+}
+
+aresult_t megaqueue_endpoint_init(struct megaqueue_endpoint *mep, struct megaqueue *queue,
+                                  megaqueue_endpoint_handler_t handler, void *priv,
+                                  size_t batch, unsigned int max_wait)
+{
+    aresult_t ret = A_OK;
+
+    TSL_ASSERT_ARG(NULL != mep);
+    TSL_ASSERT_ARG(NULL != queue);
+    TSL_ASSERT_ARG(NULL != queue->cursor);
+    TSL_ASSERT_ARG(NULL != handler);
+
+    if (AFAILED(ret = work_endpoint_init(&mep->ep, &__megaqueue_endpoint_ops, mep))) {
+        goto done;
+    }
+
+    mep->queue = queue;
+    mep->handler = handler;
+    mep->priv = priv;
+    mep->batch = 0 != batch ? batch : MEGAQUEUE_ENDPOINT_DEFAULT_BATCH;
+    mep->max_wait = 0 != max_wait ? max_wait : MEGAQUEUE_ENDPOINT_DEFAULT_MAX_WAIT;
+    mep->idle_wait = 0;
+    mep->handled = 0;
+
+done:
+    return ret;
+}
+
+/**
+ * poll operation for the Megaqueue endpoint
+ */
+static
+aresult_t __megaqueue_endpoint_poll(struct work_endpoint *ep, unsigned int *wait)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_endpoint *mep = BL_CONTAINER_OF(ep, struct megaqueue_endpoint, ep);
+    size_t handled = 0;
+
+    if (mep->queue->flags & MEGAQUEUE_FLAG_VARLEN) {
+        ret = __megaqueue_endpoint_poll_records(mep, &handled);
+    } else {
+        ret = __megaqueue_endpoint_poll_objects(mep, &handled);
+    }
+
+    mep->handled += handled;
+
+    if (0 != handled) {
+        /* Come straight back while there is a backlog */
+        mep->idle_wait = 0;
+    } else {
+        /* Back off while the queue is idle */
+        mep->idle_wait = 0 == mep->idle_wait ? 1 : BL_MIN2(mep->idle_wait * 2, mep->max_wait);
+    }
+
+    *wait = mep->idle_wait;
+
+    return ret;
+}
+
+static
+struct work_endpoint_ops __megaqueue_endpoint_ops = {
+    .poll = __megaqueue_endpoint_poll,
+    .startup = NULL,
+    .shutdown = NULL
+};
+
@@ -0,0 +1,89 @@
+#ifndef __INCLUDED_FOUNDATION_OFFLOAD_MEGAQUEUE_ENDPOINT_H__
+#define __INCLUDED_FOUNDATION_OFFLOAD_MEGAQUEUE_ENDPOINT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+#include <tsl/offload/endpoint.h>
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default number of records handled per poll
+ */
+#define MEGAQUEUE_ENDPOINT_DEFAULT_BATCH    64
+
+/**
+ * Default longest wait between two polls of an idle queue, in milliseconds
+ */
+#define MEGAQUEUE_ENDPOINT_DEFAULT_MAX_WAIT 8
+
+/** \typedef Handler called for every record read from the queue
+ * \param priv The private state passed to megaqueue_endpoint_init
+ * \param buf The record. Only valid until the handler returns.
+ * \param length The length of the record
+ * \return A_OK if the record was handled. On failure, the record is left in the
+ *         queue, and the error is returned by the poll, which shuts the endpoint down.
+ */
+typedef aresult_t (*megaqueue_endpoint_handler_t)(void *priv, void *buf, size_t length);
+
+/**
+ * A work endpoint that consumes a Megaqueue, handing every record to a handler.
+ *
+ * Each poll handles up to batch records, and moves the read cursor once for all of
+ * them (for a fixed-size queue), so the producer sees a single update of the shared
+ * header per batch. The wait hint is 0 while there is a backlog; once the queue
+ * runs dry, the wait doubles on every empty poll, up to max_wait milliseconds, so
+ * many low-rate queues can share a work thread without it spinning.
+ */
+struct megaqueue_endpoint {
+    /** The work endpoint */
+    struct work_endpoint ep;
+    /** The queue, a consumer handle owned by the caller */
+    struct megaqueue *queue;
+    /** Handler for the records */
+    megaqueue_endpoint_handler_t handler;
+    /** Private state passed to the handler */
+    void *priv;
+    /** Maximum number of records handled per poll */
+    size_t batch;
+    /** Longest wait between two polls of an idle queue, in milliseconds */
+    unsigned int max_wait;
+    /** Wait hint given on the last empty poll, 0 while records keep coming */
+    unsigned int idle_wait;
+    /** Number of records handled */
+    uint64_t handled;
+};
+
+/** \brief Initialize a Megaqueue work endpoint
+ * \param mep The endpoint to initialize
+ * \param queue The queue to consume, opened for reading. Must stay open until the
+ *        endpoint is shut down.
+ * \param handler The handler called for every record
+ * \param priv Private state for the handler
+ * \param batch Maximum number of records per poll, 0 for MEGAQUEUE_ENDPOINT_DEFAULT_BATCH
+ * \param max_wait Longest wait between polls of an idle queue, in milliseconds.
+ *        0 for MEGAQUEUE_ENDPOINT_DEFAULT_MAX_WAIT.
+ * \return A_OK on success, an error code otherwise
+ */
+aresult_t megaqueue_endpoint_init(struct megaqueue_endpoint *mep, struct megaqueue *queue,
+                                  megaqueue_endpoint_handler_t handler, void *priv,
+                                  size_t batch, unsigned int max_wait);
+
+/** \brief Get the work endpoint, to add to a work thread or pool
+ */
+static inline
+struct work_endpoint *megaqueue_endpoint_get(struct megaqueue_endpoint *mep)
+{
+    return &mep->ep;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif /* defined(__cplusplus) */
+
+#endif /* __INCLUDED_FOUNDATION_OFFLOAD_MEGAQUEUE_ENDPOINT_H__ */
+
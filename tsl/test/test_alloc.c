@@ -3,6 +3,8 @@
 #include <tsl/alloc/alloc_priv.h>
 #include <tsl/list.h>
 
+#include <pthread.h>
+
 TEST_DECL(test_alloc_basic)
 {
     struct allocator *alloc = NULL;
@@ -84,3 +86,102 @@ TEST_DECL(test_alloc_basic)
     return TEST_OK;
 }
 
+#define ALLOC_TEST_THREADS          4
+#define ALLOC_TEST_BATCH            100
+
+struct alloc_test_thread {
+    pthread_t thread;
+    struct allocator *alloc;
+    /* Items allocated by another thread, for this one to free */
+    void *foreign[ALLOC_TEST_BATCH];
+    uint64_t id;
+    int failed;
+};
+
+static
+void *__test_alloc_thread(void *arg)
+{
+    struct alloc_test_thread *thr = (struct alloc_test_thread *)arg;
+    uint64_t *items[ALLOC_TEST_BATCH];
+
+    for (size_t i = 0; i < ALLOC_TEST_BATCH; i++) {
+        if (AFAILED(allocator_free(thr->alloc, &thr->foreign[i]))) {
+            thr->failed = 1;
+        }
+    }
+
+    for (size_t round = 0; round < 1000; round++) {
+        for (size_t i = 0; i < ALLOC_TEST_BATCH; i++) {
+            if (AFAILED(allocator_alloc(thr->alloc, (void **)&items[i]))) {
+                thr->failed = 1;
+                return NULL;
+            }
+            items[i][0] = thr->id;
+            items[i][7] = round;
+        }
+
+        for (size_t i = 0; i < ALLOC_TEST_BATCH; i++) {
+            if (items[i][0] != thr->id || items[i][7] != round) {
+                thr->failed = 1;
+            }
+
+            if (AFAILED(allocator_free(thr->alloc, (void **)&items[i]))) {
+                thr->failed = 1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+TEST_DECL(test_alloc_thread_safe)
+{
+    struct allocator *alloc = NULL;
+    struct alloc_test_thread threads[ALLOC_TEST_THREADS];
+    void *item = NULL;
+    void *last = NULL;
+
+    TEST_ASSERT_EQUALS(allocator_new(&alloc, 64, 128, ALLOC_FLAG_THREAD_SAFE), A_OK);
+
+    /* Freed items are cached, and handed back first */
+    TEST_ASSERT_EQUALS(allocator_alloc(alloc, &item), A_OK);
+    last = item;
+    TEST_ASSERT_EQUALS(allocator_free(alloc, &item), A_OK);
+    TEST_ASSERT_EQUALS(item, NULL);
+    TEST_ASSERT_EQUALS(allocator_alloc(alloc, &item), A_OK);
+    TEST_ASSERT_EQUALS(item, last);
+
+    /* Cached items are still in use, as far as the slabs know */
+    TEST_ASSERT_EQUALS(allocator_delete(&alloc), A_E_BUSY);
+    TEST_ASSERT_EQUALS(allocator_free(alloc, &item), A_OK);
+
+    /* Items allocated here are freed by the other threads */
+    for (size_t t = 0; t < ALLOC_TEST_THREADS; t++) {
+        threads[t].alloc = alloc;
+        threads[t].id = t + 1;
+        threads[t].failed = 0;
+
+        for (size_t i = 0; i < ALLOC_TEST_BATCH; i++) {
+            TEST_ASSERT_EQUALS(allocator_alloc(alloc, &threads[t].foreign[i]), A_OK);
+        }
+    }
+
+    for (size_t t = 0; t < ALLOC_TEST_THREADS; t++) {
+        TEST_ASSERT_EQUALS(pthread_create(&threads[t].thread, NULL, __test_alloc_thread, &threads[t]), 0);
+    }
+
+    for (size_t t = 0; t < ALLOC_TEST_THREADS; t++) {
+        TEST_ASSERT_EQUALS(pthread_join(threads[t].thread, NULL), 0);
+        TEST_ASSERT_EQUALS(threads[t].failed, 0);
+    }
+
+    /* Magazines went back and forth through the depot */
+    TEST_ASSERT_NOT_EQUALS(alloc->depot_swaps, 0);
+
+    /* The caches of the threads that exited, and of this one, are drained */
+    TEST_ASSERT_EQUALS(allocator_delete(&alloc), A_OK);
+    TEST_ASSERT_EQUALS(alloc, NULL);
+
+    return TEST_OK;
+}
+
@@ -0,0 +1,103 @@
+#include <tsl/test/helpers.h>
+#include <tsl/lvcache/lvcache.h>
+#include <tsl/errors.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#define LVCACHE_TEST_KEYS       16
+#define LVCACHE_TEST_UPDATES    200000
+
+/* A value the reader can tell was torn: every word is the same */
+struct test_lvcache_book {
+    uint64_t words[12];
+};
+
+static
+void *__test_lvcache_writer(void *arg)
+{
+    struct lvcache *cache = arg;
+
+    for (uint64_t i = 1; i <= LVCACHE_TEST_UPDATES; i++) {
+        struct test_lvcache_book *book = lvcache_write_begin(cache, i % LVCACHE_TEST_KEYS);
+
+        for (size_t w = 0; w < BL_ARRAY_ENTRIES(book->words); w++) {
+            book->words[w] = i;
+        }
+
+        lvcache_write_end(cache, i % LVCACHE_TEST_KEYS, sizeof(*book));
+    }
+
+    return NULL;
+}
+
+TEST_DECL(test_lvcache)
+{
+    struct lvcache writer, reader, other;
+    struct test_lvcache_book book;
+    pthread_t thread;
+    uint64_t version = 0;
+    size_t length = 0;
+
+    shm_unlink("/lvcache_lvtest");
+
+    TEST_ASSERT_EQUALS(lvcache_open(&reader, O_RDONLY, "lvtest", 0, 0), A_E_NOTFOUND);
+    TEST_ASSERT_EQUALS(lvcache_open(&writer, O_RDWR | O_CREAT, "lvtest", sizeof(book), LVCACHE_TEST_KEYS), A_OK);
+    TEST_ASSERT_EQUALS(writer.slot_size & (SYS_CACHE_LINE_LENGTH - 1), 0);
+
+    /* Readers take the shape from the header, or check it */
+    TEST_ASSERT_EQUALS(lvcache_open(&other, O_RDONLY, "lvtest", sizeof(book) + 8, 0), A_E_BADARGS);
+    TEST_ASSERT_EQUALS(lvcache_open(&reader, O_RDONLY, "lvtest", 0, 0), A_OK);
+    TEST_ASSERT_EQUALS(reader.value_size, sizeof(book));
+    TEST_ASSERT_EQUALS(reader.nr_keys, LVCACHE_TEST_KEYS);
+
+    TEST_ASSERT_EQUALS(lvcache_read(&reader, 3, &book, &length, &version), A_E_NOENT);
+    TEST_ASSERT_EQUALS(lvcache_version(&reader, 3), 0);
+
+    /* Only the last value is kept */
+    memset(&book, 0xaa, sizeof(book));
+    TEST_ASSERT_EQUALS(lvcache_write(&writer, 3, &book, sizeof(book)), A_OK);
+    TEST_ASSERT_EQUALS(lvcache_write(&writer, 3, "short", 6), A_OK);
+    TEST_ASSERT_EQUALS(lvcache_version(&reader, 3), 2);
+
+    memset(&book, 0, sizeof(book));
+    TEST_ASSERT_EQUALS(lvcache_read(&reader, 3, &book, &length, &version), A_OK);
+    TEST_ASSERT_EQUALS(length, 6);
+    TEST_ASSERT_EQUALS(version, 2);
+    TEST_ASSERT_EQUALS(strcmp((char *)&book, "short"), 0);
+
+    /* Recreating the cache empties it */
+    TEST_ASSERT_EQUALS(lvcache_close(&writer, 0), A_OK);
+    TEST_ASSERT_EQUALS(lvcache_open(&writer, O_RDWR | O_CREAT, "lvtest", sizeof(book), LVCACHE_TEST_KEYS), A_OK);
+    TEST_ASSERT_EQUALS(lvcache_read(&reader, 3, &book, &length, &version), A_E_NOENT);
+
+    /* Snapshots are never torn, however busy the writer is */
+    TEST_ASSERT_EQUALS(pthread_create(&thread, NULL, __test_lvcache_writer, &writer), 0);
+
+    while (lvcache_version(&reader, 0) < LVCACHE_TEST_UPDATES / LVCACHE_TEST_KEYS) {
+        for (uint64_t key = 0; key < LVCACHE_TEST_KEYS; key++) {
+            if (A_OK != lvcache_read(&reader, key, &book, &length, NULL)) {
+                continue;
+            }
+
+            TEST_ASSERT_EQUALS(length, sizeof(book));
+            uint64_t written_key = book.words[0] % LVCACHE_TEST_KEYS;
+            TEST_ASSERT_EQUALS(written_key, key);
+            TEST_ASSERT_EQUALS(book.words[0], book.words[BL_ARRAY_ENTRIES(book.words) - 1]);
+        }
+    }
+
+    TEST_ASSERT_EQUALS(pthread_join(thread, NULL), 0);
+
+    TEST_ASSERT_EQUALS(lvcache_read(&reader, 0, &book, &length, &version), A_OK);
+    TEST_ASSERT_EQUALS(book.words[0], LVCACHE_TEST_UPDATES);
+
+    TEST_ASSERT_EQUALS(lvcache_close(&reader, 0), A_OK);
+    TEST_ASSERT_EQUALS(lvcache_close(&writer, 1), A_OK);
+
+    return TEST_OK;
+}
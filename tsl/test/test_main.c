@@ -24,6 +24,7 @@ int main(int argc, char *argv[])
     TEST_START(tsl);
     TEST_CASE(test_basic);
     TEST_CASE(test_alloc_basic);
+    TEST_CASE(test_alloc_thread_safe);
     TEST_CASE(test_logalloc_basic);
     TEST_CASE(test_logalloc_fill_in);
     TEST_CASE(test_hash_table_basic);
@@ -36,9 +37,33 @@ int main(int argc, char *argv[])
     TEST_CASE(test_fixed_heap);
     TEST_CASE(test_queue);
     TEST_CASE(test_work_endpoint);
+    TEST_CASE(test_megaqueue_endpoint);
+    TEST_CASE(test_megaqueue_archiver);
     TEST_CASE(test_work_thread);
     TEST_CASE(test_work_pool);
     TEST_CASE(test_megaqueue);
+    TEST_CASE(test_megaqueue_broadcast);
+    TEST_CASE(test_megaqueue_broadcast_lap);
+    TEST_CASE(test_megaqueue_batch);
+    TEST_CASE(test_megaqueue_fast);
+    TEST_CASE(test_megaqueue_varlen);
+    TEST_CASE(test_megaqueue_journal);
+    TEST_CASE(test_megaqueue_seek);
+    TEST_CASE(test_megaqueue_wait);
+    TEST_CASE(test_megaqueue_multi_producer);
+    TEST_CASE(test_megaqueue_hugepage);
+    TEST_CASE(test_megaqueue_maint);
+    TEST_CASE(test_megaqueue_resume);
+    TEST_CASE(test_megaqueue_snoop);
+    TEST_CASE(test_megaqueue_index);
+    TEST_CASE(test_megaqueue_merge);
+    TEST_CASE(test_megaqueue_merge_lapped);
+    TEST_CASE(test_megaqueue_numa);
+    TEST_CASE(test_megaqueue_typed);
+    TEST_CASE(test_megaqueue_prefetch);
+    TEST_CASE(test_megaqueue_group);
+    TEST_CASE(test_megaqueue_repl);
+    TEST_CASE(test_lvcache);
     TEST_CASE(test_config);
     TEST_FINISH(tsl);
     return EXIT_SUCCESS;
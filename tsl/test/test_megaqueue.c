@@ -1,11 +1,27 @@
 #include <tsl/test/helpers.h>
 #include <tsl/megaqueue/megaqueue.h>
+#include <tsl/megaqueue/megaqueue_maint.h>
+#include <tsl/megaqueue/megaqueue_index.h>
+#include <tsl/megaqueue/megaqueue_merge.h>
+#include <tsl/megaqueue/megaqueue_typed.h>
+#include <tsl/megaqueue/megaqueue_repl.h>
 #include <tsl/errors.h>
 
 #include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
 
 #include <stdint.h>
+#include <string.h>
 
 TEST_DECL(test_megaqueue)
 {
@@ -67,3 +83,1661 @@ TEST_DECL(test_megaqueue)
     return TEST_OK;
 }
 
+
+TEST_DECL(test_megaqueue_broadcast)
+{
+    struct megaqueue prod, fast, slow;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_BROADCAST };
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestbcast");
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestbcast", 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&fast, O_RDWR, "mqtestbcast", 64, 8), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&slow, O_RDWR, "mqtestbcast", 64, 8), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&fast, "fast"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&slow, "slow"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&prod, "fast"), A_E_BUSY);
+
+    /* Fill the queue; the slowest consumer holds the producer back */
+    for (uint64_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    /* Both consumers see every object */
+    for (uint64_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&fast, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&fast), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&fast, &slot), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&slow, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 0);
+    TEST_ASSERT_EQUALS(megaqueue_read_advance(&slow), A_OK);
+
+    /* Slow consumer freed up a single slot */
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    *(uint64_t *)slot = 8;
+    TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    /* A detached consumer can resume where it left off */
+    TEST_ASSERT_EQUALS(megaqueue_consumer_detach(&slow), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&slow, "slow"), A_OK);
+    TEST_ASSERT_EQUALS(slow.missed, 0);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&slow, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 1);
+
+    /* ...but no longer holds the producer back while detached */
+    TEST_ASSERT_EQUALS(megaqueue_consumer_detach(&slow), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&slow, "slow"), A_OK);
+    TEST_ASSERT_EQUALS(slow.missed, 7);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&slow, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 8);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&slow, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&fast, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_broadcast_lap)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_LAP, .lap_distance = 2 };
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestlap");
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestlap", 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestlap", 64, 8), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&cons, "lapped"), A_OK);
+
+    /* The producer never stops; it laps the consumer instead */
+    for (uint64_t i = 0; i < 12; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_E_OVERRUN);
+    TEST_ASSERT_EQUALS(cons.missed, 4);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 4);
+    TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_batch)
+{
+    struct megaqueue mq;
+    struct megaqueue_span span;
+    size_t count = 0;
+
+    shm_unlink("megaqueue_mqtestbatch");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&mq, O_RDWR | O_CREAT, "mqtestbatch", 64, 16), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&mq, 4, &span, &count), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(count, 0);
+
+    /* Claim 12 of the 16 slots, in one contiguous run */
+    TEST_ASSERT_EQUALS(megaqueue_claim_n(&mq, 12, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 12);
+    TEST_ASSERT_EQUALS(span.first, mq.writable_start);
+    TEST_ASSERT_EQUALS(span.first_count, 12);
+    TEST_ASSERT_EQUALS(span.second, NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        *(uint64_t *)(span.first + i * 64) = i;
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_publish_n(&mq, count), A_OK);
+
+    /* Consume 10 of them */
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&mq, 10, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 10);
+    TEST_ASSERT_EQUALS(*(uint64_t *)(span.first + 9 * 64), 9);
+    TEST_ASSERT_EQUALS(megaqueue_consume_n(&mq, count), A_OK);
+
+    /* Claim wraps around the end of the ring */
+    TEST_ASSERT_EQUALS(megaqueue_claim_n(&mq, 100, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 14);
+    TEST_ASSERT_EQUALS(span.first_count, 4);
+    TEST_ASSERT_EQUALS(span.second, mq.writable_start);
+    TEST_ASSERT_EQUALS(span.second_count, 10);
+
+    for (size_t i = 0; i < span.first_count; i++) {
+        *(uint64_t *)(span.first + i * 64) = 12 + i;
+    }
+
+    for (size_t i = 0; i < span.second_count; i++) {
+        *(uint64_t *)(span.second + i * 64) = 16 + i;
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_publish_n(&mq, count), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_claim_n(&mq, 1, &span, &count), A_E_NOSPC);
+
+    /* Reading the rest also wraps */
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&mq, 100, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 16);
+    TEST_ASSERT_EQUALS(span.first_count, 6);
+    TEST_ASSERT_EQUALS(*(uint64_t *)span.first, 10);
+    TEST_ASSERT_EQUALS(span.second_count, 10);
+    TEST_ASSERT_EQUALS(*(uint64_t *)(span.second + 9 * 64), 25);
+    TEST_ASSERT_EQUALS(megaqueue_consume_n(&mq, count), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&mq, 4, &span, &count), A_E_EMPTY);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_fast)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_FAST };
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestfast");
+
+    /* Fast mode needs power of two sizes */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestfast", 64, 12, &params), A_E_BADARGS);
+
+    /* Without leaving a queue behind, or a handle that can't be closed */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&cons, O_RDWR, "mqtestfast", 64, 12, NULL), A_E_INVAL);
+    TEST_ASSERT_EQUALS(prod.region, NULL);
+    TEST_ASSERT_EQUALS(prod.rgn_name, NULL);
+    TEST_ASSERT_EQUALS(prod.fd, -1);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 0), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestfast", 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&cons, O_RDWR, "mqtestfast", 64, 8, &params), A_OK);
+
+    /* The handle flag is not stored in the header */
+    TEST_ASSERT_EQUALS(prod.hdr->flags, 0);
+    TEST_ASSERT_NOT_EQUALS(prod.flags & MEGAQUEUE_FLAG_FAST, 0);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_E_EMPTY);
+
+    /* Fill the queue, then run it around the ring a few times */
+    for (uint64_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    for (uint64_t i = 0; i < 32; i++) {
+        void *expected = cons.writable_start + (i & 7) * 64;
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+        TEST_ASSERT_EQUALS(slot, expected);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i + 8;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    /* The producer's private head is visible to a plain handle */
+    TEST_ASSERT_EQUALS(prod.hdr->head, 40);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_varlen)
+{
+    struct megaqueue mq;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_VARLEN };
+    void *buf = NULL;
+    size_t length = 0;
+
+    shm_unlink("megaqueue_mqtestvarlen");
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestvarlen", 16, 64, &params), A_E_BADARGS);
+    shm_unlink("megaqueue_mqtestvarlen");
+
+    /* 64 units of 8 bytes */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestvarlen", 8, 64, &params), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_record(&mq, &buf, &length), A_E_EMPTY);
+
+    /* Records larger than half the ring are refused */
+    TEST_ASSERT_EQUALS(megaqueue_reserve(&mq, 32 * 8, &buf), A_E_BADARGS);
+
+    /* Reserve a lot, commit a little: takes 3 units */
+    TEST_ASSERT_EQUALS(megaqueue_reserve(&mq, 200, &buf), A_OK);
+    memset(buf, 0xa5, 13);
+    TEST_ASSERT_EQUALS(megaqueue_commit(&mq, 13), A_OK);
+    TEST_ASSERT_EQUALS(mq.hdr->head, 3);
+
+    /* 1 unit, just the header */
+    TEST_ASSERT_EQUALS(megaqueue_reserve(&mq, 0, &buf), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_commit(&mq, 0), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_record(&mq, &buf, &length), A_OK);
+    TEST_ASSERT_EQUALS(length, 13);
+    TEST_ASSERT_EQUALS(((uint8_t *)buf)[12], 0xa5);
+    TEST_ASSERT_EQUALS(megaqueue_release_record(&mq), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_record(&mq, &buf, &length), A_OK);
+    TEST_ASSERT_EQUALS(length, 0);
+    TEST_ASSERT_EQUALS(megaqueue_release_record(&mq), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_record(&mq, &buf, &length), A_E_EMPTY);
+
+    /* Fill up to 60 units, then a 10 unit record has to wrap */
+    for (uint64_t i = 0; i < 7; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_reserve(&mq, 56, &buf), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_commit(&mq, 56), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_read_record(&mq, &buf, &length), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_release_record(&mq), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(mq.hdr->head, 60);
+
+    TEST_ASSERT_EQUALS(megaqueue_reserve(&mq, 72, &buf), A_OK);
+    TEST_ASSERT_EQUALS(buf, mq.writable_start + sizeof(struct megaqueue_record));
+    *(uint64_t *)buf = 0xdeadbeefcafebabe;
+    TEST_ASSERT_EQUALS(megaqueue_commit(&mq, 72), A_OK);
+    TEST_ASSERT_EQUALS(mq.hdr->head, 74);
+
+    /* The padding record is skipped by the reader */
+    TEST_ASSERT_EQUALS(megaqueue_read_record(&mq, &buf, &length), A_OK);
+    TEST_ASSERT_EQUALS(length, 72);
+    TEST_ASSERT_EQUALS(*(uint64_t *)buf, 0xdeadbeefcafebabe);
+    TEST_ASSERT_EQUALS(megaqueue_release_record(&mq), A_OK);
+    TEST_ASSERT_EQUALS(mq.hdr->tail, 74);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_journal)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_JOURNAL, .journal_retain = 2 };
+    char path[] = "/tmp/mqtestjournalXXXXXX";
+    struct megaqueue_span span;
+    size_t count = 0;
+    void *slot = NULL;
+
+    TEST_ASSERT_NOT_EQUALS(mkdtemp(path), NULL);
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, path, 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&cons, O_RDWR, path, 64, 8, &params), A_OK);
+
+    /* The producer never waits on the consumer, it rolls onto new segments */
+    for (uint64_t i = 0; i < 20; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    /* Segment 0 was retired when the producer moved to segment 2 */
+    TEST_ASSERT_EQUALS(prod.hdr->journal_first, 1);
+
+    /* Reported like a lapped broadcast consumer, not as an empty queue */
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_E_OVERRUN);
+    TEST_ASSERT_EQUALS(cons.missed, 8);
+
+    for (uint64_t i = 8; i < 20; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_E_EMPTY);
+
+    /* A restarted producer picks up where it left off */
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, path, 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(prod.hdr->head, 20);
+
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    *(uint64_t *)slot = 20;
+    TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 20);
+
+    /* Falling behind again, this time seen by megaqueue_peek_n */
+    for (uint64_t i = 21; i < 52; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    /* The rest of a segment that is already mapped can still be read */
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&cons, 8, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 4);
+    TEST_ASSERT_EQUALS(megaqueue_consume_n(&cons, count), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&cons, 8, &span, &count), A_E_OVERRUN);
+    TEST_ASSERT_EQUALS(cons.missed, 24);
+    TEST_ASSERT_EQUALS(megaqueue_peek_n(&cons, 8, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)span.first, 40);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_seek)
+{
+    struct megaqueue mq;
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestseek");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&mq, O_RDWR | O_CREAT, "mqtestseek", 64, 8), A_OK);
+
+    for (uint64_t i = 0; i < 6; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_write_sequence(&mq), 6);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&mq), 2);
+
+    /* Objects that were released are gone */
+    TEST_ASSERT_EQUALS(megaqueue_seek(&mq, 1), A_E_OVERRUN);
+    TEST_ASSERT_EQUALS(mq.missed, 1);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&mq), 2);
+
+    /* Objects that were not produced yet can't be sought to */
+    TEST_ASSERT_EQUALS(megaqueue_seek(&mq, 7), A_E_NOENT);
+
+    /* Skip forward, the deletion pointer follows */
+    TEST_ASSERT_EQUALS(megaqueue_seek(&mq, 4), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_oldest_sequence(&mq), 4);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&mq, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 4);
+
+    TEST_ASSERT_EQUALS(megaqueue_seek(&mq, 6), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&mq, &slot), A_E_EMPTY);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    return TEST_OK;
+}
+
+static
+void *__test_megaqueue_wait_producer(void *arg)
+{
+    struct megaqueue *mq = arg;
+    void *slot = NULL;
+
+    /* Give the consumer time to go to sleep */
+    usleep(20000);
+
+    if (!AFAILED(megaqueue_next_slot(mq, &slot))) {
+        *(uint64_t *)slot = 0xdeadbeefcafebabe;
+        megaqueue_advance(mq);
+    }
+
+    return NULL;
+}
+
+TEST_DECL(test_megaqueue_wait)
+{
+    struct megaqueue mq;
+    pthread_t producer;
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestwait");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&mq, O_RDWR | O_CREAT, "mqtestwait", 64, 8), A_OK);
+
+    /* Nothing to read, times out */
+    TEST_ASSERT_EQUALS(megaqueue_wait(&mq, 100, 0), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(megaqueue_wait(&mq, 100, 2000000), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(mq.hdr->waiters, 0);
+
+    /* Sleep until the producer wakes us up */
+    TEST_ASSERT_EQUALS(pthread_create(&producer, NULL, __test_megaqueue_wait_producer, &mq), 0);
+    TEST_ASSERT_EQUALS(megaqueue_wait(&mq, 100, MEGAQUEUE_WAIT_FOREVER), A_OK);
+    TEST_ASSERT_EQUALS(pthread_join(producer, NULL), 0);
+    TEST_ASSERT_EQUALS(mq.hdr->waiters, 0);
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&mq, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 0xdeadbeefcafebabe);
+
+    /* Returns right away when there is something to read */
+    TEST_ASSERT_EQUALS(megaqueue_wait(&mq, 0, MEGAQUEUE_WAIT_FOREVER), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    return TEST_OK;
+}
+
+#define MQ_TEST_MP_PRODUCERS    3
+#define MQ_TEST_MP_OBJECTS      20000
+
+static
+void *__test_megaqueue_mp_producer(void *arg)
+{
+    uint64_t id = (uint64_t)(uintptr_t)arg;
+    struct megaqueue mq;
+    void *slot = NULL;
+
+    if (AFAILED(megaqueue_open(&mq, O_RDWR, "mqtestmp", 64, 64))) {
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < MQ_TEST_MP_OBJECTS; i++) {
+        while (AFAILED(megaqueue_next_slot(&mq, &slot))) {
+            ck_pr_stall();
+        }
+
+        ((uint64_t *)slot)[0] = id;
+        ((uint64_t *)slot)[1] = i;
+
+        megaqueue_advance(&mq);
+    }
+
+    megaqueue_close(&mq, 0);
+
+    return NULL;
+}
+
+/**
+ * Run the producer threads against mq, and check what comes out of it
+ */
+static
+int __test_megaqueue_mp_run(struct megaqueue *mq)
+{
+    pthread_t producers[MQ_TEST_MP_PRODUCERS];
+    uint64_t next[MQ_TEST_MP_PRODUCERS] = { 0 };
+    void *slot = NULL;
+
+    for (uint64_t i = 0; i < MQ_TEST_MP_PRODUCERS; i++) {
+        TEST_ASSERT_EQUALS(pthread_create(&producers[i], NULL, __test_megaqueue_mp_producer, (void *)(uintptr_t)i), 0);
+    }
+
+    /* Every producer's objects show up whole and in order */
+    for (uint64_t i = 0; i < MQ_TEST_MP_PRODUCERS * MQ_TEST_MP_OBJECTS; i++) {
+        uint64_t *obj = NULL;
+
+        TEST_ASSERT_EQUALS(megaqueue_wait(mq, 1000, MEGAQUEUE_WAIT_FOREVER), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(mq, &slot), A_OK);
+
+        obj = slot;
+        TEST_ASSERT(obj[0] < MQ_TEST_MP_PRODUCERS);
+        TEST_ASSERT_EQUALS(obj[1], next[obj[0]]);
+        next[obj[0]]++;
+
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(mq), A_OK);
+    }
+
+    for (uint64_t i = 0; i < MQ_TEST_MP_PRODUCERS; i++) {
+        TEST_ASSERT_EQUALS(pthread_join(producers[i], NULL), 0);
+    }
+
+    TEST_ASSERT_EQUALS(mq->hdr->head, MQ_TEST_MP_PRODUCERS * MQ_TEST_MP_OBJECTS);
+    TEST_ASSERT_EQUALS(mq->hdr->reserve, MQ_TEST_MP_PRODUCERS * MQ_TEST_MP_OBJECTS);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_multi_producer)
+{
+    struct megaqueue mq;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_MULTI_PRODUCER };
+
+    shm_unlink("megaqueue_mqtestmp");
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestmp", 64, 64, &params), A_OK);
+    TEST_ASSERT_NOT_EQUALS(mq.commit, NULL);
+    TEST_ASSERT_EQUALS(__test_megaqueue_mp_run(&mq), TEST_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    /* On a broadcast queue, the producers make room for themselves, all at once */
+    params.flags |= MEGAQUEUE_FLAG_BROADCAST;
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestmp", 64, 64, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&mq, "mp"), A_OK);
+    TEST_ASSERT_EQUALS(__test_megaqueue_mp_run(&mq), TEST_OK);
+    TEST_ASSERT(mq.hdr->_delete <= mq.hdr->reserve);
+    TEST_ASSERT(mq.hdr->reserve - mq.hdr->_delete <= 64);
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_hugepage)
+{
+    struct megaqueue mq;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_HUGE_PAGE };
+    char path[] = "/dev/shm/mqtesthugeXXXXXX";
+    char data_path[64];
+    struct stat st;
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtesthuge");
+
+    /* Any filesystem that can punch holes stands in for hugetlbfs here */
+    TEST_ASSERT_NOT_EQUALS(mkdtemp(path), NULL);
+    snprintf(data_path, sizeof(data_path), "%s/megaqueue_mqtesthuge", path);
+    params.hugetlbfs_path = path;
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtesthuge", 64, 256, &params), A_OK);
+    TEST_ASSERT_NOT_EQUALS(mq.data_region, NULL);
+    TEST_ASSERT_EQUALS(mq.writable_start, mq.data_region);
+
+    for (uint64_t i = 0; i < 256; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+    }
+
+    for (uint64_t i = 0; i < 128; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(stat(data_path, &st), 0);
+    TEST_ASSERT_EQUALS(st.st_blocks * 512, 256 * 64);
+
+    /* Half the ring was consumed, so half the pages go away */
+    TEST_ASSERT_EQUALS(megaqueue_reclaim(&mq, 0), A_OK);
+    TEST_ASSERT_EQUALS(stat(data_path, &st), 0);
+    TEST_ASSERT_EQUALS(st.st_blocks * 512, 128 * 64);
+
+    /* Nothing new to reclaim */
+    TEST_ASSERT_EQUALS(megaqueue_reclaim(&mq, 0), A_OK);
+
+    /* The unconsumed objects are still there, and the reclaimed slots are reusable */
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&mq, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 128);
+
+    for (uint64_t i = 256; i < 384; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+    }
+
+    for (uint64_t i = 128; i < 384; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&mq, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+    TEST_ASSERT_NOT_EQUALS(stat(data_path, &st), 0);
+    TEST_ASSERT_EQUALS(rmdir(path), 0);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_maint)
+{
+    struct megaqueue mq;
+    struct megaqueue_maint maint;
+    struct stat st;
+    size_t page_size = getpagesize();
+    uint64_t per_page = page_size / 64;
+    off_t full = 0;
+    unsigned int wait = 0;
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestmaint");
+
+    /* 64 pages of objects, keep 4 pages ahead of the head */
+    TEST_ASSERT_EQUALS(megaqueue_open(&mq, O_RDWR | O_CREAT, "mqtestmaint", 64, 64 * per_page), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_maint_init(&maint, &mq, 4 * per_page, 0, MEGAQUEUE_MAINT_LOCK), A_OK);
+    TEST_ASSERT_EQUALS(maint.guard, 4 * per_page);
+
+    TEST_ASSERT_EQUALS(fstat(mq.fd, &st), 0);
+    full = st.st_blocks * 512;
+
+    for (uint64_t i = 0; i < 32 * per_page; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    }
+
+    /* The first half of the ring was consumed, the window ahead is already there */
+    TEST_ASSERT_EQUALS(megaqueue_maint_step(&maint), A_OK);
+    TEST_ASSERT_EQUALS(fstat(mq.fd, &st), 0);
+    TEST_ASSERT_EQUALS(st.st_blocks * 512, full - 32 * page_size);
+    TEST_ASSERT_EQUALS(maint.fault_offset, 36 * page_size);
+
+    for (uint64_t i = 32 * per_page; i < 64 * per_page; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    }
+
+    /* The rest goes away, and the pages at the start of the ring are faulted back in */
+    TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_maint_endpoint(&maint), &wait), A_OK);
+    TEST_ASSERT_EQUALS(wait, MEGAQUEUE_MAINT_INTERVAL);
+    TEST_ASSERT_EQUALS(fstat(mq.fd, &st), 0);
+    TEST_ASSERT_EQUALS(st.st_blocks * 512, full - 60 * page_size);
+
+    /* Nothing new to do */
+    TEST_ASSERT_EQUALS(megaqueue_maint_step(&maint), A_OK);
+    TEST_ASSERT_EQUALS(fstat(mq.fd, &st), 0);
+    TEST_ASSERT_EQUALS(st.st_blocks * 512, full - 60 * page_size);
+
+    for (uint64_t i = 64 * per_page; i < 96 * per_page; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&mq, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_maint_cleanup(&maint), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    /* Journal segments are populated when they are rolled onto */
+    char path[] = "/dev/shm/mqtestmaintXXXXXX";
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_JOURNAL };
+
+    TEST_ASSERT_NOT_EQUALS(mkdtemp(path), NULL);
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, path, 64, 64 * per_page, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_maint_init(&maint, &mq, 4 * per_page, 0, 0), A_E_INVAL);
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_resume)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_RESUME };
+    struct megaqueue_params mp_params = { .flags = MEGAQUEUE_FLAG_MULTI_PRODUCER | MEGAQUEUE_FLAG_RESUME };
+    unsigned int state = 0;
+    void *slot = NULL;
+    pid_t child = -1;
+
+    shm_unlink("megaqueue_mqtestresume");
+
+    /* Nothing to resume, so the queue is created */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestresume", 64, 1024, &params), A_OK);
+    TEST_ASSERT_EQUALS(prod.hdr->magic, MEGAQUEUE_MAGIC);
+    TEST_ASSERT_EQUALS(prod.hdr->version, MEGAQUEUE_VERSION);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestresume", 64, 1024), A_OK);
+
+    for (uint64_t i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_producer_state(&cons, 1000000000ull, &state), A_OK);
+    TEST_ASSERT_EQUALS(state, MEGAQUEUE_PRODUCER_ALIVE);
+    TEST_ASSERT_EQUALS(megaqueue_producer_state(&cons, 0, &state), A_OK);
+    TEST_ASSERT_EQUALS(state, MEGAQUEUE_PRODUCER_STALLED);
+
+    /* Pretend the producer was a process that has gone away */
+    if (0 == (child = fork())) {
+        _exit(0);
+    }
+    TEST_ASSERT_EQUALS(waitpid(child, NULL, 0), child);
+    prod.hdr->producer_pid = child;
+
+    TEST_ASSERT_EQUALS(megaqueue_producer_state(&cons, 1000000000ull, &state), A_OK);
+    TEST_ASSERT_EQUALS(state, MEGAQUEUE_PRODUCER_DEAD);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 0), A_OK);
+
+    for (uint64_t i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+    }
+
+    /* A restarted producer that does not match the queue is turned away */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestresume", 64, 2048, &params), A_E_INVAL);
+
+    /* The restarted producer carries on from the head, the consumer doesn't notice */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestresume", 64, 1024, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_write_sequence(&prod), 10);
+    TEST_ASSERT_EQUALS(prod.hdr->producer_pid, (uint64_t)getpid());
+    TEST_ASSERT_EQUALS(megaqueue_producer_state(&cons, 1000000000ull, &state), A_OK);
+    TEST_ASSERT_EQUALS(state, MEGAQUEUE_PRODUCER_ALIVE);
+
+    for (uint64_t i = 10; i < 20; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    for (uint64_t i = 5; i < 20; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+
+    /* A header that is not a megaqueue's is refused */
+    prod.hdr->magic = 0;
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestresume", 64, 1024), A_E_INVAL);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    /* Claims a crashed multi-producer never published are rolled back */
+    shm_unlink("megaqueue_mqtestresumemp");
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestresumemp", 64, 1024, &mp_params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(prod.hdr->reserve, 2);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 0), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestresumemp", 64, 1024, &mp_params), A_OK);
+    TEST_ASSERT_EQUALS(prod.hdr->reserve, 1);
+    TEST_ASSERT_EQUALS(prod.hdr->head, 1);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    TEST_ASSERT_EQUALS(prod.hdr->head, 2);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_snoop)
+{
+    struct megaqueue prod, cons, snoop;
+    void *slot = NULL;
+
+    shm_unlink("megaqueue_mqtestsnoop");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestsnoop", 64, 16), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestsnoop", 64, 16), A_OK);
+
+    for (uint64_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    for (uint64_t i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+    }
+
+    /* A read-only handle starts at the oldest object, and reads on its own */
+    TEST_ASSERT_EQUALS(megaqueue_open(&snoop, O_RDONLY, "mqtestsnoop", 64, 16), A_OK);
+    TEST_ASSERT_NOT_EQUALS(snoop.flags & MEGAQUEUE_FLAG_SNOOP, 0);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&snoop), 4);
+
+    for (uint64_t i = 4; i < 8; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&snoop, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, i);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&snoop), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&snoop, &slot), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 4);
+    TEST_ASSERT_EQUALS(prod.hdr->_delete, 4);
+
+    /* Snoopers can go back to anything still in the queue */
+    TEST_ASSERT_EQUALS(megaqueue_seek(&snoop, 5), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&snoop, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 5);
+    TEST_ASSERT_EQUALS(prod.hdr->_delete, 4);
+
+    /* The producer does not wait for a snooper, which finds out it was overwritten */
+    for (uint64_t i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+    }
+
+    for (uint64_t i = 8; i < 24; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_advance(&snoop), A_E_OVERRUN);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&snoop), 8);
+    TEST_ASSERT_EQUALS(snoop.missed, 3);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&snoop, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 8);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&snoop, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+
+TEST_DECL(test_megaqueue_index)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_index index, reader;
+    uint64_t seq = 0;
+    void *slot = NULL;
+
+    shm_unlink("/megaqueue_mqtestindex");
+    shm_unlink("/megaqueue_mqtestindex_index");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestindex", 64, 128), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_index_open(&reader, &prod, O_RDONLY, 0, 0), A_E_NOTFOUND);
+    TEST_ASSERT_EQUALS(megaqueue_index_open(&index, &prod, O_RDWR | O_CREAT, 4, 64), A_OK);
+
+    /* Record i is stamped 1000 + 10 * i, every 4th record is indexed */
+    for (uint64_t i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        megaqueue_index_add(&index, megaqueue_write_sequence(&prod), 1000 + 10 * i);
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(index.hdr->count, 25);
+
+    TEST_ASSERT_EQUALS(megaqueue_index_open(&reader, &prod, O_RDONLY, 0, 0), A_OK);
+    TEST_ASSERT_EQUALS(reader.stride, 4);
+    TEST_ASSERT_EQUALS(reader.capacity, 64);
+
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&reader, 1505, &seq), A_OK);
+    TEST_ASSERT_EQUALS(seq, 48);
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&reader, 1480, &seq), A_OK);
+    TEST_ASSERT_EQUALS(seq, 48);
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&reader, 1000, &seq), A_OK);
+    TEST_ASSERT_EQUALS(seq, 0);
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&reader, 999999, &seq), A_OK);
+    TEST_ASSERT_EQUALS(seq, 96);
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&reader, 999, &seq), A_E_NOTFOUND);
+
+    /* Seeking lands on the indexed record, the rest is a short scan */
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDONLY, "mqtestindex", 64, 128), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_index_seek(&reader, &cons, 1505), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)slot, 48);
+
+    TEST_ASSERT_EQUALS(megaqueue_index_seek(&reader, &cons, 5), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 0);
+
+    /* Once the ring of entries wraps, the oldest ones are gone */
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_index_close(&reader, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_index_close(&index, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_index_open(&index, &prod, O_RDWR | O_CREAT, 4, 8), A_OK);
+    TEST_ASSERT_EQUALS(index.hdr->count, 0);
+
+    for (uint64_t i = 0; i < 100; i++) {
+        megaqueue_index_add(&index, i, 1000 + 10 * i);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&index, 1505, &seq), A_E_NOTFOUND);
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&index, 1965, &seq), A_OK);
+    TEST_ASSERT_EQUALS(seq, 96);
+    TEST_ASSERT_EQUALS(megaqueue_index_find(&index, 1725, &seq), A_OK);
+    TEST_ASSERT_EQUALS(seq, 72);
+
+    TEST_ASSERT_EQUALS(megaqueue_index_close(&index, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    /* Removing the queue removes the index */
+    TEST_ASSERT_EQUALS(shm_unlink("/megaqueue_mqtestindex_index"), -1);
+
+    return TEST_OK;
+}
+
+static
+uint64_t test_megaqueue_merge_timestamp(const void *buf, size_t length)
+{
+    return *(const uint64_t *)buf;
+}
+
+static
+aresult_t test_megaqueue_merge_publish(struct megaqueue *queue, uint64_t timestamp)
+{
+    void *slot = NULL;
+    aresult_t ret = A_OK;
+
+    if (AFAILED(ret = megaqueue_next_slot(queue, &slot))) {
+        return ret;
+    }
+
+    *(uint64_t *)slot = timestamp;
+
+    return megaqueue_advance(queue);
+}
+
+TEST_DECL(test_megaqueue_merge)
+{
+    struct megaqueue prod[3], cons[3];
+    struct megaqueue *queues[3] = { &cons[0], &cons[1], &cons[2] };
+    struct megaqueue_merge merge;
+    void *buf = NULL;
+    size_t length = 0;
+    unsigned int source = 0;
+
+    for (int i = 0; i < 3; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "mqtestmerge%d", i);
+        TEST_ASSERT_EQUALS(megaqueue_open(&prod[i], O_RDWR | O_CREAT, name, 64, 16), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_open(&cons[i], O_RDWR, name, 64, 16), A_OK);
+    }
+
+    /* Queue i gets timestamps i + 1, i + 4, i + 7 */
+    for (uint64_t ts = 1; ts <= 9; ts++) {
+        struct megaqueue *to = &prod[(ts - 1) % 3];
+        TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(to, ts), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_init(&merge, queues, 3, test_megaqueue_merge_timestamp,
+                                            MEGAQUEUE_MERGE_WAIT_FOREVER), A_OK);
+
+    for (uint64_t ts = 1; ts <= 7; ts++) {
+        size_t expected = (ts - 1) % 3;
+        TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)buf, ts);
+        TEST_ASSERT_EQUALS(length, 64);
+        TEST_ASSERT_EQUALS(source, expected);
+        TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_E_BUSY);
+        TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+    }
+
+    /* Queue 0 is empty, and could still produce something before 8 */
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[0], 10), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)buf, 8);
+    TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+
+    /* Now queue 1 could */
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[1], 11), A_OK);
+    TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[2], 12), A_OK);
+
+    for (uint64_t ts = 9; ts <= 10; ts++) {
+        TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)buf, ts);
+        TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(merge.late, 0);
+    TEST_ASSERT_EQUALS(megaqueue_merge_cleanup(&merge), A_OK);
+
+    /* With a bounded delay, a stalled queue only holds the others back for a while */
+    TEST_ASSERT_EQUALS(megaqueue_merge_init(&merge, queues, 3, test_megaqueue_merge_timestamp, 2000000), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_E_EMPTY);
+    usleep(5000);
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)buf, 11);
+    TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+
+    /* Queue 1 just ran dry, so it gets the same grace period */
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_E_EMPTY);
+    usleep(5000);
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)buf, 12);
+    TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+
+    /* What the stalled queue produces later is passed on right away, as late */
+    TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[0], 9), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, &source), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)buf, 9);
+    TEST_ASSERT_EQUALS(source, 0);
+    TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+    TEST_ASSERT_EQUALS(merge.late, 1);
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_cleanup(&merge), A_OK);
+
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_close(&cons[i], 0), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_close(&prod[i], 1), A_OK);
+    }
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_merge_lapped)
+{
+    struct megaqueue prod[2], cons[2];
+    struct megaqueue *queues[2] = { &cons[0], &cons[1] };
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_LAP, .lap_distance = 2 };
+    struct megaqueue_merge merge;
+    void *buf = NULL;
+    size_t length = 0;
+    uint64_t oldest = 0;
+
+    shm_unlink("megaqueue_mqtestmergelap");
+    shm_unlink("megaqueue_mqtestmergeslow");
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod[0], O_RDWR | O_CREAT, "mqtestmergelap", 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons[0], O_RDWR, "mqtestmergelap", 64, 8), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&cons[0], "merge"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod[1], O_RDWR | O_CREAT, "mqtestmergeslow", 64, 8), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons[1], O_RDWR, "mqtestmergeslow", 64, 8), A_OK);
+
+    TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[0], 1), A_OK);
+    TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[1], 100), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_init(&merge, queues, 2, test_megaqueue_merge_timestamp,
+                                            MEGAQUEUE_MERGE_WAIT_FOREVER), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, NULL), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)buf, 1);
+
+    /* The record is overwritten while it is held */
+    for (uint64_t ts = 11; ts <= 22; ts++) {
+        TEST_ASSERT_EQUALS(test_megaqueue_merge_publish(&prod[0], ts), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_E_OVERRUN);
+    TEST_ASSERT_NOT_EQUALS(cons[0].missed, 0);
+
+    /* The merge picks up from the oldest record the queue still has, not the stale one */
+    oldest = *(uint64_t *)__megaqueue_read_slot(&cons[0], megaqueue_read_sequence(&cons[0]));
+    TEST_ASSERT_NOT_EQUALS(oldest, 1);
+
+    for (uint64_t ts = oldest; ts <= 22; ts++) {
+        TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, NULL), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)buf, ts);
+        TEST_ASSERT_EQUALS(megaqueue_merge_release(&merge), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_merge_next(&merge, &buf, &length, NULL), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(megaqueue_merge_cleanup(&merge), A_OK);
+
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_close(&cons[i], 0), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_close(&prod[i], 1), A_OK);
+    }
+
+    return TEST_OK;
+}
+
+#define TEST_MEGAQUEUE_HUGE_PAGE    (2 * 1024 * 1024)
+
+TEST_DECL(test_megaqueue_numa)
+{
+    struct megaqueue mq;
+    struct megaqueue_params params = { .flags = 0 };
+    uint64_t pages[4];
+    uint64_t absent = 0;
+    void *slot = NULL;
+    char hugetlbfs_path[PATH_MAX] = "";
+    struct mntent *ent = NULL;
+    struct statfs sfs;
+    FILE *mounts = NULL;
+
+    shm_unlink("/megaqueue_mqtestnuma");
+
+    /* Bad policies are turned away before anything is created */
+    params.numa_policy = 42;
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestnuma", 64, 1024, &params), A_E_BADARGS);
+    params.numa_policy = MEGAQUEUE_NUMA_NODE;
+    params.numa_target = MEGAQUEUE_NUMA_MAX_NODES;
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestnuma", 64, 1024, &params), A_E_BADARGS);
+    params.flags = MEGAQUEUE_FLAG_JOURNAL;
+    params.numa_target = 0;
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestnuma", 64, 1024, &params), A_E_BADARGS);
+    TEST_ASSERT_EQUALS(shm_unlink("/megaqueue_mqtestnuma"), -1);
+
+    /* Node 0 always exists */
+    params.flags = 0;
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestnuma", 64, 1024, &params), A_OK);
+
+    for (uint64_t i = 0; i < 1024; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_numa_residency(&mq, pages, BL_ARRAY_ENTRIES(pages), &absent), A_OK);
+    TEST_ASSERT_EQUALS(pages[0], 64 * 1024 / mq.page_size);
+    TEST_ASSERT_EQUALS(absent, 0);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    /* Local to whichever CPU we happen to be on */
+    params.numa_policy = MEGAQUEUE_NUMA_LOCAL;
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestnuma", 64, 1024, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+
+    /*
+     * Huge pages hold many base pages, but are only counted once. Needs a 2MB
+     * hugetlbfs mount with 4 pages free.
+     */
+    if (NULL != (mounts = setmntent("/proc/mounts", "r"))) {
+        while (NULL != (ent = getmntent(mounts))) {
+            if (0 == strcmp(ent->mnt_type, "hugetlbfs") && 0 == statfs(ent->mnt_dir, &sfs) &&
+                    TEST_MEGAQUEUE_HUGE_PAGE == sfs.f_bsize)
+            {
+                snprintf(hugetlbfs_path, sizeof(hugetlbfs_path), "%s", ent->mnt_dir);
+                break;
+            }
+        }
+
+        endmntent(mounts);
+    }
+
+    if ('\0' != hugetlbfs_path[0]) {
+        size_t per_page = TEST_MEGAQUEUE_HUGE_PAGE / 64;
+
+        params.flags = MEGAQUEUE_FLAG_HUGE_PAGE;
+        params.numa_policy = MEGAQUEUE_NUMA_DEFAULT;
+        params.hugetlbfs_path = hugetlbfs_path;
+
+        TEST_ASSERT_EQUALS(megaqueue_open_ex(&mq, O_RDWR | O_CREAT, "mqtestnuma", 64, 4 * per_page, &params), A_OK);
+        TEST_ASSERT_EQUALS(mq.page_size, TEST_MEGAQUEUE_HUGE_PAGE);
+
+        for (uint64_t i = 0; i < mq.object_count; i++) {
+            TEST_ASSERT_EQUALS(megaqueue_next_slot(&mq, &slot), A_OK);
+            TEST_ASSERT_EQUALS(megaqueue_advance(&mq), A_OK);
+        }
+
+        /* Consume and reclaim the first two huge pages */
+        for (uint64_t i = 0; i < 2 * per_page; i++) {
+            TEST_ASSERT_EQUALS(megaqueue_read_advance(&mq), A_OK);
+        }
+
+        TEST_ASSERT_EQUALS(megaqueue_reclaim(&mq, 0), A_OK);
+
+        TEST_ASSERT_EQUALS(megaqueue_numa_residency(&mq, pages, BL_ARRAY_ENTRIES(pages), &absent), A_OK);
+        TEST_ASSERT_EQUALS(pages[0] + pages[1] + pages[2] + pages[3], 2);
+        TEST_ASSERT_EQUALS(absent, 2);
+
+        TEST_ASSERT_EQUALS(megaqueue_close(&mq, 1), A_OK);
+    }
+
+    return TEST_OK;
+}
+
+struct test_megaqueue_tick {
+    uint64_t seq;
+    uint32_t price;
+    uint32_t size;
+    uint8_t pad[48];
+};
+
+MEGAQUEUE_DEFINE(test_tick, struct test_megaqueue_tick, 64)
+
+TEST_DECL(test_megaqueue_typed)
+{
+    struct megaqueue prod, cons, other, wrong;
+    struct test_tick_span span;
+    struct test_megaqueue_tick tick = { .seq = 0 };
+    struct test_megaqueue_tick *slot = NULL;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_VARLEN };
+    size_t count = 0;
+
+    shm_unlink("/megaqueue_mqtesttyped");
+
+    TEST_ASSERT_EQUALS(test_tick_open(&prod, O_RDWR | O_CREAT, "mqtesttyped", &params), A_E_BADARGS);
+    TEST_ASSERT_EQUALS(test_tick_open(&prod, O_RDWR | O_CREAT, "mqtesttyped", NULL), A_OK);
+    TEST_ASSERT_EQUALS(test_tick_open(&cons, O_RDWR, "mqtesttyped", NULL), A_OK);
+
+    /* The layout of an existing queue has to match the type */
+    shm_unlink("/megaqueue_mqtesttyped2");
+    TEST_ASSERT_EQUALS(megaqueue_open(&other, O_RDWR | O_CREAT, "mqtesttyped2", 128, 64), A_OK);
+    TEST_ASSERT_EQUALS(test_tick_open(&wrong, O_RDONLY, "mqtesttyped2", NULL), A_E_BADARGS);
+    TEST_ASSERT_EQUALS(megaqueue_close(&other, 1), A_OK);
+
+    for (uint64_t i = 0; i < 40; i++) {
+        tick.seq = i;
+        tick.price = 100 + i;
+        TEST_ASSERT_EQUALS(test_tick_push(&prod, &tick), A_OK);
+    }
+
+    for (uint64_t i = 0; i < 40; i++) {
+        TEST_ASSERT_EQUALS(test_tick_pop(&cons, &tick), A_OK);
+        TEST_ASSERT_EQUALS(tick.seq, i);
+        TEST_ASSERT_EQUALS(tick.price, 100 + i);
+    }
+
+    TEST_ASSERT_EQUALS(test_tick_pop(&cons, &tick), A_E_EMPTY);
+
+    /* A batch that wraps around the end of the ring */
+    TEST_ASSERT_EQUALS(test_tick_claim_n(&prod, 48, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 48);
+    TEST_ASSERT_EQUALS(span.first_count, 24);
+    TEST_ASSERT_EQUALS(span.second_count, 24);
+    TEST_ASSERT_EQUALS(span.second, prod.writable_start);
+
+    for (size_t i = 0; i < span.first_count; i++) {
+        span.first[i].seq = 40 + i;
+    }
+
+    for (size_t i = 0; i < span.second_count; i++) {
+        span.second[i].seq = 40 + span.first_count + i;
+    }
+
+    TEST_ASSERT_EQUALS(test_tick_publish_n(&prod, count), A_OK);
+
+    TEST_ASSERT_EQUALS(test_tick_read_next_slot(&cons, &slot), A_OK);
+    TEST_ASSERT_EQUALS(slot->seq, 40);
+    TEST_ASSERT_EQUALS(test_tick_read_advance(&cons), A_OK);
+
+    TEST_ASSERT_EQUALS(test_tick_peek_n(&cons, 64, &span, &count), A_OK);
+    TEST_ASSERT_EQUALS(count, 47);
+    TEST_ASSERT_EQUALS(span.first[0].seq, 41);
+    TEST_ASSERT_EQUALS(span.second[span.second_count - 1].seq, 87);
+    TEST_ASSERT_EQUALS(test_tick_consume_n(&cons, count), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_prefetch)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_POPULATE, .prefetch_distance = 8 };
+    struct megaqueue_span span;
+    size_t count = 0;
+    void *slot = NULL;
+
+    shm_unlink("/megaqueue_mqtestprefetch");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestprefetch", 128, 64), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&cons, O_RDWR, "mqtestprefetch", 128, 64, &params), A_OK);
+    TEST_ASSERT_EQUALS(cons.prefetch_distance, 8);
+    TEST_ASSERT_EQUALS(prod.prefetch_distance, 0);
+
+    /* Prefetching past the head and around the end of the ring changes nothing */
+    for (uint64_t lap = 0; lap < 3; lap++) {
+        for (uint64_t i = 0; i < 48; i++) {
+            TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+            *(uint64_t *)slot = lap * 48 + i;
+            TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+        }
+
+        for (uint64_t i = 0; i < 16; i++) {
+            TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_OK);
+            TEST_ASSERT_EQUALS(*(uint64_t *)slot, lap * 48 + i);
+            TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+        }
+
+        TEST_ASSERT_EQUALS(megaqueue_peek_n(&cons, 64, &span, &count), A_OK);
+        TEST_ASSERT_EQUALS(count, 32);
+        TEST_ASSERT_EQUALS(*(uint64_t *)span.first, lap * 48 + 16);
+        TEST_ASSERT_EQUALS(megaqueue_consume_n(&cons, count), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&cons, &slot), A_E_EMPTY);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_group)
+{
+    struct megaqueue prod, a, b;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_BROADCAST };
+    struct megaqueue_span span_a, span_b;
+    size_t count_a = 0, count_b = 0;
+    void *slot = NULL;
+
+    shm_unlink("/megaqueue_mqtestgroup");
+
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestgroup", 64, 8, &params), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&a, O_RDWR, "mqtestgroup", 64, 8), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&b, O_RDWR, "mqtestgroup", 64, 8), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_join(&a, "workers"), A_E_NOTFOUND);
+    TEST_ASSERT_EQUALS(megaqueue_group_create(&prod, "workers"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_group_create(&prod, "workers"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&a, "workers"), A_E_EXIST);
+    TEST_ASSERT_EQUALS(megaqueue_group_join(&a, "workers"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_group_join(&b, "workers"), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&a, 4, &span_a, &count_a), A_E_EMPTY);
+
+    /* The group holds the producer back, even with no batch claimed */
+    for (uint64_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    /* Members don't get to move the cursor of the group on their own */
+    TEST_ASSERT_EQUALS(megaqueue_seek(&a, 4), A_E_BADARGS);
+
+    /* Each object goes to exactly one member */
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&a, 3, &span_a, &count_a), A_OK);
+    TEST_ASSERT_EQUALS(count_a, 3);
+    TEST_ASSERT_EQUALS(*(uint64_t *)span_a.first, 0);
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&a, 3, &span_a, &count_a), A_E_BUSY);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&b, 8, &span_b, &count_b), A_OK);
+    TEST_ASSERT_EQUALS(count_b, 5);
+    TEST_ASSERT_EQUALS(*(uint64_t *)span_b.first, 3);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&b, 8, &span_b, &count_b), A_E_BUSY);
+
+    /* Everything was handed out, but the batches are still held */
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_ack(&b), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_group_ack(&b), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&b, 8, &span_b, &count_b), A_E_EMPTY);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_ack(&a), A_OK);
+
+    for (uint64_t i = 8; i < 16; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    /* A member that leaves stops holding the producer back; the group does not */
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&a, 2, &span_a, &count_a), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)span_a.first, 8);
+    TEST_ASSERT_EQUALS(megaqueue_group_leave(&a), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_group_leave(&a), A_E_NOTFOUND);
+
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&b, 1, &span_b, &count_b), A_OK);
+    TEST_ASSERT_EQUALS(*(uint64_t *)span_b.first, 10);
+    TEST_ASSERT_EQUALS(megaqueue_group_ack(&b), A_OK);
+
+    /* Destroying the group releases the producer, and orphans its members */
+    TEST_ASSERT_EQUALS(megaqueue_group_destroy(&prod, "workers"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_group_destroy(&prod, "workers"), A_E_NOTFOUND);
+    TEST_ASSERT_EQUALS(megaqueue_group_claim(&b, 1, &span_b, &count_b), A_E_NOTFOUND);
+    TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_group_leave(&b), A_OK);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&b, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&a, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+struct test_megaqueue_repl_receiver {
+    struct megaqueue *queue;
+    int fd;
+    aresult_t ret;
+    uint64_t objects;
+    uint64_t missed;
+    /** Number of times the replica had no room for a batch */
+    uint64_t full;
+};
+
+static
+void *__test_megaqueue_repl_receiver(void *arg)
+{
+    struct test_megaqueue_repl_receiver *rcv = arg;
+    struct megaqueue_repl_hello hello;
+    struct megaqueue_repl repl;
+
+    if (AFAILED(rcv->ret = megaqueue_repl_receiver_hello(rcv->fd, &hello)) ||
+            AFAILED(rcv->ret = megaqueue_repl_receiver_init(&repl, rcv->queue, rcv->fd, &hello)))
+    {
+        return NULL;
+    }
+
+    /* A full replica is retried until it is drained, or the sender hangs up */
+    while (A_OK == (rcv->ret = megaqueue_repl_receive(&repl)) || A_E_NOSPC == rcv->ret) {
+        if (A_E_NOSPC == rcv->ret) {
+            ck_pr_inc_64(&rcv->full);
+        }
+    }
+
+    rcv->objects = repl.objects;
+    rcv->missed = repl.missed;
+
+    return NULL;
+}
+
+/**
+ * Connect a sender to a receiver thread over the loopback interface
+ */
+static
+int test_megaqueue_repl_connect(struct test_megaqueue_repl_receiver *rcv, struct megaqueue *dst, pthread_t *thread)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    int lfd = -1;
+    int fd = -1;
+
+    memset(rcv, 0, sizeof(*rcv));
+    rcv->queue = dst;
+    rcv->fd = -1;
+
+    if (0 > (lfd = socket(AF_INET, SOCK_STREAM, 0)) ||
+            0 > bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            0 > listen(lfd, 1) ||
+            0 > getsockname(lfd, (struct sockaddr *)&addr, &addr_len) ||
+            0 > (fd = socket(AF_INET, SOCK_STREAM, 0)) ||
+            0 > connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            0 > (rcv->fd = accept(lfd, NULL, NULL)) ||
+            0 != pthread_create(thread, NULL, __test_megaqueue_repl_receiver, rcv))
+    {
+        fd = -1;
+    }
+
+    if (0 <= lfd) {
+        close(lfd);
+    }
+
+    return fd;
+}
+
+TEST_DECL(test_megaqueue_repl)
+{
+    struct megaqueue prod, cons, dst, reader, lap_prod;
+    struct megaqueue_params params = { .flags = MEGAQUEUE_FLAG_BROADCAST };
+    struct megaqueue_params varlen = { .flags = MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_VARLEN };
+    struct megaqueue_params lapping = { .flags = MEGAQUEUE_FLAG_BROADCAST | MEGAQUEUE_FLAG_LAP };
+    struct test_megaqueue_repl_receiver rcv;
+    struct megaqueue_repl repl;
+    pthread_t thread;
+    void *slot = NULL;
+    size_t length = 0;
+    uint64_t seq = 0;
+    int fd = -1;
+    aresult_t ret = A_OK;
+
+    shm_unlink("/megaqueue_mqtestreplsrc");
+    shm_unlink("/megaqueue_mqtestrepldst");
+    shm_unlink("/megaqueue_mqtestrepllap");
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestreplsrc", 64, 64), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestreplsrc", 64, 64), A_OK);
+    /* Nobody reads the replica while it is filled, so it must not hold the receiver back */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&dst, O_RDWR | O_CREAT, "mqtestrepldst", 64, 64, &params), A_OK);
+
+    for (seq = 0; seq < 40; seq++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = seq;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    /* Objects could be overwritten under the sender of a lapping queue */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&lap_prod, O_RDWR | O_CREAT, "mqtestrepllap", 64, 64, &lapping), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&reader, O_RDWR, "mqtestrepllap", 64, 64), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_consumer_attach(&reader, "repl"), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_repl_sender_init(&repl, &reader, 0, MEGAQUEUE_REPL_RESUME, 0), A_E_INVAL);
+    TEST_ASSERT_EQUALS(megaqueue_close(&reader, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&lap_prod, 1), A_OK);
+
+    /* Catch up from sequence 10: the replica skips what comes before */
+    TEST_ASSERT_NOT_EQUALS(fd = test_megaqueue_repl_connect(&rcv, &dst, &thread), -1);
+    TEST_ASSERT_EQUALS(megaqueue_repl_sender_init(&repl, &cons, fd, 10, 16), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 10);
+
+    while (A_OK == (ret = megaqueue_repl_send(&repl)));
+    TEST_ASSERT_EQUALS(ret, A_E_EMPTY);
+    TEST_ASSERT_EQUALS(repl.batches, 2);
+
+    for (; seq < 90; seq++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = seq;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    while (A_OK == (ret = megaqueue_repl_send(&repl)));
+    TEST_ASSERT_EQUALS(ret, A_E_EMPTY);
+    TEST_ASSERT_EQUALS(repl.objects, 80);
+
+    close(fd);
+    TEST_ASSERT_EQUALS(pthread_join(thread, NULL), 0);
+    TEST_ASSERT_EQUALS(rcv.ret, A_E_DONE);
+    TEST_ASSERT_EQUALS(rcv.objects, 80);
+    TEST_ASSERT_EQUALS(rcv.missed, 10);
+    close(rcv.fd);
+
+    /* Reconnecting carries on where the replica is */
+    for (; seq < 100; seq++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = seq;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_NOT_EQUALS(fd = test_megaqueue_repl_connect(&rcv, &dst, &thread), -1);
+    TEST_ASSERT_EQUALS(megaqueue_repl_sender_init(&repl, &cons, fd, MEGAQUEUE_REPL_RESUME, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 90);
+    while (A_OK == (ret = megaqueue_repl_send(&repl)));
+    TEST_ASSERT_EQUALS(ret, A_E_EMPTY);
+
+    close(fd);
+    TEST_ASSERT_EQUALS(pthread_join(thread, NULL), 0);
+    TEST_ASSERT_EQUALS(rcv.ret, A_E_DONE);
+    TEST_ASSERT_EQUALS(rcv.objects, 10);
+    TEST_ASSERT_EQUALS(rcv.missed, 0);
+    close(rcv.fd);
+
+    /* The replica has the same objects, with the same sequence numbers */
+    TEST_ASSERT_EQUALS(megaqueue_write_sequence(&dst), 100);
+    TEST_ASSERT_EQUALS(megaqueue_open(&reader, O_RDONLY, "mqtestrepldst", 64, 64), A_OK);
+    TEST_ASSERT(megaqueue_oldest_sequence(&reader) >= 36);
+    TEST_ASSERT_EQUALS(megaqueue_seek(&reader, megaqueue_oldest_sequence(&reader)), A_OK);
+
+    for (seq = megaqueue_oldest_sequence(&reader); seq < 100; seq++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&reader, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, seq);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&reader), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&reader, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&dst, 1), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    /* Variable-length records are copied whole, padding and all */
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&prod, O_RDWR | O_CREAT, "mqtestreplsrc", 64, 64, &varlen), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDONLY, "mqtestreplsrc", 0, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open_ex(&dst, O_RDWR | O_CREAT, "mqtestrepldst", 64, 64, &varlen), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&reader, O_RDONLY, "mqtestrepldst", 0, 0), A_OK);
+
+    TEST_ASSERT_NOT_EQUALS(fd = test_megaqueue_repl_connect(&rcv, &dst, &thread), -1);
+    TEST_ASSERT_EQUALS(megaqueue_repl_sender_init(&repl, &cons, fd, MEGAQUEUE_REPL_RESUME, 3), A_OK);
+
+    for (seq = 0; seq < 100; seq++) {
+        size_t record_len = 8 + seq % 150;
+
+        while (A_E_NOSPC == megaqueue_reserve(&prod, record_len, &slot));
+        memset(slot, 0, record_len);
+        *(uint64_t *)slot = seq;
+        TEST_ASSERT_EQUALS(megaqueue_commit(&prod, record_len), A_OK);
+
+        while (A_OK == (ret = megaqueue_repl_send(&repl)));
+        TEST_ASSERT_EQUALS(ret, A_E_EMPTY);
+
+        /* Read the replica as it fills, so records are checked before they are lapped */
+        while (megaqueue_write_sequence(&dst) != megaqueue_write_sequence(&prod));
+
+        TEST_ASSERT_EQUALS(megaqueue_read_record(&reader, &slot, &length), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, seq);
+        TEST_ASSERT_EQUALS(length, record_len);
+        TEST_ASSERT_EQUALS(megaqueue_release_record(&reader), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_read_record(&reader, &slot, &length), A_E_EMPTY);
+
+    close(fd);
+    TEST_ASSERT_EQUALS(pthread_join(thread, NULL), 0);
+    TEST_ASSERT_EQUALS(rcv.ret, A_E_DONE);
+    TEST_ASSERT_EQUALS(rcv.missed, 0);
+    close(rcv.fd);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&reader, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&dst, 1), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    /* A replica nobody drains stops the receiver, until it is drained */
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestreplsrc", 64, 64), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestreplsrc", 64, 64), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&dst, O_RDWR | O_CREAT, "mqtestrepldst", 64, 64), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&reader, O_RDWR, "mqtestrepldst", 64, 64), A_OK);
+    TEST_ASSERT_NOT_EQUALS(fd = test_megaqueue_repl_connect(&rcv, &dst, &thread), -1);
+    TEST_ASSERT_EQUALS(megaqueue_repl_sender_init(&repl, &cons, fd, MEGAQUEUE_REPL_RESUME, 8), A_OK);
+
+    for (seq = 0; seq < 80; seq++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = seq;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+
+        if (7 == seq % 8) {
+            while (A_OK == (ret = megaqueue_repl_send(&repl)));
+            TEST_ASSERT_EQUALS(ret, A_E_EMPTY);
+        }
+    }
+
+    while (0 == ck_pr_load_64(&rcv.full));
+    TEST_ASSERT_EQUALS(megaqueue_write_sequence(&dst), 64);
+
+    for (seq = 0; seq < 8; seq++) {
+        TEST_ASSERT_EQUALS(megaqueue_read_next_slot(&reader, &slot), A_OK);
+        TEST_ASSERT_EQUALS(*(uint64_t *)slot, seq);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&reader), A_OK);
+    }
+
+    while (megaqueue_write_sequence(&dst) != 72);
+
+    /* The last batch never finds room, and the receiver notices the sender is gone */
+    close(fd);
+    TEST_ASSERT_EQUALS(pthread_join(thread, NULL), 0);
+    TEST_ASSERT_EQUALS(rcv.ret, A_E_DONE);
+    TEST_ASSERT_EQUALS(rcv.objects, 72);
+    close(rcv.fd);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&reader, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&dst, 1), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
@@ -3,8 +3,13 @@
 #include <tsl/offload/endpoint.h>
 #include <tsl/offload/thread.h>
 #include <tsl/offload/pool.h>
+#include <tsl/offload/megaqueue_endpoint.h>
+#include <tsl/offload/megaqueue_archiver.h>
 
+#include <fcntl.h>
 #include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
 
 TEST_DECL(test_queue)
 {
@@ -109,6 +114,228 @@ TEST_DECL(test_work_endpoint)
     return TEST_OK;
 }
 
+struct test_mq_handler {
+    uint64_t next;
+    uint64_t fail_at;
+};
+
+static
+aresult_t test_mq_handler(void *priv, void *buf, size_t length)
+{
+    struct test_mq_handler *state = priv;
+
+    if (*(uint64_t *)buf == state->fail_at) {
+        return A_E_INVAL;
+    }
+
+    if (*(uint64_t *)buf != state->next) {
+        return A_E_BADARGS;
+    }
+
+    state->next++;
+
+    return A_OK;
+}
+
+TEST_DECL(test_megaqueue_endpoint)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_endpoint mep;
+    struct test_mq_handler state = { .next = 0, .fail_at = UINT64_MAX };
+    unsigned int expect_wait[] = { 1, 2, 4, 8, 8 };
+    unsigned int wait = 0;
+    void *slot = NULL;
+
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestendpoint", 64, 16), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestendpoint", 64, 16), A_OK);
+
+    /* Wraps around the end of the ring on the way */
+    for (uint64_t i = 0; i < 6; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+    }
+
+    for (uint64_t i = 0; i < 14; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(megaqueue_endpoint_init(&mep, &cons, test_mq_handler, &state, 4, 8), A_OK);
+
+    /* Full batches, straight back for more, until the queue runs dry */
+    for (uint64_t batch = 1; batch <= 4; batch++) {
+        TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_endpoint_get(&mep), &wait), A_OK);
+        TEST_ASSERT_EQUALS(wait, 0);
+        TEST_ASSERT_EQUALS(mep.handled, BL_MIN2(batch * 4, 14));
+        TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 6 + mep.handled);
+    }
+
+    TEST_ASSERT_EQUALS(state.next, 14);
+
+    /* Then back off */
+    for (size_t i = 0; i < BL_ARRAY_ENTRIES(expect_wait); i++) {
+        TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_endpoint_get(&mep), &wait), A_OK);
+        TEST_ASSERT_EQUALS(wait, expect_wait[i]);
+    }
+
+    /* A failing handler leaves its record in the queue */
+    state.fail_at = 15;
+
+    for (uint64_t i = 14; i < 17; i++) {
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+        *(uint64_t *)slot = i;
+        TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+    }
+
+    TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_endpoint_get(&mep), &wait), A_E_INVAL);
+    TEST_ASSERT_EQUALS(wait, 0);
+    TEST_ASSERT_EQUALS(mep.handled, 15);
+    TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 6 + 15);
+
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
+TEST_DECL(test_megaqueue_archiver)
+{
+    struct megaqueue prod, cons;
+    struct megaqueue_archiver arch;
+    unsigned int flags[] = { 0, MEGAQUEUE_ARCHIVER_FLAG_NO_URING };
+    unsigned int wait = 0;
+    uint64_t obj[8];
+    void *slot = NULL;
+
+    for (size_t f = 0; f < BL_ARRAY_ENTRIES(flags); f++) {
+        char path[] = "/tmp/mqtestarchiveXXXXXX";
+        int fd = mkstemp(path);
+
+        TEST_ASSERT_NOT_EQUALS(fd, -1);
+        unlink(path);
+
+        TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestarchive", 64, 16), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestarchive", 64, 16), A_OK);
+
+        /* Wraps around the end of the ring on the way */
+        for (uint64_t i = 0; i < 6; i++) {
+            TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+            TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+            TEST_ASSERT_EQUALS(megaqueue_read_advance(&cons), A_OK);
+        }
+
+        TEST_ASSERT_EQUALS(megaqueue_archiver_init(&arch, &cons, fd, 2, 4 * 64, flags[f]), A_OK);
+        if (flags[f] & MEGAQUEUE_ARCHIVER_FLAG_NO_URING) {
+            TEST_ASSERT_EQUALS(megaqueue_archiver_uses_uring(&arch), false);
+        }
+
+        for (uint64_t i = 0; i < 16; i++) {
+            TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+            memset(slot, 0, 64);
+            *(uint64_t *)slot = i;
+            TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+        }
+
+        /* Objects stay in the queue until they are written out */
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+        for (int i = 0; i < 100000 && arch.archived < 16; i++) {
+            TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_archiver_get(&arch), &wait), A_OK);
+        }
+
+        TEST_ASSERT_EQUALS(arch.archived, 16);
+        TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 6 + 16);
+        /* Runs of at most 4 objects, and never across the end of the ring */
+        TEST_ASSERT_EQUALS(arch.nr_completed, 5);
+
+        TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_archiver_get(&arch), &wait), A_OK);
+        TEST_ASSERT_EQUALS(wait, 1);
+        TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+
+        TEST_ASSERT_EQUALS(megaqueue_archiver_cleanup(&arch), A_OK);
+
+        /* The archive holds the objects in order */
+        TEST_ASSERT_EQUALS(lseek(fd, 0, SEEK_END), 16 * 64);
+
+        for (uint64_t i = 0; i < 16; i++) {
+            TEST_ASSERT_EQUALS(pread(fd, obj, sizeof(obj), i * 64), sizeof(obj));
+            TEST_ASSERT_EQUALS(obj[0], i);
+        }
+
+        close(fd);
+
+        TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+        TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+    }
+
+    /* A failed write stops the archiver, and its objects stay in the queue */
+    for (size_t f = 0; f < BL_ARRAY_ENTRIES(flags); f++) {
+        const char *paths[] = { "/dev/full", NULL };
+        char path[] = "/tmp/mqtestarchiveXXXXXX";
+        int tmp_fd = mkstemp(path);
+
+        TEST_ASSERT_NOT_EQUALS(tmp_fd, -1);
+        close(tmp_fd);
+        /* A read-only file, or a full device */
+        paths[1] = path;
+
+        for (size_t p = 0; p < BL_ARRAY_ENTRIES(paths); p++) {
+            int fd = open(paths[p], 0 == p ? O_WRONLY : O_RDONLY);
+            aresult_t ret = A_OK;
+            aresult_t err = A_E_INVAL;
+
+            TEST_ASSERT_NOT_EQUALS(fd, -1);
+
+            TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestarchive", 64, 16), A_OK);
+            TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDWR, "mqtestarchive", 64, 16), A_OK);
+            TEST_ASSERT_EQUALS(megaqueue_archiver_init(&arch, &cons, fd, 2, 4 * 64, flags[f]), A_OK);
+
+            /* Devices can't be spliced to, but io_uring writes to /dev/full fail like a full disk */
+            if (0 == p && megaqueue_archiver_uses_uring(&arch)) {
+                err = A_E_NOSPC;
+            }
+
+            for (uint64_t i = 0; i < 16; i++) {
+                TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_OK);
+                TEST_ASSERT_EQUALS(megaqueue_advance(&prod), A_OK);
+            }
+
+            for (int i = 0; i < 100000 && A_OK == ret; i++) {
+                ret = work_endpoint_poll(megaqueue_archiver_get(&arch), &wait);
+            }
+
+            TEST_ASSERT_EQUALS(ret, err);
+            TEST_ASSERT_EQUALS(arch.archived, 0);
+            TEST_ASSERT_EQUALS(megaqueue_read_sequence(&cons), 0);
+            TEST_ASSERT_EQUALS(megaqueue_next_slot(&prod, &slot), A_E_NOSPC);
+
+            /* Nothing is left waiting on the writes that failed */
+            TEST_ASSERT_EQUALS(work_endpoint_poll(megaqueue_archiver_get(&arch), &wait), err);
+            TEST_ASSERT_EQUALS(megaqueue_archiver_flush(&arch), err);
+            TEST_ASSERT_EQUALS(arch.nr_in_flight, 0);
+            TEST_ASSERT_EQUALS(megaqueue_archiver_cleanup(&arch), err);
+
+            close(fd);
+
+            TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+            TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+        }
+
+        unlink(path);
+    }
+
+    /* Read-only handles do not hold the producer back */
+    TEST_ASSERT_EQUALS(megaqueue_open(&prod, O_RDWR | O_CREAT, "mqtestarchive", 64, 16), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_open(&cons, O_RDONLY, "mqtestarchive", 64, 16), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_archiver_init(&arch, &cons, 0, 0, 0, 0), A_E_INVAL);
+    TEST_ASSERT_EQUALS(megaqueue_close(&cons, 0), A_OK);
+    TEST_ASSERT_EQUALS(megaqueue_close(&prod, 1), A_OK);
+
+    return TEST_OK;
+}
+
 TEST_DECL(test_work_thread)
 {
     struct test_endpoint tep;
@@ -0,0 +1,685 @@
+/*
+ * mqbench - cross-process Megaqueue latency and throughput benchmarks.
+ *
+ * Every run forks a consumer process, pins the producer and the consumer to the cores
+ * of the placement being measured, and measures one of:
+ *  - oneway: latency from the producer publishing to the consumer seeing the object,
+ *    with the producer pausing between objects so the queue stays empty
+ *  - pingpong: round trip over two queues, the consumer echoing every object back
+ *  - throughput: sustained rate with the producer writing as fast as it can
+ *
+ * Runs are swept over object sizes, queue depths and core placements. Latencies are
+ * in nanoseconds, from CLOCK_MONOTONIC, which is shared between the processes.
+ */
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <tsl/cpumask.h>
+#include <tsl/errors.h>
+#include <tsl/basic.h>
+#include <tsl/cal.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SEC                  1000000000ull
+
+#define MQBENCH_MAX_SWEEP           16
+#define MQBENCH_MAX_PLACEMENTS      16
+
+/**
+ * The histogram has 16 linear sub-buckets per power of two, so every bucket is
+ * within 1/16th of the values in it.
+ */
+#define MQBENCH_HIST_SUB_BITS       4
+#define MQBENCH_HIST_SUB            (1 << MQBENCH_HIST_SUB_BITS)
+#define MQBENCH_HIST_BUCKETS        (64 << MQBENCH_HIST_SUB_BITS)
+
+/**
+ * How many times the producer spins waiting on the consumer before checking that
+ * the consumer process is still there
+ */
+#define MQBENCH_CHECK_SPINS         (1ull << 16)
+
+enum mqbench_mode {
+    MQBENCH_ONEWAY,
+    MQBENCH_PINGPONG,
+    MQBENCH_THROUGHPUT,
+};
+
+static const char *mqbench_mode_names[] = { "oneway", "pingpong", "throughput" };
+
+/**
+ * A producer and consumer core, -1 for unpinned
+ */
+struct mqbench_placement {
+    const char *name;
+    int producer;
+    int consumer;
+};
+
+struct mqbench_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[MQBENCH_HIST_BUCKETS];
+};
+
+/**
+ * Shared between the producer and the consumer process
+ */
+struct mqbench_shared {
+    /** Set by the consumer once it has its queues open */
+    uint32_t ready CAL_CACHE_ALIGNED;
+    /** Latencies, as seen by whoever measures them */
+    struct mqbench_hist hist;
+    /** Throughput: when the consumer saw the first measured object, and the last one */
+    uint64_t first_ns;
+    uint64_t last_ns;
+    /** Objects that arrived out of order */
+    uint64_t errors;
+};
+
+/**
+ * What goes at the start of every object
+ */
+struct mqbench_msg {
+    uint64_t seq;
+    uint64_t sent_ns;
+};
+
+/**
+ * The consumer process, as watched by the producer while it waits
+ */
+struct mqbench_peer {
+    /** -1 if there is nobody to watch */
+    pid_t pid;
+    /** Whether it exited, and was reaped */
+    bool exited;
+    /** Its wait status, once reaped */
+    int status;
+    /** Spins since the last check */
+    uint64_t spins;
+};
+
+struct mqbench_run {
+    enum mqbench_mode mode;
+    size_t size;
+    size_t depth;
+    struct mqbench_placement *place;
+    uint64_t count;
+    uint64_t warmup;
+    uint64_t gap_ns;
+    uint32_t flags;
+    uint32_t consumer_flags;
+    uint32_t prefetch;
+};
+
+static
+uint64_t mqbench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static
+unsigned int mqbench_hist_index(uint64_t v)
+{
+    int msb = 0;
+
+    if (v < MQBENCH_HIST_SUB) {
+        return v;
+    }
+
+    msb = 63 - __builtin_clzll(v);
+
+    return ((msb - MQBENCH_HIST_SUB_BITS + 1) << MQBENCH_HIST_SUB_BITS) +
+           ((v >> (msb - MQBENCH_HIST_SUB_BITS)) & (MQBENCH_HIST_SUB - 1));
+}
+
+static
+uint64_t mqbench_hist_value(unsigned int idx)
+{
+    int msb = 0;
+
+    if (idx < MQBENCH_HIST_SUB) {
+        return idx;
+    }
+
+    msb = (idx >> MQBENCH_HIST_SUB_BITS) + MQBENCH_HIST_SUB_BITS - 1;
+
+    return (uint64_t)(MQBENCH_HIST_SUB + (idx & (MQBENCH_HIST_SUB - 1))) << (msb - MQBENCH_HIST_SUB_BITS);
+}
+
+static
+void mqbench_hist_add(struct mqbench_hist *hist, uint64_t v)
+{
+    hist->buckets[mqbench_hist_index(v)]++;
+    hist->sum += v;
+    hist->min = hist->count ? BL_MIN2(hist->min, v) : v;
+    hist->max = BL_MAX2(hist->max, v);
+    hist->count++;
+}
+
+static
+uint64_t mqbench_hist_percentile(struct mqbench_hist *hist, double pct)
+{
+    uint64_t rank = (uint64_t)(hist->count * pct / 100.0);
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < MQBENCH_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            return mqbench_hist_value(i);
+        }
+    }
+
+    return hist->max;
+}
+
+/**
+ * Pin the calling process to a core. Failing to is not fatal, the numbers just get
+ * noisier.
+ */
+static
+void mqbench_pin(int cpu)
+{
+    struct cpu_mask *mask = NULL;
+
+    if (0 > cpu) {
+        return;
+    }
+
+    if (AFAILED(cpu_mask_create(&mask)) || AFAILED(cpu_mask_set(mask, cpu)) || AFAILED(cpu_mask_apply(mask))) {
+        fprintf(stderr, "WARNING: failed to pin to core %d, running unpinned\n", cpu);
+    }
+
+    if (NULL != mask) {
+        cpu_mask_destroy(&mask);
+    }
+}
+
+static
+int mqbench_read_int(const char *fmt, int cpu)
+{
+    char path[128];
+    FILE *fp = NULL;
+    int value = -1;
+
+    snprintf(path, sizeof(path), fmt, cpu);
+
+    if (NULL == (fp = fopen(path, "r"))) {
+        return -1;
+    }
+
+    if (1 != fscanf(fp, "%d", &value)) {
+        value = -1;
+    }
+
+    fclose(fp);
+
+    return value;
+}
+
+/**
+ * Work out the interesting placements from the topology in sysfs, relative to the
+ * given producer core.
+ */
+static
+size_t mqbench_auto_placements(struct mqbench_placement *places, int prod)
+{
+    size_t nr = 0;
+    int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    int pkg = mqbench_read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", prod);
+    int core = mqbench_read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", prod);
+    int smt = -1, socket = -1, remote = -1;
+
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        int cpkg = mqbench_read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        int ccore = mqbench_read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+
+        if (cpu == prod || 0 > cpkg) {
+            continue;
+        }
+
+        if (cpkg == pkg && ccore == core && 0 > smt) {
+            smt = cpu;
+        } else if (cpkg == pkg && ccore != core && 0 > socket) {
+            socket = cpu;
+        } else if (cpkg != pkg && 0 > remote) {
+            remote = cpu;
+        }
+    }
+
+    places[nr++] = (struct mqbench_placement){ "same-core", prod, prod };
+
+    if (0 <= smt) {
+        places[nr++] = (struct mqbench_placement){ "smt-sibling", prod, smt };
+    }
+
+    if (0 <= socket) {
+        places[nr++] = (struct mqbench_placement){ "same-socket", prod, socket };
+    }
+
+    if (0 <= remote) {
+        places[nr++] = (struct mqbench_placement){ "cross-socket", prod, remote };
+    }
+
+    return nr;
+}
+
+static
+size_t mqbench_parse_list(const char *arg, size_t *values, size_t max)
+{
+    size_t nr = 0;
+    char *end = NULL;
+
+    while (nr < max && '\0' != *arg) {
+        values[nr++] = strtoull(arg, &end, 0);
+        if (',' != *end) {
+            break;
+        }
+        arg = end + 1;
+    }
+
+    return nr;
+}
+
+static
+size_t mqbench_parse_placements(char *arg, struct mqbench_placement *places, size_t max)
+{
+    size_t nr = 0;
+    char *save = NULL;
+
+    for (char *tok = strtok_r(arg, ",", &save); NULL != tok && nr < max; tok = strtok_r(NULL, ",", &save)) {
+        int prod = -1, cons = -1;
+
+        if (2 != sscanf(tok, "%d:%d", &prod, &cons)) {
+            return 0;
+        }
+
+        places[nr++] = (struct mqbench_placement){ tok, prod, cons };
+    }
+
+    return nr;
+}
+
+/**
+ * Spin once waiting on the peer. Every so often, check whether the peer died, so
+ * the producer does not wait forever on a consumer that is gone.
+ */
+static
+bool mqbench_peer_gone(struct mqbench_peer *peer)
+{
+    ck_pr_stall();
+
+    if (0 > peer->pid || 0 != (++peer->spins & (MQBENCH_CHECK_SPINS - 1))) {
+        return false;
+    }
+
+    if (peer->pid == waitpid(peer->pid, &peer->status, WNOHANG)) {
+        fprintf(stderr, "Consumer exited in the middle of the run\n");
+        peer->exited = true;
+    }
+
+    return peer->exited;
+}
+
+/**
+ * Wait until the next object is readable. Spins, since that is
+ * what latency-sensitive consumers do. Returns NULL if the peer died.
+ */
+static
+struct mqbench_msg *mqbench_receive(struct megaqueue *queue, struct mqbench_peer *peer)
+{
+    void *slot = NULL;
+
+    while (A_OK != megaqueue_read_next_slot(queue, &slot)) {
+        if (mqbench_peer_gone(peer)) {
+            return NULL;
+        }
+    }
+
+    return slot;
+}
+
+static
+bool mqbench_send(struct megaqueue *queue, struct mqbench_peer *peer, size_t size, uint64_t seq, uint64_t sent_ns)
+{
+    struct mqbench_msg *msg = NULL;
+
+    while (A_OK != megaqueue_next_slot(queue, (void **)&msg)) {
+        if (mqbench_peer_gone(peer)) {
+            return false;
+        }
+    }
+
+    /* Write the whole object, as a real producer would */
+    memset((void *)(msg + 1), (int)seq, size - sizeof(*msg));
+    msg->seq = seq;
+    msg->sent_ns = sent_ns;
+
+    megaqueue_advance(queue);
+
+    return true;
+}
+
+static
+void mqbench_consumer(struct mqbench_run *run, struct mqbench_shared *shared, const char *fwd, const char *back)
+{
+    struct megaqueue in = MEGAQUEUE_SAFE_INIT_EMPTY, out = MEGAQUEUE_SAFE_INIT_EMPTY;
+    struct megaqueue_params params = { .flags = run->flags | run->consumer_flags, .prefetch_distance = run->prefetch };
+    struct mqbench_peer nobody = { .pid = -1 };
+    uint64_t total = run->warmup + run->count;
+
+    mqbench_pin(run->place->consumer);
+
+    if (AFAILED(megaqueue_open_ex(&in, O_RDWR, fwd, run->size, run->depth, &params)) ||
+            (MQBENCH_PINGPONG == run->mode &&
+             AFAILED(megaqueue_open_ex(&out, O_RDWR, back, run->size, run->depth, &params))))
+    {
+        fprintf(stderr, "Consumer failed to open the benchmark queues\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    ck_pr_store_32(&shared->ready, 1);
+
+    for (uint64_t seq = 0; seq < total; seq++) {
+        struct mqbench_msg *msg = mqbench_receive(&in, &nobody);
+        uint64_t now = mqbench_now_ns();
+        uint64_t sent_ns = msg->sent_ns;
+
+        if (msg->seq != seq) {
+            shared->errors++;
+        }
+
+        if (run->warmup == seq) {
+            shared->first_ns = now;
+        }
+
+        megaqueue_read_advance(&in);
+
+        if (MQBENCH_PINGPONG == run->mode) {
+            mqbench_send(&out, &nobody, run->size, seq, sent_ns);
+        } else if (MQBENCH_ONEWAY == run->mode && seq >= run->warmup) {
+            mqbench_hist_add(&shared->hist, now - sent_ns);
+        }
+    }
+
+    shared->last_ns = mqbench_now_ns();
+
+    megaqueue_close(&out, 0);
+    megaqueue_close(&in, 0);
+
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Returns -1 if the consumer died before the end of the run
+ */
+static
+int mqbench_producer(struct mqbench_run *run, struct mqbench_shared *shared, struct megaqueue *out,
+                     struct megaqueue *in, struct mqbench_peer *peer)
+{
+    uint64_t total = run->warmup + run->count;
+
+    /* The consumer exits without getting ready if it can't open the queues */
+    while (0 == ck_pr_load_32(&shared->ready)) {
+        if (mqbench_peer_gone(peer)) {
+            return -1;
+        }
+    }
+
+    for (uint64_t seq = 0; seq < total; seq++) {
+        uint64_t sent_ns = mqbench_now_ns();
+
+        if (false == mqbench_send(out, peer, run->size, seq, sent_ns)) {
+            return -1;
+        }
+
+        if (MQBENCH_PINGPONG == run->mode) {
+            struct mqbench_msg *msg = mqbench_receive(in, peer);
+            uint64_t now = mqbench_now_ns();
+
+            if (NULL == msg) {
+                return -1;
+            }
+
+            if (msg->seq != seq) {
+                shared->errors++;
+            }
+
+            megaqueue_read_advance(in);
+
+            if (seq >= run->warmup) {
+                mqbench_hist_add(&shared->hist, now - sent_ns);
+            }
+        } else if (MQBENCH_ONEWAY == run->mode) {
+            /* Let the consumer catch up, so we measure an empty queue */
+            while (mqbench_now_ns() - sent_ns < run->gap_ns) {
+                ck_pr_stall();
+            }
+        }
+    }
+
+    return 0;
+}
+
+static
+int mqbench_run_one(struct mqbench_run *run, struct mqbench_shared *shared)
+{
+    struct megaqueue fwd = MEGAQUEUE_SAFE_INIT_EMPTY, back = MEGAQUEUE_SAFE_INIT_EMPTY;
+    struct megaqueue_params params = { .flags = run->flags };
+    char fwd_name[64], back_name[64];
+    struct mqbench_peer child = { .pid = -1 };
+    int ret = -1;
+
+    snprintf(fwd_name, sizeof(fwd_name), "mqbench_%d_fwd", (int)getpid());
+    snprintf(back_name, sizeof(back_name), "mqbench_%d_back", (int)getpid());
+
+    memset(shared, 0, sizeof(*shared));
+
+    if (AFAILED(megaqueue_open_ex(&fwd, O_RDWR | O_CREAT, fwd_name, run->size, run->depth, &params)) ||
+            (MQBENCH_PINGPONG == run->mode &&
+             AFAILED(megaqueue_open_ex(&back, O_RDWR | O_CREAT, back_name, run->size, run->depth, &params))))
+    {
+        fprintf(stderr, "Failed to create the benchmark queues (size %zu, depth %zu)\n", run->size, run->depth);
+        goto done;
+    }
+
+    if (0 > (child.pid = fork())) {
+        perror("fork");
+        goto done;
+    }
+
+    if (0 == child.pid) {
+        mqbench_consumer(run, shared, fwd_name, back_name);
+    }
+
+    mqbench_pin(run->place->producer);
+
+    /* If the consumer died, it was already reaped */
+    if (0 == mqbench_producer(run, shared, &fwd, &back, &child) && 0 > waitpid(child.pid, &child.status, 0)) {
+        perror("waitpid");
+        goto done;
+    }
+
+    if (!WIFEXITED(child.status) || EXIT_SUCCESS != WEXITSTATUS(child.status)) {
+        fprintf(stderr, "Consumer failed\n");
+        goto done;
+    }
+
+    printf("%-10s %6zu %8zu %-14s", mqbench_mode_names[run->mode], run->size, run->depth, run->place->name);
+
+    if (MQBENCH_THROUGHPUT == run->mode) {
+        /* Only the measured objects, not the fork, the consumer's setup or the warmup */
+        double secs = (double)BL_MAX2(shared->last_ns - shared->first_ns, 1) / NS_PER_SEC;
+        double rate = run->count / secs;
+
+        printf(" %12.0f msg/s %10.1f MB/s", rate, rate * run->size / (1024.0 * 1024.0));
+    } else {
+        struct mqbench_hist *hist = &shared->hist;
+
+        printf(" %8" PRIu64 " %8.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64,
+               hist->min, (double)hist->sum / BL_MAX2(hist->count, 1),
+               mqbench_hist_percentile(hist, 50.0), mqbench_hist_percentile(hist, 99.0),
+               mqbench_hist_percentile(hist, 99.9), mqbench_hist_percentile(hist, 99.99), hist->max);
+    }
+
+    if (0 != shared->errors) {
+        printf("  (%" PRIu64 " out of order!)", shared->errors);
+    }
+
+    printf("\n");
+    fflush(stdout);
+
+    ret = 0;
+
+done:
+    megaqueue_close(&back, 1);
+    megaqueue_close(&fwd, 1);
+
+    return ret;
+}
+
+static
+void mqbench_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-m modes] [-s sizes] [-d depths] [-c placements | -A core] [-n count] [-w warmup] [-g gap_ns] [-f] [-p distance] [-P]\n", name);
+    fprintf(stderr, "  -m modes      Comma-separated: oneway, pingpong, throughput, or all (default)\n");
+    fprintf(stderr, "  -s sizes      Object sizes, in bytes (default 64,256,1024)\n");
+    fprintf(stderr, "  -d depths     Queue depths, in objects (default 1024,65536)\n");
+    fprintf(stderr, "  -c placements Producer:consumer core pairs, e.g. 2:3,2:10 (default unpinned)\n");
+    fprintf(stderr, "  -A core       Same core, SMT sibling, same socket and cross socket from this core\n");
+    fprintf(stderr, "  -n count      Objects measured per run (default 1000000, 10x for throughput)\n");
+    fprintf(stderr, "  -w warmup     Objects sent before measuring (default 10000)\n");
+    fprintf(stderr, "  -g gap_ns     Pause between objects for one-way latency (default 2000)\n");
+    fprintf(stderr, "  -f            Use MEGAQUEUE_FLAG_FAST handles (sizes and depths must be powers of 2)\n");
+    fprintf(stderr, "  -p distance   Consumer prefetches this many objects ahead (default 0)\n");
+    fprintf(stderr, "  -P            Consumer maps the whole queue up front (MEGAQUEUE_FLAG_POPULATE)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct mqbench_placement places[MQBENCH_MAX_PLACEMENTS] = { { "unpinned", -1, -1 } };
+    size_t nr_places = 1;
+    size_t sizes[MQBENCH_MAX_SWEEP] = { 64, 256, 1024 };
+    size_t nr_sizes = 3;
+    size_t depths[MQBENCH_MAX_SWEEP] = { 1024, 65536 };
+    size_t nr_depths = 2;
+    bool modes[] = { true, true, true };
+    struct mqbench_run run = { .count = 1000000, .warmup = 10000, .gap_ns = 2000, .flags = 0 };
+    struct mqbench_shared *shared = NULL;
+    int opt = 0;
+    int ret = EXIT_SUCCESS;
+
+    while (-1 != (opt = getopt(argc, argv, "m:s:d:c:A:n:w:g:fp:Ph"))) {
+        switch (opt) {
+        case 'm':
+            for (size_t i = 0; i < BL_ARRAY_ENTRIES(modes); i++) {
+                modes[i] = NULL != strstr(optarg, mqbench_mode_names[i]) || 0 == strcmp(optarg, "all");
+            }
+            break;
+        case 's':
+            nr_sizes = mqbench_parse_list(optarg, sizes, MQBENCH_MAX_SWEEP);
+            break;
+        case 'd':
+            nr_depths = mqbench_parse_list(optarg, depths, MQBENCH_MAX_SWEEP);
+            break;
+        case 'c':
+            nr_places = mqbench_parse_placements(optarg, places, MQBENCH_MAX_PLACEMENTS);
+            break;
+        case 'A':
+            nr_places = mqbench_auto_placements(places, atoi(optarg));
+            break;
+        case 'n':
+            run.count = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            run.warmup = strtoull(optarg, NULL, 0);
+            break;
+        case 'g':
+            run.gap_ns = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            run.flags |= MEGAQUEUE_FLAG_FAST;
+            break;
+        case 'p':
+            run.prefetch = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            run.consumer_flags |= MEGAQUEUE_FLAG_POPULATE;
+            break;
+        default:
+            mqbench_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (0 == nr_sizes || 0 == nr_depths || 0 == nr_places || 0 == run.count) {
+        mqbench_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < nr_sizes; i++) {
+        if (sizes[i] < sizeof(struct mqbench_msg)) {
+            fprintf(stderr, "Objects must be at least %zu bytes\n", sizeof(struct mqbench_msg));
+            return EXIT_FAILURE;
+        }
+    }
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == shared) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %6s %8s %-14s %8s %8s %8s %8s %8s %8s %8s\n", "mode", "size", "depth", "placement",
+           "min", "mean", "p50", "p99", "p99.9", "p99.99", "max");
+
+    for (size_t m = 0; m < BL_ARRAY_ENTRIES(modes); m++) {
+        if (false == modes[m]) {
+            continue;
+        }
+
+        for (size_t p = 0; p < nr_places; p++) {
+            for (size_t s = 0; s < nr_sizes; s++) {
+                for (size_t d = 0; d < nr_depths; d++) {
+                    struct mqbench_run this_run = run;
+
+                    this_run.mode = m;
+                    this_run.size = sizes[s];
+                    this_run.depth = depths[d];
+                    this_run.place = &places[p];
+
+                    if (MQBENCH_THROUGHPUT == m) {
+                        this_run.count *= 10;
+                    }
+
+                    if (0 != mqbench_run_one(&this_run, shared)) {
+                        ret = EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+
+    munmap(shared, sizeof(*shared));
+
+    return ret;
+}
+
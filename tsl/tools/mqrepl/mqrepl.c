@@ -0,0 +1,410 @@
+/*
+ * mqrepl - replicate a Megaqueue to another host over TCP.
+ *
+ * The sender tails a queue and streams whatever is readable, in batches, to the
+ * receiver, which republishes it into an identically shaped queue with the same
+ * sequence numbers: a warm standby of the queue, for disaster recovery.
+ *
+ * The receiver listens, and serves one sender at a time. When a sender connects,
+ * the receiver tells it which sequence it needs next, so a sender that restarts (or
+ * reconnects after a network outage) carries on where the replica is. If the
+ * sender no longer has that, it starts from its oldest object, and the replica
+ * skips the gap.
+ */
+#include <tsl/megaqueue/megaqueue.h>
+#include <tsl/megaqueue/megaqueue_repl.h>
+
+#include <tsl/errors.h>
+#include <tsl/basic.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SEC                  1000000000ull
+
+/**
+ * Number of times the sender polls the queue before sleeping, when it caught up
+ */
+#define MQREPL_WAIT_SPINS           1000
+
+/**
+ * How long the sender sleeps at most when it caught up, in nanoseconds
+ */
+#define MQREPL_WAIT_NS              (NS_PER_SEC / 10)
+
+/**
+ * Number of batches between two producer heartbeats, on the receiver
+ */
+#define MQREPL_HEARTBEAT_BATCHES    64
+
+static
+uint64_t mqrepl_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static
+void mqrepl_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s -c host:port [-s seq] [-b batch] [-n consumer] [-1] source\n", name);
+    fprintf(stderr, "       %s -l [host:]port [-C] destination\n", name);
+    fprintf(stderr, "  source      Journal directory or queue name to replicate\n");
+    fprintf(stderr, "  destination Queue name (or journal directory) of the replica\n");
+    fprintf(stderr, "  -c host:port Send to the receiver at this address\n");
+    fprintf(stderr, "  -s seq      Sequence to start from, if the replica does not have it yet\n");
+    fprintf(stderr, "  -b batch    Largest batch to send, in objects (default %d)\n", MEGAQUEUE_REPL_DEFAULT_BATCH);
+    fprintf(stderr, "  -n consumer Attach to a broadcast queue as this consumer, so it is never overrun\n");
+    fprintf(stderr, "  -1          Exit once the replica has caught up\n");
+    fprintf(stderr, "  -l [host:]port Receive on this address\n");
+    fprintf(stderr, "  -C          Create the replica shaped like the source, or resume it\n");
+}
+
+static
+bool mqrepl_is_dir(const char *path)
+{
+    struct stat st;
+
+    return 0 == stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Resolve a [host:]port address. The address string is modified.
+ */
+static
+struct addrinfo *mqrepl_resolve(char *addr, bool passive)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    char *port = strrchr(addr, ':');
+    char *host = addr;
+    int err = 0;
+
+    if (NULL == port) {
+        port = addr;
+        host = NULL;
+    } else {
+        *port++ = '\0';
+    }
+
+    if (true == passive) {
+        hints.ai_flags = AI_PASSIVE;
+    }
+
+    if (0 != (err = getaddrinfo(host, port, &hints, &res))) {
+        fprintf(stderr, "Failed to resolve '%s:%s': %s\n", NULL == host ? "*" : host, port, gai_strerror(err));
+        return NULL;
+    }
+
+    return res;
+}
+
+/**
+ * Batches are small and latency matters more than packet count, don't let Nagle hold them
+ */
+static
+void mqrepl_nodelay(int fd)
+{
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static
+int mqrepl_send(char *addr, const char *src_name, uint64_t start, size_t max_batch, const char *consumer,
+                bool once)
+{
+    struct megaqueue queue;
+    struct megaqueue_params params = { .flags = 0 };
+    struct megaqueue_repl repl;
+    struct addrinfo *res = NULL;
+    uint64_t began = 0;
+    int fd = -1;
+    int ret = EXIT_FAILURE;
+
+    MEGAQUEUE_EMPTY(&queue);
+    memset(&repl, 0, sizeof(repl));
+
+    if (mqrepl_is_dir(src_name)) {
+        params.flags |= MEGAQUEUE_FLAG_JOURNAL;
+    }
+
+    /* A snooping handle never holds the producer back, a named consumer does */
+    if (AFAILED(megaqueue_open_ex(&queue, NULL == consumer ? O_RDONLY : O_RDWR, src_name, 0, 0, &params))) {
+        fprintf(stderr, "Failed to open source '%s'\n", src_name);
+        goto done;
+    }
+
+    if (NULL != consumer && AFAILED(megaqueue_consumer_attach(&queue, consumer))) {
+        fprintf(stderr, "Failed to attach to '%s' as consumer '%s'\n", src_name, consumer);
+        goto done;
+    }
+
+    if (NULL == (res = mqrepl_resolve(addr, false))) {
+        goto done;
+    }
+
+    if (0 > (fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) ||
+            0 > connect(fd, res->ai_addr, res->ai_addrlen))
+    {
+        perror("Failed to connect to the receiver");
+        goto done;
+    }
+
+    mqrepl_nodelay(fd);
+
+    if (AFAILED(megaqueue_repl_sender_init(&repl, &queue, fd, start, max_batch))) {
+        fprintf(stderr, "Failed to start replicating\n");
+        goto done;
+    }
+
+    fprintf(stderr, "Replicating '%s' from sequence %" PRIu64 "\n", src_name, megaqueue_read_sequence(&queue));
+
+    began = mqrepl_now_ns();
+
+    while (1) {
+        aresult_t err = megaqueue_repl_send(&repl);
+
+        if (A_E_EMPTY == err) {
+            if (true == once) {
+                break;
+            }
+
+            /* Only a consumer with the header mapped writable can sleep on the queue */
+            if (NULL != consumer) {
+                megaqueue_wait(&queue, MQREPL_WAIT_SPINS, MQREPL_WAIT_NS);
+            } else {
+                usleep(100);
+            }
+
+            continue;
+        }
+
+        if (A_E_OVERRUN == err) {
+            fprintf(stderr, "Overrun while sending, the replica might hold overwritten objects "
+                    "(attach with -n to hold the producer back)\n");
+            goto done;
+        }
+
+        if (AFAILED(err)) {
+            fprintf(stderr, "Replication stopped%s\n", A_E_DONE == err ? ", the receiver hung up" : "");
+            goto done;
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    if (0 != began) {
+        fprintf(stderr, "Sent %" PRIu64 " objects in %" PRIu64 " batches in %.3fs\n", repl.objects, repl.batches,
+                (double)(mqrepl_now_ns() - began) / NS_PER_SEC);
+    }
+
+    if (0 <= fd) {
+        close(fd);
+    }
+
+    if (NULL != res) {
+        freeaddrinfo(res);
+    }
+
+    megaqueue_close(&queue, 0);
+
+    return ret;
+}
+
+/**
+ * Open the replica, the first time a sender connects
+ */
+static
+aresult_t mqrepl_open_replica(struct megaqueue *queue, const char *dst_name, bool create,
+                              const struct megaqueue_repl_hello *hello)
+{
+    struct megaqueue_params params = { .flags = 0 };
+
+    if (true == create) {
+        /* Same shape as the source, but the receiver is the only producer. Don't reset a live replica. */
+        params.flags = hello->flags & ~(MEGAQUEUE_HANDLE_FLAGS | MEGAQUEUE_FLAG_JOURNAL | MEGAQUEUE_FLAG_MULTI_PRODUCER);
+        params.flags |= MEGAQUEUE_FLAG_RESUME;
+    } else if (mqrepl_is_dir(dst_name)) {
+        params.flags |= MEGAQUEUE_FLAG_JOURNAL;
+    }
+
+    return megaqueue_open_ex(queue, O_RDWR | (create ? O_CREAT : 0), dst_name, hello->object_size,
+                             hello->object_count, &params);
+}
+
+static
+int mqrepl_receive(char *addr, const char *dst_name, bool create)
+{
+    struct megaqueue queue;
+    struct addrinfo *res = NULL;
+    int lfd = -1;
+    int one = 1;
+    int ret = EXIT_FAILURE;
+
+    MEGAQUEUE_EMPTY(&queue);
+
+    if (NULL == (res = mqrepl_resolve(addr, true))) {
+        goto done;
+    }
+
+    if (0 > (lfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) ||
+            0 > setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+            0 > bind(lfd, res->ai_addr, res->ai_addrlen) ||
+            0 > listen(lfd, 1))
+    {
+        perror("Failed to listen for senders");
+        goto done;
+    }
+
+    while (1) {
+        struct megaqueue_repl_hello hello;
+        struct megaqueue_repl repl;
+        aresult_t err = A_OK;
+        uint64_t began = 0;
+        bool full = false;
+        int fd = -1;
+
+        if (0 > (fd = accept(lfd, NULL, NULL))) {
+            perror("Failed to accept a sender");
+            goto done;
+        }
+
+        mqrepl_nodelay(fd);
+
+        if (AFAILED(megaqueue_repl_receiver_hello(fd, &hello))) {
+            fprintf(stderr, "Sender did not say hello\n");
+            close(fd);
+            continue;
+        }
+
+        if (NULL == queue.hdr && AFAILED(mqrepl_open_replica(&queue, dst_name, create, &hello))) {
+            fprintf(stderr, "Failed to open replica '%s'\n", dst_name);
+            close(fd);
+            goto done;
+        }
+
+        if (AFAILED(megaqueue_repl_receiver_init(&repl, &queue, fd, &hello))) {
+            fprintf(stderr, "Replica '%s' is not shaped like the source\n", dst_name);
+            close(fd);
+            goto done;
+        }
+
+        fprintf(stderr, "Sender connected, replica is at sequence %" PRIu64 "\n", megaqueue_write_sequence(&queue));
+
+        began = mqrepl_now_ns();
+
+        while (A_OK == (err = megaqueue_repl_receive(&repl)) || A_E_NOSPC == err) {
+            if (A_E_NOSPC == err) {
+                /* The stream backs up to the source until the replica is drained */
+                if (false == full) {
+                    fprintf(stderr, "Replica is full, waiting for its consumers to drain it\n");
+                    full = true;
+                }
+
+                megaqueue_heartbeat(&queue);
+                usleep(1000);
+                continue;
+            }
+
+            full = false;
+
+            if (0 == repl.batches % MQREPL_HEARTBEAT_BATCHES) {
+                megaqueue_heartbeat(&queue);
+            }
+        }
+
+        fprintf(stderr, "Received %" PRIu64 " objects in %" PRIu64 " batches in %.3fs, skipped %" PRIu64 "%s\n",
+                repl.objects, repl.batches, (double)(mqrepl_now_ns() - began) / NS_PER_SEC, repl.missed,
+                A_E_DONE == err ? "" : ", stopped on an error");
+
+        close(fd);
+
+        /* A replica that can't take the stream will not take the next one either */
+        if (A_E_DONE != err && A_E_NO_SOCKET != err) {
+            goto done;
+        }
+    }
+
+done:
+    if (0 <= lfd) {
+        close(lfd);
+    }
+
+    if (NULL != res) {
+        freeaddrinfo(res);
+    }
+
+    megaqueue_close(&queue, 0);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char *connect_addr = NULL;
+    char *listen_addr = NULL;
+    const char *consumer = NULL;
+    uint64_t start = MEGAQUEUE_REPL_RESUME;
+    size_t max_batch = 0;
+    bool create = false;
+    bool once = false;
+    int opt = 0;
+
+    while (-1 != (opt = getopt(argc, argv, "c:l:s:b:n:1Ch"))) {
+        switch (opt) {
+        case 'c':
+            connect_addr = optarg;
+            break;
+        case 'l':
+            listen_addr = optarg;
+            break;
+        case 's':
+            start = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            max_batch = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            consumer = optarg;
+            break;
+        case '1':
+            once = true;
+            break;
+        case 'C':
+            create = true;
+            break;
+        default:
+            mqrepl_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || (NULL == connect_addr) == (NULL == listen_addr)) {
+        mqrepl_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (NULL != connect_addr) {
+        return mqrepl_send(connect_addr, argv[optind], start, max_batch, consumer, once);
+    }
+
+    return mqrepl_receive(listen_addr, argv[optind], create);
+}
+
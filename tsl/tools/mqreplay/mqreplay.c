@@ -0,0 +1,500 @@
+/*
+ * mqreplay - re-publish a recorded Megaqueue stream into a live Megaqueue.
+ *
+ * The recording (usually a journal) is opened read-only, so replaying never disturbs
+ * it, and the same recording can be replayed any number of times. Records are paced
+ * by a timestamp read from each record: at their original inter-arrival times, sped
+ * up or slowed down by a multiplier, or as fast as the destination takes them.
+ *
+ * Replay can start at a given time, if the producer kept a timestamp index of the
+ * recording (see megaqueue_index.h), using the same units as the record timestamps.
+ */
+#include <tsl/megaqueue/megaqueue.h>
+#include <tsl/megaqueue/megaqueue_index.h>
+
+#include <tsl/errors.h>
+#include <tsl/basic.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SEC                  1000000000ull
+
+/**
+ * Sleep until this close to the time a record is due, then spin the rest of the way
+ */
+#define MQREPLAY_SPIN_NS            100000ull
+
+/**
+ * Number of records between two producer heartbeats
+ */
+#define MQREPLAY_HEARTBEAT_RECORDS  1024
+
+/**
+ * Number of tries on a full destination before sleeping between them
+ */
+#define MQREPLAY_FULL_SPINS         1024
+
+struct mqreplay {
+    /** The recording being replayed (read-only) */
+    struct megaqueue src;
+    /** The live queue records are published to */
+    struct megaqueue dst;
+    /** Offset of the timestamp in each record, negative to replay as fast as possible */
+    long ts_offset;
+    /** Width of the timestamp, 4 or 8 bytes */
+    unsigned int ts_width;
+    /** Nanoseconds per timestamp tick */
+    double ts_unit;
+    /** Speed multiplier, 2.0 replays twice as fast as recorded */
+    double speed;
+    /** Keep waiting for more records at the end of the recording */
+    bool follow;
+
+    /** Timestamp of the first timed record, and when it was replayed */
+    uint64_t ts_base;
+    uint64_t wall_base;
+    bool have_base;
+
+    /** Statistics */
+    uint64_t replayed;
+    uint64_t untimed;
+    uint64_t oversized;
+    uint64_t max_late_ns;
+};
+
+static
+uint64_t mqreplay_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static
+void mqreplay_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-t offset [-w width] [-u ns]] [-x speed | -a] [-s seq | -T time] [-n count] [-C] [-F] recording destination\n", name);
+    fprintf(stderr, "  recording  Journal directory or queue name to replay from (opened read-only)\n");
+    fprintf(stderr, "  destination Queue name (or journal directory) to publish to\n");
+    fprintf(stderr, "  -t offset  Byte offset of the timestamp in each record\n");
+    fprintf(stderr, "  -w width   Width of the timestamp, 4 or 8 bytes (default 8)\n");
+    fprintf(stderr, "  -u ns      Nanoseconds per timestamp tick (default 1)\n");
+    fprintf(stderr, "  -x speed   Replay speed multiplier (default 1.0, original timing)\n");
+    fprintf(stderr, "  -a         Replay as fast as possible\n");
+    fprintf(stderr, "  -s seq     Sequence number to start from (default oldest)\n");
+    fprintf(stderr, "  -T time    Time to start from, found with the timestamp index of the recording\n");
+    fprintf(stderr, "  -n count   Number of records to replay (default all)\n");
+    fprintf(stderr, "  -C         Create the destination shaped like the recording, or resume it\n");
+    fprintf(stderr, "  -F         Follow the recording, waiting for new records at the end\n");
+}
+
+static
+bool mqreplay_is_dir(const char *path)
+{
+    struct stat st;
+
+    return 0 == stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Read the timestamp of a record, if the record is long enough to have one.
+ */
+static
+bool mqreplay_timestamp(struct mqreplay *rep, const void *buf, size_t length, uint64_t *ts)
+{
+    uint32_t ts32 = 0;
+
+    if (0 > rep->ts_offset || (size_t)rep->ts_offset + rep->ts_width > length) {
+        return false;
+    }
+
+    if (4 == rep->ts_width) {
+        memcpy(&ts32, buf + rep->ts_offset, sizeof(ts32));
+        *ts = ts32;
+    } else {
+        memcpy(ts, buf + rep->ts_offset, sizeof(*ts));
+    }
+
+    return true;
+}
+
+/**
+ * Wait until the given record is due, relative to the first timed record.
+ */
+static
+void mqreplay_pace(struct mqreplay *rep, const void *buf, size_t length)
+{
+    uint64_t ts = 0;
+    uint64_t due = 0;
+    uint64_t now = 0;
+
+    if (0 > rep->ts_offset) {
+        return;
+    }
+
+    if (false == mqreplay_timestamp(rep, buf, length, &ts)) {
+        rep->untimed++;
+        return;
+    }
+
+    if (false == rep->have_base) {
+        rep->ts_base = ts;
+        rep->wall_base = mqreplay_now_ns();
+        rep->have_base = true;
+        return;
+    }
+
+    /* Records that went back in time are replayed right away */
+    if (ts <= rep->ts_base) {
+        return;
+    }
+
+    due = rep->wall_base + (uint64_t)((double)(ts - rep->ts_base) * rep->ts_unit / rep->speed);
+    now = mqreplay_now_ns();
+
+    if (now > due) {
+        rep->max_late_ns = BL_MAX2(rep->max_late_ns, now - due);
+        return;
+    }
+
+    if (due - now > MQREPLAY_SPIN_NS) {
+        struct timespec until = {
+            .tv_sec = (due - MQREPLAY_SPIN_NS) / NS_PER_SEC,
+            .tv_nsec = (due - MQREPLAY_SPIN_NS) % NS_PER_SEC
+        };
+
+        megaqueue_heartbeat(&rep->dst);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+    }
+
+    while (mqreplay_now_ns() < due) {
+        ck_pr_stall();
+    }
+}
+
+/**
+ * Wait a little for a full destination to make room. Spin at first, then sleep and
+ * keep the heartbeat going, so a slow consumer doesn't make the producer look dead.
+ */
+static
+void mqreplay_backoff(struct mqreplay *rep, unsigned int *tries)
+{
+    if (++*tries < MQREPLAY_FULL_SPINS) {
+        ck_pr_stall();
+        return;
+    }
+
+    megaqueue_heartbeat(&rep->dst);
+    usleep(1000);
+}
+
+/**
+ * Publish a record to the destination, waiting for room if it is full. A record that
+ * can never fit in the destination is skipped and counted.
+ */
+static
+aresult_t mqreplay_publish(struct mqreplay *rep, const void *buf, size_t length)
+{
+    aresult_t ret = A_OK;
+    void *slot = NULL;
+    unsigned int tries = 0;
+
+    if (rep->dst.flags & MEGAQUEUE_FLAG_VARLEN) {
+        while (A_E_NOSPC == (ret = megaqueue_reserve(&rep->dst, length, &slot))) {
+            mqreplay_backoff(rep, &tries);
+        }
+
+        /* More than half the ring of the destination */
+        if (A_E_BADARGS == ret) {
+            rep->oversized++;
+            ret = A_OK;
+            goto done;
+        }
+
+        if (AFAILED(ret)) {
+            fprintf(stderr, "Failed to reserve %zu bytes in the destination\n", length);
+            goto done;
+        }
+
+        memcpy(slot, buf, length);
+        ret = megaqueue_commit(&rep->dst, length);
+        goto done;
+    }
+
+    while (A_E_NOSPC == (ret = megaqueue_next_slot(&rep->dst, &slot))) {
+        mqreplay_backoff(rep, &tries);
+    }
+
+    if (AFAILED(ret)) {
+        fprintf(stderr, "Failed to get a slot in the destination\n");
+        goto done;
+    }
+
+    /* Opening the destination with the recording's object size made sure it fits */
+    memcpy(slot, buf, length);
+    ret = megaqueue_advance(&rep->dst);
+
+done:
+    return ret;
+}
+
+/**
+ * Get the next record from the recording. Returns A_E_EMPTY at the end of it.
+ */
+static
+aresult_t mqreplay_next(struct mqreplay *rep, void **buf, size_t *length)
+{
+    aresult_t ret = A_OK;
+
+    do {
+        if (rep->src.flags & MEGAQUEUE_FLAG_VARLEN) {
+            ret = megaqueue_read_record(&rep->src, buf, length);
+        } else {
+            ret = megaqueue_read_next_slot(&rep->src, buf);
+            *length = rep->src.object_size;
+        }
+
+        if (A_E_OVERRUN == ret) {
+            fprintf(stderr, "Recording was overwritten under us, skipped to %" PRIu64 "\n",
+                    megaqueue_read_sequence(&rep->src));
+        }
+    } while (A_E_OVERRUN == ret);
+
+    return ret;
+}
+
+static
+aresult_t mqreplay_release(struct mqreplay *rep)
+{
+    if (rep->src.flags & MEGAQUEUE_FLAG_VARLEN) {
+        return megaqueue_release_record(&rep->src);
+    }
+
+    return megaqueue_read_only_advance(&rep->src);
+}
+
+/**
+ * Move to the first record at or after the given time. The timestamp index of the
+ * recording gets us close, then the record timestamps are scanned, if we know where
+ * they are.
+ */
+static
+aresult_t mqreplay_seek_time(struct mqreplay *rep, uint64_t start_time)
+{
+    aresult_t ret = A_OK;
+    struct megaqueue_index index;
+    void *buf = NULL;
+    size_t length = 0;
+    uint64_t ts = 0;
+
+    if (AFAILED(ret = megaqueue_index_open(&index, &rep->src, O_RDONLY, 0, 0))) {
+        fprintf(stderr, "Recording has no timestamp index\n");
+        goto done;
+    }
+
+    ret = megaqueue_index_seek(&index, &rep->src, start_time);
+    megaqueue_index_close(&index, 0);
+
+    if (A_E_EMPTY == ret) {
+        fprintf(stderr, "Timestamp index of the recording is empty\n");
+        goto done;
+    }
+
+    /* Overrun just means the time is older than anything left in the recording */
+    ret = A_OK;
+
+    while (A_OK == mqreplay_next(rep, &buf, &length) && true == mqreplay_timestamp(rep, buf, length, &ts) &&
+            ts < start_time)
+    {
+        mqreplay_release(rep);
+    }
+
+done:
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    struct mqreplay rep;
+    struct megaqueue_params src_params = { .flags = 0 };
+    struct megaqueue_params dst_params = { .flags = 0 };
+    const char *src_name = NULL;
+    const char *dst_name = NULL;
+    uint64_t start = 0;
+    bool have_start = false;
+    uint64_t start_time = 0;
+    bool have_time = false;
+    uint64_t count = UINT64_MAX;
+    bool create = false;
+    uint64_t began = 0;
+    double elapsed = 0.0;
+    int opt = 0;
+    int ret = EXIT_FAILURE;
+
+    began = mqreplay_now_ns();
+
+    memset(&rep, 0, sizeof(rep));
+    MEGAQUEUE_EMPTY(&rep.src);
+    MEGAQUEUE_EMPTY(&rep.dst);
+    rep.ts_offset = -1;
+    rep.ts_width = 8;
+    rep.ts_unit = 1.0;
+    rep.speed = 1.0;
+
+    while (-1 != (opt = getopt(argc, argv, "t:w:u:x:as:T:n:CFh"))) {
+        switch (opt) {
+        case 't':
+            rep.ts_offset = strtol(optarg, NULL, 0);
+            break;
+        case 'w':
+            rep.ts_width = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            rep.ts_unit = strtod(optarg, NULL);
+            break;
+        case 'x':
+            rep.speed = strtod(optarg, NULL);
+            break;
+        case 'a':
+            rep.speed = 0.0;
+            break;
+        case 's':
+            start = strtoull(optarg, NULL, 0);
+            have_start = true;
+            break;
+        case 'T':
+            start_time = strtoull(optarg, NULL, 0);
+            have_time = true;
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'C':
+            create = true;
+            break;
+        case 'F':
+            rep.follow = true;
+            break;
+        default:
+            mqreplay_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 2 || (4 != rep.ts_width && 8 != rep.ts_width) || 0.0 >= rep.ts_unit || 0.0 > rep.speed) {
+        mqreplay_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    src_name = argv[optind];
+    dst_name = argv[optind + 1];
+
+    if (mqreplay_is_dir(src_name)) {
+        src_params.flags |= MEGAQUEUE_FLAG_JOURNAL;
+    }
+
+    if (AFAILED(megaqueue_open_ex(&rep.src, O_RDONLY, src_name, 0, 0, &src_params))) {
+        fprintf(stderr, "Failed to open recording '%s'\n", src_name);
+        goto done;
+    }
+
+    if (true == have_start && A_E_NOENT == megaqueue_seek(&rep.src, start)) {
+        fprintf(stderr, "Sequence %" PRIu64 " is not in the recording\n", start);
+        goto done;
+    }
+
+    if (true == have_time && AFAILED(mqreplay_seek_time(&rep, start_time))) {
+        goto done;
+    }
+
+    /* No speed at all means no pacing at all */
+    if (0.0 == rep.speed) {
+        rep.ts_offset = -1;
+    }
+
+    if (true == create) {
+        /* Same shape as the recording, but never a journal. Don't reset a live queue. */
+        dst_params.flags = rep.src.flags & ~(MEGAQUEUE_HANDLE_FLAGS | MEGAQUEUE_FLAG_JOURNAL);
+        dst_params.flags |= MEGAQUEUE_FLAG_RESUME;
+    } else if (mqreplay_is_dir(dst_name)) {
+        dst_params.flags |= MEGAQUEUE_FLAG_JOURNAL;
+    }
+
+    if (AFAILED(megaqueue_open_ex(&rep.dst, O_RDWR | (create ? O_CREAT : 0), dst_name,
+                                  rep.src.object_size, rep.src.object_count, &dst_params)))
+    {
+        fprintf(stderr, "Failed to open destination '%s'\n", dst_name);
+        goto done;
+    }
+
+    if ((rep.src.flags & MEGAQUEUE_FLAG_VARLEN) != (rep.dst.flags & MEGAQUEUE_FLAG_VARLEN)) {
+        fprintf(stderr, "Can't replay between fixed-size and variable-length queues\n");
+        goto done;
+    }
+
+    while (rep.replayed < count) {
+        void *buf = NULL;
+        size_t length = 0;
+        aresult_t res = mqreplay_next(&rep, &buf, &length);
+
+        if (A_E_EMPTY == res) {
+            if (false == rep.follow) {
+                break;
+            }
+
+            megaqueue_heartbeat(&rep.dst);
+            usleep(1000);
+            continue;
+        }
+
+        if (AFAILED(res)) {
+            fprintf(stderr, "Failed to read from the recording\n");
+            goto done;
+        }
+
+        mqreplay_pace(&rep, buf, length);
+
+        if (AFAILED(mqreplay_publish(&rep, buf, length))) {
+            goto done;
+        }
+
+        mqreplay_release(&rep);
+
+        if (0 == ++rep.replayed % MQREPLAY_HEARTBEAT_RECORDS) {
+            megaqueue_heartbeat(&rep.dst);
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    elapsed = (double)(mqreplay_now_ns() - began) / NS_PER_SEC;
+
+    fprintf(stderr, "Replayed %" PRIu64 " records in %.3fs", rep.replayed, elapsed);
+    if (0 != rep.oversized) {
+        fprintf(stderr, ", %" PRIu64 " of them skipped as too large for the destination", rep.oversized);
+    }
+    if (0 <= rep.ts_offset) {
+        fprintf(stderr, ", %" PRIu64 " without a timestamp, at most %.3fms late",
+                rep.untimed, (double)rep.max_late_ns / 1000000.0);
+    }
+    fprintf(stderr, "\n");
+
+    megaqueue_close(&rep.dst, 0);
+    megaqueue_close(&rep.src, 0);
+
+    return ret;
+}
+
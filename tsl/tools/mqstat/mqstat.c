@@ -0,0 +1,450 @@
+/*
+ * mqstat - inspect a live Megaqueue without disturbing it.
+ *
+ * The queue is mapped read-only, so nothing in here can ever write to the header or
+ * the objects. All the numbers are sampled from a queue that keeps moving, so they
+ * are only ever approximately consistent with each other.
+ */
+#include <tsl/megaqueue/megaqueue.h>
+
+#include <tsl/errors.h>
+#include <tsl/basic.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SEC                  1000000000ull
+
+/**
+ * Default number of bytes of each object or record that are dumped
+ */
+#define MQSTAT_DUMP_BYTES           64
+
+struct mqstat_sample {
+    uint64_t when;
+    uint64_t head;
+    uint64_t reserve;
+    uint64_t oldest;
+    uint64_t tail;
+    uint64_t cursors[MEGAQUEUE_MAX_CONSUMERS];
+};
+
+static
+uint64_t mqstat_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static
+void mqstat_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-i interval_ms] [-c count] [-d records] [-s bytes] [-H hugetlbfs] [-j] [-N] queue\n", name);
+    fprintf(stderr, "  queue          Queue name, /dev/shm/megaqueue_* path, or journal directory\n");
+    fprintf(stderr, "  -i interval_ms Time between samples (default 1000)\n");
+    fprintf(stderr, "  -c count       Number of reports to print, 0 to run forever (default 1)\n");
+    fprintf(stderr, "  -d records     Dump the last records in the queue, then exit\n");
+    fprintf(stderr, "  -s bytes       Bytes of each record to dump (default %d)\n", MQSTAT_DUMP_BYTES);
+    fprintf(stderr, "  -H hugetlbfs   Mount point the objects of a huge page queue live in\n");
+    fprintf(stderr, "  -j             The queue is a journal (implied if queue is a directory)\n");
+    fprintf(stderr, "  -N             Show which NUMA nodes the objects are on, then exit\n");
+}
+
+static
+void mqstat_sample(struct megaqueue *queue, struct mqstat_sample *smp)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+
+    smp->when = mqstat_now_ns();
+    smp->head = ck_pr_load_64(&hdr->head);
+    smp->reserve = ck_pr_load_64(&hdr->reserve);
+    smp->oldest = megaqueue_oldest_sequence(queue);
+    smp->tail = ck_pr_load_64(&hdr->tail);
+
+    for (int i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        smp->cursors[i] = ck_pr_load_64(&hdr->consumers[i].cursor);
+    }
+}
+
+static
+double mqstat_rate(uint64_t from, uint64_t to, uint64_t ns)
+{
+    if (0 == ns) {
+        return 0.0;
+    }
+
+    return (double)(to - from) * NS_PER_SEC / ns;
+}
+
+static
+void mqstat_print_header(struct megaqueue *queue, const char *name)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+    unsigned int state = 0;
+    static const char *states[] = { "alive", "stalled", "dead" };
+    uint64_t heartbeat = ck_pr_load_64(&hdr->heartbeat);
+    uint64_t now = mqstat_now_ns();
+
+    printf("megaqueue '%s': %u objects of %u bytes, flags 0x%x%s%s%s%s%s%s\n",
+           name, queue->object_count, queue->object_size, queue->flags,
+           (queue->flags & MEGAQUEUE_FLAG_BROADCAST) ? " broadcast" : "",
+           (queue->flags & MEGAQUEUE_FLAG_LAP) ? " lap" : "",
+           (queue->flags & MEGAQUEUE_FLAG_VARLEN) ? " varlen" : "",
+           (queue->flags & MEGAQUEUE_FLAG_JOURNAL) ? " journal" : "",
+           (queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) ? " multi-producer" : "",
+           (queue->flags & MEGAQUEUE_FLAG_HUGE_PAGE) ? " huge-page" : "");
+
+    /* One second is as good a guess as any for a stalled producer */
+    megaqueue_producer_state(queue, NS_PER_SEC, &state);
+
+    printf("producer: pid %" PRIu64 " %s, last heartbeat %.3fs ago\n",
+           ck_pr_load_64(&hdr->producer_pid), states[state],
+           now > heartbeat ? (double)(now - heartbeat) / NS_PER_SEC : 0.0);
+}
+
+static
+void mqstat_report(struct megaqueue *queue, struct mqstat_sample *prev, struct mqstat_sample *cur,
+                   uint64_t started, uint64_t last_advance)
+{
+    struct megaqueue_header *hdr = queue->hdr;
+    uint64_t ns = cur->when - prev->when;
+    uint64_t fill = cur->head - cur->oldest;
+
+    if (queue->flags & MEGAQUEUE_FLAG_JOURNAL) {
+        printf("head %" PRIu64 ", oldest retained %" PRIu64 " (%" PRIu64 " objects in %" PRIu64 " segments)\n",
+               cur->head, cur->oldest, fill, cur->head / queue->object_count - cur->oldest / queue->object_count + 1);
+    } else {
+        printf("head %" PRIu64 ", oldest %" PRIu64 ", fill %" PRIu64 "/%u (%.1f%%)\n",
+               cur->head, cur->oldest, fill, queue->object_count, 100.0 * fill / queue->object_count);
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_MULTI_PRODUCER) {
+        printf("reserved, not yet published: %" PRIu64 "\n", cur->reserve - cur->head);
+    }
+
+    if (queue->flags & MEGAQUEUE_FLAG_LAP) {
+        printf("laps: %" PRIu64 "\n", ck_pr_load_64(&hdr->laps));
+    }
+
+    /* Until the head moves, all we know is how long we have been watching it */
+    printf("publish rate %.1f/s, last advance %s%.3fs ago\n", mqstat_rate(prev->head, cur->head, ns),
+           0 == last_advance ? "> " : "",
+           (double)(cur->when - (0 == last_advance ? started : last_advance)) / NS_PER_SEC);
+
+    if (!(queue->flags & MEGAQUEUE_FLAG_BROADCAST)) {
+        printf("consumer: cursor %" PRIu64 ", lag %" PRIu64 ", consume rate %.1f/s\n",
+               cur->tail, cur->head - cur->tail, mqstat_rate(prev->tail, cur->tail, ns));
+        return;
+    }
+
+    printf("%-*s %-9s %20s %12s %14s\n", MEGAQUEUE_CONSUMER_NAME_LEN, "consumer", "state", "cursor", "lag", "rate/s");
+
+    for (int i = 0; i < MEGAQUEUE_MAX_CONSUMERS; i++) {
+        struct megaqueue_consumer *cons = &hdr->consumers[i];
+        char name[MEGAQUEUE_CONSUMER_NAME_LEN];
+        uint32_t state = ck_pr_load_32(&cons->state);
+        const char *state_name = "live";
+
+        memcpy(name, cons->name, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+
+        if ('\0' == name[0]) {
+            continue;
+        }
+
+        if (MEGAQUEUE_CONSUMER_FREE == state) {
+            /* Destroyed groups and departed members can't be resumed */
+            if (MEGAQUEUE_CONSUMER_PLAIN != cons->kind) {
+                continue;
+            }
+            state_name = "detached";
+        } else if (MEGAQUEUE_CONSUMER_ATTACHING == state) {
+            state_name = "attaching";
+        } else if (MEGAQUEUE_CONSUMER_GROUP == cons->kind) {
+            state_name = "group";
+        } else if (MEGAQUEUE_CONSUMER_MEMBER == cons->kind) {
+            state_name = "member";
+
+            if (MEGAQUEUE_MEMBER_IDLE == cur->cursors[i]) {
+                printf("%-*s %-9s %20s %12s %14s\n", MEGAQUEUE_CONSUMER_NAME_LEN, name, "idle", "-", "-", "-");
+                continue;
+            }
+        }
+
+        printf("%-*s %-9s %20" PRIu64 " %12" PRIu64 " %14.1f\n", MEGAQUEUE_CONSUMER_NAME_LEN, name, state_name,
+               cur->cursors[i], cur->head > cur->cursors[i] ? cur->head - cur->cursors[i] : 0,
+               (MEGAQUEUE_MEMBER_IDLE == prev->cursors[i]) ? 0.0 : mqstat_rate(prev->cursors[i], cur->cursors[i], ns));
+    }
+}
+
+static
+void mqstat_hexdump(const void *buf, size_t length)
+{
+    const uint8_t *bytes = buf;
+
+    for (size_t offs = 0; offs < length; offs += 16) {
+        size_t line = BL_MIN2(length - offs, 16);
+
+        printf("    %04zx ", offs);
+
+        for (size_t i = 0; i < 16; i++) {
+            if (i < line) {
+                printf(" %02x", bytes[offs + i]);
+            } else {
+                printf("   ");
+            }
+        }
+
+        printf("  |");
+
+        for (size_t i = 0; i < line; i++) {
+            printf("%c", isprint(bytes[offs + i]) ? bytes[offs + i] : '.');
+        }
+
+        printf("|\n");
+    }
+}
+
+/**
+ * Print how many pages of objects are on each NUMA node. Pages that were never
+ * touched, or that were swapped out, show as absent.
+ */
+static
+int mqstat_numa(struct megaqueue *queue)
+{
+    uint64_t *pages = NULL;
+    uint64_t absent = 0;
+    int ret = -1;
+
+    if (NULL == (pages = calloc(MEGAQUEUE_NUMA_MAX_NODES, sizeof(uint64_t)))) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+
+    if (AFAILED(megaqueue_numa_residency(queue, pages, MEGAQUEUE_NUMA_MAX_NODES, &absent))) {
+        fprintf(stderr, "Failed to find out where the pages of the queue are\n");
+        goto done;
+    }
+
+    printf("\nNUMA residency (%zu byte pages):\n", queue->page_size);
+
+    for (size_t node = 0; node < MEGAQUEUE_NUMA_MAX_NODES; node++) {
+        if (0 != pages[node]) {
+            printf("  node %-4zu %" PRIu64 " pages\n", node, pages[node]);
+        }
+    }
+
+    printf("  absent    %" PRIu64 " pages\n", absent);
+
+    ret = 0;
+
+done:
+    free(pages);
+    return ret;
+}
+
+/**
+ * Dump the last count fixed-size objects in the queue, consumed or not.
+ */
+static
+void mqstat_dump_objects(struct megaqueue *queue, uint64_t count, size_t bytes)
+{
+    uint64_t head = megaqueue_write_sequence(queue);
+    /* Consumed objects stay around until the producer laps them, except for the slot it is writing */
+    uint64_t oldest = head >= queue->object_count ? head - queue->object_count + 1 : 0;
+    uint64_t first = head - BL_MIN2(count, head - oldest);
+
+    for (uint64_t pos = first; pos < head; pos++) {
+        printf("object %" PRIu64 ":\n", pos);
+        mqstat_hexdump(__megaqueue_read_slot(queue, pos), BL_MIN2(bytes, (size_t)queue->object_size));
+    }
+}
+
+/**
+ * Dump the last count unconsumed records in a variable-length queue. Records can only
+ * be found by walking forward from the oldest one, so remember the last count of them
+ * on the way to the head.
+ */
+static
+int mqstat_dump_records(struct megaqueue *queue, uint64_t count, size_t bytes)
+{
+    uint64_t head = megaqueue_write_sequence(queue);
+    uint64_t pos = megaqueue_oldest_sequence(queue);
+    uint64_t *ring = NULL;
+    uint64_t found = 0;
+
+    if (0 == count) {
+        return 0;
+    }
+
+    if (NULL == (ring = calloc(count, sizeof(uint64_t)))) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    while (pos < head) {
+        struct megaqueue_record *rec = __megaqueue_read_slot(queue, pos);
+        uint64_t units = __megaqueue_record_units(queue, rec->length);
+
+        /* The producer can overwrite what we are looking at, so don't trust it */
+        if (0 == units || units > queue->object_count - __megaqueue_index(queue, pos)) {
+            fprintf(stderr, "Record at %" PRIu64 " is garbled, the producer probably overwrote it\n", pos);
+            break;
+        }
+
+        if (!(rec->flags & MEGAQUEUE_RECORD_PAD)) {
+            ring[found++ % count] = pos;
+        }
+
+        pos += units;
+    }
+
+    if (0 == found) {
+        printf("No unconsumed records between %" PRIu64 " and %" PRIu64 "\n", megaqueue_oldest_sequence(queue), head);
+    }
+
+    for (uint64_t i = found > count ? found - count : 0; i < found; i++) {
+        struct megaqueue_record *rec = __megaqueue_read_slot(queue, ring[i % count]);
+
+        printf("record %" PRIu64 ": %u bytes\n", ring[i % count], rec->length);
+        mqstat_hexdump(rec + 1, BL_MIN2(bytes, (size_t)rec->length));
+    }
+
+    free(ring);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct megaqueue queue = MEGAQUEUE_SAFE_INIT_EMPTY;
+    struct megaqueue_params params = { .flags = 0 };
+    struct mqstat_sample prev, cur;
+    const char *name = NULL;
+    unsigned long interval_ms = 1000;
+    unsigned long count = 1;
+    long dump = -1;
+    bool numa = false;
+    size_t dump_bytes = MQSTAT_DUMP_BYTES;
+    uint64_t started = 0;
+    uint64_t last_advance = 0;
+    struct stat st;
+    int opt = 0;
+    int ret = EXIT_FAILURE;
+
+    while (-1 != (opt = getopt(argc, argv, "i:c:d:s:H:jNh"))) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            dump = strtol(optarg, NULL, 0);
+            break;
+        case 's':
+            dump_bytes = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            params.hugetlbfs_path = optarg;
+            break;
+        case 'j':
+            params.flags |= MEGAQUEUE_FLAG_JOURNAL;
+            break;
+        case 'N':
+            numa = true;
+            break;
+        default:
+            mqstat_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || 0 == interval_ms) {
+        mqstat_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    name = argv[optind];
+
+    if (0 == stat(name, &st) && S_ISDIR(st.st_mode)) {
+        params.flags |= MEGAQUEUE_FLAG_JOURNAL;
+    }
+
+    if (!(params.flags & MEGAQUEUE_FLAG_JOURNAL)) {
+        /* Accept the path in /dev/shm, or the name with or without the prefix */
+        if (0 == strncmp(name, "/dev/shm/", 9)) {
+            name += 9;
+        }
+
+        if (0 == strncmp(name, MEGAQUEUE_NAME_PREFIX, strlen(MEGAQUEUE_NAME_PREFIX))) {
+            name += strlen(MEGAQUEUE_NAME_PREFIX);
+        }
+    }
+
+    /* Read-only: the mapping itself guarantees we never touch the live queue */
+    if (AFAILED(megaqueue_open_ex(&queue, O_RDONLY, name, 0, 0, &params))) {
+        fprintf(stderr, "Failed to open megaqueue '%s' read-only\n", name);
+        return EXIT_FAILURE;
+    }
+
+    mqstat_print_header(&queue, name);
+
+    if (true == numa) {
+        ret = mqstat_numa(&queue) ? EXIT_FAILURE : EXIT_SUCCESS;
+        goto done;
+    }
+
+    if (0 <= dump) {
+        if (queue.flags & MEGAQUEUE_FLAG_JOURNAL) {
+            fprintf(stderr, "Dumping records is not supported for journals\n");
+        } else if (queue.flags & MEGAQUEUE_FLAG_VARLEN) {
+            ret = mqstat_dump_records(&queue, dump, dump_bytes) ? EXIT_FAILURE : EXIT_SUCCESS;
+        } else {
+            mqstat_dump_objects(&queue, dump, dump_bytes);
+            ret = EXIT_SUCCESS;
+        }
+
+        goto done;
+    }
+
+    mqstat_sample(&queue, &prev);
+    started = prev.when;
+
+    for (unsigned long i = 0; 0 == count || i < count; i++) {
+        usleep(interval_ms * 1000);
+
+        mqstat_sample(&queue, &cur);
+
+        if (cur.head != prev.head) {
+            last_advance = cur.when;
+        }
+
+        printf("\n");
+        mqstat_report(&queue, &prev, &cur, started, last_advance);
+        fflush(stdout);
+
+        prev = cur;
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    megaqueue_close(&queue, 0);
+    return ret;
+}
+